@@ -0,0 +1,49 @@
+//=============================================================================
+// AllocCounter.cpp.
+//=============================================================================
+
+#include <cstdlib>
+#include <new>
+#include "AllocCounter.h"
+
+namespace
+{
+	// One per thread, so no interlocked add is needed either.
+	__declspec(thread) LONG gNumHeapAllocs = 0;
+
+	void* countedAlloc(size_t bytes)
+	{
+		++gNumHeapAllocs;
+
+		// operator new must return a unique pointer even for 0 bytes.
+		void* p = malloc(bytes ? bytes : 1);
+		if( p == 0 )
+			throw std::bad_alloc();
+		return p;
+	}
+}
+
+LONG GetNumHeapAllocs()
+{
+	return gNumHeapAllocs;
+}
+
+void* operator new(size_t bytes)
+{
+	return countedAlloc(bytes);
+}
+
+void* operator new[](size_t bytes)
+{
+	return countedAlloc(bytes);
+}
+
+void operator delete(void* p)
+{
+	free(p);
+}
+
+void operator delete[](void* p)
+{
+	free(p);
+}
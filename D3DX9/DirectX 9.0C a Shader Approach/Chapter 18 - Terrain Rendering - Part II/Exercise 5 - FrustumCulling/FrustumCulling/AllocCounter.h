@@ -0,0 +1,22 @@
+//=============================================================================
+// AllocCounter.h.
+//
+// Counts every call to the global operator new (and new[]), so the render
+// path can show that it makes no heap allocations once warmed up.  The
+// replacements themselves live in AllocCounter.cpp and just forward to
+// malloc/free.
+//
+// Each thread keeps its own count, so the TerrainWorld loader and the job
+// system's workers don't show up in the render thread's.
+//=============================================================================
+
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <windows.h>
+
+// Number of heap allocations the calling thread has made through operator
+// new since it started.
+LONG GetNumHeapAllocs();
+
+#endif // ALLOC_COUNTER_H
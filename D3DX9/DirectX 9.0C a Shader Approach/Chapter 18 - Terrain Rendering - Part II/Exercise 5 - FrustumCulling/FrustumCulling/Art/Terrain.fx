@@ -2,6 +2,12 @@
 // Terrain.fx by Frank Luna (C) 2004 All Rights Reserved.
 //
 // Blends three textures together with a blend map.
+//
+// TerrainCompactTech reads VertexTerrainQ vertices (see Vertex.h) and
+// rebuilds the position, normal and texture coordinates from them.
+//
+// gAOMap holds baked ambient occlusion, one texel per vertex (see
+// HorizonBaker.h), and darkens the shade.
 //=============================================================================
 
 
@@ -11,12 +17,19 @@ uniform extern texture gTex0;
 uniform extern texture gTex1;
 uniform extern texture gTex2;
 uniform extern texture gBlendMap;
+uniform extern texture gAOMap;
+uniform extern float4  gAOTexTransform; // Scale and offset from blend map to AO map texels.
 uniform extern float3  gEyePosW;
 
 uniform extern float3 gFogColor;// = {0.5f, 0.5f, 0.5f};
 uniform extern float  gFogStart;// = 1.0f;
 uniform extern float  gFogRange;// = 250.0f;
 
+// Compact vertices only.
+uniform extern float4 gGridToWorld; // dx, -dz, and the x, z of vertex (0, 0).
+uniform extern float2 gGridToTex;   // 1/(cols-1), 1/(rows-1).
+uniform extern float2 gHeightQuant; // Height = q*scale + bias.
+
 static float gTexScale = 64.0f;
 
 sampler Tex0S = sampler_state
@@ -61,6 +74,16 @@ sampler BlendMapS = sampler_state
 	AddressU  = WRAP;
     AddressV  = WRAP;
 };
+
+sampler AOMapS = sampler_state
+{
+	Texture = <gAOMap>;
+	MinFilter = LINEAR;
+	MagFilter = LINEAR;
+	MipFilter = NONE;
+	AddressU  = CLAMP;
+    AddressV  = CLAMP;
+};
  
 struct OutputVS
 {
@@ -98,6 +121,30 @@ OutputVS TerrainVS(float3 posW : POSITION0,  // We assume terrain geometry is sp
     return outVS;
 }
 
+OutputVS TerrainCompactVS(float4 packed : POSITION0)
+{
+	// packed is (column, row, quantized height, octahedral normal).
+	float3 posW;
+	posW.x = packed.x*gGridToWorld.x + gGridToWorld.z;
+	posW.y = packed.z*gHeightQuant.x + gHeightQuant.y;
+	posW.z = packed.y*gGridToWorld.y + gGridToWorld.w;
+	
+	// Unpack the two signed bytes x*256 + z and unfold the octahedron,
+	// the same way as DecodeOctNormal.
+	float ex = floor((packed.w + 128.0f) / 256.0f);
+	float ez = packed.w - ex*256.0f;
+	float3 normalW = float3(ex, 0.0f, ez) / 127.0f;
+	normalW.y = 1.0f - abs(normalW.x) - abs(normalW.z);
+	if( normalW.y < 0.0f )
+	{
+		float2 s = normalW.xz >= 0.0f ? 1.0f : -1.0f;
+		normalW.xz = (1.0f - abs(normalW.zx)) * s;
+	}
+	normalW = normalize(normalW);
+	
+	return TerrainVS(posW, normalW, packed.xy * gGridToTex);
+}
+
 float4 TerrainPS(float2 tiledTexC : TEXCOORD0, 
                  float2 nonTiledTexC : TEXCOORD1,
                  float shade : TEXCOORD2,
@@ -110,6 +157,9 @@ float4 TerrainPS(float2 tiledTexC : TEXCOORD0,
     
     // Blendmap is not tiled.
     float3 B = tex2D(BlendMapS, nonTiledTexC).rgb;
+    
+    // So is the ambient occlusion.
+    float ao = tex2D(AOMapS, nonTiledTexC*gAOTexTransform.xy + gAOTexTransform.zw).r;
 
 	// Find the inverse of all the blend weights so that we can
 	// scale the total color to the range [0, 1].
@@ -122,7 +172,7 @@ float4 TerrainPS(float2 tiledTexC : TEXCOORD0,
     c2 *= B.b * totalInverse;
     
     // Sum the colors and modulate with the shade to brighten/darken.
-    float3 texColor = (c0 + c1 + c2) * shade;
+    float3 texColor = (c0 + c1 + c2) * shade * ao;
     
     // Add fog.
     float3 final = lerp(texColor, gFogColor, fogLerpParam);
@@ -138,3 +188,12 @@ technique TerrainTech
         pixelShader  = compile ps_2_0 TerrainPS();
     }
 }
+
+technique TerrainCompactTech
+{
+    pass P0
+    {
+        vertexShader = compile vs_2_0 TerrainCompactVS();
+        pixelShader  = compile ps_2_0 TerrainPS();
+    }
+}
@@ -23,6 +23,7 @@ struct DirLight
 uniform extern float4x4 gWorld;
 uniform extern float4x4 gWorldInvTrans;
 uniform extern float4x4 gWVP;
+uniform extern float4x4 gViewProj;
 uniform extern Mtrl     gMtrl;
 uniform extern DirLight gLight;
 uniform extern float3   gEyePosW;
@@ -51,18 +52,12 @@ struct OutputVS
     float fogLerpParam : TEXCOORD1;
 };
 
-OutputVS DirLightTexVS(float3 posL : POSITION0, float3 normalL : NORMAL0, float2 tex0: TEXCOORD0)
+// Lights, fogs and textures a vertex already in world space.
+OutputVS LightVertex(float3 posW, float3 normalW, float2 tex0)
 {
     // Zero out our output.
 	OutputVS outVS = (OutputVS)0;
 	
-	// Transform normal to world space.
-	float3 normalW = mul(float4(normalL, 0.0f), gWorldInvTrans).xyz;
-	normalW = normalize(normalW);
-	
-	// Transform vertex position to world space.
-	float3 posW  = mul(float4(posL, 1.0f), gWorld).xyz;
-	
 	//=======================================================
 	// Compute the color: Equation 10.3.
 	
@@ -92,9 +87,6 @@ OutputVS DirLightTexVS(float3 posL : POSITION0, float3 normalL : NORMAL0, float2
 	outVS.spec = float4(spec, 1.0f);
 	//=======================================================
 	
-	// Transform to homogeneous clip space.
-	outVS.posH = mul(float4(posL, 1.0f), gWVP);
-	
 	// Pass on texture coordinates to be interpolated in rasterization.
 	outVS.tex0 = tex0;
 	
@@ -106,6 +98,45 @@ OutputVS DirLightTexVS(float3 posL : POSITION0, float3 normalL : NORMAL0, float2
     return outVS;
 }
 
+OutputVS DirLightTexVS(float3 posL : POSITION0, float3 normalL : NORMAL0, float2 tex0: TEXCOORD0)
+{
+	// Transform normal to world space.
+	float3 normalW = mul(float4(normalL, 0.0f), gWorldInvTrans).xyz;
+	normalW = normalize(normalW);
+	
+	// Transform vertex position to world space.
+	float3 posW  = mul(float4(posL, 1.0f), gWorld).xyz;
+	
+	OutputVS outVS = LightVertex(posW, normalW, tex0);
+	
+	// Transform to homogeneous clip space.
+	outVS.posH = mul(float4(posL, 1.0f), gWVP);
+	
+    return outVS;
+}
+
+// The world matrix comes from the instance stream, one per copy.  The
+// copies are only scaled uniformly, rotated and translated, so the world
+// matrix transforms normals too, once renormalized.
+OutputVS DirLightTexInstancedVS(float3 posL : POSITION0, float3 normalL : NORMAL0, float2 tex0: TEXCOORD0,
+                                float4 world0 : TEXCOORD1, float4 world1 : TEXCOORD2,
+                                float4 world2 : TEXCOORD3, float4 world3 : TEXCOORD4)
+{
+	float4x4 world = float4x4(world0, world1, world2, world3);
+	
+	float3 normalW = mul(float4(normalL, 0.0f), world).xyz;
+	normalW = normalize(normalW);
+	
+	float4 posW = mul(float4(posL, 1.0f), world);
+	
+	OutputVS outVS = LightVertex(posW.xyz, normalW, tex0);
+	
+	// Transform to homogeneous clip space.
+	outVS.posH = mul(posW, gViewProj);
+	
+    return outVS;
+}
+
 float4 DirLightTexPS(float4 c : COLOR0, 
                      float4 spec : COLOR1, 
                      float2 tex0 : TEXCOORD0,
@@ -129,3 +160,14 @@ technique DirLightTexTech
         pixelShader  = compile ps_2_0 DirLightTexPS();
     }
 }
+
+technique DirLightTexInstancedTech
+{
+    pass P0
+    {
+        // Hardware instancing needs vertex shader 3.0, which in turn
+        // needs a 3.0 pixel shader.
+        vertexShader = compile vs_3_0 DirLightTexInstancedVS();
+        pixelShader  = compile ps_3_0 DirLightTexPS();
+    }
+}
@@ -5,7 +5,8 @@
 #include "Camera.h"
 #include "DirectInput.h"
 #include "d3dUtil.h"
-#include "Terrain.h"
+#include "GroundQuery.h"
+#include <xmmintrin.h>
 
 Camera* gCamera = 0;
 
@@ -61,6 +62,11 @@ D3DXVECTOR3& Camera::pos()
 	return mPosW;
 }
 
+const D3DXVECTOR3& Camera::pos() const
+{
+	return mPosW;
+}
+
 void Camera::lookAt(D3DXVECTOR3& pos, D3DXVECTOR3& target, D3DXVECTOR3& up)
 {
 	D3DXVECTOR3 L = target - pos;
@@ -161,7 +167,103 @@ bool Camera::isVisible(const BoundingSphere& sphere)const
 	return true;
 }
 
-void Camera::update(float dt, Terrain* terrain, float offsetHeight)
+void Camera::isVisible(const AABBSoA& boxes, UINT n, UINT* visible)const
+{
+	// Same test as the single box version, but the choice of Q depends
+	// only on the plane, so it is made once per plane for every box.
+	// Each of the six planes then costs three multiplies, three adds
+	// and a compare per four boxes.
+	const float* qx[6];
+	const float* qy[6];
+	const float* qz[6];
+	for(int i = 0; i < 6; ++i)
+	{
+		qx[i] = mFrustumPlanes[i].a >= 0.0f ? boxes.maxX : boxes.minX;
+		qy[i] = mFrustumPlanes[i].b >= 0.0f ? boxes.maxY : boxes.minY;
+		qz[i] = mFrustumPlanes[i].c >= 0.0f ? boxes.maxZ : boxes.minZ;
+	}
+
+	ZeroMemory(visible, ((n + 31) / 32)*sizeof(UINT));
+
+	const __m128 zero = _mm_setzero_ps();
+
+	UINT j = 0;
+	for(; j + 4 <= n; j += 4)
+	{
+		__m128 inside = _mm_cmpeq_ps(zero, zero);
+		for(int i = 0; i < 6; ++i)
+		{
+			const D3DXPLANE& p = mFrustumPlanes[i];
+			__m128 d = _mm_mul_ps(_mm_set1_ps(p.a), _mm_loadu_ps(qx[i] + j));
+			d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(p.b), _mm_loadu_ps(qy[i] + j)));
+			d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(p.c), _mm_loadu_ps(qz[i] + j)));
+			d = _mm_add_ps(d, _mm_set1_ps(p.d));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(d, zero));
+		}
+
+		// j is a multiple of four, so the four bits never straddle words.
+		visible[j / 32] |= (UINT)_mm_movemask_ps(inside) << (j % 32);
+	}
+
+	// Leftovers.
+	for(; j < n; ++j)
+	{
+		bool inside = true;
+		for(int i = 0; i < 6 && inside; ++i)
+		{
+			D3DXVECTOR3 Q(qx[i][j], qy[i][j], qz[i][j]);
+			inside = D3DXPlaneDotCoord(&mFrustumPlanes[i], &Q) >= 0.0f;
+		}
+		if( inside )
+			visible[j / 32] |= 1u << (j % 32);
+	}
+}
+
+void Camera::isVisible(const BoundingSphereSoA& spheres, UINT n, UINT* visible)const
+{
+	ZeroMemory(visible, ((n + 31) / 32)*sizeof(UINT));
+
+	const __m128 zero = _mm_setzero_ps();
+
+	UINT j = 0;
+	for(; j + 4 <= n; j += 4)
+	{
+		__m128 x = _mm_loadu_ps(spheres.x + j);
+		__m128 y = _mm_loadu_ps(spheres.y + j);
+		__m128 z = _mm_loadu_ps(spheres.z + j);
+		__m128 r = _mm_loadu_ps(spheres.radius + j);
+
+		__m128 inside = _mm_cmpeq_ps(zero, zero);
+		for(int i = 0; i < 6; ++i)
+		{
+			const D3DXPLANE& p = mFrustumPlanes[i];
+			__m128 d = _mm_mul_ps(_mm_set1_ps(p.a), x);
+			d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(p.b), y));
+			d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(p.c), z));
+			d = _mm_add_ps(d, _mm_set1_ps(p.d));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(d, r), zero));
+		}
+
+		visible[j / 32] |= (UINT)_mm_movemask_ps(inside) << (j % 32);
+	}
+
+	// Leftovers.
+	for(; j < n; ++j)
+	{
+		BoundingSphere sphere;
+		sphere.pos    = D3DXVECTOR3(spheres.x[j], spheres.y[j], spheres.z[j]);
+		sphere.radius = spheres.radius[j];
+		if( isVisible(sphere) )
+			visible[j / 32] |= 1u << (j % 32);
+	}
+}
+
+const D3DXPLANE* Camera::frustumPlanes()const
+{
+	return mFrustumPlanes;
+}
+
+void Camera::update(float dt, GroundQuery* ground, float offsetHeight)
 {
 	// Find the net direction the camera is traveling in (since the
 	// camera could be running and strafing).
@@ -177,31 +279,23 @@ void Camera::update(float dt, Terrain* terrain, float offsetHeight)
 
 	// Move at mSpeed along net direction.
 	D3DXVec3Normalize(&dir, &dir);
-	D3DXVECTOR3 newPos = mPosW + dir*mSpeed*dt;
 
-	if( terrain != 0)
+	if( ground != 0)
 	{
-		// New position might not be on terrain, so project the
-		// point onto the terrain.
-		newPos.y = terrain->getHeight(newPos.x, newPos.z) + offsetHeight;
-
-		// Now the difference of the new position and old (current) 
-		// position approximates a tangent vector on the terrain.
-		D3DXVECTOR3 tangent = newPos - mPosW;
-		D3DXVec3Normalize(&tangent, &tangent);
-
-		// Now move camera along tangent vector.
+		// Walk along the plane of the ground under the camera, so the
+		// camera keeps its speed up and down hills.
+		GroundQuery::Sample here = ground->sample(mPosW.x, mPosW.z);
+		D3DXVECTOR3 tangent = GroundQuery::alongGround(dir, here.normal);
 		mPosW += tangent*mSpeed*dt;
 
-		// After update, there may be errors in the camera height since our
-		// tangent is only an approximation.  So force camera to correct height,
-		// and offset by the specified amount so that camera does not sit
-		// exactly on terrain, but instead, slightly above it.
-		mPosW.y = terrain->getHeight(mPosW.x, mPosW.z) + offsetHeight;
+		// The step may cross into another triangle, so put the camera back
+		// on the ground, and offset by the specified amount so that camera
+		// does not sit exactly on terrain, but instead, slightly above it.
+		mPosW.y = ground->sample(mPosW.x, mPosW.z).height + offsetHeight;
 	}
 	else
 	{
-		mPosW = newPos;
+		mPosW += dir*mSpeed*dt;
 	}
 	
 
@@ -9,7 +9,7 @@
 #include "d3dUtil.h"
 
 // Forward declaration.
-class Terrain;
+class GroundQuery;
 
 class Camera
 {
@@ -25,6 +25,7 @@ public:
 	const D3DXVECTOR3& look() const;
 
 	D3DXVECTOR3& pos();
+	const D3DXVECTOR3& pos() const;
 
 	void lookAt(D3DXVECTOR3& pos, D3DXVECTOR3& target, D3DXVECTOR3& up);
 	void setLens(float fov, float aspect, float nearZ, float farZ);
@@ -35,7 +36,20 @@ public:
 	// Sphere coordinates should be relative to world space.
 	bool isVisible(const BoundingSphere& sphere)const;
 
-	void update(float dt, Terrain* terrain, float offsetHeight);
+	// Batch versions of the above that test four volumes at a time.  Bit
+	// (i % 32) of visible[i / 32] is set if volume i is visible, so
+	// visible needs (n + 31) / 32 entries.  The sums are the same as the
+	// single versions', but those may be computed at x87 precision, so a
+	// volume lying right on a plane can come out differently.
+	void isVisible(const AABBSoA& boxes, UINT n, UINT* visible)const;
+	void isVisible(const BoundingSphereSoA& spheres, UINT n, UINT* visible)const;
+
+	// World space frustum planes, facing inward, in the order
+	// near, far, left, right, top, bottom.
+	const D3DXPLANE* frustumPlanes()const;
+
+	// With ground, the camera walks on it, offsetHeight above it.
+	void update(float dt, GroundQuery* ground, float offsetHeight);
 
 protected:
 	void buildView();
@@ -0,0 +1,95 @@
+//=============================================================================
+// CameraPath.cpp.
+//=============================================================================
+
+#include "CameraPath.h"
+#include "Camera.h"
+#include <fstream>
+using namespace std;
+
+namespace
+{
+	const char* const PATH_TAG = "CameraPath";
+	const int PATH_VERSION = 1;
+}
+
+void CameraPath::clear()
+{
+	mFrames.clear();
+}
+
+void CameraPath::record(const Camera& camera)
+{
+	addFrame(camera.pos(), camera.look());
+}
+
+void CameraPath::addFrame(const D3DXVECTOR3& pos, const D3DXVECTOR3& look)
+{
+	Frame f;
+	f.pos  = pos;
+	f.look = look;
+	mFrames.push_back(f);
+}
+
+UINT CameraPath::numFrames()const
+{
+	return (UINT)mFrames.size();
+}
+
+const CameraPath::Frame& CameraPath::getFrame(UINT i)const
+{
+	return mFrames[i];
+}
+
+void CameraPath::apply(UINT i, Camera& camera)const
+{
+	D3DXVECTOR3 pos    = mFrames[i].pos;
+	D3DXVECTOR3 target = mFrames[i].pos + mFrames[i].look;
+	D3DXVECTOR3 up(0.0f, 1.0f, 0.0f);
+	camera.lookAt(pos, target, up);
+}
+
+bool CameraPath::save(const std::string& filename)const
+{
+	ofstream outFile(filename.c_str(), ios_base::trunc);
+	if( !outFile )
+		return false;
+
+	outFile << PATH_TAG << " " << PATH_VERSION << " " << mFrames.size() << "\n";
+
+	// Nine significant digits round-trip a float exactly.
+	outFile.precision(9);
+	for(UINT i = 0; i < mFrames.size(); ++i)
+	{
+		const Frame& f = mFrames[i];
+		outFile << f.pos.x  << " " << f.pos.y  << " " << f.pos.z  << " "
+		        << f.look.x << " " << f.look.y << " " << f.look.z << "\n";
+	}
+	return !outFile.fail();
+}
+
+bool CameraPath::load(const std::string& filename)
+{
+	ifstream inFile(filename.c_str());
+	if( !inFile )
+		return false;
+
+	std::string tag;
+	int version = 0;
+	UINT n = 0;
+	inFile >> tag >> version >> n;
+	if( !inFile || tag != PATH_TAG || version != PATH_VERSION )
+		return false;
+
+	std::vector<Frame> frames(n);
+	for(UINT i = 0; i < n; ++i)
+	{
+		Frame& f = frames[i];
+		inFile >> f.pos.x >> f.pos.y >> f.pos.z >> f.look.x >> f.look.y >> f.look.z;
+	}
+	if( !inFile )
+		return false;
+
+	mFrames.swap(frames);
+	return true;
+}
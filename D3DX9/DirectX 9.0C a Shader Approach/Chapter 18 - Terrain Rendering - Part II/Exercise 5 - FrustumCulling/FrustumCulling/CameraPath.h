@@ -0,0 +1,48 @@
+//=============================================================================
+// CameraPath.h.
+//
+// A recorded flight through the scene: the camera's position and view
+// direction once per frame.  The demo records one with 'P', and
+// HeadlessBench replays it to run the terrain level of detail selection on
+// the same views every time.  Paths are saved as text, one frame per line.
+//=============================================================================
+
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+#include "d3dUtil.h"
+#include <string>
+#include <vector>
+
+class Camera;
+
+class CameraPath
+{
+public:
+	struct Frame
+	{
+		D3DXVECTOR3 pos;
+		D3DXVECTOR3 look;
+	};
+
+	void clear();
+	void record(const Camera& camera);
+	void addFrame(const D3DXVECTOR3& pos, const D3DXVECTOR3& look);
+
+	UINT numFrames()const;
+	const Frame& getFrame(UINT i)const;
+
+	// Points the camera the way it was at frame i.  The camera never rolls,
+	// so the position and view direction are enough to rebuild it; the lens
+	// is left alone.
+	void apply(UINT i, Camera& camera)const;
+
+	// Both return false if the file can't be opened or isn't a camera path.
+	bool save(const std::string& filename)const;
+	bool load(const std::string& filename);
+
+private:
+	std::vector<Frame> mFrames;
+};
+
+#endif // CAMERA_PATH_H
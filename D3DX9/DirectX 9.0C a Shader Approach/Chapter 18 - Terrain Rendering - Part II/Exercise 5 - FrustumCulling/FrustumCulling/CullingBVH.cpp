@@ -0,0 +1,410 @@
+//=============================================================================
+// CullingBVH.cpp.
+//=============================================================================
+
+#include "CullingBVH.h"
+#include "Camera.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace
+{
+	const int ALL_PLANES = 0x3f;
+
+	// Kept off every margin to cover rounding in the plane tests.
+	const float MARGIN_EPSILON = 1e-3f;
+
+	// Running drift past which every decision is dropped and the total
+	// starts again from zero, before doubles lose the precision to hold
+	// margins.
+	const double MAX_DRIFT = 1e9;
+
+	// Orders item indices by the center of their box along one axis.
+	struct CenterLess
+	{
+		const AABB* boxes;
+		int axis;
+
+		bool operator()(UINT a, UINT b)const
+		{
+			return boxes[a].minPt[axis] + boxes[a].maxPt[axis] <
+				   boxes[b].minPt[axis] + boxes[b].maxPt[axis];
+		}
+	};
+}
+
+CullingBVH::CullingBVH()
+: mTemporalCoherence(true), mHavePrevPlanes(false), mDrift(0.0),
+  mPlanes(0), mVisible(0), mNumVisible(0)
+{
+	ZeroMemory(&mStats, sizeof(mStats));
+}
+
+void CullingBVH::build(const AABB* boxes, UINT numBoxes, UINT maxLeafItems)
+{
+	mNodes.clear();
+	mItems.resize(numBoxes);
+	mItemBoxes.resize(numBoxes);
+
+	// Nothing is known about the new boxes.
+	ItemState fresh;
+	fresh.lastOutPlane        = -1;
+	fresh.decision.validUntil = -1.0;
+	fresh.decision.result     = 0;
+	mItemStates.assign(numBoxes, fresh);
+
+	if( numBoxes == 0 )
+		return;
+
+	for(UINT i = 0; i < numBoxes; ++i)
+		mItems[i] = i;
+
+	// Keep the source boxes in mItemBoxes while building; buildNode only
+	// permutes mItems.
+	for(UINT i = 0; i < numBoxes; ++i)
+		mItemBoxes[i] = boxes[i];
+
+	mNodes.reserve(2*numBoxes/max(maxLeafItems, 1u) + 1);
+	buildNode(0, numBoxes, max(maxLeafItems, 1u));
+
+	// Now store the boxes in leaf order, so the leaves read them linearly.
+	for(UINT i = 0; i < numBoxes; ++i)
+		mItemBoxes[i] = boxes[mItems[i]];
+}
+
+void CullingBVH::refit(const AABB* boxes)
+{
+	for(UINT i = 0; i < mItems.size(); ++i)
+	{
+		const AABB& b = boxes[mItems[i]];
+		if( b.minPt != mItemBoxes[i].minPt || b.maxPt != mItemBoxes[i].maxPt )
+			mItemStates[i].decision.validUntil = -1.0;
+		mItemBoxes[i] = b;
+	}
+
+	// Children always come after their parent, so walking the nodes
+	// backwards visits every child before the node that holds it.
+	for(UINT i = (UINT)mNodes.size(); i-- > 0; )
+	{
+		Node& n = mNodes[i];
+		AABB box;
+		if( n.count > 0 )
+		{
+			for(UINT k = n.first; k < n.first + n.count; ++k)
+			{
+				D3DXVec3Minimize(&box.minPt, &box.minPt, &mItemBoxes[k].minPt);
+				D3DXVec3Maximize(&box.maxPt, &box.maxPt, &mItemBoxes[k].maxPt);
+			}
+		}
+		else
+		{
+			const AABB& l = mNodes[i+1].box;
+			const AABB& r = mNodes[n.right].box;
+			D3DXVec3Minimize(&box.minPt, &l.minPt, &r.minPt);
+			D3DXVec3Maximize(&box.maxPt, &l.maxPt, &r.maxPt);
+		}
+		if( box.minPt != n.box.minPt || box.maxPt != n.box.maxPt )
+			n.decision.validUntil = -1.0;
+		n.box = box;
+	}
+}
+
+UINT CullingBVH::buildNode(UINT first, UINT count, UINT maxLeafItems)
+{
+	UINT index = (UINT)mNodes.size();
+	mNodes.push_back(Node());
+
+	AABB box;
+	AABB centers;
+	for(UINT i = first; i < first + count; ++i)
+	{
+		const AABB& b = mItemBoxes[mItems[i]];
+		D3DXVec3Minimize(&box.minPt, &box.minPt, &b.minPt);
+		D3DXVec3Maximize(&box.maxPt, &box.maxPt, &b.maxPt);
+
+		D3DXVECTOR3 c = b.center();
+		D3DXVec3Minimize(&centers.minPt, &centers.minPt, &c);
+		D3DXVec3Maximize(&centers.maxPt, &centers.maxPt, &c);
+	}
+
+	mNodes[index].box          = box;
+	mNodes[index].lastOutPlane = -1;
+	mNodes[index].decision.validUntil = -1.0;
+	mNodes[index].decision.result     = 0;
+
+	if( count <= maxLeafItems )
+	{
+		mNodes[index].right = 0;
+		mNodes[index].first = first;
+		mNodes[index].count = count;
+		return index;
+	}
+
+	// Split at the median along the axis the centers spread most on.
+	D3DXVECTOR3 spread = centers.maxPt - centers.minPt;
+	CenterLess less;
+	less.boxes = &mItemBoxes[0];
+	less.axis  = 0;
+	if( spread.y > spread[less.axis] ) less.axis = 1;
+	if( spread.z > spread[less.axis] ) less.axis = 2;
+
+	UINT half = count / 2;
+	std::nth_element(mItems.begin() + first, mItems.begin() + first + half,
+		mItems.begin() + first + count, less);
+
+	buildNode(first, half, maxLeafItems);
+	UINT right = buildNode(first + half, count - half, maxLeafItems);
+
+	mNodes[index].right = right;
+	mNodes[index].first = 0;
+	mNodes[index].count = 0;
+	return index;
+}
+
+UINT CullingBVH::cull(const Camera& camera, UINT* visible)
+{
+	ZeroMemory(&mStats, sizeof(mStats));
+
+	mPlanes     = camera.frustumPlanes();
+	mVisible    = visible;
+	mNumVisible = 0;
+
+	if( !mNodes.empty() )
+	{
+		// Move the running drift on by as much as the planes moved since
+		// the last cull, which uses up that much of every stored margin.
+		bool restart = !mHavePrevPlanes;
+		if( mHavePrevPlanes )
+			mDrift += planeDrift(mPlanes);
+		if( mDrift > MAX_DRIFT )
+			restart = true;
+
+		for(int p = 0; p < 6; ++p)
+			mPrevPlanes[p] = mPlanes[p];
+		mHavePrevPlanes = true;
+
+		if( restart )
+		{
+			mDrift = 0.0;
+			for(UINT i = 0; i < mNodes.size(); ++i)
+				mNodes[i].decision.validUntil = -1.0;
+			for(UINT i = 0; i < mItemStates.size(); ++i)
+				mItemStates[i].decision.validUntil = -1.0;
+		}
+
+		cullNode(0, ALL_PLANES, FLT_MAX);
+	}
+
+	mStats.itemsVisible = mNumVisible;
+	return mNumVisible;
+}
+
+float CullingBVH::planeDrift(const D3DXPLANE* planes)const
+{
+	// For a box with center c and half widths e, the plane test values
+	// d + r and d - r change by at most |n' - n|.(|c| + e) + |d' - d|.
+	// On each axis |c| + e is the box's largest absolute coordinate, and
+	// every box is inside the root box.
+	const AABB& root = mNodes[0].box;
+	D3DXVECTOR3 reach(max(fabsf(root.minPt.x), fabsf(root.maxPt.x)),
+					  max(fabsf(root.minPt.y), fabsf(root.maxPt.y)),
+					  max(fabsf(root.minPt.z), fabsf(root.maxPt.z)));
+
+	float drift = 0.0f;
+	for(int p = 0; p < 6; ++p)
+	{
+		const D3DXPLANE& a = mPrevPlanes[p];
+		const D3DXPLANE& b = planes[p];
+		float d = fabsf(b.a - a.a)*reach.x + fabsf(b.b - a.b)*reach.y +
+			fabsf(b.c - a.c)*reach.z + fabsf(b.d - a.d);
+		drift = max(drift, d);
+	}
+	return drift;
+}
+
+void CullingBVH::decide(Decision& decision, int result, float margin)
+{
+	decision.result     = result;
+	decision.validUntil = mDrift + margin - MARGIN_EPSILON;
+}
+
+void CullingBVH::cullNode(UINT node, int planeMask, float insideMargin)
+{
+	// insideMargin is how far inside the planes missing from planeMask
+	// (the ones an ancestor was found inside) this node is, at least.
+	Node& n = mNodes[node];
+	++mStats.nodesVisited;
+
+	if( mTemporalCoherence && n.decision.validUntil > mDrift )
+	{
+		++mStats.coherentSkips;
+		if( n.decision.result > 0 )
+		{
+			++mStats.subtreesAccepted;
+			acceptSubtree(node);
+		}
+		return;
+	}
+
+	// Try the plane that rejected this node last time first.
+	float margin = 0.0f;
+	int last = n.lastOutPlane;
+	if( last >= 0 && (planeMask & (1 << last)) )
+	{
+		int result = classify(n.box, last, margin);
+		if( result < 0 )
+		{
+			decide(n.decision, -1, margin);
+			return;
+		}
+		if( result > 0 )
+		{
+			planeMask &= ~(1 << last);
+			insideMargin = min(insideMargin, margin);
+		}
+	}
+
+	for(int p = 0; p < 6; ++p)
+	{
+		if( p == last || !(planeMask & (1 << p)) )
+			continue;
+
+		int result = classify(n.box, p, margin);
+		if( result < 0 )
+		{
+			n.lastOutPlane = p;
+			decide(n.decision, -1, margin);
+			return;
+		}
+		if( result > 0 )
+		{
+			planeMask &= ~(1 << p);
+			insideMargin = min(insideMargin, margin);
+		}
+	}
+
+	// Inside every plane: everything below is visible.
+	if( planeMask == 0 )
+	{
+		++mStats.subtreesAccepted;
+		decide(n.decision, 1, insideMargin);
+		acceptSubtree(node);
+		return;
+	}
+
+	// Straddling: the children decide.
+	n.decision.validUntil = -1.0;
+
+	if( n.count > 0 )
+	{
+		for(UINT i = n.first; i < n.first + n.count; ++i)
+			cullItem(i, planeMask, insideMargin);
+		return;
+	}
+
+	cullNode(node + 1, planeMask, insideMargin);
+	cullNode(n.right, planeMask, insideMargin);
+}
+
+void CullingBVH::cullItem(UINT item, int planeMask, float insideMargin)
+{
+	ItemState& state = mItemStates[item];
+
+	if( mTemporalCoherence && state.decision.validUntil > mDrift )
+	{
+		++mStats.coherentSkips;
+		if( state.decision.result > 0 )
+			mVisible[mNumVisible++] = mItems[item];
+		return;
+	}
+
+	// Test the planes that are left, the one that rejected the item last
+	// time first.  The item stays visible until it is outside one of them.
+	float margin = insideMargin;
+	int last = state.lastOutPlane;
+	for(int k = -1; k < 6; ++k)
+	{
+		int p = k < 0 ? last : k;
+		if( p < 0 || (k >= 0 && p == last) || !(planeMask & (1 << p)) )
+			continue;
+
+		float planeMargin = 0.0f;
+		if( classify(mItemBoxes[item], p, planeMargin) < 0 )
+		{
+			state.lastOutPlane = p;
+			decide(state.decision, 0, planeMargin);
+			return;
+		}
+		margin = min(margin, planeMargin);
+	}
+
+	decide(state.decision, 1, margin);
+	mVisible[mNumVisible++] = mItems[item];
+}
+
+void CullingBVH::acceptSubtree(UINT node)
+{
+	const Node& n = mNodes[node];
+	if( n.count > 0 )
+	{
+		for(UINT i = n.first; i < n.first + n.count; ++i)
+			mVisible[mNumVisible++] = mItems[i];
+		return;
+	}
+
+	acceptSubtree(node + 1);
+	acceptSubtree(n.right);
+}
+
+int CullingBVH::classify(const AABB& box, int p, float& margin)
+{
+	++mStats.planeTests;
+
+	// Signed distance from the box center to the plane, against the
+	// box's extent projected onto the plane normal.
+	const D3DXPLANE& P = mPlanes[p];
+	D3DXVECTOR3 c = box.center();
+	D3DXVECTOR3 e = box.extent();
+
+	float d = P.a*c.x + P.b*c.y + P.c*c.z + P.d;
+	float r = fabsf(P.a)*e.x + fabsf(P.b)*e.y + fabsf(P.c)*e.z;
+
+	if( d + r < 0.0f )
+	{
+		margin = -(d + r);
+		return -1;
+	}
+	if( d - r >= 0.0f )
+	{
+		margin = d - r;
+		return 1;
+	}
+	margin = d + r;
+	return 0;
+}
+
+UINT CullingBVH::numItems()const
+{
+	return (UINT)mItems.size();
+}
+
+UINT CullingBVH::numNodes()const
+{
+	return (UINT)mNodes.size();
+}
+
+void CullingBVH::setTemporalCoherence(bool enable)
+{
+	mTemporalCoherence = enable;
+}
+
+bool CullingBVH::isTemporalCoherenceEnabled()const
+{
+	return mTemporalCoherence;
+}
+
+const CullingBVH::Stats& CullingBVH::getStats()const
+{
+	return mStats;
+}
@@ -0,0 +1,137 @@
+//=============================================================================
+// CullingBVH.h.
+//
+// A static bounding volume hierarchy for frustum culling many world space
+// boxes at once, instead of calling Camera::isVisible on each of them.
+//
+// cull() walks the tree from the root.  A node completely outside one
+// frustum plane is rejected along with its whole subtree.  A node
+// completely inside a plane drops that plane from the set its children
+// are tested against (plane masking), and once a node is inside all six
+// planes its whole subtree is accepted without further tests.  Each node
+// and item also remembers the plane that last rejected it and tries that
+// one first the next frame (coherency caching), since the camera moves
+// little from frame to frame.
+//
+// Temporal coherence goes further and skips the tests altogether.  Every
+// decision (node rejected, node accepted, item visible or not) is stored
+// with its margin: how far the box could move relative to the planes
+// before the decision changed.  Each cull() bounds how far the frustum
+// planes have moved anywhere in the hierarchy's box since the last one and
+// adds that to a running total; decisions whose margin the total hasn't
+// used up yet are still right and are reused as they are.  A camera
+// that is standing still or moving slowly retests almost nothing; turning
+// it moves the planes a long way near the edge of the scene and most
+// decisions get retested.
+//
+// Only the Camera's frustum planes are used, so the culling can be run
+// and timed headless against any number of boxes.
+//=============================================================================
+
+#ifndef CULLING_BVH_H
+#define CULLING_BVH_H
+
+#include "d3dUtil.h"
+#include <vector>
+
+class Camera;
+
+class CullingBVH
+{
+public:
+	struct Stats
+	{
+		UINT nodesVisited;
+		UINT planeTests;
+		UINT subtreesAccepted; // Nodes found inside every plane.
+		UINT itemsVisible;
+		UINT coherentSkips;    // Nodes and items decided without testing.
+	};
+
+	CullingBVH();
+
+	// Item i is the box boxes[i].  Leaves hold at most maxLeafItems items.
+	void build(const AABB* boxes, UINT numBoxes, UINT maxLeafItems = 4);
+
+	// Updates the node boxes after the items' boxes have changed, keeping
+	// the tree's structure.  boxes has the same items as build was given.
+	// Cheap, but the tree gets looser the further the boxes move.  Nodes
+	// and items whose boxes changed are retested by the next cull().
+	void refit(const AABB* boxes);
+
+	// Writes the indices of the items that intersect the camera frustum to
+	// visible, which must have room for numItems() entries, and returns
+	// how many there are.
+	UINT cull(const Camera& camera, UINT* visible);
+
+	UINT numItems()const;
+	UINT numNodes()const;
+
+	// On by default.  Turning it off makes every cull() test from scratch
+	// (apart from the last plane ordering), for comparison.
+	void setTemporalCoherence(bool enable);
+	bool isTemporalCoherenceEnabled()const;
+
+	const Stats& getStats()const;
+
+private:
+	// A decision kept for temporal coherence.  It holds while the running
+	// plane drift is below validUntil.
+	struct Decision
+	{
+		double validUntil;
+		int    result; // Nodes: -1 rejected, 1 accepted.  Items: 1 visible.
+	};
+
+	// Interior nodes keep their left child right after them and store the
+	// right child's index; leaves store a range of mItems instead.
+	struct Node
+	{
+		AABB box;
+		UINT right;
+		UINT first;        // Leaves: first item in mItems.
+		UINT count;        // Leaves: number of items; 0 for interior nodes.
+		int  lastOutPlane; // Plane that last rejected the node, or -1.
+		Decision decision;
+	};
+
+	struct ItemState
+	{
+		int lastOutPlane;
+		Decision decision;
+	};
+
+	UINT buildNode(UINT first, UINT count, UINT maxLeafItems);
+	void cullNode(UINT node, int planeMask, float insideMargin);
+	void cullItem(UINT item, int planeMask, float insideMargin);
+	void acceptSubtree(UINT node);
+	void decide(Decision& decision, int result, float margin);
+	float planeDrift(const D3DXPLANE* planes)const;
+
+	// Returns -1 if the box is outside plane p, 1 if it is inside and
+	// 0 if it straddles it.  margin is how far the plane could move before
+	// that changes (for 0, before the box is outside).
+	int classify(const AABB& box, int p, float& margin);
+
+private:
+	std::vector<Node> mNodes;
+	std::vector<UINT> mItems;     // Item indices in leaf order.
+	std::vector<AABB> mItemBoxes; // Boxes in leaf order.
+	std::vector<ItemState> mItemStates;
+
+	// Temporal coherence.  mDrift is the total distance the planes have
+	// moved (at most) since the first cull().
+	bool      mTemporalCoherence;
+	bool      mHavePrevPlanes;
+	D3DXPLANE mPrevPlanes[6];
+	double    mDrift;
+
+	// Per cull() state.
+	const D3DXPLANE* mPlanes;
+	UINT* mVisible;
+	UINT  mNumVisible;
+
+	Stats mStats;
+};
+
+#endif // CULLING_BVH_H
@@ -0,0 +1,77 @@
+//=============================================================================
+// FrameArena.cpp.
+//=============================================================================
+
+#include "FrameArena.h"
+
+namespace
+{
+	char* alignUp(char* p, UINT alignment)
+	{
+		UINT_PTR a = (UINT_PTR)alignment - 1;
+		return (char*)(((UINT_PTR)p + a) & ~a);
+	}
+}
+
+FrameArena::FrameArena(UINT capacity)
+: mBlock(0), mCapacity(capacity), mUsed(0), mOverflowBytes(0)
+{
+	if( mCapacity )
+		mBlock = new char[mCapacity];
+}
+
+FrameArena::~FrameArena()
+{
+	for(UINT i = 0; i < mOverflow.size(); ++i)
+		delete[] mOverflow[i];
+	delete[] mBlock;
+}
+
+void FrameArena::reset()
+{
+	if( !mOverflow.empty() )
+	{
+		// Last frame did not fit.  Grow the block so it would have.
+		UINT highWater = mUsed + mOverflowBytes;
+
+		for(UINT i = 0; i < mOverflow.size(); ++i)
+			delete[] mOverflow[i];
+		mOverflow.clear();
+		mOverflowBytes = 0;
+
+		delete[] mBlock;
+		mCapacity = highWater + highWater/2;
+		mBlock    = new char[mCapacity];
+	}
+
+	mUsed = 0;
+}
+
+void* FrameArena::alloc(UINT bytes, UINT alignment)
+{
+	if( mBlock )
+	{
+		char* p = alignUp(mBlock + mUsed, alignment);
+		if( p + bytes <= mBlock + mCapacity )
+		{
+			mUsed = (UINT)(p + bytes - mBlock);
+			return p;
+		}
+	}
+
+	// Out of room; give out a heap block for the rest of the frame.
+	char* block = new char[bytes + alignment];
+	mOverflow.push_back(block);
+	mOverflowBytes += bytes + alignment;
+	return alignUp(block, alignment);
+}
+
+UINT FrameArena::capacity()const
+{
+	return mCapacity;
+}
+
+UINT FrameArena::bytesUsed()const
+{
+	return mUsed + mOverflowBytes;
+}
@@ -0,0 +1,53 @@
+//=============================================================================
+// FrameArena.h.
+//
+// A linear allocator for memory that only lives for one frame.  alloc()
+// bumps a pointer through one block and reset() throws everything away at
+// the start of the next frame, so per frame lists cost no heap traffic.
+//
+// If a frame needs more than the block holds, the extra requests fall back
+// to the heap; the next reset() frees them and grows the block to the
+// frame's high-water mark, so after a frame or two the arena stops
+// allocating altogether.
+//=============================================================================
+
+#ifndef FRAME_ARENA_H
+#define FRAME_ARENA_H
+
+#include <windows.h>
+#include <vector>
+
+class FrameArena
+{
+public:
+	explicit FrameArena(UINT capacity = 0);
+	~FrameArena();
+
+	void  reset();
+	void* alloc(UINT bytes, UINT alignment = 16);
+
+	template <typename T>
+	T* alloc(UINT count)
+	{
+		return (T*)alloc(count*sizeof(T));
+	}
+
+	UINT capacity()const;
+	UINT bytesUsed()const;
+
+private:
+	// Make private to prevent copying of members of this class.
+	FrameArena(const FrameArena& rhs);
+	FrameArena& operator=(const FrameArena& rhs);
+
+private:
+	char* mBlock;
+	UINT  mCapacity;
+	UINT  mUsed;
+
+	// Heap blocks handed out after the arena filled up this frame.
+	std::vector<char*> mOverflow;
+	UINT mOverflowBytes;
+};
+
+#endif // FRAME_ARENA_H
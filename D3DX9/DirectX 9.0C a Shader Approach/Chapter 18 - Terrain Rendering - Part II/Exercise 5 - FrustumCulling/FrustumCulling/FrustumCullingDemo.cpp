@@ -7,7 +7,15 @@
 // Controls: Use mouse to look and 'W', 'S', 'A', and 'D' keys to move.
 //           Use 'M' to enable free camera, 'N' to disable free camera.
 //			 Use 'R' to toggle between bounding boxes and bounding spheres.
+//			 Use 'B' to test the boxes through the hierarchy or in a batch.
 //			 Use 'T' to toggle rendering of the bounding volumes.
+//			 Use 'L' to cycle terrain level of detail (off, stitched, skirts).
+//			 Use 'I' to toggle instanced tree rendering.
+//			 Use 'C' to toggle temporal coherence in the box culling.
+//			 Use 'O' to toggle occlusion culling.
+//			 Use 'P' to start and stop recording a camera path.
+//			 Use 'G' to toggle drawing the terrain streamed in tiles.
+//			 Use 'V' to toggle full and compact terrain vertices.
 //=============================================================================
 
 #include <list>
@@ -28,6 +36,11 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE prevInstance,
 
 	srand(time(0));
 
+	// Construct the job system before the application, since the terrain
+	// uses it while it loads.
+	JobSystem jobs;
+	gJobSystem = &jobs;
+
 	// Construct camera before application, since the application uses the camera.
 	Camera camera;
 	gCamera = &camera;
@@ -69,6 +82,23 @@ FrustumCullingDemo::FrustumCullingDemo(HINSTANCE hInstance, std::string winCapti
 	D3DXVECTOR3 toSun(-1.0f, 3.0f, 1.0f);
 	D3DXVec3Normalize(&toSun, &toSun);
 	mTerrain->setDirToSunW(toSun);
+	mGround = new GroundQuery(mTerrain);
+
+	// Convert the map to the tiled format and stream it back in as a 2x2
+	// grid of tiles, drawn instead of mTerrain when enabled.  The heights
+	// match, so the camera and the props follow either one.  Each tile
+	// stretches the blend map over itself.
+	std::string tiledFilename = GetScratchDirectory("FrustumCulling") + "castlehm257.til";
+	PagedHeightmap::convertRAW(257, 257, "castlehm257.raw", 0.5f, 0.0f, 64, tiledFilename);
+	mWorld = new TerrainWorld(tiledFilename, 129, 2.0f, 2.0f, "grass.dds", "dirt.dds",
+		"rock.dds", "blend_castle.dds", 160.0f, 220.0f);
+	mWorld->setDirToSunW(toSun);
+	mWorldEnabled = false;
+	mWorldStatus  = "Disabled";
+
+	// Darken the valleys.  The bake is cached in the temp directory, out of
+	// the art folder, so only the first run pays for it.
+	mTerrainAOStats = mTerrain->bakeAmbientOcclusion(64, GetScratchDirectory("FrustumCulling"));
 
 	// Setup water.
 	D3DXMATRIX waterWorld;
@@ -79,9 +109,34 @@ FrustumCullingDemo::FrustumCullingDemo(HINSTANCE hInstance, std::string winCapti
 	gCamera->pos() = D3DXVECTOR3(8.0f, 35.0f, -100.0f);
 	gCamera->setSpeed(20.0f);
 	mFreeCamera = false;
+	mRecordingPath = false;
+	mCameraPathStatus = "Not recording";
 
 	buildCastle();
 	buildTrees();
+	buildPropBounds();
+
+	// Hills and the castle hide much of the scene from the ground.
+	mOcclusion = new OcclusionCuller(256, 192);
+	buildOccluders();
+	mOcclusionEnabled = true;
+	mOcclusionStatus  = "Enabled";
+	mNumPropsOccluded = 0;
+	mTerrain->setOcclusionCuller(mOcclusion);
+
+	mTreeBatcher = new InstanceBatcher(NUM_TREES);
+	for(int i = 0; i < NUM_TREE_MESHES; ++i)
+		mTreeBatcher->addMesh(mTrees[i].mesh, mTrees[i].mtrls, mTrees[i].textures);
+
+	// Hardware instancing needs vertex shader 3.0.  Without it the trees
+	// are drawn one at a time.
+	D3DCAPS9 caps;
+	HR(gd3dDevice->GetDeviceCaps(&caps));
+	mInstancingSupported = caps.VertexShaderVersion >= D3DVS_VERSION(3, 0);
+	mInstancing          = mInstancingSupported;
+	mInstancingStatus    = mInstancing ? "Enabled" : "Disabled";
+	mNumPropDrawCalls    = 0;
+	mNumPropStateChanges = 0;
 	buildGrass();
 
 	HR(D3DXCreateTextureFromFile(gd3dDevice, "grassfin0.dds", &mGrassTex));
@@ -117,7 +172,8 @@ FrustumCullingDemo::FrustumCullingDemo(HINSTANCE hInstance, std::string winCapti
 	initFont();
 
 	mIsBoundingVolumeSphere = false;
-	mBoundingVolumeUsed = "AABB";
+	mBoxCullBatch = false;
+	mBoundingVolumeUsed = "AABB (hierarchy)";
 	// Define the bounding volume mesh's material--make semi-transparent.
 	FrustumCullingDemo::Object3D::boundingVolumeMtrl.ambient   = D3DXCOLOR(0.0f, 0.0f, 1.0f, 1.0f);
 	FrustumCullingDemo::Object3D::boundingVolumeMtrl.diffuse   = D3DXCOLOR(0.0f, 0.0f, 1.0f, 0.5f);
@@ -125,6 +181,10 @@ FrustumCullingDemo::FrustumCullingDemo(HINSTANCE hInstance, std::string winCapti
 	FrustumCullingDemo::Object3D::boundingVolumeMtrl.specPower = 8.0f;
 	mDrawBoundingVolumes = true;
 	mDrawBoundingVolumesStatus = "Enabled";
+	mTerrainLODStatus = "Disabled";
+	mCullCoherenceStatus = "Enabled";
+	mPropPlaneTests = 0.0;
+	mPropCullFrames = 0;
 
 	onResetDevice();
 }
@@ -132,8 +192,12 @@ FrustumCullingDemo::FrustumCullingDemo(HINSTANCE hInstance, std::string winCapti
 FrustumCullingDemo::~FrustumCullingDemo()
 {
 	delete mGfxStats;
+	delete mGround;
+	delete mWorld;
 	delete mTerrain;
 	delete mWater;
+	delete mTreeBatcher;
+	delete mOcclusion;
 	ReleaseCOM(mWhiteTex);
 	ReleaseCOM(mFX);
 	ReleaseCOM(mGrassMesh);
@@ -164,7 +228,9 @@ void FrustumCullingDemo::onLostDevice()
 {
 	mGfxStats->onLostDevice();
 	mTerrain->onLostDevice();
+	mWorld->onLostDevice();
 	mWater->onLostDevice();
+	mTreeBatcher->onLostDevice();
 	HR(mFX->OnLostDevice());
 	HR(mGrassFX->OnLostDevice());
 	HR(mFont->OnLostDevice());
@@ -174,7 +240,9 @@ void FrustumCullingDemo::onResetDevice()
 {
 	mGfxStats->onResetDevice();
 	mTerrain->onResetDevice();
+	mWorld->onResetDevice();
 	mWater->onResetDevice();
+	mTreeBatcher->onResetDevice();
 	HR(mFX->OnResetDevice());
 	HR(mGrassFX->OnResetDevice());
 	HR(mFont->OnResetDevice());
@@ -184,6 +252,8 @@ void FrustumCullingDemo::onResetDevice()
 	float w = (float)md3dPP.BackBufferWidth;
 	float h = (float)md3dPP.BackBufferHeight;
 	gCamera->setLens(D3DX_PI * 0.25f, w/h, 1.0f, 1000.0f);
+	mTerrain->setLODViewportHeight(h);
+	mWorld->setLODViewportHeight(h);
 }
 
 void FrustumCullingDemo::updateScene(float dt)
@@ -205,8 +275,25 @@ void FrustumCullingDemo::updateScene(float dt)
 		if (mIsBoundingVolumeSphere)
 		
 			mBoundingVolumeUsed = "Sphere";
+		else if (mBoxCullBatch)
+			mBoundingVolumeUsed = "AABB (batch)";
 		else
-			mBoundingVolumeUsed = "AABB";
+			mBoundingVolumeUsed = "AABB (hierarchy)";
+		mPropPlaneTests = 0.0;
+		mPropCullFrames = 0;
+	}
+	if (gDInput->keyPressed(DIK_B)) //Toggle testing the boxes through the hierarchy or in a batch
+	{
+		mBoxCullBatch = !mBoxCullBatch;
+		if (!mIsBoundingVolumeSphere)
+		{
+			if (mBoxCullBatch)
+				mBoundingVolumeUsed = "AABB (batch)";
+			else
+				mBoundingVolumeUsed = "AABB (hierarchy)";
+			mPropPlaneTests = 0.0;
+			mPropCullFrames = 0;
+		}
 	}
 	if (gDInput->keyPressed(DIK_T)) //Toggle rendering of the bounding volumes
 	{
@@ -216,6 +303,92 @@ void FrustumCullingDemo::updateScene(float dt)
 		else
 			mDrawBoundingVolumesStatus = "Disabled";
 	}
+	if (gDInput->keyPressed(DIK_L)) //Cycle terrain level of detail: off, stitched, skirts
+	{
+		if (!mTerrain->isLODEnabled())
+		{
+			mTerrain->setLODEnabled(true);
+			mTerrain->setLODCrackFix(Terrain::LOD_STITCH);
+			mTerrainLODStatus = "Stitched";
+		}
+		else if (mTerrain->getLODCrackFix() == Terrain::LOD_STITCH)
+		{
+			mTerrain->setLODCrackFix(Terrain::LOD_SKIRTS);
+			mTerrainLODStatus = "Skirts";
+		}
+		else
+		{
+			mTerrain->setLODEnabled(false);
+			mTerrainLODStatus = "Disabled";
+		}
+		mWorld->setLODEnabled(mTerrain->isLODEnabled());
+		mWorld->setLODCrackFix(mTerrain->getLODCrackFix());
+	}
+	if (gDInput->keyPressed(DIK_I) && mInstancingSupported) //Toggle instanced tree rendering
+	{
+		mInstancing = !mInstancing;
+		if (mInstancing)
+			mInstancingStatus = "Enabled";
+		else
+			mInstancingStatus = "Disabled";
+	}
+	if (gDInput->keyPressed(DIK_C)) //Toggle temporal coherence in the box culling
+	{
+		mPropBVH.setTemporalCoherence(!mPropBVH.isTemporalCoherenceEnabled());
+		if (mPropBVH.isTemporalCoherenceEnabled())
+			mCullCoherenceStatus = "Enabled";
+		else
+			mCullCoherenceStatus = "Disabled";
+		mPropPlaneTests = 0.0;
+		mPropCullFrames = 0;
+	}
+	if (gDInput->keyPressed(DIK_O)) //Toggle occlusion culling
+	{
+		mOcclusionEnabled = !mOcclusionEnabled;
+		if (mOcclusionEnabled)
+		{
+			mOcclusionStatus = "Enabled";
+			mTerrain->setOcclusionCuller(mOcclusion);
+		}
+		else
+		{
+			mOcclusionStatus = "Disabled";
+			mTerrain->setOcclusionCuller(0);
+			mNumPropsOccluded = 0;
+		}
+	}
+	if (gDInput->keyPressed(DIK_P)) //Start or stop recording a camera path
+	{
+		mRecordingPath = !mRecordingPath;
+		if (mRecordingPath)
+		{
+			mCameraPath.clear();
+			mCameraPathStatus = "Recording";
+		}
+		else
+		{
+			std::string filename = GetScratchDirectory("FrustumCulling") + "camera_path.txt";
+			if (mCameraPath.save(filename))
+				mCameraPathStatus = "Saved to " + filename;
+			else
+				mCameraPathStatus = "Could not save " + filename;
+		}
+	}
+	if (gDInput->keyPressed(DIK_G)) //Toggle drawing the streamed terrain
+	{
+		mWorldEnabled = !mWorldEnabled;
+		if (mWorldEnabled)
+			mWorldStatus = "Enabled";
+		else
+			mWorldStatus = "Disabled";
+	}
+	if (gDInput->keyPressed(DIK_V)) //Toggle full and compact terrain vertices
+	{
+		if (mTerrain->getVertexFormat() == Terrain::VERTEX_FULL)
+			rebuildTerrain(Terrain::VERTEX_COMPACT);
+		else
+			rebuildTerrain(Terrain::VERTEX_FULL);
+	}
 
 	if( mFreeCamera )
 	{
@@ -223,9 +396,18 @@ void FrustumCullingDemo::updateScene(float dt)
 	}
 	else
 	{
-		gCamera->update(dt, mTerrain, 2.5f);
+		gCamera->update(dt, mGround, 2.5f);
 	}
 
+	if( mRecordingPath )
+		mCameraPath.record(*gCamera);
+
+	// Stream the tiles and heightmap pages around the camera.
+	if( mWorldEnabled )
+		mWorld->update(gCamera->pos());
+
+	// Props only pay for new transforms when something has moved them.
+	updatePropTransforms();
 
 	mWater->update(dt);
 }
@@ -237,13 +419,28 @@ void FrustumCullingDemo::drawScene()
 
 	HR(gd3dDevice->BeginScene());
 
+	// The occluders' depths for this frame, for the props and the terrain.
+	// The terrain occluder is a copy of the heights, so rebuild it after
+	// they are edited.
+	if( mOcclusionEnabled )
+	{
+		if( mTerrain->getEditCount() != mOccluderEditCount )
+			buildOccluders();
+		mOcclusion->render(gCamera->viewProj());
+	}
+
 	HR(mFX->SetValue(mhEyePosW, &gCamera->pos(), sizeof(D3DXVECTOR3)));
 	HR(mFX->SetTechnique(mhTech));
 	UINT numPasses = 0;
 	HR(mFX->Begin(&numPasses, 0));
 	HR(mFX->BeginPass(0));
 
-	drawObject(mCastle, mCastle.world);
+	cullProps();
+	mNumPropDrawCalls    = 0;
+	mNumPropStateChanges = 0;
+
+	if( mPropVisible[0] )
+		drawObject(mCastle);
 
 	// Use alpha test to block non leaf pixels from being rendered in the
 	// trees (i.e., use alpha mask).
@@ -251,9 +448,17 @@ void FrustumCullingDemo::drawScene()
 	HR(gd3dDevice->SetRenderState(D3DRS_ALPHAFUNC, D3DCMP_GREATEREQUAL));
 	HR(gd3dDevice->SetRenderState(D3DRS_ALPHAREF, 200));
 
-	for(int i = 0; i < NUM_TREES; ++i)
+	if( mInstancing )
 	{
-		drawObject(mTrees[i], mTrees[i].world);
+		drawTreesInstanced();
+	}
+	else
+	{
+		for(int i = 0; i < NUM_TREES; ++i)
+		{
+			if( mPropVisible[i+1] )
+				drawObject(mTrees[i]);
+		}
 	}
 
 	HR(gd3dDevice->SetRenderState(D3DRS_ALPHATESTENABLE, false));
@@ -264,18 +469,9 @@ void FrustumCullingDemo::drawScene()
 
 	if (mDrawBoundingVolumes)
 	{
-		if (mIsBoundingVolumeSphere)
-			drawBoundingVolume(mCastle.boundingSphereMesh, mCastle.sphereOffset, mCastle.sphere);
-		else
-			drawBoundingVolume(mCastle.boundingAABoxMesh, mCastle.boxOffset, mCastle.box);
-
+		drawBoundingVolume(mCastle);
 		for (UINT i = 0; i < NUM_TREES; ++i)
-		{
-			if (mIsBoundingVolumeSphere)
-				drawBoundingVolume(mTrees[i].boundingSphereMesh, mTrees[i].sphereOffset, mTrees[i].sphere);
-			else
-				drawBoundingVolume(mTrees[i].boundingAABoxMesh, mTrees[i].boxOffset, mTrees[i].box);
-		}
+			drawBoundingVolume(mTrees[i]);
 	}
 	HR(gd3dDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, false));
 
@@ -295,7 +491,18 @@ void FrustumCullingDemo::drawScene()
 	HR(mGrassFX->EndPass());
 	HR(mGrassFX->End());
 
-	mTerrain->draw();
+	if( mWorldEnabled )
+	{
+		mWorld->draw();
+		mGfxStats->setHeapAllocCount(mWorld->getStats().numDrawAllocs);
+		mGfxStats->setTerrainTriCount(mWorld->getStats().numTrisDrawn, mTerrain->getNumTriangles());
+	}
+	else
+	{
+		mTerrain->draw();
+		mGfxStats->setHeapAllocCount(mTerrain->getNumDrawAllocs());
+		mGfxStats->setTerrainTriCount(mTerrain->getNumTrianglesDrawn(), mTerrain->getNumTriangles());
+	}
 
 	//mWater->draw(); // draw alpha blended objects last.
 
@@ -308,24 +515,24 @@ void FrustumCullingDemo::drawScene()
 	HR(gd3dDevice->Present(0, 0, 0, 0));
 }
 
-void FrustumCullingDemo::drawBoundingVolume(ID3DXMesh* boundingVolumeMesh, const D3DXMATRIX& toWorld, const BoundingSphere &boundingVolume) const
-{
-	if (gCamera->isVisible(boundingVolume))
-		drawBoundingVolumeSharedCode(boundingVolumeMesh, toWorld);
-}
-
-void FrustumCullingDemo::drawBoundingVolume(ID3DXMesh* boundingVolumeMesh, const D3DXMATRIX& toWorld, const AABB &boundingVolume) const
+void FrustumCullingDemo::drawBoundingVolume(const Object3D& obj) const
 {
-	if (gCamera->isVisible(boundingVolume))
-		drawBoundingVolumeSharedCode(boundingVolumeMesh, toWorld);
+	if (mIsBoundingVolumeSphere)
+	{
+		if (gCamera->isVisible(obj.sphere))
+			drawBoundingVolumeSharedCode(obj.boundingSphereMesh, obj.sphereOffset, obj.sphereOffsetInvTrans);
+	}
+	else
+	{
+		if (gCamera->isVisible(obj.box))
+			drawBoundingVolumeSharedCode(obj.boundingAABoxMesh, obj.boxOffset, obj.boxOffsetInvTrans);
+	}
 }
 
-void FrustumCullingDemo::drawBoundingVolumeSharedCode(ID3DXMesh* boundingVolumeMesh, const D3DXMATRIX& toWorld) const
+void FrustumCullingDemo::drawBoundingVolumeSharedCode(ID3DXMesh* boundingVolumeMesh, const D3DXMATRIX& toWorld,
+													  const D3DXMATRIX& worldInvTrans) const
 {
 	HR(mFX->SetMatrix(mhWVP, &(toWorld*gCamera->viewProj())));
-	D3DXMATRIX worldInvTrans;
-	D3DXMatrixInverse(&worldInvTrans, 0, &toWorld);
-	D3DXMatrixTranspose(&worldInvTrans, &worldInvTrans);
 	HR(mFX->SetMatrix(mhWorldInvTrans, &worldInvTrans));
 	HR(mFX->SetMatrix(mhWorld, &toWorld));
 	HR(mFX->SetValue(mhMtrl, &Object3D::boundingVolumeMtrl, sizeof(Mtrl)));
@@ -345,6 +552,8 @@ void FrustumCullingDemo::buildFX()
 
 	// Obtain handles.
 	mhTech            = mFX->GetTechniqueByName("DirLightTexTech");
+	mhInstancedTech   = mFX->GetTechniqueByName("DirLightTexInstancedTech");
+	mhViewProj        = mFX->GetParameterByName(0, "gViewProj");
 	mhWVP             = mFX->GetParameterByName(0, "gWVP");
 	mhWorldInvTrans   = mFX->GetParameterByName(0, "gWorldInvTrans");
 	mhMtrl            = mFX->GetParameterByName(0, "gMtrl");
@@ -372,80 +581,128 @@ void FrustumCullingDemo::buildFX()
 	HR(mGrassFX->SetTexture(mhGrassTex, mGrassTex));
 }
 
-void FrustumCullingDemo::drawObject(Object3D& obj, const D3DXMATRIX& toWorld)
+void FrustumCullingDemo::drawObject(Object3D& obj)
 {
-	// Transform AABB into the world space.
-	AABB box;
-	obj.box.xform(toWorld, box);
+	HR(mFX->SetMatrix(mhWVP, &(obj.world*gCamera->viewProj())));
+	HR(mFX->SetMatrix(mhWorldInvTrans, &obj.worldInvTrans));
+	HR(mFX->SetMatrix(mhWorld, &obj.world));
+	mNumPropStateChanges += 3;
 
-	// Only draw if AABB is visible.
-	if (mIsBoundingVolumeSphere)
+	for(UINT j = 0; j < obj.mtrls.size(); ++j)
 	{
-		if( gCamera->isVisible( obj.sphere ) )
+		HR(mFX->SetValue(mhMtrl, &obj.mtrls[j], sizeof(Mtrl)));
+
+		// If there is a texture, then use.
+		if(obj.textures[j] != 0)
 		{
-			HR(mFX->SetMatrix(mhWVP, &(toWorld*gCamera->viewProj())));
-			D3DXMATRIX worldInvTrans;
-			D3DXMatrixInverse(&worldInvTrans, 0, &toWorld);
-			D3DXMatrixTranspose(&worldInvTrans, &worldInvTrans);
-			HR(mFX->SetMatrix(mhWorldInvTrans, &worldInvTrans));
-			HR(mFX->SetMatrix(mhWorld, &toWorld));
-
-			for(UINT j = 0; j < obj.mtrls.size(); ++j)
-			{
-				HR(mFX->SetValue(mhMtrl, &obj.mtrls[j], sizeof(Mtrl)));
-
-				// If there is a texture, then use.
-				if(obj.textures[j] != 0)
-				{
-					HR(mFX->SetTexture(mhTex, obj.textures[j]));
-				}
-
-				// But if not, then set a pure white texture.  When the texture color
-				// is multiplied by the color from lighting, it is like multiplying by
-				// 1 and won't change the color from lighting.
-				else
-				{
-					HR(mFX->SetTexture(mhTex, mWhiteTex));
-				}
-
-				HR(mFX->CommitChanges());
-				HR(obj.mesh->DrawSubset(j));
-			}
+			HR(mFX->SetTexture(mhTex, obj.textures[j]));
 		}
+
+		// But if not, then set a pure white texture.  When the texture color
+		// is multiplied by the color from lighting, it is like multiplying by
+		// 1 and won't change the color from lighting.
+		else
+		{
+			HR(mFX->SetTexture(mhTex, mWhiteTex));
+		}
+
+		HR(mFX->CommitChanges());
+		HR(obj.mesh->DrawSubset(j));
+		mNumPropStateChanges += 2;
+		++mNumPropDrawCalls;
+	}
+}
+
+void FrustumCullingDemo::drawTreesInstanced()
+{
+	mTreeBatcher->begin();
+	for(int i = 0; i < NUM_TREES; ++i)
+	{
+		if( mPropVisible[i+1] )
+			mTreeBatcher->add(i % NUM_TREE_MESHES, mTrees[i].world);
+	}
+
+	// Swap to the instanced technique for the trees, and back again after.
+	HR(mFX->EndPass());
+	HR(mFX->End());
+
+	HR(mFX->SetTechnique(mhInstancedTech));
+	HR(mFX->SetMatrix(mhViewProj, &gCamera->viewProj()));
+	UINT numPasses = 0;
+	HR(mFX->Begin(&numPasses, 0));
+	HR(mFX->BeginPass(0));
+
+	mTreeBatcher->draw(mFX, mhMtrl, mhTex, mWhiteTex);
+
+	HR(mFX->EndPass());
+	HR(mFX->End());
+
+	HR(mFX->SetTechnique(mhTech));
+	HR(mFX->Begin(&numPasses, 0));
+	HR(mFX->BeginPass(0));
+
+	const InstanceBatcher::Stats& stats = mTreeBatcher->getStats();
+	mNumPropDrawCalls    += stats.numDrawCalls;
+	mNumPropStateChanges += stats.numStateChanges;
+}
+
+void FrustumCullingDemo::cullProps()
+{
+	++mPropCullFrames;
+
+	if (mIsBoundingVolumeSphere)
+	{
+		// Spheres are tested four at a time.
+		BoundingSphereSoA spheres = {mPropSphereX, mPropSphereY, mPropSphereZ, mPropSphereRadius};
+		gCamera->isVisible(spheres, NUM_PROPS, mPropVisibleBits);
+		for(int i = 0; i < NUM_PROPS; ++i)
+			mPropVisible[i] = (mPropVisibleBits[i / 32] & (1u << (i % 32))) != 0;
+
+		// Every sphere is tested against all six planes.
+		mPropPlaneTests += 6.0*NUM_PROPS;
+	}
+	else if (mBoxCullBatch)
+	{
+		// Boxes are tested four at a time, each against all six planes.
+		AABBSoA boxes = {mPropBoxMinX, mPropBoxMinY, mPropBoxMinZ, mPropBoxMaxX, mPropBoxMaxY, mPropBoxMaxZ};
+		gCamera->isVisible(boxes, NUM_PROPS, mPropVisibleBits);
+		for(int i = 0; i < NUM_PROPS; ++i)
+			mPropVisible[i] = (mPropVisibleBits[i / 32] & (1u << (i % 32))) != 0;
+
+		mPropPlaneTests += 6.0*NUM_PROPS;
 	}
 	else
 	{
-		if( gCamera->isVisible( obj.box ) )
+		// Boxes go through the hierarchy, which rejects or accepts whole
+		// groups of props at once.
+		for(int i = 0; i < NUM_PROPS; ++i)
+			mPropVisible[i] = false;
+
+		UINT numVisible = mPropBVH.cull(*gCamera, mVisibleProps);
+		for(UINT i = 0; i < numVisible; ++i)
+			mPropVisible[mVisibleProps[i]] = true;
+
+		mPropPlaneTests += mPropBVH.getStats().planeTests;
+	}
+
+	// Then drop the props hidden behind the occluders.
+	if( mOcclusionEnabled )
+	{
+		UINT n = 0;
+		for(int i = 0; i < NUM_PROPS; ++i)
 		{
-			HR(mFX->SetMatrix(mhWVP, &(toWorld*gCamera->viewProj())));
-			D3DXMATRIX worldInvTrans;
-			D3DXMatrixInverse(&worldInvTrans, 0, &toWorld);
-			D3DXMatrixTranspose(&worldInvTrans, &worldInvTrans);
-			HR(mFX->SetMatrix(mhWorldInvTrans, &worldInvTrans));
-			HR(mFX->SetMatrix(mhWorld, &toWorld));
-
-			for(UINT j = 0; j < obj.mtrls.size(); ++j)
+			if( mPropVisible[i] )
 			{
-				HR(mFX->SetValue(mhMtrl, &obj.mtrls[j], sizeof(Mtrl)));
-
-				// If there is a texture, then use.
-				if(obj.textures[j] != 0)
-				{
-					HR(mFX->SetTexture(mhTex, obj.textures[j]));
-				}
-
-				// But if not, then set a pure white texture.  When the texture color
-				// is multiplied by the color from lighting, it is like multiplying by
-				// 1 and won't change the color from lighting.
-				else
-				{
-					HR(mFX->SetTexture(mhTex, mWhiteTex));
-				}
-
-				HR(mFX->CommitChanges());
-				HR(obj.mesh->DrawSubset(j));
+				mOccludeeProps[n] = i;
+				mOccludeeBoxes[n] = mPropBoxes[i];
+				++n;
 			}
 		}
+
+		mOcclusion->testBoxes(mOccludeeBoxes, n, mOccludeeVisible);
+		for(UINT i = 0; i < n; ++i)
+			mPropVisible[mOccludeeProps[i]] = mOccludeeVisible[i];
+		mNumPropsOccluded = mOcclusion->getStats().boxesOccluded;
 	}
 }
 
@@ -453,35 +710,66 @@ void FrustumCullingDemo::buildBoundingVolumes(Object3D& obj)
 {
 	//Assumes the world matrix of the model has already been set.
 
-	//Create a scaling and rotation matrix so the bounding volumes can be scaled and rotated
-	// to match the current scale and rotation of the model.
-	D3DXMATRIX scaling;
-	D3DXMATRIX rotation;
-	D3DXMatrixScaling(&scaling, obj.scaling, obj.scaling, obj.scaling);
-	D3DXMatrixRotationYawPitchRoll(&rotation, obj.rotation.y, obj.rotation.x, obj.rotation.z);
-
 	VertexPNT* v = 0;
 	HR(obj.mesh->LockVertexBuffer(0, (void**)&v));
 
-	// Compute the bounding sphere.
-	HR(D3DXComputeBoundingSphere(&v[0].pos, obj.mesh->GetNumVertices(), sizeof(VertexPNT), &obj.sphere.pos, &obj.sphere.radius));
-	// Transform the coordinates of the bounding volume to match those of the objects
-	D3DXVec3TransformCoord(&obj.sphere.pos, &obj.sphere.pos, &obj.world);
-	D3DXMatrixTranslation(&obj.sphereOffset, 
-		obj.sphere.pos.x, obj.sphere.pos.y, obj.sphere.pos.z); // Create a translation matrix for the bounding volume based upon the transformed coordinates.
-	obj.sphereOffset = scaling * rotation * obj.sphereOffset;
-	obj.sphere.radius *= obj.scaling;
-
-	// Compute the bounding box
+	// Compute the bounding sphere and box in the mesh's own space; 
+	// updateTransforms takes them to world space.
+	HR(D3DXComputeBoundingSphere(&v[0].pos, obj.mesh->GetNumVertices(), sizeof(VertexPNT), 
+		&obj.localSphere.pos, &obj.localSphere.radius));
 	HR(D3DXComputeBoundingBox(&v[0].pos, obj.mesh->GetNumVertices(), 
-		sizeof(VertexPNT), &obj.box.minPt, &obj.box.maxPt));
-	D3DXVECTOR3 boxPos = obj.box.center();
-	D3DXVec3TransformCoord(&boxPos, &boxPos, &obj.world);
-	D3DXMatrixTranslation(&obj.boxOffset, boxPos.x, boxPos.y, boxPos.z);
-	obj.boxOffset = scaling * rotation * obj.boxOffset;
-	obj.box.xform(obj.boxOffset, obj.box);
+		sizeof(VertexPNT), &obj.localBox.minPt, &obj.localBox.maxPt));
 
 	HR(obj.mesh->UnlockVertexBuffer());
+
+	obj.transformsDirty = true;
+	obj.updateTransforms();
+}
+
+void FrustumCullingDemo::Object3D::setWorld(const D3DXMATRIX& W, float s, const D3DXVECTOR3& r)
+{
+	world    = W;
+	scaling  = s;
+	rotation = r;
+	transformsDirty = true;
+}
+
+void FrustumCullingDemo::Object3D::updateTransforms()
+{
+	if( !transformsDirty )
+		return;
+
+	//Create a scaling and rotation matrix so the bounding volumes can be scaled and rotated
+	// to match the current scale and rotation of the model.
+	D3DXMATRIX S;
+	D3DXMATRIX R;
+	D3DXMatrixScaling(&S, scaling, scaling, scaling);
+	D3DXMatrixRotationYawPitchRoll(&R, rotation.y, rotation.x, rotation.z);
+
+	// Transform the coordinates of the bounding volume to match those of the objects
+	sphere = localSphere;
+	D3DXVec3TransformCoord(&sphere.pos, &sphere.pos, &world);
+	D3DXMatrixTranslation(&sphereOffset, 
+		sphere.pos.x, sphere.pos.y, sphere.pos.z); // Create a translation matrix for the bounding volume based upon the transformed coordinates.
+	sphereOffset = S * R * sphereOffset;
+	sphere.radius *= scaling;
+
+	D3DXVECTOR3 boxPos = localBox.center();
+	D3DXVec3TransformCoord(&boxPos, &boxPos, &world);
+	D3DXMatrixTranslation(&boxOffset, boxPos.x, boxPos.y, boxPos.z);
+	boxOffset = S * R * boxOffset;
+	localBox.xform(boxOffset, box);
+
+	// The shaders light with the inverse-transposes; invert here, once,
+	// rather than every time the object is drawn.
+	D3DXMatrixInverse(&worldInvTrans, 0, &world);
+	D3DXMatrixTranspose(&worldInvTrans, &worldInvTrans);
+	D3DXMatrixInverse(&boxOffsetInvTrans, 0, &boxOffset);
+	D3DXMatrixTranspose(&boxOffsetInvTrans, &boxOffsetInvTrans);
+	D3DXMatrixInverse(&sphereOffsetInvTrans, 0, &sphereOffset);
+	D3DXMatrixTranspose(&sphereOffsetInvTrans, &sphereOffsetInvTrans);
+
+	transformsDirty = false;
 }
 
 void FrustumCullingDemo::buildBoundingVolumeMeshes(Object3D& obj)
@@ -535,9 +823,7 @@ void FrustumCullingDemo::buildCastle()
 	// Build castle's world matrix.
 	D3DXMatrixRotationY(&Ry, D3DX_PI);
 	D3DXMatrixTranslation(&T, 8.0f, 35.0f, -80.0f);
-	mCastle.world = Ry*T;
-	mCastle.scaling = 1.0f;
-	mCastle.rotation = D3DXVECTOR3(0.0f, D3DX_PI, 0.0f);
+	mCastle.setWorld(Ry*T, 1.0f, D3DXVECTOR3(0.0f, D3DX_PI, 0.0f));
 
 	buildBoundingVolumes(mCastle);
 	buildBoundingVolumeMeshes(mCastle);
@@ -545,16 +831,20 @@ void FrustumCullingDemo::buildCastle()
 
 void FrustumCullingDemo::buildTrees()
 {
-	//Load the tree mesh
+	//Load the tree meshes
 	LoadXFile("tree0.x", &mTrees[0].mesh, mTrees[0].mtrls, mTrees[0].textures);
+	LoadXFile("tree1.x", &mTrees[1].mesh, mTrees[1].mtrls, mTrees[1].textures);
+	LoadXFile("tree2.x", &mTrees[2].mesh, mTrees[2].mtrls, mTrees[2].textures);
+	LoadXFile("tree3.x", &mTrees[3].mesh, mTrees[3].mtrls, mTrees[3].textures);
 
 	// Make sure the rest of the trees mesh related variables are populated
-	for(int i = 1; i < NUM_TREES; ++i)
+	for(int i = NUM_TREE_MESHES; i < NUM_TREES; ++i)
 	{
-		mTrees[i].mesh = mTrees[0].mesh;
+		const Object3D& src = mTrees[i % NUM_TREE_MESHES];
+		mTrees[i].mesh = src.mesh;
 		mTrees[i].mesh->AddRef(); //To avoid corruption when freeing the mesh
-		mTrees[i].mtrls = mTrees[0].mtrls;
-		mTrees[i].textures = mTrees[0].textures;
+		mTrees[i].mtrls = src.mtrls;
+		mTrees[i].textures = src.textures;
 		//To avoid corruption when freeing the texture
 		for (vector<IDirect3DTexture9*>::iterator it = mTrees[i].textures.begin(); it != mTrees[i].textures.end(); ++it)
 			(*it)->AddRef();
@@ -594,9 +884,7 @@ void FrustumCullingDemo::buildTrees()
 		D3DXMatrixScaling(&S, treeScale, treeScale, treeScale);
 		D3DXMatrixRotationYawPitchRoll(&R, 0.0f, 0.0f, 0.0f);
 
-		mTrees[i].scaling = treeScale;
-		mTrees[i].rotation = D3DXVECTOR3(0.0f, 0.0f, 0.0f);
-		mTrees[i].world = S*R*T;
+		mTrees[i].setWorld(S*R*T, treeScale, D3DXVECTOR3(0.0f, 0.0f, 0.0f));
 
 		// Only generate trees in this height range.  If the height
 		// is outside this range, generate a new random position and 
@@ -612,6 +900,134 @@ void FrustumCullingDemo::buildTrees()
 	}
 }
 
+void FrustumCullingDemo::buildPropBounds()
+{
+	// Assumes the castle and trees have their world space bounding
+	// volumes built.
+	gatherPropBounds();
+	mPropBVH.build(mPropBoxes, NUM_PROPS);
+}
+
+void FrustumCullingDemo::gatherPropBounds()
+{
+	mPropBoxes[0] = mCastle.box;
+	for(int i = 0; i < NUM_TREES; ++i)
+		mPropBoxes[i+1] = mTrees[i].box;
+
+	for(int i = 0; i < NUM_PROPS; ++i)
+	{
+		mPropBoxMinX[i] = mPropBoxes[i].minPt.x;
+		mPropBoxMinY[i] = mPropBoxes[i].minPt.y;
+		mPropBoxMinZ[i] = mPropBoxes[i].minPt.z;
+		mPropBoxMaxX[i] = mPropBoxes[i].maxPt.x;
+		mPropBoxMaxY[i] = mPropBoxes[i].maxPt.y;
+		mPropBoxMaxZ[i] = mPropBoxes[i].maxPt.z;
+
+		const BoundingSphere& sphere = i == 0 ? mCastle.sphere : mTrees[i-1].sphere;
+		mPropSphereX[i]      = sphere.pos.x;
+		mPropSphereY[i]      = sphere.pos.y;
+		mPropSphereZ[i]      = sphere.pos.z;
+		mPropSphereRadius[i] = sphere.radius;
+	}
+}
+
+void FrustumCullingDemo::updatePropTransforms()
+{
+	// Nothing in the demo moves the props after loading, so this is
+	// normally a handful of flag checks.  The occluders taken from the
+	// castle are built once and don't follow it.
+	bool moved = mCastle.transformsDirty;
+	mCastle.updateTransforms();
+	for(int i = 0; i < NUM_TREES; ++i)
+	{
+		moved = moved || mTrees[i].transformsDirty;
+		mTrees[i].updateTransforms();
+	}
+
+	if( moved )
+	{
+		gatherPropBounds();
+		mPropBVH.refit(mPropBoxes);
+	}
+}
+
+void FrustumCullingDemo::buildOccluders()
+{
+	mOcclusion->clearOccluders();
+	mOccluderEditCount = mTerrain->getEditCount();
+
+	// The terrain at every fourth vertex.  Coarser occluders rasterize
+	// faster but sink further below the hilltops, and hide much less.
+	mOcclusion->addHeightmapOccluder(mTerrain->getHeightmap(), mTerrain->getDX(),
+		mTerrain->getDZ(), mTerrain->getCenter(), 4);
+
+	// The castle's large triangles: its walls, towers and roofs.  The
+	// small ones are trim that covers little of the screen, and leaving
+	// them out only makes the occluder smaller than the castle, never
+	// bigger.
+	const float MIN_OCCLUDER_AREA = 5.0f;
+
+	UINT numVerts = mCastle.mesh->GetNumVertices();
+	UINT numFaces = mCastle.mesh->GetNumFaces();
+	bool indices32 = (mCastle.mesh->GetOptions() & D3DXMESH_32BIT) != 0;
+
+	VertexPNT* v = 0;
+	void* k = 0;
+	HR(mCastle.mesh->LockVertexBuffer(D3DLOCK_READONLY, (void**)&v));
+	HR(mCastle.mesh->LockIndexBuffer(D3DLOCK_READONLY, &k));
+
+	vector<D3DXVECTOR3> verts(numVerts);
+	for(UINT i = 0; i < numVerts; ++i)
+		D3DXVec3TransformCoord(&verts[i], &v[i].pos, &mCastle.world);
+
+	vector<DWORD> indices;
+	for(UINT f = 0; f < numFaces; ++f)
+	{
+		DWORD tri[3];
+		for(int j = 0; j < 3; ++j)
+			tri[j] = indices32 ? ((DWORD*)k)[3*f+j] : ((WORD*)k)[3*f+j];
+
+		D3DXVECTOR3 e0 = verts[tri[1]] - verts[tri[0]];
+		D3DXVECTOR3 e1 = verts[tri[2]] - verts[tri[0]];
+		D3DXVECTOR3 n;
+		D3DXVec3Cross(&n, &e0, &e1);
+		if( 0.5f*D3DXVec3Length(&n) >= MIN_OCCLUDER_AREA )
+			indices.insert(indices.end(), tri, tri + 3);
+	}
+
+	HR(mCastle.mesh->UnlockVertexBuffer());
+	HR(mCastle.mesh->UnlockIndexBuffer());
+
+	if( !indices.empty() )
+		mOcclusion->addOccluder(&verts[0], numVerts, &indices[0], (UINT)indices.size() / 3);
+}
+
+void FrustumCullingDemo::rebuildTerrain(Terrain::VertexFormat format)
+{
+	// The vertex format is fixed when the buffers are built, so build the
+	// terrain again from the same map and carry its settings over.
+	bool lodEnabled = mTerrain->isLODEnabled();
+	Terrain::LODCrackFix crackFix = mTerrain->getLODCrackFix();
+
+	delete mGround;
+	delete mTerrain;
+
+	mTerrain = new Terrain(257, 257, 2.0f, 2.0f, 
+		"castlehm257.raw", "grass.dds",	"dirt.dds",	
+		"rock.dds", "blend_castle.dds", 0.5f, 0.0f, Heightmap::RAW_8BIT, format);
+	mTerrain->setDirToSunW(-mLight.dirW);
+	mGround = new GroundQuery(mTerrain);
+	mTerrainAOStats = mTerrain->bakeAmbientOcclusion(64, GetScratchDirectory("FrustumCulling"));
+
+	mTerrain->setLODEnabled(lodEnabled);
+	mTerrain->setLODCrackFix(crackFix);
+	mTerrain->setLODViewportHeight((float)md3dPP.BackBufferHeight);
+	// The new terrain starts over from the unedited map.
+	buildOccluders();
+	if( mOcclusionEnabled )
+		mTerrain->setOcclusionCuller(mOcclusion);
+}
+
 void FrustumCullingDemo::buildGrass()
 {
 	D3DVERTEXELEMENT9 elems[MAX_FVF_DECL_SIZE];
@@ -755,16 +1171,31 @@ void FrustumCullingDemo::initFont()
 void FrustumCullingDemo::drawText()
 {
 	// Make static so memory is not allocated every frame.
-	static char buffer[256];
+	static char buffer[512];
 
-	sprintf(buffer, "Controls:\n"
+	// Too long for buffer, so drawn straight from the literal, and raised
+	// off the bottom of the screen by a line of the font per line.
+	static const char CONTROLS[] = "Controls:\n"
 		"Use mouse to look and 'W', 'S', 'A', and 'D' keys to move.\n"
 		"Use 'M' to enable free camera, 'N' to disable free camera.\n"
 		"Use 'R' to toggle between bounding boxes and bounding spheres.\n"
-		"Use 'T' to toggle rendering of the bounding volumes.");
-
-	RECT R = {5, md3dPP.BackBufferHeight-100, 0, 0};
-	HR(mFont->DrawText(0, buffer, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
+		"Use 'B' to test the boxes through the hierarchy or in a batch.\n"
+		"Use 'T' to toggle rendering of the bounding volumes.\n"
+		"Use 'L' to cycle terrain level of detail (off, stitched, skirts).\n"
+		"Use 'I' to toggle instanced tree rendering.\n"
+		"Use 'C' to toggle temporal coherence in the box culling.\n"
+		"Use 'O' to toggle occlusion culling.\n"
+		"Use 'P' to start and stop recording a camera path.\n"
+		"Use 'G' to toggle drawing the terrain streamed in tiles.\n"
+		"Use 'V' to toggle full and compact terrain vertices.";
+	const int LINE_HEIGHT = 18; // fontDesc.Height in initFont.
+	int numLines = 1;
+	for(const char* c = CONTROLS; *c; ++c)
+		if( *c == '\n' )
+			++numLines;
+
+	RECT R = {5, md3dPP.BackBufferHeight - (numLines*LINE_HEIGHT + 10), 0, 0};
+	HR(mFont->DrawText(0, CONTROLS, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
 
 	sprintf(buffer, "Bounding Volume Used:\t%s%", mBoundingVolumeUsed.c_str());
 	R.left = md3dPP.BackBufferWidth-240; R.top = 5;
@@ -773,4 +1204,42 @@ void FrustumCullingDemo::drawText()
 	sprintf(buffer, "Rendering Bounding Volumes:\t%s%", mDrawBoundingVolumesStatus.c_str());
 	R.left = md3dPP.BackBufferWidth-240; R.top = 20;
 	HR(mFont->DrawText(0, buffer, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
+
+	sprintf(buffer, "Terrain LOD:\t%s (%d triangles drawn)", mTerrainLODStatus.c_str(), mTerrain->getNumTrianglesDrawn());
+	R.left = md3dPP.BackBufferWidth-240; R.top = 35;
+	HR(mFont->DrawText(0, buffer, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
+
+	sprintf(buffer, "Tree Instancing:\t%s (%d prop draw calls, %d state changes)", mInstancingStatus.c_str(), mNumPropDrawCalls, mNumPropStateChanges);
+	R.left = md3dPP.BackBufferWidth-240; R.top = 50;
+	HR(mFont->DrawText(0, buffer, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
+
+	sprintf(buffer, "Terrain AO:\t%s in %.1f ms", mTerrainAOStats.cacheHit ? "Loaded" : "Baked", mTerrainAOStats.bakeMs);
+	R.left = md3dPP.BackBufferWidth-240; R.top = 65;
+	HR(mFont->DrawText(0, buffer, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
+
+	float testsPerProp = mPropCullFrames > 0 ? (float)(mPropPlaneTests / mPropCullFrames / NUM_PROPS) : 0.0f;
+	sprintf(buffer, "Culling Coherence:\t%s (%.2f plane tests per prop)", mCullCoherenceStatus.c_str(), testsPerProp);
+	R.left = md3dPP.BackBufferWidth-240; R.top = 80;
+	HR(mFont->DrawText(0, buffer, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
+
+	sprintf(buffer, "Occlusion Culling:\t%s (%d props, %d terrain patches hidden, %.2f ms)", mOcclusionStatus.c_str(),
+		mNumPropsOccluded, mTerrain->getNumPatchesOccluded(), mOcclusionEnabled ? mOcclusion->getStats().renderMs : 0.0f);
+	R.left = md3dPP.BackBufferWidth-240; R.top = 95;
+	HR(mFont->DrawText(0, buffer, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
+
+	sprintf(buffer, "Camera Path:\t%s (%u frames)", mCameraPathStatus.c_str(), mCameraPath.numFrames());
+	R.left = md3dPP.BackBufferWidth-240; R.top = 110;
+	HR(mFont->DrawText(0, buffer, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
+
+	const TerrainWorld::Stats& world = mWorld->getStats();
+	sprintf(buffer, "Streamed Terrain:\t%s (%u tiles, %u pending, %u pages mapped, %u evicted)", mWorldStatus.c_str(),
+		world.residentTiles, world.pendingTiles, world.residentPages, world.pagesEvicted);
+	R.left = md3dPP.BackBufferWidth-240; R.top = 125;
+	HR(mFont->DrawText(0, buffer, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
+
+	sprintf(buffer, "Terrain Vertices:\t%s (%u KB)",
+		mTerrain->getVertexFormat() == Terrain::VERTEX_COMPACT ? "Compact" : "Full",
+		mTerrain->getMemoryStats().totalBytes / 1024);
+	R.left = md3dPP.BackBufferWidth-240; R.top = 140;
+	HR(mFont->DrawText(0, buffer, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
 }
\ No newline at end of file
@@ -5,6 +5,13 @@
 #include "Terrain.h"
 #include "Camera.h"
 #include "Water.h"
+#include "JobSystem.h"
+#include "CullingBVH.h"
+#include "InstanceBatcher.h"
+#include "GroundQuery.h"
+#include "OcclusionCuller.h"
+#include "CameraPath.h"
+#include "TerrainWorld.h"
 
 class FrustumCullingDemo : public D3DApp
 {
@@ -18,6 +25,7 @@ private:
 		Object3D()
 		{
 			mesh = 0;
+			transformsDirty = true;
 		}
 		~Object3D()
 		{
@@ -35,6 +43,24 @@ private:
 		float scaling;
 		D3DXVECTOR3 rotation;
 
+		// Sets world, and the scaling and rotation it was built from, and
+		// marks what is derived from them stale.
+		void setWorld(const D3DXMATRIX& W, float s, const D3DXVECTOR3& r);
+
+		// Recomputes the world space bounding volumes, their offsets and
+		// the inverse-transposes from world, if they are stale.  Static
+		// props pay for it once, after loading.
+		void updateTransforms();
+		bool transformsDirty;
+
+		// The mesh's bounds in its own space, from buildBoundingVolumes.
+		AABB localBox;
+		BoundingSphere localSphere;
+
+		D3DXMATRIX worldInvTrans;
+		D3DXMATRIX boxOffsetInvTrans;
+		D3DXMATRIX sphereOffsetInvTrans;
+
 		AABB box;
 		ID3DXMesh* boundingAABoxMesh;
 		D3DXMATRIX boxOffset;
@@ -56,9 +82,10 @@ public:
 	void drawText();
 
 	void buildFX();
-	void drawObject(Object3D& obj, const D3DXMATRIX& toWorld);
-	void drawBoundingVolume(ID3DXMesh* boundingVolumeMesh, const D3DXMATRIX& toWorld, const BoundingSphere &boundingVolume) const;
-	void drawBoundingVolume(ID3DXMesh* boundingVolumeMesh, const D3DXMATRIX& toWorld, const AABB &boundingVolume) const;
+	void drawObject(Object3D& obj);
+	void cullProps();
+	void drawTreesInstanced();
+	void drawBoundingVolume(const Object3D& obj) const;
 
 	void buildCastle();
 	void buildTrees();
@@ -67,22 +94,87 @@ public:
 		D3DXVECTOR3& worldPos, D3DXVECTOR3& scale);
 	void buildBoundingVolumes(Object3D& obj);
 	void buildBoundingVolumeMeshes(Object3D& obj);
+	void buildPropBounds();
+	void gatherPropBounds();
+	void updatePropTransforms();
+	void buildOccluders();
+	void rebuildTerrain(Terrain::VertexFormat format);
 
 private:
-	void drawBoundingVolumeSharedCode(ID3DXMesh* boundingVolumeMesh, const D3DXMATRIX& toWorld) const;
+	void drawBoundingVolumeSharedCode(ID3DXMesh* boundingVolumeMesh, const D3DXMATRIX& toWorld,
+		const D3DXMATRIX& worldInvTrans) const;
 
 private:
 	GfxStats* mGfxStats;
+	// 'V' rebuilds mTerrain with the other vertex format.
 	Terrain*  mTerrain;
+	GroundQuery* mGround;
 	Water*    mWater;
 
+	// The same heights streamed in tiles from a paged copy of the map;
+	// 'G' draws it in place of mTerrain.
+	TerrainWorld* mWorld;
+	bool mWorldEnabled;
+	std::string mWorldStatus;
+
 	float mTime; // Time elapsed from program start.
 
 	// Models
 	Object3D mCastle;
 	static const int NUM_TREES = 200;
+	static const int NUM_TREE_MESHES = 4; // Tree i uses tree(i % 4).x.
 	Object3D mTrees[NUM_TREES];
 
+	// Draws the visible trees with one draw call per tree mesh subset.
+	InstanceBatcher* mTreeBatcher;
+	bool mInstancingSupported;
+	bool mInstancing;
+	std::string mInstancingStatus;
+
+	// Prop draw calls and state changes sent this frame.
+	DWORD mNumPropDrawCalls;
+	DWORD mNumPropStateChanges;
+
+	// Prop 0 is the castle and prop i+1 is tree i.  The hierarchy is over
+	// their world space boxes, and the boxes and spheres are also kept as
+	// structure of arrays for batch testing; mPropVisible is refreshed
+	// every frame.  'B' picks the hierarchy or the batch test for boxes.
+	static const int NUM_PROPS = NUM_TREES + 1;
+	CullingBVH mPropBVH;
+	bool mBoxCullBatch;
+	float mPropBoxMinX[NUM_PROPS];
+	float mPropBoxMinY[NUM_PROPS];
+	float mPropBoxMinZ[NUM_PROPS];
+	float mPropBoxMaxX[NUM_PROPS];
+	float mPropBoxMaxY[NUM_PROPS];
+	float mPropBoxMaxZ[NUM_PROPS];
+	float mPropSphereX[NUM_PROPS];
+	float mPropSphereY[NUM_PROPS];
+	float mPropSphereZ[NUM_PROPS];
+	float mPropSphereRadius[NUM_PROPS];
+	UINT mVisibleProps[NUM_PROPS];
+	UINT mPropVisibleBits[(NUM_PROPS + 31) / 32];
+	bool mPropVisible[NUM_PROPS];
+
+	// Plane tests made culling the props, summed over the frames since
+	// the culling settings last changed, for the average per prop.
+	std::string mCullCoherenceStatus;
+	double mPropPlaneTests;
+	DWORD  mPropCullFrames;
+
+	// Props and terrain patches that pass frustum culling are tested
+	// against a CPU depth buffer of the terrain and the castle.  The props
+	// still in view are gathered into the mOccludee arrays for testing.
+	OcclusionCuller* mOcclusion;
+	bool mOcclusionEnabled;
+	DWORD mOccluderEditCount; // mTerrain's, when the occluders were built.
+	std::string mOcclusionStatus;
+	AABB mPropBoxes[NUM_PROPS];
+	AABB mOccludeeBoxes[NUM_PROPS];
+	UINT mOccludeeProps[NUM_PROPS];
+	bool mOccludeeVisible[NUM_PROPS];
+	DWORD mNumPropsOccluded;
+
 	static const int NUM_GRASS_BLOCKS = 4000;
 	ID3DXMesh* mGrassMesh;
 	IDirect3DTexture9* mGrassTex;
@@ -99,6 +191,8 @@ private:
 	// General light/texture FX
 	ID3DXEffect* mFX;
 	D3DXHANDLE   mhTech;
+	D3DXHANDLE   mhInstancedTech;
+	D3DXHANDLE   mhViewProj;
 	D3DXHANDLE   mhWVP;
 	D3DXHANDLE   mhWorldInvTrans;
 	D3DXHANDLE   mhEyePosW;
@@ -113,6 +207,12 @@ private:
 	// Camera fixed to ground or can fly?
 	bool mFreeCamera;
 
+	// 'P' starts recording the camera every frame, and again stops and
+	// saves the path for HeadlessBench to replay.
+	CameraPath mCameraPath;
+	bool mRecordingPath;
+	std::string mCameraPathStatus;
+
 	// Default texture if no texture present for subset.
 	IDirect3DTexture9* mWhiteTex;
 
@@ -122,4 +222,6 @@ private:
 	bool mIsBoundingVolumeSphere;
 	bool mDrawBoundingVolumes;
 	std::string mDrawBoundingVolumesStatus;
+	std::string mTerrainLODStatus;
+	HorizonBaker::Stats mTerrainAOStats;
 };
\ No newline at end of file
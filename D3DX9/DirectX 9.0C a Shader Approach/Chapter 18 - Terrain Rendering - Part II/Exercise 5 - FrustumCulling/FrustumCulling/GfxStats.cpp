@@ -8,7 +8,8 @@
 #include <tchar.h>
 
 GfxStats::GfxStats()
-: mFont(0), mFPS(0.0f), mMilliSecPerFrame(0.0f), mNumTris(0), mNumVertices(0)
+: mFont(0), mFPS(0.0f), mMilliSecPerFrame(0.0f), mNumTris(0), mNumVertices(0),
+  mNumHeapAllocs(0), mNumTerrainTris(0), mNumFullTerrainTris(0)
 {
 	D3DXFONT_DESC fontDesc;
 	fontDesc.Height          = 18;
@@ -70,6 +71,17 @@ void GfxStats::setVertexCount(DWORD n)
 	mNumVertices = n;
 }
 
+void GfxStats::setHeapAllocCount(DWORD n)
+{
+	mNumHeapAllocs = n;
+}
+
+void GfxStats::setTerrainTriCount(DWORD drawn, DWORD full)
+{
+	mNumTerrainTris     = drawn;
+	mNumFullTerrainTris = full;
+}
+
 void GfxStats::update(float dt)
 {
 	// Make static so that their values persist accross function calls.
@@ -111,7 +123,10 @@ void GfxStats::display()
 	sprintf(buffer, "Frames Per Second = %.2f\n"
 		"Milliseconds Per Frame = %.4f\n"
 		"Triangle Count = %d\n"
-		"Vertex Count = %d", mFPS, mMilliSecPerFrame, mNumTris, mNumVertices);
+		"Vertex Count = %d\n"
+		"Heap Allocations = %d\n"
+		"Terrain Triangles = %d of %d", mFPS, mMilliSecPerFrame, mNumTris, mNumVertices, mNumHeapAllocs,
+		mNumTerrainTris, mNumFullTerrainTris);
 
 	RECT R = {5, 5, 0, 0};
 	HR(mFont->DrawText(0, buffer, -1, &R, DT_NOCLIP, D3DCOLOR_XRGB(0,0,0)));
@@ -26,6 +26,10 @@ public:
 
 	void setTriCount(DWORD n);
 	void setVertexCount(DWORD n);
+	void setHeapAllocCount(DWORD n);
+
+	// Terrain triangles drawn this frame, against the full resolution count.
+	void setTerrainTriCount(DWORD drawn, DWORD full);
 
 	void update(float dt);
 	void display();
@@ -41,5 +45,8 @@ private:
 	float mMilliSecPerFrame;
 	DWORD mNumTris;
 	DWORD mNumVertices;
+	DWORD mNumHeapAllocs;
+	DWORD mNumTerrainTris;
+	DWORD mNumFullTerrainTris;
 };
 #endif // GFX_STATS_H
\ No newline at end of file
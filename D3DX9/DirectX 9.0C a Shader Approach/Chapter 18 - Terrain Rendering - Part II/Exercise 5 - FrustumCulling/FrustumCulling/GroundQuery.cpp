@@ -0,0 +1,139 @@
+//=============================================================================
+// GroundQuery.cpp.
+//=============================================================================
+
+#include "GroundQuery.h"
+#include <cmath>
+
+GroundQuery::GroundQuery(Terrain* terrain)
+: mTerrain(terrain), mEditCount(terrain->getEditCount())
+{
+	for(int i = 0; i < CACHE_SIDE*CACHE_SIDE; ++i)
+		mCache[i].row = -1;
+
+	ZeroMemory(&mStats, sizeof(mStats));
+}
+
+GroundQuery::Sample GroundQuery::sample(float x, float z)
+{
+	// Edits invalidate everything cached.
+	if( mTerrain->getEditCount() != mEditCount )
+	{
+		for(int i = 0; i < CACHE_SIDE*CACHE_SIDE; ++i)
+			mCache[i].row = -1;
+		mEditCount = mTerrain->getEditCount();
+	}
+
+	int row, col;
+	float s, t;
+	mTerrain->getCell(x, z, row, col, s, t);
+	const Cell& cell = fetchCell(row, col);
+	++mStats.numQueries;
+
+	Sample result;
+	if( t < 1.0f - s )
+	{
+		result.height = cell.A + s*cell.upperUY + t*cell.upperVY;
+		result.normal = cell.upperNormal;
+		result.slope  = cell.upperSlope;
+	}
+	else
+	{
+		result.height = cell.D + (1.0f-s)*cell.lowerUY + (1.0f-t)*cell.lowerVY;
+		result.normal = cell.lowerNormal;
+		result.slope  = cell.lowerSlope;
+	}
+	return result;
+}
+
+const GroundQuery::Cell& GroundQuery::fetchCell(int row, int col)
+{
+	Cell& cell = mCache[(row % CACHE_SIDE)*CACHE_SIDE + col % CACHE_SIDE];
+	if( cell.row == row && cell.col == col )
+		return cell;
+
+	++mStats.numCellFetches;
+
+	// A*--*B
+	//  | /|
+	//  |/ |
+	// C*--*D
+	float h[4];
+	mTerrain->getCellCorners(row, col, h);
+	float dx = mTerrain->getDX();
+	float dz = mTerrain->getDZ();
+
+	cell.row = row;
+	cell.col = col;
+
+	cell.A       = h[0];
+	cell.upperUY = h[1] - h[0];
+	cell.upperVY = h[2] - h[0];
+	cell.upperNormal = D3DXVECTOR3(-cell.upperUY*dz, dx*dz, cell.upperVY*dx);
+	D3DXVec3Normalize(&cell.upperNormal, &cell.upperNormal);
+
+	cell.D       = h[3];
+	cell.lowerUY = h[2] - h[3];
+	cell.lowerVY = h[1] - h[3];
+	cell.lowerNormal = D3DXVECTOR3(cell.lowerUY*dz, dx*dz, -cell.lowerVY*dx);
+	D3DXVec3Normalize(&cell.lowerNormal, &cell.lowerNormal);
+
+	// The normal tilts away from up by as much as the plane does.
+	const D3DXVECTOR3& u = cell.upperNormal;
+	const D3DXVECTOR3& l = cell.lowerNormal;
+	cell.upperSlope = sqrtf(u.x*u.x + u.z*u.z) / u.y;
+	cell.lowerSlope = sqrtf(l.x*l.x + l.z*l.z) / l.y;
+
+	return cell;
+}
+
+UINT GroundQuery::add(float x, float z)
+{
+	mXs.push_back(x);
+	mZs.push_back(z);
+	return (UINT)mXs.size() - 1;
+}
+
+void GroundQuery::resolve()
+{
+	// Points added together tend to be close together, so answering them
+	// in one go keeps their cells in the cache.
+	mResults.resize(mXs.size());
+	for(size_t i = 0; i < mXs.size(); ++i)
+		mResults[i] = sample(mXs[i], mZs[i]);
+}
+
+const GroundQuery::Sample& GroundQuery::result(UINT query)const
+{
+	return mResults[query];
+}
+
+void GroundQuery::clear()
+{
+	// clear keeps the vectors' memory for the next batch.
+	mXs.clear();
+	mZs.clear();
+	mResults.clear();
+}
+
+D3DXVECTOR3 GroundQuery::alongGround(const D3DXVECTOR3& dir, const D3DXVECTOR3& normal)
+{
+	// Drop dir straight down onto the ground's plane: keep x and z and
+	// pick the y that makes it perpendicular to the normal.
+	D3DXVECTOR3 tangent(dir.x, 0.0f, dir.z);
+	if( D3DXVec3LengthSq(&tangent) < 1e-12f )
+		return D3DXVECTOR3(0.0f, 0.0f, 0.0f);
+	tangent.y = -(normal.x*dir.x + normal.z*dir.z) / normal.y;
+	D3DXVec3Normalize(&tangent, &tangent);
+	return tangent;
+}
+
+const GroundQuery::Stats& GroundQuery::getStats()const
+{
+	return mStats;
+}
+
+void GroundQuery::resetStats()
+{
+	ZeroMemory(&mStats, sizeof(mStats));
+}
@@ -0,0 +1,96 @@
+//=============================================================================
+// GroundQuery.h.
+//
+// Answers "where is the ground under (x, z)" for things that follow the
+// terrain: the height, the normal and the slope, all from one lookup.
+//
+// Things that move stay in the same few cells from one query to the next,
+// so the cells they touch are kept in a small cache along with both of
+// their triangles' normals and slopes.  A query in a cached cell skips the
+// heightmap reads and the normalize and is just the plane equation.  The
+// cache is dropped when the terrain's heights are edited.  It holds one
+// 8x8 block of cells, so it suits a handful of things (the camera and
+// what follows it); hundreds spread over the map mostly miss, and then a
+// query costs about what getHeight does.
+//
+// Queries can be made one at a time with sample(), or collected over a
+// frame with add() and answered together with resolve().  Either way the
+// heights are the same as Terrain::getHeight's.
+//=============================================================================
+
+#ifndef GROUND_QUERY_H
+#define GROUND_QUERY_H
+
+#include "Terrain.h"
+#include <vector>
+
+class GroundQuery
+{
+public:
+	struct Sample
+	{
+		float       height;
+		D3DXVECTOR3 normal;
+		float       slope; // Rise over run, up the steepest direction.
+	};
+
+	struct Stats
+	{
+		DWORD numQueries;
+		DWORD numCellFetches; // Queries that missed the cache.
+	};
+
+	GroundQuery(Terrain* terrain);
+
+	Sample sample(float x, float z);
+
+	// Batched queries.  add returns the index to read the result at after
+	// the next resolve; clear starts a new batch.
+	UINT add(float x, float z);
+	void resolve();
+	const Sample& result(UINT query)const;
+	void clear();
+
+	// Unit vector along the ground with the given normal that heads the
+	// same way as dir seen from above, or zero if dir is vertical.
+	static D3DXVECTOR3 alongGround(const D3DXVECTOR3& dir, const D3DXVECTOR3& normal);
+
+	// Totals since construction or the last resetStats.
+	const Stats& getStats()const;
+	void resetStats();
+
+private:
+	// Both triangles of a cell, as in Terrain::getHeight: the upper one
+	// is A + s*uy + t*vy, the lower one D + (1-s)*uy + (1-t)*vy.
+	struct Cell
+	{
+		int row;
+		int col;
+
+		float A, upperUY, upperVY;
+		float D, lowerUY, lowerVY;
+		D3DXVECTOR3 upperNormal;
+		D3DXVECTOR3 lowerNormal;
+		float upperSlope;
+		float lowerSlope;
+	};
+
+	// An 8x8 block of cells maps onto the cache one to one, so nearby
+	// cells never push each other out.
+	const static int CACHE_SIDE = 8;
+
+	const Cell& fetchCell(int row, int col);
+
+private:
+	Terrain* mTerrain;
+	DWORD    mEditCount; // The terrain's, when the cache was last valid.
+	Cell     mCache[CACHE_SIDE*CACHE_SIDE];
+
+	std::vector<float>  mXs;
+	std::vector<float>  mZs;
+	std::vector<Sample> mResults;
+
+	Stats mStats;
+};
+
+#endif // GROUND_QUERY_H
@@ -4,11 +4,208 @@
 
 #include <fstream>
 #include <vector>
+#include <cmath>
+#include <cstring>
+#include <xmmintrin.h>
 #include "Heightmap.h"
+#include "JobSystem.h"
 #include "d3dUtil.h"
 using namespace std;
 
+namespace
+{
+	// Rows handed to a job at a time by the filters.
+	const int FILTER_ROWS_PER_JOB = 16;
+
+	// Narrows [t0, t1] to the part of the ray o + t*d with lo <= o + t*d
+	// <= hi along one axis.  Returns false if nothing is left.
+	bool ClipSlab(float o, float d, float lo, float hi, float& t0, float& t1)
+	{
+		if( d == 0.0f )
+			return o >= lo && o <= hi;
+
+		float ta = (lo - o) / d;
+		float tb = (hi - o) / d;
+		if( ta > tb ) std::swap(ta, tb);
+
+		t0 = max(t0, ta);
+		t1 = min(t1, tb);
+		return t0 <= t1;
+	}
+
+	// Two-sided ray/triangle test (Moller-Trumbore).  Returns whether the
+	// ray hits the triangle at some t >= 0, and if so that t.  The line
+	// through the ray may also cross the triangle behind the origin; that
+	// is a miss.
+	bool IntersectTri(const D3DXVECTOR3& o, const D3DXVECTOR3& d,
+		const D3DXVECTOR3& a, const D3DXVECTOR3& b, const D3DXVECTOR3& c, float& t)
+	{
+		D3DXVECTOR3 e1 = b - a;
+		D3DXVECTOR3 e2 = c - a;
+
+		D3DXVECTOR3 p;
+		D3DXVec3Cross(&p, &d, &e2);
+		float det = D3DXVec3Dot(&e1, &p);
+		if( det == 0.0f )
+			return false;
+		float invDet = 1.0f / det;
+
+		D3DXVECTOR3 s = o - a;
+		float u = D3DXVec3Dot(&s, &p) * invDet;
+		if( u < 0.0f || u > 1.0f )
+			return false;
+
+		D3DXVECTOR3 q;
+		D3DXVec3Cross(&q, &s, &e1);
+		float v = D3DXVec3Dot(&d, &q) * invDet;
+		if( v < 0.0f || u + v > 1.0f )
+			return false;
+
+		float tTri = D3DXVec3Dot(&e2, &q) * invDet;
+		if( tTri < 0.0f )
+			return false;
+
+		t = tTri;
+		return true;
+	}
+
+	struct Filter3x3Job
+	{
+		Heightmap*                    heightmap;
+		const Heightmap::HeightTable* src;
+		Heightmap::HeightTable*       dst;
+	};
+
+	// One pass of the separable filter over rows of a map mapRows high.
+	// src and dst hold whole rows, but may hold just a band of them, whose
+	// first row is map row srcRow0 (dstRow0).  weights holds the
+	// 2*radius+1 taps.
+	struct SeparablePass
+	{
+		const Heightmap::HeightTable* src;
+		Heightmap::HeightTable*       dst;
+		int                           srcRow0;
+		int                           dstRow0;
+		int                           mapRows;
+		const float*                  weights;
+		int                           radius;
+	};
+
+	// The 2*radius+1 taps of a filter kernel.
+	void FilterWeights(int radius, Heightmap::FilterKernel kernel, vector<float>& weights)
+	{
+		weights.assign(2*radius + 1, 1.0f);
+		if( kernel == Heightmap::FILTER_GAUSSIAN )
+		{
+			// Put the edge of the kernel at two standard deviations.
+			float sigma = 0.5f * (float)radius;
+			for(int k = -radius; k <= radius; ++k)
+				weights[k + radius] = expf(-(float)(k*k) / (2.0f*sigma*sigma));
+		}
+	}
+
+	// Horizontal pass: filters the rows [begin, end) of src along x.
+	void filterRowsH(void* context, int begin, int end)
+	{
+		TABLE_ASSERT_ROWS_CONTIGUOUS(Heightmap::HeightTable);
+
+		const SeparablePass& p = *(const SeparablePass*)context;
+		int n = p.src->numCols();
+		int r = p.radius;
+
+		float wsum = 0.0f;
+		for(int k = 0; k <= 2*r; ++k)
+			wsum += p.weights[k];
+		__m128 invW = _mm_set1_ps(1.0f / wsum);
+
+		for(int i = begin; i < end; ++i)
+		{
+			const float* src = &(*p.src)(i - p.srcRow0, 0);
+			float*       dst = &(*p.dst)(i - p.dstRow0, 0);
+
+			// Interior columns, whose taps are all on the map, four at a time.
+			int j = r;
+			for(; j + 4 <= n - r; j += 4)
+			{
+				__m128 acc = _mm_setzero_ps();
+				for(int k = -r; k <= r; ++k)
+				{
+					__m128 w = _mm_set1_ps(p.weights[k + r]);
+					acc = _mm_add_ps(acc, _mm_mul_ps(w, _mm_loadu_ps(src + j + k)));
+				}
+				_mm_storeu_ps(dst + j, _mm_mul_ps(acc, invW));
+			}
+
+			// Edge pass: the first and last r columns, plus whatever the
+			// vector loop left over, renormalized over the taps on the map.
+			for(int c = 0; c < n; ++c)
+			{
+				if( c == r && j > r )
+					c = j;
+
+				float sum = 0.0f;
+				float w   = 0.0f;
+				for(int k = max(-r, -c); k <= min(r, n - 1 - c); ++k)
+				{
+					sum += p.weights[k + r] * src[c + k];
+					w   += p.weights[k + r];
+				}
+				dst[c] = sum / w;
+			}
+		}
+	}
+
+	// Vertical pass: filters the rows [begin, end) along z.  The taps of
+	// each output row are the same for the whole row, so the edge rows only
+	// differ in how many taps they use.
+	void filterRowsV(void* context, int begin, int end)
+	{
+		TABLE_ASSERT_ROWS_CONTIGUOUS(Heightmap::HeightTable);
+
+		const SeparablePass& p = *(const SeparablePass*)context;
+		int m = p.mapRows;
+		int n = p.src->numCols();
+		int r = p.radius;
+
+		for(int i = begin; i < end; ++i)
+		{
+			int k0 = max(-r, -i);
+			int k1 = min(r, m - 1 - i);
+
+			float wsum = 0.0f;
+			for(int k = k0; k <= k1; ++k)
+				wsum += p.weights[k + r];
+			float  inv  = 1.0f / wsum;
+			__m128 invW = _mm_set1_ps(inv);
+
+			const Heightmap::HeightTable& src = *p.src;
+			float* dst = &(*p.dst)(i - p.dstRow0, 0);
+			int    s0  = i - p.srcRow0;
+
+			int j = 0;
+			for(; j + 4 <= n; j += 4)
+			{
+				__m128 acc = _mm_setzero_ps();
+				for(int k = k0; k <= k1; ++k)
+				{
+					__m128 w = _mm_set1_ps(p.weights[k + r]);
+					acc = _mm_add_ps(acc, _mm_mul_ps(w, _mm_loadu_ps(&src(s0 + k, j))));
+				}
+				_mm_storeu_ps(dst + j, _mm_mul_ps(acc, invW));
+			}
+			for(; j < n; ++j)
+			{
+				float sum = 0.0f;
+				for(int k = k0; k <= k1; ++k)
+					sum += p.weights[k + r] * src(s0 + k, j);
+				dst[j] = sum * inv;
+			}
+		}
+	}
+}
+
 Heightmap::Heightmap()
+: mHeightScale(1.0f), mHeightOffset(0.0f), mFilterRadius(0), mFilterKernel(FILTER_BOX)
 {
 }
 
@@ -17,66 +214,274 @@ Heightmap::Heightmap(int m, int n)
 	recreate(m, n);
 }
 
-Heightmap::Heightmap(int m, int n,  const string& filename, float heightScale, float heightOffset)
+Heightmap::Heightmap(int m, int n,  const string& filename, float heightScale, float heightOffset,
+					 int filterRadius, FilterKernel kernel, RawFormat format)
 {
-	loadRAW(m, n, filename, heightScale, heightOffset);
+	loadRAW(m, n, filename, heightScale, heightOffset, filterRadius, kernel, format);
 }
 
 void Heightmap::recreate(int m, int n)
 {
 	mHeightScale       = 1.0f;
 	mHeightOffset      = 0.0f;
+	mFilterRadius      = 0;
+	mFilterKernel      = FILTER_BOX;
+	HeightTable().swap(mSourceHeights);
 	mHeightMap.resize(m, n, 0.0f);
+	buildMinMax();
 }
 
-void Heightmap::loadRAW(int m, int n, const string& filename, float heightScale, float heightOffset)
+void Heightmap::assign(const Table<float>& heights)
 {
+	mHeightScale       = 1.0f;
+	mHeightOffset      = 0.0f;
+	mFilterRadius      = 0;
+	mFilterKernel      = FILTER_BOX;
+	HeightTable().swap(mSourceHeights);
+	mHeightMap         = heights;
+	buildMinMax();
+}
+
+void Heightmap::loadRAW(int m, int n, const string& filename, float heightScale, float heightOffset,
+						int filterRadius, FilterKernel kernel, RawFormat format)
+{
+	TABLE_ASSERT_ROWS_CONTIGUOUS(HeightTable);
+
 	mHeightMapFilename = filename;
 	mHeightScale       = heightScale;
 	mHeightOffset      = heightOffset;
-
-	// A height for each vertex
-	std::vector<unsigned char> in( m * n );
+	mFilterRadius      = 0;
+	mFilterKernel      = FILTER_BOX;
+	HeightTable().swap(mSourceHeights);
 
 	// Open the file.
 	std::ifstream inFile;
 	inFile.open(filename.c_str(), ios_base::binary);
 	if(!inFile) HR(E_FAIL);
 
-	// Read the RAW bytes.
-	inFile.read((char*)&in[0], (streamsize)in.size());
-
-	// Done with file.
-	inFile.close();
+	// Read the RAW samples a row at a time, copying them into a float
+	// table format and scaling the heights as we go, so that we never hold
+	// a second full-size copy of the map.
+	int sampleBytes = 1;
+	if( format == RAW_16BIT ) sampleBytes = 2;
+	if( format == RAW_FLOAT ) sampleBytes = 4;
 
-	// Copy the array data into a float table format and scale
-	// the heights.
+	std::vector<unsigned char> in( n*sampleBytes );
 	mHeightMap.resize(m, n, 0);
 	for(int i = 0; i < m; ++i)
 	{
-		for(int j = 0; j < n; ++j)
+		inFile.read((char*)&in[0], (streamsize)in.size());
+		if( !inFile ) HR(E_FAIL);
+
+		float* row = &mHeightMap(i, 0);
+		switch( format )
 		{
-			int k = i * n + j;
-			mHeightMap(i, j) = (float)in[k] * heightScale + heightOffset;
+		case RAW_8BIT:
+			for(int j = 0; j < n; ++j)
+				row[j] = (float)in[j] * heightScale + heightOffset;
+			break;
+		case RAW_16BIT:
+			for(int j = 0; j < n; ++j)
+				row[j] = (float)(in[2*j] | (in[2*j+1] << 8)) * heightScale + heightOffset;
+			break;
+		case RAW_FLOAT:
+			memcpy(row, &in[0], n*sizeof(float));
+			for(int j = 0; j < n; ++j)
+				row[j] = row[j] * heightScale + heightOffset;
+			break;
 		}
 	}
 
+	// Done with file.
+	inFile.close();
+
 	// Filter the table to smooth it out.  We do this because 256 height
 	// steps is rather course.  And now that we copied the data into a
 	// float-table, we have more precision.  So we can smooth things out
 	// a bit by filtering the heights.
-	filter3x3();
+	if( filterRadius > 0 )
+		filter(filterRadius, kernel);
+	else
+		buildMinMax();
+}
+
+void Heightmap::filter(int radius, FilterKernel kernel)
+{
+	if( radius <= 0 )
+		return;
+
+	// Keep the heights as they were for modify, which edits them and
+	// filters them again the same way.
+	mSourceHeights = mHeightMap;
+	mFilterRadius  = radius;
+	mFilterKernel  = kernel;
+
+	// The radius 1 box filter is the one every map is loaded with, and it
+	// has a faster (and bit-exact) path of its own.
+	if( radius == 1 && kernel == FILTER_BOX )
+		filter3x3();
+	else
+		filterSeparable(radius, kernel);
+
+	buildMinMax();
 }
 
 void Heightmap::filter3x3()
 {
-	Table<float> temp(mHeightMap.numRows(), mHeightMap.numCols());
+	HeightTable temp(mHeightMap.numRows(), mHeightMap.numCols());
+
+	Filter3x3Job job = {this, &mHeightMap, &temp};
+	JobSystem::run(mHeightMap.numRows(), FILTER_ROWS_PER_JOB, filter3x3Rows, &job);
+
+	mHeightMap.swap(temp);
+}
+
+void Heightmap::filter3x3Rows(void* context, int begin, int end)
+{
+	TABLE_ASSERT_ROWS_CONTIGUOUS(HeightTable);
+
+	const Filter3x3Job& job = *(const Filter3x3Job*)context;
+	const HeightTable& src = *job.src;
+	HeightTable&       dst = *job.dst;
+	int m = src.numRows();
+	int n = src.numCols();
+
+	const __m128 nine = _mm_set1_ps(9.0f);
+
+	for(int i = begin; i < end; ++i)
+	{
+		// Edge rows and columns are missing neighbours; they go through
+		// sampleHeight3x3, which leaves those out of the average.
+		if( i == 0 || i == m-1 || n < 3 )
+		{
+			for(int j = 0; j < n; ++j)
+				dst(i,j) = job.heightmap->sampleHeight3x3(src, i, j);
+			continue;
+		}
+
+		const float* r0 = &src(i-1, 0);
+		const float* r1 = &src(i,   0);
+		const float* r2 = &src(i+1, 0);
+		float*       d  = &dst(i,   0);
+
+		dst(i,0) = job.heightmap->sampleHeight3x3(src, i, 0);
+
+		// Four interior texels at a time.  The taps are added in the same
+		// order as sampleHeight3x3, starting from zero, and divided (not
+		// multiplied by 1/9) so the result matches it exactly; the
+		// HeadlessBench filter suite checks it bit for bit.
+		int j = 1;
+		for(; j + 4 <= n-1; j += 4)
+		{
+			__m128 s = _mm_setzero_ps();
+			s = _mm_add_ps(s, _mm_loadu_ps(r0 + j-1));
+			s = _mm_add_ps(s, _mm_loadu_ps(r0 + j));
+			s = _mm_add_ps(s, _mm_loadu_ps(r0 + j+1));
+			s = _mm_add_ps(s, _mm_loadu_ps(r1 + j-1));
+			s = _mm_add_ps(s, _mm_loadu_ps(r1 + j));
+			s = _mm_add_ps(s, _mm_loadu_ps(r1 + j+1));
+			s = _mm_add_ps(s, _mm_loadu_ps(r2 + j-1));
+			s = _mm_add_ps(s, _mm_loadu_ps(r2 + j));
+			s = _mm_add_ps(s, _mm_loadu_ps(r2 + j+1));
+			_mm_storeu_ps(d + j, _mm_div_ps(s, nine));
+		}
+		for(; j < n; ++j)
+			dst(i,j) = job.heightmap->sampleHeight3x3(src, i, j);
+	}
+}
+
+void Heightmap::filterSeparable(int radius, FilterKernel kernel)
+{
+	int m = mHeightMap.numRows();
+	int n = mHeightMap.numCols();
+
+	vector<float> weights;
+	FilterWeights(radius, kernel, weights);
+
+	// Ping-pong: filter along x into temp, then along z back into the map.
+	HeightTable temp(m, n);
+
+	SeparablePass h = {&mHeightMap, &temp, 0, 0, m, &weights[0], radius};
+	JobSystem::run(m, FILTER_ROWS_PER_JOB, filterRowsH, &h);
+
+	SeparablePass v = {&temp, &mHeightMap, 0, 0, m, &weights[0], radius};
+	JobSystem::run(m, FILTER_ROWS_PER_JOB, filterRowsV, &v);
+}
+
+RECT Heightmap::modify(const RECT& R, const HeightBrush& brush)
+{
+	RECT r;
+	r.left   = max((int)R.left,   0);
+	r.top    = max((int)R.top,    0);
+	r.right  = min((int)R.right,  numCols()-1);
+	r.bottom = min((int)R.bottom, numRows()-1);
+	if( r.right < r.left || r.bottom < r.top )
+	{
+		RECT none = {0, 0, -1, -1};
+		return none;
+	}
 
-	for(int i = 0; i < mHeightMap.numRows(); ++i)
-		for(int j = 0; j < mHeightMap.numCols(); ++j)
-			temp(i,j) = sampleHeight3x3(i,j);
+	// A filtered map is brushed before filtering, and the area the brush
+	// reaches filtered again from there.
+	HeightTable& heights = mFilterRadius > 0 ? mSourceHeights : mHeightMap;
+	for(int i = r.top; i <= r.bottom; ++i)
+		for(int j = r.left; j <= r.right; ++j)
+			heights(i, j) = brush.apply(i, j, heights(i, j));
 
-	mHeightMap = temp;
+	r = filterRegion(r);
+	updateMinMax(r.top, r.left, r.bottom, r.right);
+	return r;
+}
+
+RECT Heightmap::filterRegion(const RECT& R)
+{
+	int m = numRows();
+	int n = numCols();
+	int radius = mFilterRadius;
+	if( radius <= 0 )
+		return R;
+
+	// Every height within radius of R can change, and those read the
+	// source heights within radius of them.
+	RECT out;
+	out.left   = max((int)R.left   - radius, 0);
+	out.top    = max((int)R.top    - radius, 0);
+	out.right  = min((int)R.right  + radius, n-1);
+	out.bottom = min((int)R.bottom + radius, m-1);
+
+	// Filter them the way filter() did, so the map ends up exactly as if
+	// the whole of the edited source had been filtered.
+	if( radius == 1 && mFilterKernel == FILTER_BOX )
+	{
+		for(int i = out.top; i <= out.bottom; ++i)
+			for(int j = out.left; j <= out.right; ++j)
+				mHeightMap(i, j) = sampleHeight3x3(mSourceHeights, i, j);
+		return out;
+	}
+
+	// The separable passes take the same path through a column wherever
+	// they start, so run them over whole rows: along x for the rows that
+	// are read into band, then along z for the rows that change, and copy
+	// back just the columns that change.
+	int top    = max((int)out.top    - radius, 0);
+	int bottom = min((int)out.bottom + radius, m-1);
+
+	vector<float> weights;
+	FilterWeights(radius, mFilterKernel, weights);
+
+	HeightTable band(bottom - top + 1, n);
+	SeparablePass h = {&mSourceHeights, &band, 0, top, m, &weights[0], radius};
+	filterRowsH(&h, top, bottom + 1);
+
+	HeightTable rows(out.bottom - out.top + 1, n);
+	SeparablePass v = {&band, &rows, top, out.top, m, &weights[0], radius};
+	filterRowsV(&v, out.top, out.bottom + 1);
+
+	for(int i = out.top; i <= out.bottom; ++i)
+		for(int j = out.left; j <= out.right; ++j)
+			mHeightMap(i, j) = rows(i - out.top, j);
+
+	return out;
 }
 
 int Heightmap::numRows()const
@@ -94,6 +499,424 @@ float& Heightmap::operator()(int i, int j)
 	return mHeightMap(i, j);
 }
 
+const float& Heightmap::operator()(int i, int j)const
+{
+	return mHeightMap(i, j);
+}
+
+void Heightmap::buildMinMax()
+{
+	mMinMax.clear();
+
+	int cellRows = numRows()-1;
+	int cellCols = numCols()-1;
+	if( cellRows < 1 || cellCols < 1 )
+		return;
+
+	// Halve the size until a single block is left.
+	mMinMax.push_back(Table<HeightRange>(cellRows, cellCols));
+	while( mMinMax.back().numRows() > 1 || mMinMax.back().numCols() > 1 )
+	{
+		int rows = mMinMax.back().numRows();
+		int cols = mMinMax.back().numCols();
+		mMinMax.push_back(Table<HeightRange>((rows+1)/2, (cols+1)/2));
+	}
+
+	updateMinMax(0, 0, numRows()-1, numCols()-1);
+}
+
+void Heightmap::updateMinMax(int r0, int c0, int r1, int c1)
+{
+	TABLE_ASSERT_ROWS_CONTIGUOUS(HeightTable);
+
+	if( mMinMax.empty() )
+		return;
+
+	// The cells with a corner in the vertices [r0, r1] x [c0, c1].
+	Table<HeightRange>& base = mMinMax[0];
+	int br0 = max(r0-1, 0);
+	int bc0 = max(c0-1, 0);
+	int br1 = min(r1, base.numRows()-1);
+	int bc1 = min(c1, base.numCols()-1);
+
+	// Level 0: the range of each cell's corners.
+	for(int i = br0; i <= br1; ++i)
+	{
+		const float* top    = &mHeightMap(i,   0);
+		const float* bottom = &mHeightMap(i+1, 0);
+		for(int j = bc0; j <= bc1; ++j)
+		{
+			HeightRange& b = base(i, j);
+			b.minH = min(min(top[j], top[j+1]), min(bottom[j], bottom[j+1]));
+			b.maxH = max(max(top[j], top[j+1]), max(bottom[j], bottom[j+1]));
+		}
+	}
+
+	// Each level above merges the (up to) 2x2 blocks below it.
+	for(size_t L = 1; L < mMinMax.size(); ++L)
+	{
+		const Table<HeightRange>& src = mMinMax[L-1];
+		Table<HeightRange>&       dst = mMinMax[L];
+		int rows = src.numRows();
+		int cols = src.numCols();
+
+		br0 >>= 1;
+		bc0 >>= 1;
+		br1 >>= 1;
+		bc1 >>= 1;
+		for(int i = br0; i <= br1; ++i)
+		{
+			for(int j = bc0; j <= bc1; ++j)
+			{
+				HeightRange r = src(2*i, 2*j);
+				for(int k = 1; k < 4; ++k)
+				{
+					int si = 2*i + (k >> 1);
+					int sj = 2*j + (k & 1);
+					if( si < rows && sj < cols )
+					{
+						r.minH = min(r.minH, src(si, sj).minH);
+						r.maxH = max(r.maxH, src(si, sj).maxH);
+					}
+				}
+				dst(i, j) = r;
+			}
+		}
+	}
+}
+
+int Heightmap::numMinMaxLevels()const
+{
+	return (int)mMinMax.size();
+}
+
+const Heightmap::HeightRange& Heightmap::minMaxBlock(int level, int r, int c)const
+{
+	return mMinMax[level](r, c);
+}
+
+Heightmap::HeightRange Heightmap::minMaxRegion(int r0, int c0, int r1, int c1)const
+{
+	HeightRange out;
+	out.minH =  INFINITY;
+	out.maxH = -INFINITY;
+
+	// A single row or column of vertices isn't made of cells; read it.
+	if( r0 == r1 || c0 == c1 || mMinMax.empty() )
+	{
+		for(int i = r0; i <= r1; ++i)
+		{
+			for(int j = c0; j <= c1; ++j)
+			{
+				out.minH = min(out.minH, mHeightMap(i, j));
+				out.maxH = max(out.maxH, mHeightMap(i, j));
+			}
+		}
+		return out;
+	}
+
+	// Otherwise the vertices are exactly the corners of the cells
+	// [r0, r1) x [c0, c1).  Start at the coarsest level whose blocks fit
+	// inside the rectangle.
+	int size  = min(r1-r0, c1-c0);
+	int level = 0;
+	while( level+1 < numMinMaxLevels() && (2 << level) <= size )
+		++level;
+
+	minMaxCells(level, r0, c0, r1, c1, out);
+	return out;
+}
+
+void Heightmap::minMaxCells(int level, int r0, int c0, int r1, int c1, HeightRange& out)const
+{
+	// Blocks wholly inside the cells [r0, r1) x [c0, c1) are merged in
+	// directly; the partly covered ones are split up a level down.
+	const Table<HeightRange>& blocks = mMinMax[level];
+	int cellRows = numRows()-1;
+	int cellCols = numCols()-1;
+
+	for(int br = r0 >> level; br <= (r1-1) >> level; ++br)
+	{
+		int top    = br << level;
+		int bottom = min(top + (1 << level), cellRows);
+		for(int bc = c0 >> level; bc <= (c1-1) >> level; ++bc)
+		{
+			int left  = bc << level;
+			int right = min(left + (1 << level), cellCols);
+
+			if( top >= r0 && bottom <= r1 && left >= c0 && right <= c1 )
+			{
+				const HeightRange& b = blocks(br, bc);
+				out.minH = min(out.minH, b.minH);
+				out.maxH = max(out.maxH, b.maxH);
+			}
+			else
+			{
+				minMaxCells(level-1, max(top, r0), max(left, c0),
+					min(bottom, r1), min(right, c1), out);
+			}
+		}
+	}
+}
+
+bool Heightmap::intersectRay(const D3DXVECTOR3& origin, const D3DXVECTOR3& dir,
+							 float maxT, float& tHit)const
+{
+	if( mMinMax.empty() )
+		return false;
+
+	int cellRows = numRows()-1;
+	int cellCols = numCols()-1;
+	int topLevel = numMinMaxLevels()-1;
+	const HeightRange& all = mMinMax[topLevel](0, 0);
+
+	// Clip the ray to the box around the whole map.
+	float t  = 0.0f;
+	float t1 = maxT;
+	if( !ClipSlab(origin.x, dir.x, 0.0f, (float)cellCols, t, t1) ||
+		!ClipSlab(origin.y, dir.y, all.minH, all.maxH, t, t1) ||
+		!ClipSlab(origin.z, dir.z, 0.0f, (float)cellRows, t, t1) )
+		return false;
+
+	// The cell the ray enters the map in.
+	int r = (int)floorf(origin.z + t*dir.z);
+	int c = (int)floorf(origin.x + t*dir.x);
+	r = min(max(r, 0), cellRows-1);
+	c = min(max(c, 0), cellCols-1);
+
+	// Walk the blocks under the ray, at the level of the pyramid we are
+	// at.  A block the ray doesn't reach the height range of within it is
+	// skipped whole, and the walk moves up a level in the hope of skipping
+	// more at once; one the ray might hit is looked at a level down,
+	// until it is a single cell and we test its two triangles.
+	int level = 0;
+	for(;;)
+	{
+		int r0   = (r >> level) << level;
+		int c0   = (c >> level) << level;
+		int rEnd = min(r0 + (1 << level), cellRows);
+		int cEnd = min(c0 + (1 << level), cellCols);
+
+		// Where the ray leaves the block through its sides.
+		float tx = INFINITY;
+		float tz = INFINITY;
+		if( dir.x > 0.0f ) tx = ((float)cEnd - origin.x) / dir.x;
+		if( dir.x < 0.0f ) tx = ((float)c0   - origin.x) / dir.x;
+		if( dir.z > 0.0f ) tz = ((float)rEnd - origin.z) / dir.z;
+		if( dir.z < 0.0f ) tz = ((float)r0   - origin.z) / dir.z;
+		float tExit = min(min(tx, tz), t1);
+
+		float y0 = origin.y + t*dir.y;
+		float y1 = origin.y + tExit*dir.y;
+		const HeightRange& b = mMinMax[level](r >> level, c >> level);
+
+		if( min(y0, y1) > b.maxH || max(y0, y1) < b.minH )
+		{
+			if( level < topLevel )
+				++level;
+		}
+		else if( level > 0 )
+		{
+			--level;
+			continue;
+		}
+		else if( intersectCell(r, c, origin, dir, tHit) && tHit >= 0.0f && tHit <= maxT )
+		{
+			return true;
+		}
+
+		if( tExit >= t1 )
+			return false;
+
+		// Step into the neighbouring block the ray leaves through.  Take
+		// the cell across the other axis from the exit point, kept inside
+		// the block we are leaving so rounding can't skip a cell.
+		int nr = (int)floorf(origin.z + tExit*dir.z);
+		int nc = (int)floorf(origin.x + tExit*dir.x);
+		nr = min(max(nr, r0), rEnd-1);
+		nc = min(max(nc, c0), cEnd-1);
+		if( tx <= tz ) nc = (dir.x > 0.0f) ? cEnd : c0-1;
+		if( tz <= tx ) nr = (dir.z > 0.0f) ? rEnd : r0-1;
+
+		if( nr < 0 || nr >= cellRows || nc < 0 || nc >= cellCols )
+			return false;
+
+		r = nr;
+		c = nc;
+		t = tExit;
+	}
+}
+
+bool Heightmap::intersectCell(int r, int c, const D3DXVECTOR3& origin,
+							  const D3DXVECTOR3& dir, float& t)const
+{
+	// A*--*B
+	//  | /|
+	//  |/ |
+	// C*--*D
+	D3DXVECTOR3 A((float)c,     mHeightMap(r,   c),   (float)r);
+	D3DXVECTOR3 B((float)(c+1), mHeightMap(r,   c+1), (float)r);
+	D3DXVECTOR3 C((float)c,     mHeightMap(r+1, c),   (float)(r+1));
+	D3DXVECTOR3 D((float)(c+1), mHeightMap(r+1, c+1), (float)(r+1));
+
+	// The ray can cross both triangles; keep the nearer hit.
+	float t0, t1;
+	bool hit0 = IntersectTri(origin, dir, A, B, C, t0);
+	bool hit1 = IntersectTri(origin, dir, C, B, D, t1);
+	if( hit0 && hit1 ) t = min(t0, t1);
+	else if( hit0 )    t = t0;
+	else if( hit1 )    t = t1;
+	return hit0 || hit1;
+}
+
+void Heightmap::computeNormals(int i, int j, int count, float dx, float dz,
+							   D3DXVECTOR3* out, UINT stride)const
+{
+	TABLE_ASSERT_ROWS_CONTIGUOUS(HeightTable);
+
+	int m = numRows();
+	int n = numCols();
+	int end = j + count;
+
+	// Every vertex off the border has all six faces around it, and the sum
+	// of their normals reduces to
+	//
+	//   x = -dz*(2(R - L) + (UR - U) + (D - DL))
+	//   y = 6*dx*dz
+	//   z =  dx*(2(D - U) + (R - UR) + (DL - L))
+	//
+	// where U/D are the rows above and below and L/R the columns left and
+	// right.  Those go four at a time; the border takes the general path.
+	// Both do the same arithmetic in the same order, so a vertex gets the
+	// same normal whichever path (and whichever subgrid) computes it.
+	if( i > 0 && i < m-1 )
+	{
+		const float* up  = &mHeightMap(i-1, 0);
+		const float* row = &mHeightMap(i,   0);
+		const float* dn  = &mHeightMap(i+1, 0);
+
+		__m128 two = _mm_set1_ps(2.0f);
+		__m128 nDZ = _mm_set1_ps(-dz);
+		__m128 DX  = _mm_set1_ps(dx);
+		__m128 NY  = _mm_set1_ps(6.0f*dx*dz);
+		__m128 NY2 = _mm_mul_ps(NY, NY);
+
+		for(; j < end && j < 1; ++j)
+		{
+			*out = vertexNormal(i, j, dx, dz);
+			out = (D3DXVECTOR3*)((char*)out + stride);
+		}
+
+		for(; j + 4 <= end && j + 4 <= n-1; j += 4)
+		{
+			__m128 L  = _mm_loadu_ps(row + j - 1);
+			__m128 R  = _mm_loadu_ps(row + j + 1);
+			__m128 U  = _mm_loadu_ps(up  + j);
+			__m128 UR = _mm_loadu_ps(up  + j + 1);
+			__m128 D  = _mm_loadu_ps(dn  + j);
+			__m128 DL = _mm_loadu_ps(dn  + j - 1);
+
+			__m128 sx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(two, _mm_sub_ps(R, L)),
+				_mm_sub_ps(UR, U)), _mm_sub_ps(D, DL));
+			__m128 sz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(two, _mm_sub_ps(D, U)),
+				_mm_sub_ps(R, UR)), _mm_sub_ps(DL, L));
+			__m128 nx = _mm_mul_ps(nDZ, sx);
+			__m128 nz = _mm_mul_ps(DX, sz);
+
+			__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), NY2),
+				_mm_mul_ps(nz, nz)));
+			nx = _mm_div_ps(nx, len);
+			__m128 ny = _mm_div_ps(NY, len);
+			nz = _mm_div_ps(nz, len);
+
+			float x[4], y[4], z[4];
+			_mm_storeu_ps(x, nx);
+			_mm_storeu_ps(y, ny);
+			_mm_storeu_ps(z, nz);
+			for(int k = 0; k < 4; ++k)
+			{
+				*out = D3DXVECTOR3(x[k], y[k], z[k]);
+				out = (D3DXVECTOR3*)((char*)out + stride);
+			}
+		}
+	}
+
+	for(; j < end; ++j)
+	{
+		*out = vertexNormal(i, j, dx, dz);
+		out = (D3DXVECTOR3*)((char*)out + stride);
+	}
+}
+
+D3DXVECTOR3 Heightmap::vertexNormal(int i, int j, float dx, float dz)const
+{
+	int m = numRows();
+	int n = numCols();
+
+	float sx = 0.0f;
+	float sz = 0.0f;
+	float ny = 0.0f;
+
+	if( i > 0 && i < m-1 && j > 0 && j < n-1 )
+	{
+		// All six faces; same sums as the vector loop in computeNormals.
+		float L  = mHeightMap(i,   j-1);
+		float R  = mHeightMap(i,   j+1);
+		float U  = mHeightMap(i-1, j);
+		float UR = mHeightMap(i-1, j+1);
+		float D  = mHeightMap(i+1, j);
+		float DL = mHeightMap(i+1, j-1);
+
+		sx = 2.0f*(R - L) + (UR - U) + (D - DL);
+		sz = 2.0f*(D - U) + (R - UR) + (DL - L);
+		ny = 6.0f*dx*dz;
+	}
+	else
+	{
+		// Each cell is split into the triangles (i,j) (i,j+1) (i+1,j) and
+		// (i+1,j) (i,j+1) (i+1,j+1).  The unnormalized normal of each is
+		// (-dz*(height change along x), dx*dz, dx*(height change along -z)),
+		// so add up the faces of the (up to four) cells around the vertex
+		// that are on the map.
+		float h = mHeightMap(i, j);
+		bool up    = i > 0;
+		bool down  = i < m-1;
+		bool left  = j > 0;
+		bool right = j < n-1;
+
+		if( up && left )    // Lower triangle of the cell up and left.
+		{
+			sx += h - mHeightMap(i, j-1);
+			sz += h - mHeightMap(i-1, j);
+			ny += 1.0f;
+		}
+		if( up && right )   // Both triangles of the cell up and right.
+		{
+			sx += (mHeightMap(i-1, j+1) - mHeightMap(i-1, j)) + (mHeightMap(i, j+1) - h);
+			sz += (h - mHeightMap(i-1, j)) + (mHeightMap(i, j+1) - mHeightMap(i-1, j+1));
+			ny += 2.0f;
+		}
+		if( down && left )  // Both triangles of the cell down and left.
+		{
+			sx += (h - mHeightMap(i, j-1)) + (mHeightMap(i+1, j) - mHeightMap(i+1, j-1));
+			sz += (mHeightMap(i+1, j-1) - mHeightMap(i, j-1)) + (mHeightMap(i+1, j) - h);
+			ny += 2.0f;
+		}
+		if( down && right ) // Upper triangle of the cell down and right.
+		{
+			sx += mHeightMap(i, j+1) - h;
+			sz += mHeightMap(i+1, j) - h;
+			ny += 1.0f;
+		}
+		ny *= dx*dz;
+	}
+
+	float nx  = -dz*sx;
+	float nz  =  dx*sz;
+	float len = sqrtf((nx*nx + ny*ny) + nz*nz);
+	return D3DXVECTOR3(nx/len, ny/len, nz/len);
+}
+
 bool Heightmap::inBounds(int i, int j)
 {
 	return 
@@ -103,7 +926,7 @@ bool Heightmap::inBounds(int i, int j)
 		j < (int)mHeightMap.numCols();
 }
 
-float Heightmap::sampleHeight3x3(int i, int j)
+float Heightmap::sampleHeight3x3(const HeightTable& src, int i, int j)
 {
 	// Function computes the average height of the ij element.
 	// It averages itself with its eight neighbor pixels.  Note
@@ -127,7 +950,7 @@ float Heightmap::sampleHeight3x3(int i, int j)
 		{
 			if( inBounds(m,n) )
 			{
-				avg += mHeightMap(m,n);
+				avg += src(m,n);
 				num += 1.0f;
 			}
 		}
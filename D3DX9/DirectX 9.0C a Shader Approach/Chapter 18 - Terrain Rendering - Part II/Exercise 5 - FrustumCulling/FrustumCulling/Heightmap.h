@@ -8,19 +8,111 @@
 #include "d3dUtil.h"
 #include "Table.h"
 #include <string>
+#include <vector>
+
+// Changes the heights inside a rectangle of a Heightmap; see
+// Heightmap::modify.
+class HeightBrush
+{
+public:
+	virtual ~HeightBrush() {}
+
+	// Returns the new height of vertex (i, j), given its current height.
+	virtual float apply(int i, int j, float height)const = 0;
+};
+
+// Raises the heights by amount at (centerRow, centerCol), falling off
+// smoothly to nothing radius vertices away.  A negative amount digs.
+class RaiseBrush : public HeightBrush
+{
+public:
+	RaiseBrush(float centerRow, float centerCol, float radius, float amount)
+		: mRow(centerRow), mCol(centerCol), mRadius(radius), mAmount(amount) {}
+
+	float apply(int i, int j, float height)const
+	{
+		float dr = (float)i - mRow;
+		float dc = (float)j - mCol;
+		float t  = 1.0f - (dr*dr + dc*dc) / (mRadius*mRadius);
+		return t > 0.0f ? height + mAmount*t*t : height;
+	}
+
+private:
+	float mRow;
+	float mCol;
+	float mRadius;
+	float mAmount;
+};
 
 class Heightmap
 {
 public:
+	// The heights are row-major; the SSE passes over them, and callers
+	// such as Terrain and HorizonBaker, walk rows with pointers.
+	typedef Table<float> HeightTable;
+
+	enum FilterKernel
+	{
+		FILTER_BOX,
+		FILTER_GAUSSIAN
+	};
+
+	// Sample formats of a RAW file.  Multi-byte samples are little-endian.
+	enum RawFormat
+	{
+		RAW_8BIT,  // Unsigned bytes.
+		RAW_16BIT, // Unsigned 16-bit integers.
+		RAW_FLOAT  // 32-bit floats.
+	};
+
+	// Height range of one block of the min/max pyramid.
+	struct HeightRange
+	{
+		float minH;
+		float maxH;
+	};
+
 	Heightmap();
 	Heightmap(int m, int n);
 	Heightmap(int m, int n, 
-		const std::string& filename, float heightScale, float heightOffset);
+		const std::string& filename, float heightScale, float heightOffset,
+		int filterRadius = 1, FilterKernel kernel = FILTER_BOX,
+		RawFormat format = RAW_8BIT);
 
 	void recreate(int m, int n);
 
+	// Takes its heights from a table that is already scaled and filtered,
+	// e.g. a region of a PagedHeightmap.
+	void assign(const Table<float>& heights);
+
+	// Each sample is scaled by heightScale and offset by heightOffset.  The
+	// heights are smoothed with filter() after loading; a filterRadius of 0
+	// leaves them unfiltered, which suits the 16-bit and float formats
+	// since they don't have 8-bit's 256 visible height steps to hide.
 	void loadRAW(int m, int n,
-		const std::string& filename, float heightScale, float heightOffset);
+		const std::string& filename, float heightScale, float heightOffset,
+		int filterRadius = 1, FilterKernel kernel = FILTER_BOX,
+		RawFormat format = RAW_8BIT);
+
+	// Smooths the heights with a (2*radius+1)^2 kernel.  Samples that fall
+	// off the map are left out and the remaining weights renormalized, so a
+	// radius 1 box filter gives exactly the old 3x3 neighbour average.  The
+	// heights from before filtering are kept, for modify, so a filtered map
+	// holds two copies of its heights: 4*m*n more bytes (256 KB for a
+	// 257x257 map, 4 MB for 1025x1025).  Load with a filterRadius of 0 and
+	// never call filter() if the map won't be brushed and the memory counts.
+	void filter(int radius, FilterKernel kernel = FILTER_BOX);
+
+	// Applies the brush to the vertices in R (rows top to bottom, columns
+	// left to right, inclusive), clipped to the map, and brings the min/max
+	// pyramid up to date there.  If the map has been filtered, the brush
+	// edits the heights from before the last filter() instead, and the area
+	// it reaches is filtered again from them; the map is then exactly what
+	// filtering all the edited heights would give.  (Changes made through
+	// operator() since that filter() are lost where the brush reaches.)
+	// Returns the rectangle of heights that changed, which is empty
+	// (right < left) if R is off the map.
+	RECT modify(const RECT& R, const HeightBrush& brush);
 
 	int numRows()const;
 	int numCols()const;
@@ -31,15 +123,68 @@ public:
 	// For const objects
 	const float& operator()(int i, int j)const;
 
+	// The min/max pyramid.  Block (r, c) of level 0 is the grid cell whose
+	// top-left vertex is (r, c), and holds the range of its four corner
+	// heights; each level above merges 2x2 blocks of the one below, so a
+	// level L block covers 2^L x 2^L cells (clipped to the map) and the top
+	// level is a single block.  loadRAW, recreate, filter and modify keep it
+	// up to date; call buildMinMax after changing heights through operator().
+	void buildMinMax();
+	int  numMinMaxLevels()const;
+	const HeightRange& minMaxBlock(int level, int r, int c)const;
+
+	// Exact range of the heights of the vertices [r0, r1] x [c0, c1],
+	// inclusive.  A rectangle that lines up with the pyramid blocks (such
+	// as a terrain sub-grid) is a single lookup.
+	HeightRange minMaxRegion(int r0, int c0, int r1, int c1)const;
+
+	// Intersects the ray origin + t*dir, 0 <= t <= maxT, with the surface
+	// through the heights, in grid space: x runs along the columns and z
+	// down the rows, one unit per cell, and y is the height.  The cells are
+	// split into triangles the way GenTriGrid splits them.  Returns whether
+	// the ray hits, and if so the t of the nearest hit.
+	//
+	// The cells under the ray are walked in order (a 2D DDA), and the
+	// min/max pyramid lets whole blocks of cells that the ray passes over
+	// or under be skipped at once.  Nothing is modified, so any number of
+	// threads can cast rays at the same time.
+	bool intersectRay(const D3DXVECTOR3& origin, const D3DXVECTOR3& dir,
+		float maxT, float& t)const;
+
+	// Vertex normals of the grid GenTriGrid builds over the heights, with
+	// cells dx by dz, without building the mesh: each is the sum of the
+	// face normals around the vertex (so larger faces count for more),
+	// normalized.  Writes the normals of count vertices of row i, starting
+	// at column j, stride bytes apart.
+	void computeNormals(int i, int j, int count, float dx, float dz,
+		D3DXVECTOR3* out, UINT stride)const;
+
 private:
 	bool  inBounds(int i, int j);
-	float sampleHeight3x3(int i, int j);
+	float sampleHeight3x3(const HeightTable& src, int i, int j);
+	D3DXVECTOR3 vertexNormal(int i, int j, float dx, float dz)const;
+	void  minMaxCells(int level, int r0, int c0, int r1, int c1, HeightRange& out)const;
+	bool  intersectCell(int r, int c, const D3DXVECTOR3& origin,
+		const D3DXVECTOR3& dir, float& t)const;
 	void  filter3x3();
+	void  filterSeparable(int radius, FilterKernel kernel);
+	RECT  filterRegion(const RECT& R);
+	void  updateMinMax(int r0, int c0, int r1, int c1);
+
+	static void filter3x3Rows(void* context, int begin, int end);
 private:
 	std::string  mHeightMapFilename;
-	Table<float> mHeightMap;
+	HeightTable  mHeightMap;
+	std::vector< Table<HeightRange> > mMinMax; // Finest level first.
 	float        mHeightScale;
 	float        mHeightOffset;
+
+	// The last filter() the map was smoothed with, and the heights from
+	// before it, for modify: as big as mHeightMap, and empty if
+	// mFilterRadius is 0.
+	HeightTable  mSourceHeights;
+	int          mFilterRadius;
+	FilterKernel mFilterKernel;
 };
 
 #endif //HEIGHTMAP_H
\ No newline at end of file
@@ -0,0 +1,269 @@
+//=============================================================================
+// HorizonBaker.cpp.
+//=============================================================================
+
+#include <fstream>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <xmmintrin.h>
+#include "HorizonBaker.h"
+#include "JobSystem.h"
+#include "d3dUtil.h"
+using namespace std;
+
+namespace
+{
+	const int NUM_DIRS = 8;
+
+	// Column and row steps of the march directions.
+	const int DIR_COLS[NUM_DIRS] = { 1, 1, 0, -1, -1, -1,  0,  1 };
+	const int DIR_ROWS[NUM_DIRS] = { 0, 1, 1,  1,  0, -1, -1, -1 };
+
+	// Rows baked between progress callbacks.
+	const int ROWS_PER_BAND = 32;
+
+	const DWORD CACHE_VERSION = 1;
+
+	struct CacheHeader
+	{
+		char  magic[4]; // "HZAO"
+		DWORD version;
+		DWORD rows;
+		DWORD cols;
+		unsigned __int64 hash;
+	};
+
+	struct BakeJob
+	{
+		const Heightmap* heightmap;
+		Table<float>*    ao;
+		int              row0;     // First row of the band.
+		int              maxSteps;
+		float            stepDist[NUM_DIRS]; // Length of one step.
+	};
+
+	// Fraction of the sky a horizon with the given slope leaves visible:
+	// 1 - sin(atan(t)).
+	float SkyVisible(float t)
+	{
+		return 1.0f - t / sqrtf(1.0f + t*t);
+	}
+
+	__m128 SkyVisible(__m128 t)
+	{
+		__m128 one = _mm_set1_ps(1.0f);
+		return _mm_sub_ps(one, _mm_div_ps(t, _mm_sqrt_ps(_mm_add_ps(one, _mm_mul_ps(t, t)))));
+	}
+
+	// Number of steps from (i, j) along direction d that stay on the map.
+	int StepsOnMap(int i, int j, int d, int m, int n, int maxSteps)
+	{
+		int k = maxSteps;
+		if( DIR_ROWS[d] > 0 ) k = min(k, m-1 - i);
+		if( DIR_ROWS[d] < 0 ) k = min(k, i);
+		if( DIR_COLS[d] > 0 ) k = min(k, n-1 - j);
+		if( DIR_COLS[d] < 0 ) k = min(k, j);
+		return k;
+	}
+}
+
+void HorizonBaker::bake(const Heightmap& heightmap, float dx, float dz, int maxSteps,
+						Table<float>& ao, ProgressFunc progress, void* context)
+{
+	int m = heightmap.numRows();
+	ao.resize(m, heightmap.numCols());
+
+	BakeJob job;
+	job.heightmap = &heightmap;
+	job.ao        = &ao;
+	job.maxSteps  = max(maxSteps, 1);
+	for(int d = 0; d < NUM_DIRS; ++d)
+	{
+		float sx = DIR_COLS[d]*dx;
+		float sz = DIR_ROWS[d]*dz;
+		job.stepDist[d] = sqrtf(sx*sx + sz*sz);
+	}
+
+	// A band at a time, so the progress callback runs on this thread.
+	for(int row0 = 0; row0 < m; row0 += ROWS_PER_BAND)
+	{
+		job.row0 = row0;
+		JobSystem::run(min(ROWS_PER_BAND, m - row0), 1, bakeRows, &job);
+
+		if( progress )
+			progress(context, (float)min(row0 + ROWS_PER_BAND, m) / m);
+	}
+}
+
+void HorizonBaker::bakeRows(void* context, int begin, int end)
+{
+	// The vector loop loads four neighbouring columns of a row at once.
+	TABLE_ASSERT_ROWS_CONTIGUOUS(Heightmap::HeightTable);
+
+	const BakeJob& job = *(const BakeJob*)context;
+	const Heightmap& h = *job.heightmap;
+	int m = h.numRows();
+	int n = h.numCols();
+	int S = job.maxSteps;
+
+	const __m128 zero    = _mm_setzero_ps();
+	const __m128 invDirs = _mm_set1_ps(1.0f / NUM_DIRS);
+
+	for(int i = job.row0 + begin; i < job.row0 + end; ++i)
+	{
+		// Four vertices at a time where every step of every direction
+		// stays inside the map's columns; the rows are the same for all
+		// four, so only the columns need checking.
+		int j = 0;
+		if( n >= 2*S + 4 )
+		{
+			for(j = S; j + 3 <= n-1 - S; j += 4)
+			{
+				__m128 h0  = _mm_loadu_ps(&h(i, j));
+				__m128 sum = zero;
+				for(int d = 0; d < NUM_DIRS; ++d)
+				{
+					int steps = StepsOnMap(i, j, d, m, n, S);
+					__m128 maxSlope = zero;
+					for(int k = 1; k <= steps; ++k)
+					{
+						const float* p = &h(i + k*DIR_ROWS[d], j + k*DIR_COLS[d]);
+						__m128 dist  = _mm_set1_ps(k*job.stepDist[d]);
+						__m128 slope = _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(p), h0), dist);
+						maxSlope = _mm_max_ps(maxSlope, slope);
+					}
+					sum = _mm_add_ps(sum, SkyVisible(maxSlope));
+				}
+				_mm_storeu_ps(&(*job.ao)(i, j), _mm_mul_ps(sum, invDirs));
+			}
+		}
+
+		// The columns near the edges, one vertex at a time.
+		for(int c = 0; c < n; ++c)
+		{
+			if( c == S && j > S )
+			{
+				c = j-1;
+				continue;
+			}
+
+			float h0  = h(i, c);
+			float sum = 0.0f;
+			for(int d = 0; d < NUM_DIRS; ++d)
+			{
+				int steps = StepsOnMap(i, c, d, m, n, S);
+				float maxSlope = 0.0f;
+				for(int k = 1; k <= steps; ++k)
+				{
+					float slope = (h(i + k*DIR_ROWS[d], c + k*DIR_COLS[d]) - h0) / (k*job.stepDist[d]);
+					maxSlope = max(maxSlope, slope);
+				}
+				sum += SkyVisible(maxSlope);
+			}
+			(*job.ao)(i, c) = sum * (1.0f / NUM_DIRS);
+		}
+	}
+}
+
+unsigned __int64 HorizonBaker::hash(const Heightmap& heightmap, float dx, float dz, int maxSteps)
+{
+	// Hashes the heights a row at a time, straight from memory.
+	TABLE_ASSERT_ROWS_CONTIGUOUS(Heightmap::HeightTable);
+
+	unsigned __int64 hash = 14695981039346656037ULL;
+	const unsigned __int64 prime = 1099511628211ULL;
+
+	int m = heightmap.numRows();
+	int n = heightmap.numCols();
+	DWORD settings[5] = { CACHE_VERSION, (DWORD)m, (DWORD)n, (DWORD)maxSteps, 0 };
+	const unsigned char* bytes = (const unsigned char*)settings;
+	for(size_t k = 0; k < sizeof(settings); ++k)
+		hash = (hash ^ bytes[k]) * prime;
+
+	float spacing[2] = { dx, dz };
+	bytes = (const unsigned char*)spacing;
+	for(size_t k = 0; k < sizeof(spacing); ++k)
+		hash = (hash ^ bytes[k]) * prime;
+
+	for(int i = 0; i < m; ++i)
+	{
+		bytes = (const unsigned char*)&heightmap(i, 0);
+		for(size_t k = 0; k < n*sizeof(float); ++k)
+			hash = (hash ^ bytes[k]) * prime;
+	}
+	return hash;
+}
+
+void HorizonBaker::bakeCached(const Heightmap& heightmap, float dx, float dz, int maxSteps,
+							  const std::string& cacheDir, Table<float>& ao,
+							  ProgressFunc progress, void* context, Stats* stats)
+{
+	__int64 cntsPerSec = 0;
+	__int64 startCnts  = 0;
+	__int64 endCnts    = 0;
+	QueryPerformanceFrequency((LARGE_INTEGER*)&cntsPerSec);
+	QueryPerformanceCounter((LARGE_INTEGER*)&startCnts);
+
+	int m = heightmap.numRows();
+	int n = heightmap.numCols();
+	unsigned __int64 key = hash(heightmap, dx, dz, maxSteps);
+
+	char name[32];
+	sprintf(name, "ao_%08x%08x.bin", (DWORD)(key >> 32), (DWORD)(key & 0xffffffff));
+	string filename = cacheDir + name;
+	if( !cacheDir.empty() && cacheDir[cacheDir.size()-1] != '\\' && cacheDir[cacheDir.size()-1] != '/' )
+		filename = cacheDir + "/" + name;
+
+	// Use the cache if it holds this bake.  Anything wrong with it just
+	// means baking again.
+	bool hit = false;
+	ifstream inFile(filename.c_str(), ios_base::binary);
+	if( inFile )
+	{
+		CacheHeader header;
+		inFile.read((char*)&header, sizeof(header));
+		if( inFile && memcmp(header.magic, "HZAO", 4) == 0 && header.version == CACHE_VERSION &&
+			header.rows == (DWORD)m && header.cols == (DWORD)n && header.hash == key )
+		{
+			ao.resize(m, n);
+			for(int i = 0; i < m; ++i)
+				inFile.read((char*)&ao(i, 0), (streamsize)(n*sizeof(float)));
+			hit = !inFile.fail();
+		}
+		inFile.close();
+	}
+
+	if( hit )
+	{
+		if( progress )
+			progress(context, 1.0f);
+	}
+	else
+	{
+		bake(heightmap, dx, dz, maxSteps, ao, progress, context);
+
+		// Failing to save the cache only costs the next run a bake.
+		ofstream outFile(filename.c_str(), ios_base::binary | ios_base::trunc);
+		if( outFile )
+		{
+			CacheHeader header;
+			memcpy(header.magic, "HZAO", 4);
+			header.version = CACHE_VERSION;
+			header.rows    = m;
+			header.cols    = n;
+			header.hash    = key;
+			outFile.write((const char*)&header, sizeof(header));
+			for(int i = 0; i < m; ++i)
+				outFile.write((const char*)&ao(i, 0), (streamsize)(n*sizeof(float)));
+		}
+	}
+
+	QueryPerformanceCounter((LARGE_INTEGER*)&endCnts);
+	if( stats )
+	{
+		stats->cacheHit = hit;
+		stats->bakeMs   = (float)((endCnts - startCnts) * 1000.0 / (double)cntsPerSec);
+		stats->hash     = key;
+	}
+}
@@ -0,0 +1,67 @@
+//=============================================================================
+// HorizonBaker.h.
+//
+// Bakes per-vertex ambient occlusion for a heightmap on the CPU, so the
+// terrain shader can darken valleys without any work at run time.
+//
+// From each vertex the baker marches outward along eight directions (the
+// axes and diagonals of the grid) and finds the highest horizon angle in
+// each.  A direction whose horizon is at angle a above the vertex sees
+// 1 - sin(a) of its sky, and the vertex's occlusion term is the average
+// over the eight directions: 1 on a peak or a plain, less in a valley.
+// Only horizons above the vertex count; the march stops at maxSteps
+// vertices or the edge of the map, whichever comes first.
+//
+// The grid directions step a whole number of rows and columns at a time,
+// so four neighbouring vertices of a row read four neighbouring heights
+// at every step, and the inner loop runs four vertices at once with SSE.
+// Rows are split across the job system.  The SIMD and scalar paths do the
+// same arithmetic in the same order, so the edges match the interior.
+//
+// Baking is deterministic, so bakeCached keeps the result in a file named
+// after a hash of the heights and settings; later runs over the same map
+// just read it back.
+//=============================================================================
+
+#ifndef HORIZON_BAKER_H
+#define HORIZON_BAKER_H
+
+#include "Heightmap.h"
+#include <string>
+
+class HorizonBaker
+{
+public:
+	// Called on the thread that called bake, between bands of rows, with
+	// the fraction of the rows done so far.
+	typedef void (*ProgressFunc)(void* context, float fraction);
+
+	struct Stats
+	{
+		bool  cacheHit;
+		float bakeMs;    // Baking, or reading the cache.
+		unsigned __int64 hash;
+	};
+
+	// ao receives one value in [0, 1] per heightmap vertex.  dx and dz
+	// are the grid spacings; maxSteps is how many vertices out to march in
+	// each direction.
+	static void bake(const Heightmap& heightmap, float dx, float dz, int maxSteps,
+		Table<float>& ao, ProgressFunc progress = 0, void* context = 0);
+
+	// Same as bake, but reads the result from cacheDir if a bake of the
+	// same heights and settings is there, and saves it there otherwise.
+	// An empty cacheDir means the current directory; otherwise it may end
+	// with a slash or not.
+	static void bakeCached(const Heightmap& heightmap, float dx, float dz, int maxSteps,
+		const std::string& cacheDir, Table<float>& ao, ProgressFunc progress = 0,
+		void* context = 0, Stats* stats = 0);
+
+	// 64-bit FNV-1a of the heights, the map's size and the settings.
+	static unsigned __int64 hash(const Heightmap& heightmap, float dx, float dz, int maxSteps);
+
+private:
+	static void bakeRows(void* context, int begin, int end);
+};
+
+#endif // HORIZON_BAKER_H
@@ -0,0 +1,160 @@
+//=============================================================================
+// InstanceBatcher.cpp.
+//=============================================================================
+
+#include "InstanceBatcher.h"
+#include "Vertex.h"
+
+InstanceBatcher::InstanceBatcher(UINT maxInstances)
+: mMaxInstances(maxInstances), mInstanceVB(0)
+{
+	mInstances.reserve(mMaxInstances);
+	ZeroMemory(&mStats, sizeof(mStats));
+}
+
+InstanceBatcher::~InstanceBatcher()
+{
+	ReleaseCOM(mInstanceVB);
+}
+
+void InstanceBatcher::onLostDevice()
+{
+	// Dynamic buffers live in the default pool.
+	ReleaseCOM(mInstanceVB);
+}
+
+void InstanceBatcher::onResetDevice()
+{
+	HR(gd3dDevice->CreateVertexBuffer(mMaxInstances*sizeof(InstanceWorld),
+		D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY, 0, D3DPOOL_DEFAULT, &mInstanceVB, 0));
+}
+
+int InstanceBatcher::addMesh(ID3DXMesh* mesh, const std::vector<Mtrl>& mtrls,
+	const std::vector<IDirect3DTexture9*>& textures)
+{
+	Batch b;
+	b.mesh     = mesh;
+	b.mtrls    = mtrls;
+	b.textures = textures;
+	b.first    = 0;
+	b.count    = 0;
+
+	DWORD numSubsets = 0;
+	HR(mesh->GetAttributeTable(0, &numSubsets));
+	b.subsets.resize(numSubsets);
+	HR(mesh->GetAttributeTable(&b.subsets[0], &numSubsets));
+
+	mBatches.push_back(b);
+	return (int)mBatches.size() - 1;
+}
+
+void InstanceBatcher::begin()
+{
+	mInstances.clear();
+}
+
+void InstanceBatcher::add(int mesh, const D3DXMATRIX& world)
+{
+	if( mInstances.size() == mMaxInstances )
+		return;
+
+	Instance inst;
+	inst.mesh  = mesh;
+	inst.world = world;
+	mInstances.push_back(inst);
+}
+
+void InstanceBatcher::draw(ID3DXEffect* fx, D3DXHANDLE hMtrl, D3DXHANDLE hTex,
+	IDirect3DTexture9* whiteTex)
+{
+	ZeroMemory(&mStats, sizeof(mStats));
+	mStats.numInstances = (DWORD)mInstances.size();
+	if( mInstances.empty() )
+		return;
+
+	// Group the copies by mesh with a counting sort: count, find where
+	// each mesh's run starts, then scatter the matrices straight into the
+	// instance stream.
+	for(UINT i = 0; i < mBatches.size(); ++i)
+		mBatches[i].count = 0;
+	for(UINT i = 0; i < mInstances.size(); ++i)
+		++mBatches[mInstances[i].mesh].count;
+
+	UINT first = 0;
+	for(UINT i = 0; i < mBatches.size(); ++i)
+	{
+		mBatches[i].first = first;
+		first += mBatches[i].count;
+		mBatches[i].count = 0;
+	}
+
+	InstanceWorld* v = 0;
+	HR(mInstanceVB->Lock(0, 0, (void**)&v, D3DLOCK_DISCARD));
+	for(UINT i = 0; i < mInstances.size(); ++i)
+	{
+		Batch& b = mBatches[mInstances[i].mesh];
+		v[b.first + b.count++].world = mInstances[i].world;
+	}
+	HR(mInstanceVB->Unlock());
+
+	HR(gd3dDevice->SetVertexDeclaration(InstanceWorld::Decl));
+	++mStats.numStateChanges;
+
+	IDirect3DTexture9* currTex = 0;
+	for(UINT i = 0; i < mBatches.size(); ++i)
+	{
+		Batch& b = mBatches[i];
+		if( b.count == 0 )
+			continue;
+
+		IDirect3DVertexBuffer9* vb = 0;
+		IDirect3DIndexBuffer9*  ib = 0;
+		HR(b.mesh->GetVertexBuffer(&vb));
+		HR(b.mesh->GetIndexBuffer(&ib));
+
+		// Stream 0 walks the mesh count times; stream 1 steps one matrix
+		// per copy.
+		HR(gd3dDevice->SetStreamSource(0, vb, 0, b.mesh->GetNumBytesPerVertex()));
+		HR(gd3dDevice->SetStreamSourceFreq(0, D3DSTREAMSOURCE_INDEXEDDATA | b.count));
+		HR(gd3dDevice->SetStreamSource(1, mInstanceVB, b.first*sizeof(InstanceWorld), sizeof(InstanceWorld)));
+		HR(gd3dDevice->SetStreamSourceFreq(1, D3DSTREAMSOURCE_INSTANCEDATA | 1));
+		HR(gd3dDevice->SetIndices(ib));
+		mStats.numStateChanges += 5;
+
+		for(UINT j = 0; j < b.subsets.size(); ++j)
+		{
+			const D3DXATTRIBUTERANGE& s = b.subsets[j];
+
+			HR(fx->SetValue(hMtrl, &b.mtrls[s.AttribId], sizeof(Mtrl)));
+			++mStats.numStateChanges;
+
+			// The copies share textures, so only set them when they change.
+			IDirect3DTexture9* tex = b.textures[s.AttribId] ? b.textures[s.AttribId] : whiteTex;
+			if( tex != currTex )
+			{
+				HR(fx->SetTexture(hTex, tex));
+				++mStats.numStateChanges;
+				currTex = tex;
+			}
+
+			HR(fx->CommitChanges());
+			HR(gd3dDevice->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, 0,
+				s.VertexStart, s.VertexCount, s.FaceStart*3, s.FaceCount));
+			++mStats.numDrawCalls;
+		}
+
+		ReleaseCOM(vb);
+		ReleaseCOM(ib);
+	}
+
+	// Put the streams back for non-instanced drawing.
+	HR(gd3dDevice->SetStreamSourceFreq(0, 1));
+	HR(gd3dDevice->SetStreamSourceFreq(1, 1));
+	HR(gd3dDevice->SetStreamSource(1, 0, 0, 0));
+	mStats.numStateChanges += 3;
+}
+
+const InstanceBatcher::Stats& InstanceBatcher::getStats()const
+{
+	return mStats;
+}
@@ -0,0 +1,87 @@
+//=============================================================================
+// InstanceBatcher.h.
+//
+// Draws many copies of a few meshes with hardware instancing.  Each frame
+// the visible copies are add()ed with their world matrices; draw() groups
+// them by mesh, writes the matrices into a dynamic instance stream and
+// issues one DrawIndexedPrimitive per mesh subset, however many copies
+// there are.
+//
+// The meshes must have VertexPNT vertices and an attribute table (as
+// LoadXFile produces), and are not owned by the batcher.  Drawing needs
+// vertex shader 3.0 and an effect pass that reads InstanceWorld from
+// stream 1.
+//=============================================================================
+
+#ifndef INSTANCE_BATCHER_H
+#define INSTANCE_BATCHER_H
+
+#include "d3dUtil.h"
+#include <vector>
+
+class InstanceBatcher
+{
+public:
+	// Per frame counts of what draw() sent to the device.  State changes
+	// are effect parameter sets and stream/index/declaration binds.
+	struct Stats
+	{
+		DWORD numInstances;
+		DWORD numDrawCalls;
+		DWORD numStateChanges;
+	};
+
+	explicit InstanceBatcher(UINT maxInstances);
+	~InstanceBatcher();
+
+	void onLostDevice();
+	void onResetDevice();
+
+	// Returns the id to add() copies of the mesh with.
+	int addMesh(ID3DXMesh* mesh, const std::vector<Mtrl>& mtrls,
+		const std::vector<IDirect3DTexture9*>& textures);
+
+	void begin();
+	void add(int mesh, const D3DXMATRIX& world);
+
+	// Must be called between BeginPass/EndPass of an instanced pass of fx.
+	// Subsets without a texture get whiteTex.
+	void draw(ID3DXEffect* fx, D3DXHANDLE hMtrl, D3DXHANDLE hTex,
+		IDirect3DTexture9* whiteTex);
+
+	const Stats& getStats()const;
+
+private:
+	// Make private to prevent copying of members of this class.
+	InstanceBatcher(const InstanceBatcher& rhs);
+	InstanceBatcher& operator=(const InstanceBatcher& rhs);
+
+private:
+	struct Batch
+	{
+		ID3DXMesh* mesh;
+		std::vector<Mtrl> mtrls;
+		std::vector<IDirect3DTexture9*> textures;
+		std::vector<D3DXATTRIBUTERANGE> subsets;
+
+		// This frame's copies, in the instance stream.
+		UINT first;
+		UINT count;
+	};
+
+	struct Instance
+	{
+		int mesh;
+		D3DXMATRIX world;
+	};
+
+	std::vector<Batch> mBatches;
+	std::vector<Instance> mInstances; // Reserved to mMaxInstances.
+	UINT mMaxInstances;
+
+	IDirect3DVertexBuffer9* mInstanceVB;
+
+	Stats mStats;
+};
+
+#endif // INSTANCE_BATCHER_H
@@ -0,0 +1,149 @@
+//=============================================================================
+// JobSystem.cpp.
+//=============================================================================
+
+#include <process.h>
+#include "d3dUtil.h"
+#include "JobSystem.h"
+
+JobSystem* gJobSystem = 0;
+
+JobSystem::JobSystem(int numWorkers)
+: mQuit(0), mJobOpen(0), mActiveWorkers(0), mFunc(0), mContext(0),
+  mCount(0), mGrainSize(1), mNumChunks(0), mNextChunk(0), mChunksLeft(0)
+{
+	if( numWorkers < 0 )
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		numWorkers = (int)info.dwNumberOfProcessors - 1;
+	}
+
+	InitializeCriticalSection(&mLock);
+	mWake = CreateSemaphore(0, 0, 0x7fffffff, 0);
+	mDone = CreateEvent(0, FALSE, FALSE, 0);
+	if( mWake == 0 || mDone == 0 ) HR(E_FAIL);
+
+	for(int i = 0; i < numWorkers; ++i)
+	{
+		HANDLE h = (HANDLE)_beginthreadex(0, 0, workerMain, this, 0, 0);
+		if( h == 0 ) HR(E_FAIL);
+		mThreads.push_back(h);
+	}
+}
+
+JobSystem::~JobSystem()
+{
+	InterlockedExchange(&mQuit, 1);
+	if( !mThreads.empty() )
+	{
+		ReleaseSemaphore(mWake, (LONG)mThreads.size(), 0);
+		WaitForMultipleObjects((DWORD)mThreads.size(), &mThreads[0], TRUE, INFINITE);
+	}
+	for(size_t i = 0; i < mThreads.size(); ++i)
+		CloseHandle(mThreads[i]);
+
+	CloseHandle(mWake);
+	CloseHandle(mDone);
+	DeleteCriticalSection(&mLock);
+}
+
+int JobSystem::numThreads()const
+{
+	return (int)mThreads.size() + 1;
+}
+
+void JobSystem::parallelFor(int count, int grainSize, RangeFunc func, void* context)
+{
+	if( count <= 0 )
+		return;
+
+	grainSize = max(grainSize, 1);
+	LONG numChunks = (count + grainSize - 1) / grainSize;
+
+	// Not worth waking anybody for a single chunk.
+	if( numChunks == 1 || mThreads.empty() )
+	{
+		func(context, 0, count);
+		return;
+	}
+
+	// The pool runs one job at a time.  If another thread has it (say a
+	// background loader while the main thread filters), do the work here
+	// rather than wait for that job to finish.
+	if( !TryEnterCriticalSection(&mLock) )
+	{
+		func(context, 0, count);
+		return;
+	}
+
+	// The job fields are only written while the job is closed and no worker
+	// is between checking mJobOpen and finishing its chunks.
+	mFunc       = func;
+	mContext    = context;
+	mCount      = count;
+	mGrainSize  = grainSize;
+	mNumChunks  = numChunks;
+	mNextChunk  = 0;
+	mChunksLeft = numChunks;
+	InterlockedExchange(&mJobOpen, 1);
+
+	LONG numWake = min((LONG)mThreads.size(), numChunks - 1);
+	ReleaseSemaphore(mWake, numWake, 0);
+
+	runChunks();
+	WaitForSingleObject(mDone, INFINITE);
+
+	// Close the job and wait for stragglers that saw it open to leave, so
+	// the next job can safely overwrite the fields.  Workers that wake up
+	// later find the job closed and go back to sleep.
+	InterlockedExchange(&mJobOpen, 0);
+	while( mActiveWorkers != 0 )
+		Sleep(0);
+
+	LeaveCriticalSection(&mLock);
+}
+
+void JobSystem::run(int count, int grainSize, RangeFunc func, void* context)
+{
+	if( gJobSystem )
+		gJobSystem->parallelFor(count, grainSize, func, context);
+	else if( count > 0 )
+		func(context, 0, count);
+}
+
+void JobSystem::runChunks()
+{
+	for(;;)
+	{
+		LONG chunk = InterlockedIncrement(&mNextChunk) - 1;
+		if( chunk >= mNumChunks )
+			break;
+
+		int begin = chunk * mGrainSize;
+		int end   = min(begin + mGrainSize, mCount);
+		mFunc(mContext, begin, end);
+
+		if( InterlockedDecrement(&mChunksLeft) == 0 )
+			SetEvent(mDone);
+	}
+}
+
+unsigned __stdcall JobSystem::workerMain(void* param)
+{
+	JobSystem* js = (JobSystem*)param;
+
+	for(;;)
+	{
+		WaitForSingleObject(js->mWake, INFINITE);
+		if( js->mQuit )
+			break;
+
+		InterlockedIncrement(&js->mActiveWorkers);
+		if( js->mJobOpen )
+			js->runChunks();
+		InterlockedDecrement(&js->mActiveWorkers);
+	}
+
+	return 0;
+}
@@ -0,0 +1,74 @@
+//=============================================================================
+// JobSystem.h.
+//
+// A small pool of Win32 worker threads for splitting CPU work (heightmap
+// filtering, sub-grid builds, ...) across the cores.  parallelFor() cuts a
+// range of items into chunks; the workers and the calling thread pull
+// chunks until the range is done, and the call returns once every chunk
+// has finished.  Nothing here touches the device, so job bodies must not
+// either.
+//
+// parallelFor() may be called from any thread.  Only one job runs on the
+// workers at a time; a call made while another thread's job is running
+// does its work on the calling thread alone.
+//
+// Code that has no job system available (gJobSystem is null) should just
+// run the work on the calling thread.
+//=============================================================================
+
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <windows.h>
+#include <vector>
+
+class JobSystem
+{
+public:
+	// Processes the items [begin, end).
+	typedef void (*RangeFunc)(void* context, int begin, int end);
+
+	// numWorkers < 0 creates one worker per core, less one for the caller.
+	explicit JobSystem(int numWorkers = -1);
+	~JobSystem();
+
+	// Worker threads plus the calling thread.
+	int numThreads()const;
+
+	// Calls func on chunks of at most grainSize items covering [0, count).
+	// Blocks until all of them are done.
+	void parallelFor(int count, int grainSize, RangeFunc func, void* context);
+
+	// Runs func over [0, count) on gJobSystem if there is one, or on the
+	// calling thread otherwise.
+	static void run(int count, int grainSize, RangeFunc func, void* context);
+
+private:
+	// Make private to prevent copying of members of this class.
+	JobSystem(const JobSystem& rhs);
+	JobSystem& operator=(const JobSystem& rhs);
+
+	static unsigned __stdcall workerMain(void* param);
+	void runChunks();
+
+private:
+	std::vector<HANDLE> mThreads;
+	HANDLE mWake;        // Semaphore released once per worker per job.
+	HANDLE mDone;        // Set when the last chunk of a job finishes.
+	CRITICAL_SECTION mLock; // Held by the thread whose job is running.
+
+	volatile LONG mQuit;
+	volatile LONG mJobOpen;       // Job fields below may be read.
+	volatile LONG mActiveWorkers; // Workers that may be reading them.
+
+	RangeFunc mFunc;
+	void*     mContext;
+	int       mCount;
+	int       mGrainSize;
+	LONG      mNumChunks;
+	volatile LONG mNextChunk;
+	volatile LONG mChunksLeft;
+};
+extern JobSystem* gJobSystem;
+
+#endif // JOB_SYSTEM_H
@@ -0,0 +1,439 @@
+//=============================================================================
+// OcclusionCuller.cpp.
+//=============================================================================
+
+#include "OcclusionCuller.h"
+#include "JobSystem.h"
+#include <fstream>
+#include <cmath>
+#include <cfloat>
+#include <emmintrin.h>
+using namespace std;
+
+namespace
+{
+	// Rows per rasterization job.
+	const int BAND_ROWS = 8;
+
+	// Projects a clip space point to pixel coordinates and z/w.
+	D3DXVECTOR3 ToScreen(const D3DXVECTOR4& p, int width, int height)
+	{
+		float invW = 1.0f / p.w;
+		return D3DXVECTOR3(( p.x*invW*0.5f + 0.5f) * width,
+						   (-p.y*invW*0.5f + 0.5f) * height,
+						   p.z*invW);
+	}
+}
+
+OcclusionCuller::OcclusionCuller(int width, int height)
+: mWidth(width & ~3), mHeight(height), mTestBoxes(0), mTestResults(0)
+{
+	mDepth.resize(mWidth*mHeight, 1.0f);
+	D3DXMatrixIdentity(&mViewProj);
+	ZeroMemory(&mStats, sizeof(mStats));
+}
+
+void OcclusionCuller::clearOccluders()
+{
+	mVerts.clear();
+	mIndices.clear();
+}
+
+void OcclusionCuller::addOccluder(const D3DXVECTOR3* verts, UINT numVerts, const DWORD* indices, UINT numTris)
+{
+	DWORD base = (DWORD)mVerts.size();
+	mVerts.insert(mVerts.end(), verts, verts + numVerts);
+	for(UINT i = 0; i < 3*numTris; ++i)
+		mIndices.push_back(base + indices[i]);
+}
+
+void OcclusionCuller::addBoxOccluder(const AABB& box)
+{
+	D3DXVECTOR3 v[8];
+	for(int i = 0; i < 8; ++i)
+	{
+		v[i].x = (i & 1) ? box.maxPt.x : box.minPt.x;
+		v[i].y = (i & 2) ? box.maxPt.y : box.minPt.y;
+		v[i].z = (i & 4) ? box.maxPt.z : box.minPt.z;
+	}
+
+	// Occluders are drawn from both sides, so the winding doesn't matter.
+	const DWORD k[36] =
+	{
+		0, 1, 3,  0, 3, 2, // -z
+		4, 5, 7,  4, 7, 6, // +z
+		0, 1, 5,  0, 5, 4, // -y
+		2, 3, 7,  2, 7, 6, // +y
+		0, 2, 6,  0, 6, 4, // -x
+		1, 3, 7,  1, 7, 5  // +x
+	};
+	addOccluder(v, 8, k, 12);
+}
+
+void OcclusionCuller::addHeightmapOccluder(const Heightmap& heightmap, float dx, float dz,
+										   const D3DXVECTOR3& center, int step)
+{
+	int m = heightmap.numRows();
+	int n = heightmap.numCols();
+	step = max(step, 1);
+
+	// The heightmap rows and columns the occluder keeps: every step'th,
+	// and the last.
+	vector<int> rows;
+	vector<int> cols;
+	for(int i = 0; i < m-1; i += step) rows.push_back(i);
+	for(int j = 0; j < n-1; j += step) cols.push_back(j);
+	rows.push_back(m-1);
+	cols.push_back(n-1);
+
+	int numRows = (int)rows.size();
+	int numCols = (int)cols.size();
+	float x0 = center.x - 0.5f*(n-1)*dx;
+	float z0 = center.z + 0.5f*(m-1)*dz;
+
+	// Each vertex takes the lowest height of the cells around it.  Every
+	// corner of an occluder cell is then at or below all the terrain in
+	// that cell, and so is the flat triangle between them.
+	vector<D3DXVECTOR3> verts(numRows*numCols);
+	for(int r = 0; r < numRows; ++r)
+	{
+		int r0 = rows[max(r-1, 0)];
+		int r1 = rows[min(r+1, numRows-1)];
+		for(int c = 0; c < numCols; ++c)
+		{
+			int c0 = cols[max(c-1, 0)];
+			int c1 = cols[min(c+1, numCols-1)];
+			Heightmap::HeightRange range = heightmap.minMaxRegion(r0, c0, r1, c1);
+			verts[r*numCols + c] = D3DXVECTOR3(x0 + cols[c]*dx, range.minH, z0 - rows[r]*dz);
+		}
+	}
+
+	vector<DWORD> indices;
+	indices.reserve((numRows-1)*(numCols-1)*6);
+	for(int r = 0; r < numRows-1; ++r)
+	{
+		for(int c = 0; c < numCols-1; ++c)
+		{
+			DWORD a = r*numCols + c;
+			DWORD b = a + 1;
+			DWORD d = a + numCols;
+			indices.push_back(a); indices.push_back(b); indices.push_back(d);
+			indices.push_back(d); indices.push_back(b); indices.push_back(d + 1);
+		}
+	}
+
+	addOccluder(&verts[0], (UINT)verts.size(), &indices[0], (UINT)indices.size() / 3);
+}
+
+void OcclusionCuller::render(const D3DXMATRIX& viewProj)
+{
+	__int64 cntsPerSec = 0;
+	__int64 startCnts  = 0;
+	__int64 endCnts    = 0;
+	QueryPerformanceFrequency((LARGE_INTEGER*)&cntsPerSec);
+	QueryPerformanceCounter((LARGE_INTEGER*)&startCnts);
+
+	mViewProj = viewProj;
+
+	UINT numTris = (UINT)mIndices.size() / 3;
+	mClipVerts.resize(mVerts.size());
+	mTris.resize(2*numTris);
+	mTriCounts.resize(numTris);
+
+	if( !mVerts.empty() )
+		JobSystem::run((int)mVerts.size(), 1024, transformVerts, this);
+	if( numTris > 0 )
+		JobSystem::run((int)numTris, 256, setupTriangles, this);
+
+	// The bands clear their own rows, so this runs even with no occluders.
+	JobSystem::run((mHeight + BAND_ROWS-1) / BAND_ROWS, 1, rasterizeBands, this);
+
+	ZeroMemory(&mStats, sizeof(mStats));
+	for(UINT t = 0; t < numTris; ++t)
+		mStats.numTriangles += mTriCounts[t];
+
+	QueryPerformanceCounter((LARGE_INTEGER*)&endCnts);
+	mStats.renderMs = (float)((endCnts - startCnts) * 1000.0 / (double)cntsPerSec);
+}
+
+void OcclusionCuller::transformVerts(void* context, int begin, int end)
+{
+	OcclusionCuller& c = *(OcclusionCuller*)context;
+	for(int i = begin; i < end; ++i)
+		D3DXVec3Transform(&c.mClipVerts[i], &c.mVerts[i], &c.mViewProj);
+}
+
+void OcclusionCuller::setupTriangles(void* context, int begin, int end)
+{
+	OcclusionCuller& c = *(OcclusionCuller*)context;
+	for(int t = begin; t < end; ++t)
+	{
+		D3DXVECTOR4 clip[3];
+		clip[0] = c.mClipVerts[c.mIndices[3*t]];
+		clip[1] = c.mClipVerts[c.mIndices[3*t+1]];
+		clip[2] = c.mClipVerts[c.mIndices[3*t+2]];
+		c.setupTriangle(clip, &c.mTris[2*t], c.mTriCounts[t]);
+	}
+}
+
+void OcclusionCuller::setupTriangle(const D3DXVECTOR4* clip, Triangle* out, int& count)const
+{
+	count = 0;
+
+	// Drop triangles wholly outside a side of the frustum.
+	bool outside[5] = {true, true, true, true, true};
+	for(int i = 0; i < 3; ++i)
+	{
+		const D3DXVECTOR4& p = clip[i];
+		outside[0] = outside[0] && p.x < -p.w;
+		outside[1] = outside[1] && p.x >  p.w;
+		outside[2] = outside[2] && p.y < -p.w;
+		outside[3] = outside[3] && p.y >  p.w;
+		outside[4] = outside[4] && p.z >  p.w;
+	}
+	for(int i = 0; i < 5; ++i)
+		if( outside[i] )
+			return;
+
+	// Clip against the near plane (z >= 0), which leaves up to four
+	// vertices.
+	D3DXVECTOR4 poly[4];
+	int numPoly = 0;
+	for(int i = 0; i < 3; ++i)
+	{
+		const D3DXVECTOR4& a = clip[i];
+		const D3DXVECTOR4& b = clip[(i+1) % 3];
+		if( a.z >= 0.0f )
+			poly[numPoly++] = a;
+		if( (a.z >= 0.0f) != (b.z >= 0.0f) )
+			poly[numPoly++] = a + (b - a)*(a.z / (a.z - b.z));
+	}
+
+	for(int k = 1; k + 1 < numPoly; ++k)
+	{
+		D3DXVECTOR3 v[3];
+		v[0] = ToScreen(poly[0],   mWidth, mHeight);
+		v[1] = ToScreen(poly[k],   mWidth, mHeight);
+		v[2] = ToScreen(poly[k+1], mWidth, mHeight);
+
+		float area = (v[1].x - v[0].x)*(v[2].y - v[0].y) - (v[2].x - v[0].x)*(v[1].y - v[0].y);
+		if( fabsf(area) < 1e-6f )
+			continue;
+
+		// Pixels whose centers fall in the triangle's bounds.  Clamp
+		// before converting, since the triangle can reach far off screen.
+		float minX = min(v[0].x, min(v[1].x, v[2].x)) - 0.5f;
+		float maxX = max(v[0].x, max(v[1].x, v[2].x)) - 0.5f;
+		float minY = min(v[0].y, min(v[1].y, v[2].y)) - 0.5f;
+		float maxY = max(v[0].y, max(v[1].y, v[2].y)) - 0.5f;
+		if( maxX < 0.0f || maxY < 0.0f || minX > mWidth-1 || minY > mHeight-1 )
+			continue;
+
+		Triangle& tri = out[count];
+		tri.minX = (int)ceilf(max(minX, 0.0f));
+		tri.minY = (int)ceilf(max(minY, 0.0f));
+		tri.maxX = (int)floorf(min(maxX, (float)(mWidth-1)));
+		tri.maxY = (int)floorf(min(maxY, (float)(mHeight-1)));
+		if( tri.minX > tri.maxX || tri.minY > tri.maxY )
+			continue;
+
+		// Edge i runs from v[i] to v[i+1], and is area at the vertex
+		// opposite, so dividing the sign of area out makes inside positive.
+		float sign = area > 0.0f ? 1.0f : -1.0f;
+		for(int i = 0; i < 3; ++i)
+		{
+			const D3DXVECTOR3& a = v[i];
+			const D3DXVECTOR3& b = v[(i+1) % 3];
+			tri.edgeA[i] = sign*(a.y - b.y);
+			tri.edgeB[i] = sign*(b.x - a.x);
+			tri.edgeC[i] = sign*(a.x*b.y - b.x*a.y);
+		}
+
+		// z/w is linear in screen space.  Moving from the center to the
+		// farthest corner of a pixel adds half of each gradient.
+		float dz1 = v[1].z - v[0].z;
+		float dz2 = v[2].z - v[0].z;
+		tri.zA = (dz1*(v[2].y - v[0].y) - dz2*(v[1].y - v[0].y)) / area;
+		tri.zB = (dz2*(v[1].x - v[0].x) - dz1*(v[2].x - v[0].x)) / area;
+		tri.zC = v[0].z - tri.zA*v[0].x - tri.zB*v[0].y + 0.5f*(fabsf(tri.zA) + fabsf(tri.zB));
+
+		++count;
+	}
+}
+
+void OcclusionCuller::rasterizeBands(void* context, int begin, int end)
+{
+	OcclusionCuller& c = *(OcclusionCuller*)context;
+	const int W = c.mWidth;
+
+	const __m128 zero    = _mm_setzero_ps();
+	const __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+	const __m128 four    = _mm_set1_ps(4.0f);
+
+	for(int band = begin; band < end; ++band)
+	{
+		int y0 = band*BAND_ROWS;
+		int y1 = min(y0 + BAND_ROWS, c.mHeight) - 1;
+
+		float* depth = &c.mDepth[0];
+		for(int i = y0*W; i < (y1+1)*W; ++i)
+			depth[i] = 1.0f;
+
+		for(size_t t = 0; t < c.mTriCounts.size(); ++t)
+		{
+			for(int k = 0; k < c.mTriCounts[t]; ++k)
+			{
+				const Triangle& tri = c.mTris[2*t + k];
+				int rowBegin = max(tri.minY, y0);
+				int rowEnd   = min(tri.maxY, y1);
+				if( rowBegin > rowEnd )
+					continue;
+
+				__m128 eA0 = _mm_set1_ps(tri.edgeA[0]);
+				__m128 eA1 = _mm_set1_ps(tri.edgeA[1]);
+				__m128 eA2 = _mm_set1_ps(tri.edgeA[2]);
+				__m128 zA  = _mm_set1_ps(tri.zA);
+
+				// Groups of four pixels start at multiples of four, so
+				// they never run past the end of a row.
+				int xBegin = tri.minX & ~3;
+				for(int y = rowBegin; y <= rowEnd; ++y)
+				{
+					float py = y + 0.5f;
+					__m128 rowE0 = _mm_set1_ps(tri.edgeB[0]*py + tri.edgeC[0]);
+					__m128 rowE1 = _mm_set1_ps(tri.edgeB[1]*py + tri.edgeC[1]);
+					__m128 rowE2 = _mm_set1_ps(tri.edgeB[2]*py + tri.edgeC[2]);
+					__m128 rowZ  = _mm_set1_ps(tri.zB*py + tri.zC);
+
+					float* row = depth + y*W;
+					__m128 px = _mm_add_ps(_mm_set1_ps((float)xBegin), offsets);
+					for(int x = xBegin; x <= tri.maxX; x += 4)
+					{
+						__m128 e0 = _mm_add_ps(_mm_mul_ps(eA0, px), rowE0);
+						__m128 e1 = _mm_add_ps(_mm_mul_ps(eA1, px), rowE1);
+						__m128 e2 = _mm_add_ps(_mm_mul_ps(eA2, px), rowE2);
+						__m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero),
+							_mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+
+						if( _mm_movemask_ps(inside) )
+						{
+							__m128 z = _mm_add_ps(_mm_mul_ps(zA, px), rowZ);
+							__m128 d = _mm_loadu_ps(row + x);
+							__m128 nearer = _mm_min_ps(d, z);
+							_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, d)));
+						}
+						px = _mm_add_ps(px, four);
+					}
+				}
+			}
+		}
+	}
+}
+
+bool OcclusionCuller::isVisible(const AABB& box)const
+{
+	// The box's screen rectangle and nearest depth.
+	float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+	float minZ = FLT_MAX;
+	for(int i = 0; i < 8; ++i)
+	{
+		D3DXVECTOR3 corner((i & 1) ? box.maxPt.x : box.minPt.x,
+						   (i & 2) ? box.maxPt.y : box.minPt.y,
+						   (i & 4) ? box.maxPt.z : box.minPt.z);
+		D3DXVECTOR4 p;
+		D3DXVec3Transform(&p, &corner, &mViewProj);
+
+		// Reaches in front of the near plane.
+		if( p.z < 0.0f || p.w <= 0.0f )
+			return true;
+
+		D3DXVECTOR3 s = ToScreen(p, mWidth, mHeight);
+		minX = min(minX, s.x); maxX = max(maxX, s.x);
+		minY = min(minY, s.y); maxY = max(maxY, s.y);
+		minZ = min(minZ, s.z);
+	}
+
+	if( maxX < 0.0f || maxY < 0.0f || minX >= (float)mWidth || minY >= (float)mHeight )
+		return true;
+
+	// Every pixel the rectangle touches.
+	int x0 = (int)max(minX, 0.0f);
+	int y0 = (int)max(minY, 0.0f);
+	int x1 = (int)min(maxX, (float)(mWidth-1));
+	int y1 = (int)min(maxY, (float)(mHeight-1));
+
+	// Visible if any of them has nothing nearer than the box.
+	const __m128  nearest = _mm_set1_ps(minZ);
+	const __m128i first   = _mm_set1_epi32(x0 - 1);
+	const __m128i last    = _mm_set1_epi32(x1 + 1);
+	for(int y = y0; y <= y1; ++y)
+	{
+		const float* row = &mDepth[y*mWidth];
+		for(int x = x0 & ~3; x <= x1; x += 4)
+		{
+			__m128i index = _mm_add_epi32(_mm_set1_epi32(x), _mm_set_epi32(3, 2, 1, 0));
+			__m128i inRect = _mm_and_si128(_mm_cmpgt_epi32(index, first), _mm_cmplt_epi32(index, last));
+			__m128 behind  = _mm_cmpge_ps(_mm_loadu_ps(row + x), nearest);
+			if( _mm_movemask_ps(_mm_and_ps(behind, _mm_castsi128_ps(inRect))) )
+				return true;
+		}
+	}
+	return false;
+}
+
+void OcclusionCuller::testBoxes(const AABB* boxes, UINT n, bool* visible)
+{
+	mTestBoxes   = boxes;
+	mTestResults = visible;
+	JobSystem::run((int)n, 16, testBoxRange, this);
+
+	mStats.boxesTested += n;
+	for(UINT i = 0; i < n; ++i)
+		if( !visible[i] )
+			++mStats.boxesOccluded;
+}
+
+void OcclusionCuller::testBoxRange(void* context, int begin, int end)
+{
+	OcclusionCuller& c = *(OcclusionCuller*)context;
+	for(int i = begin; i < end; ++i)
+		c.mTestResults[i] = c.isVisible(c.mTestBoxes[i]);
+}
+
+int OcclusionCuller::getWidth()const
+{
+	return mWidth;
+}
+
+int OcclusionCuller::getHeight()const
+{
+	return mHeight;
+}
+
+const float* OcclusionCuller::getDepthBuffer()const
+{
+	return &mDepth[0];
+}
+
+bool OcclusionCuller::saveDepthImage(const std::string& filename)const
+{
+	ofstream outFile(filename.c_str(), ios_base::binary | ios_base::trunc);
+	if( !outFile )
+		return false;
+
+	outFile << "P5\n" << mWidth << " " << mHeight << "\n65535\n";
+	for(size_t i = 0; i < mDepth.size(); ++i)
+	{
+		// PGM samples are big-endian.
+		float d = min(max(mDepth[i], 0.0f), 1.0f);
+		WORD v = (WORD)(d*65535.0f + 0.5f);
+		outFile.put((char)(v >> 8));
+		outFile.put((char)(v & 0xff));
+	}
+	return !outFile.fail();
+}
+
+const OcclusionCuller::Stats& OcclusionCuller::getStats()const
+{
+	return mStats;
+}
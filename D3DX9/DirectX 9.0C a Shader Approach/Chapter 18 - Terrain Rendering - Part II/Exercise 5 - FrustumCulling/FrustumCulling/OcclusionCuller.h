@@ -0,0 +1,131 @@
+//=============================================================================
+// OcclusionCuller.h.
+//
+// Occlusion culling on the CPU.  A few large occluders (a coarse copy of
+// the terrain, the big faces of the castle) are rasterized into a small
+// depth buffer, and then each object's world space box is projected to
+// the screen and checked against it: if the occluders are in front of the
+// box's nearest point everywhere its screen rectangle covers, the object
+// can't be seen and need not be drawn.
+//
+// Occluders must be opaque and must not stick out of what they stand for,
+// or they would hide things that are really visible.  The terrain occluder
+// is built under the terrain surface for that reason (see
+// addHeightmapOccluder), and each pixel keeps the farthest depth the
+// occluder reaches inside it rather than the depth at its center.
+// Coverage is still decided at pixel centers, so an object seen only
+// through a gap thinner than a pixel at an occluder's edge can be culled.
+//
+// render() transforms and sets up the triangles with the job system and
+// then rasterizes bands of rows in parallel, four pixels at a time with
+// SSE.  Boxes are tested the same way.  Nothing touches the device, so the
+// depth buffer can be rendered and checked headless.
+//=============================================================================
+
+#ifndef OCCLUSION_CULLER_H
+#define OCCLUSION_CULLER_H
+
+#include "d3dUtil.h"
+#include "Heightmap.h"
+#include <string>
+#include <vector>
+
+class OcclusionCuller
+{
+public:
+	struct Stats
+	{
+		UINT  numTriangles;  // Occluder triangles rasterized by render().
+		UINT  boxesTested;   // By testBoxes, since the last render().
+		UINT  boxesOccluded;
+		float renderMs;
+	};
+
+	// width must be a multiple of 4.
+	OcclusionCuller(int width = 256, int height = 192);
+
+	// Occluders are in world space and stay until clearOccluders.
+	void clearOccluders();
+	void addOccluder(const D3DXVECTOR3* verts, UINT numVerts, const DWORD* indices, UINT numTris);
+
+	// Only for boxes that are solid all the way through.
+	void addBoxOccluder(const AABB& box);
+
+	// A terrain over the heightmap (laid out like Terrain's, with cells dx
+	// by dz and centered on center), at one vertex in step.  Each occluder
+	// vertex takes the lowest height of the cells around it, so the
+	// occluder lies under the terrain everywhere.
+	void addHeightmapOccluder(const Heightmap& heightmap, float dx, float dz,
+		const D3DXVECTOR3& center, int step);
+
+	// Rasterizes the occluders as seen through viewProj.
+	void render(const D3DXMATRIX& viewProj);
+
+	// Whether any of the box could be seen past the occluders of the last
+	// render().  Boxes reaching behind the near plane or wholly off the
+	// screen count as visible; frustum culling deals with those.  A box
+	// partly off the screen is tested on the pixels it covers on screen.
+	// Safe to call from several threads at once.
+	bool isVisible(const AABB& box)const;
+
+	// isVisible for n boxes, spread over the job system.
+	void testBoxes(const AABB* boxes, UINT n, bool* visible);
+
+	int getWidth()const;
+	int getHeight()const;
+
+	// Row-major depths in [0, 1] (z/w), 1 where there is no occluder.
+	const float* getDepthBuffer()const;
+
+	// Writes the depth buffer as a 16-bit binary PGM, for looking at or
+	// comparing against a known good image.
+	bool saveDepthImage(const std::string& filename)const;
+
+	const Stats& getStats()const;
+
+private:
+	// Make private to prevent copying of members of this class.
+	OcclusionCuller(const OcclusionCuller& rhs);
+	OcclusionCuller& operator=(const OcclusionCuller& rhs);
+
+	// A screen space triangle ready to rasterize.  The edge functions are
+	// positive inside, and depth = zA*x + zB*y + zC, pushed back to the
+	// farthest depth inside each pixel.
+	struct Triangle
+	{
+		int   minX, minY, maxX, maxY; // Pixel bounds, inclusive.
+		float edgeA[3], edgeB[3], edgeC[3];
+		float zA, zB, zC;
+	};
+
+	void setupTriangle(const D3DXVECTOR4* clip, Triangle* out, int& count)const;
+
+	static void transformVerts(void* context, int begin, int end);
+	static void setupTriangles(void* context, int begin, int end);
+	static void rasterizeBands(void* context, int begin, int end);
+	static void testBoxRange(void* context, int begin, int end);
+
+private:
+	int mWidth;
+	int mHeight;
+	std::vector<float> mDepth;
+
+	std::vector<D3DXVECTOR3> mVerts;
+	std::vector<DWORD>       mIndices;
+
+	// Per render() scratch.  Clipping against the near plane can turn a
+	// triangle into two, so each has two slots; mTriCounts says how many
+	// it filled.
+	D3DXMATRIX mViewProj;
+	std::vector<D3DXVECTOR4> mClipVerts;
+	std::vector<Triangle>    mTris;
+	std::vector<int>         mTriCounts;
+
+	// testBoxes arguments, for the jobs.
+	const AABB* mTestBoxes;
+	bool*       mTestResults;
+
+	Stats mStats;
+};
+
+#endif // OCCLUSION_CULLER_H
@@ -0,0 +1,448 @@
+//=============================================================================
+// PagedHeightmap.cpp.
+//=============================================================================
+
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include "PagedHeightmap.h"
+using namespace std;
+
+namespace
+{
+	const DWORD TILE_FILE_VERSION = 2;
+
+	// Same neighbourhood average as Heightmap::sampleHeight3x3, evaluated on
+	// a band of rows.  band holds the rows of an m x n map starting at
+	// bandRow0; (i, j) are map coordinates.
+	float sampleBand3x3(const vector<float>& band, int bandRow0,
+		int m, int n, int i, int j)
+	{
+		float avg = 0.0f;
+		float num = 0.0f;
+
+		for(int r = i-1; r <= i+1; ++r)
+		{
+			for(int c = j-1; c <= j+1; ++c)
+			{
+				if( r >= 0 && r < m && c >= 0 && c < n )
+				{
+					avg += band[(r - bandRow0) * n + c];
+					num += 1.0f;
+				}
+			}
+		}
+
+		return avg / num;
+	}
+}
+
+PagedHeightmap::PagedHeightmap()
+: mFile(INVALID_HANDLE_VALUE), mMapping(0), mTileShift(0), mMaxResidentTiles(0), mGranularity(0),
+  mLRUHead(-1), mLRUTail(-1), mLastTile(-1), mLastData(0), mTotalLoadMs(0.0)
+{
+	memset(&mHeader, 0, sizeof(mHeader));
+	memset(&mStats, 0, sizeof(mStats));
+}
+
+PagedHeightmap::~PagedHeightmap()
+{
+	close();
+}
+
+DWORD PagedHeightmap::allocationGranularity()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwAllocationGranularity;
+}
+
+void PagedHeightmap::convertRAW(int m, int n, const string& rawFilename,
+	float heightScale, float heightOffset, int tileSize, const string& tiledFilename)
+{
+	// Tile coordinates are found by shifting, so insist on a power of two.
+	if( tileSize <= 0 || (tileSize & (tileSize-1)) != 0 ) HR(E_INVALIDARG);
+
+	ifstream inFile;
+	inFile.open(rawFilename.c_str(), ios_base::binary);
+	if(!inFile) HR(E_FAIL);
+
+	ofstream outFile;
+	outFile.open(tiledFilename.c_str(), ios_base::binary | ios_base::trunc);
+	if(!outFile) HR(E_FAIL);
+
+	DWORD tileBytes = tileSize * tileSize * sizeof(float);
+
+	TileFileHeader header;
+	memcpy(header.magic, "HTIL", 4);
+	header.version     = TILE_FILE_VERSION;
+	header.rows        = m;
+	header.cols        = n;
+	header.tileSize    = tileSize;
+	header.tileRows    = (m + tileSize - 1) / tileSize;
+	header.tileCols    = (n + tileSize - 1) / tileSize;
+	header.headerBytes = sizeof(TileFileHeader);
+	header.tileBytes   = tileBytes;
+	outFile.write((const char*)&header, sizeof(header));
+
+	// A band is one row of tiles plus a row of filter support above and
+	// below it.
+	vector<unsigned char> rawRow(n);
+	vector<float> band((tileSize + 2) * n);
+	vector<float> tile(tileSize * tileSize);
+
+	for(DWORD tr = 0; tr < header.tileRows; ++tr)
+	{
+		int firstRow = tr * tileSize;
+		int lastRow  = min(firstRow + tileSize, m) - 1;
+
+		// Read and scale the band, including the filter support rows.
+		int bandRow0 = max(firstRow - 1, 0);
+		int bandRow1 = min(lastRow + 1, m - 1);
+		inFile.seekg((streamoff)bandRow0 * n, ios_base::beg);
+		for(int i = bandRow0; i <= bandRow1; ++i)
+		{
+			inFile.read((char*)&rawRow[0], (streamsize)n);
+			if(!inFile) HR(E_FAIL);
+
+			float* dst = &band[(i - bandRow0) * n];
+			for(int j = 0; j < n; ++j)
+				dst[j] = (float)rawRow[j] * heightScale + heightOffset;
+		}
+
+		// Filter each tile in the band and write it out.  Samples past the
+		// edge of the map repeat the last row/column.
+		for(DWORD tc = 0; tc < header.tileCols; ++tc)
+		{
+			int firstCol = tc * tileSize;
+			for(int r = 0; r < tileSize; ++r)
+			{
+				int i = min(firstRow + r, lastRow);
+				for(int c = 0; c < tileSize; ++c)
+				{
+					int j = min(firstCol + c, n - 1);
+					tile[r * tileSize + c] = sampleBand3x3(band, bandRow0, m, n, i, j);
+				}
+			}
+
+			outFile.write((const char*)&tile[0], tileBytes);
+		}
+	}
+
+	inFile.close();
+	outFile.close();
+	if(!outFile) HR(E_FAIL);
+}
+
+void PagedHeightmap::open(const string& filename, int maxResidentTiles)
+{
+	close();
+
+	mFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, 0);
+	if( mFile == INVALID_HANDLE_VALUE ) HR(E_FAIL);
+
+	DWORD bytesRead = 0;
+	if( !ReadFile(mFile, &mHeader, sizeof(mHeader), &bytesRead, 0) ||
+		bytesRead != sizeof(mHeader) ||
+		memcmp(mHeader.magic, "HTIL", 4) != 0 ||
+		mHeader.version != TILE_FILE_VERSION ||
+		mHeader.headerBytes < sizeof(mHeader) ||
+		mHeader.tileBytes != mHeader.tileSize * mHeader.tileSize * sizeof(float) )
+	{
+		close();
+		HR(E_FAIL);
+	}
+
+	mMapping = CreateFileMappingA(mFile, 0, PAGE_READONLY, 0, 0, 0);
+	if( mMapping == 0 )
+	{
+		close();
+		HR(E_FAIL);
+	}
+
+	mTileShift = 0;
+	while( (1u << mTileShift) < mHeader.tileSize )
+		++mTileShift;
+
+	Tile empty = {0, 0, -1, -1};
+	mTiles.assign(mHeader.tileRows * mHeader.tileCols, empty);
+	mMaxResidentTiles = max(maxResidentTiles, 1);
+	mGranularity      = allocationGranularity();
+
+	resetStats();
+}
+
+void PagedHeightmap::close()
+{
+	while( mLRUHead != -1 )
+		evictTile(mLRUHead);
+	mTiles.clear();
+
+	if( mMapping )
+	{
+		CloseHandle(mMapping);
+		mMapping = 0;
+	}
+	if( mFile != INVALID_HANDLE_VALUE )
+	{
+		CloseHandle(mFile);
+		mFile = INVALID_HANDLE_VALUE;
+	}
+
+	mLastTile = -1;
+	mLastData = 0;
+}
+
+int PagedHeightmap::numRows()const
+{
+	return mHeader.rows;
+}
+
+int PagedHeightmap::numCols()const
+{
+	return mHeader.cols;
+}
+
+int PagedHeightmap::tileSize()const
+{
+	return mHeader.tileSize;
+}
+
+float PagedHeightmap::operator()(int i, int j)
+{
+	int mask = mHeader.tileSize - 1;
+	int tile = (i >> mTileShift) * mHeader.tileCols + (j >> mTileShift);
+
+	const float* data = tile == mLastTile ? mLastData : acquireTile(tile);
+	return data[((i & mask) << mTileShift) + (j & mask)];
+}
+
+float PagedHeightmap::sampleHeight(float row, float col)
+{
+	row = min(max(row, 0.0f), (float)(mHeader.rows-1));
+	col = min(max(col, 0.0f), (float)(mHeader.cols-1));
+
+	// The last row/column of vertices belongs to the cell before it.
+	int i = min((int)floorf(row), (int)mHeader.rows-2);
+	int j = min((int)floorf(col), (int)mHeader.cols-2);
+	float s = col - (float)j;
+	float t = row - (float)i;
+
+	// A*--*B
+	//  | /|
+	//  |/ |
+	// C*--*D
+	float A = (*this)(i,   j);
+	float B = (*this)(i,   j+1);
+	float C = (*this)(i+1, j);
+	float D = (*this)(i+1, j+1);
+
+	if( t < 1.0f - s )
+		return A + s*(B - A) + t*(C - A);
+	else
+		return D + (1.0f-s)*(C - D) + (1.0f-t)*(B - D);
+}
+
+void PagedHeightmap::copyRegion(const RECT& R, Table<float>& out)
+{
+	int rows = R.bottom - R.top + 1;
+	int cols = R.right - R.left + 1;
+	out.resize(rows, cols);
+
+	int tileSize = mHeader.tileSize;
+	int mask     = tileSize - 1;
+
+	// Copy one tile-sized run at a time so each tile is looked up once per
+	// row rather than once per sample.
+	for(int i = R.top; i <= R.bottom; ++i)
+	{
+		int j = R.left;
+		while( j <= R.right )
+		{
+			int tile = (i >> mTileShift) * mHeader.tileCols + (j >> mTileShift);
+			const float* src = acquireTile(tile) + ((i & mask) << mTileShift);
+
+			int runEnd = min((int)R.right, (j | mask));
+			for(; j <= runEnd; ++j)
+				out(i - R.top, j - R.left) = src[j & mask];
+		}
+	}
+}
+
+int PagedHeightmap::maxUpdateRadius()const
+{
+	int radius = 0;
+	while( (2*radius+3)*(2*radius+3) <= mMaxResidentTiles )
+		++radius;
+	return radius;
+}
+
+void PagedHeightmap::update(int i, int j, int radius)
+{
+	int maxRadius = maxUpdateRadius();
+	if( radius > maxRadius )
+	{
+		radius = maxRadius;
+		++mStats.radiusClamps;
+	}
+
+	int ti = i >> mTileShift;
+	int tj = j >> mTileShift;
+
+	// Evict first so the prefetch below does not push out tiles it is
+	// about to ask for.
+	int tile = mLRUHead;
+	while( tile != -1 )
+	{
+		int next = mTiles[tile].next;
+		int r = tile / mHeader.tileCols;
+		int c = tile % mHeader.tileCols;
+		if( abs(r - ti) > radius + 1 || abs(c - tj) > radius + 1 )
+			evictTile(tile);
+		tile = next;
+	}
+
+	int r0 = max(ti - radius, 0);
+	int r1 = min(ti + radius, (int)mHeader.tileRows - 1);
+	int c0 = max(tj - radius, 0);
+	int c1 = min(tj + radius, (int)mHeader.tileCols - 1);
+	for(int r = r0; r <= r1; ++r)
+		for(int c = c0; c <= c1; ++c)
+			acquireTile(r * mHeader.tileCols + c);
+}
+
+const PagedHeightmap::Stats& PagedHeightmap::getStats()const
+{
+	return mStats;
+}
+
+void PagedHeightmap::resetStats()
+{
+	DWORD residentTiles = mStats.residentTiles;
+	DWORD residentBytes = mStats.residentBytes;
+	if( mTiles.empty() )
+		residentTiles = residentBytes = 0;
+
+	memset(&mStats, 0, sizeof(mStats));
+	mStats.residentTiles = residentTiles;
+	mStats.residentBytes = residentBytes;
+	mTotalLoadMs = 0.0;
+}
+
+const float* PagedHeightmap::acquireTile(int tile)
+{
+	Tile& t = mTiles[tile];
+	if( t.data )
+	{
+		++mStats.cacheHits;
+		if( mLRUHead != tile )
+		{
+			lruUnlink(tile);
+			lruPushFront(tile);
+		}
+	}
+	else
+	{
+		++mStats.cacheMisses;
+		if( (int)mStats.residentTiles >= mMaxResidentTiles )
+			evictTile(mLRUTail);
+		loadTile(tile);
+	}
+
+	mLastTile = tile;
+	mLastData = t.data;
+	return t.data;
+}
+
+void PagedHeightmap::loadTile(int tile)
+{
+	__int64 cntsPerSec = 0;
+	__int64 startCnts  = 0;
+	__int64 endCnts    = 0;
+	QueryPerformanceFrequency((LARGE_INTEGER*)&cntsPerSec);
+	QueryPerformanceCounter((LARGE_INTEGER*)&startCnts);
+
+	unsigned __int64 viewOffset;
+	DWORD viewBytes, dataOffset;
+	tileView(tile, viewOffset, viewBytes, dataOffset);
+	const void* view = MapViewOfFile(mMapping, FILE_MAP_READ,
+		(DWORD)(viewOffset >> 32), (DWORD)(viewOffset & 0xffffffff), viewBytes);
+	if( view == 0 ) HR(E_FAIL);
+	const float* data = (const float*)((const char*)view + dataOffset);
+
+	// Touch every page now, so the page faults are paid for (and timed)
+	// here rather than scattered over the first frame that samples the tile.
+	volatile float sink = 0.0f;
+	DWORD numFloats = mHeader.tileSize * mHeader.tileSize;
+	for(DWORD k = 0; k < numFloats; k += 1024)
+		sink += data[k];
+
+	QueryPerformanceCounter((LARGE_INTEGER*)&endCnts);
+	float ms = (float)((endCnts - startCnts) * 1000.0 / (double)cntsPerSec);
+
+	mTiles[tile].view = view;
+	mTiles[tile].data = data;
+	lruPushFront(tile);
+
+	++mStats.tileLoads;
+	++mStats.residentTiles;
+	mStats.residentBytes += viewBytes;
+	mStats.lastLoadMs = ms;
+	mStats.maxLoadMs  = max(mStats.maxLoadMs, ms);
+	mTotalLoadMs     += ms;
+	mStats.avgLoadMs  = (float)(mTotalLoadMs / mStats.tileLoads);
+}
+
+void PagedHeightmap::evictTile(int tile)
+{
+	unsigned __int64 viewOffset;
+	DWORD viewBytes, dataOffset;
+	tileView(tile, viewOffset, viewBytes, dataOffset);
+
+	Tile& t = mTiles[tile];
+	UnmapViewOfFile(t.view);
+	t.view = 0;
+	t.data = 0;
+	lruUnlink(tile);
+
+	if( mLastTile == tile )
+	{
+		mLastTile = -1;
+		mLastData = 0;
+	}
+
+	++mStats.tileEvictions;
+	--mStats.residentTiles;
+	mStats.residentBytes -= viewBytes;
+}
+
+void PagedHeightmap::tileView(int tile, unsigned __int64& viewOffset,
+	DWORD& viewBytes, DWORD& dataOffset)const
+{
+	// Start the view on the granularity boundary at or below the tile.
+	unsigned __int64 offset = mHeader.headerBytes + (unsigned __int64)tile * mHeader.tileBytes;
+	viewOffset = offset / mGranularity * mGranularity;
+	dataOffset = (DWORD)(offset - viewOffset);
+	viewBytes  = dataOffset + mHeader.tileBytes;
+}
+
+void PagedHeightmap::lruUnlink(int tile)
+{
+	Tile& t = mTiles[tile];
+	if( t.prev != -1 ) mTiles[t.prev].next = t.next;
+	else               mLRUHead = t.next;
+	if( t.next != -1 ) mTiles[t.next].prev = t.prev;
+	else               mLRUTail = t.prev;
+	t.prev = t.next = -1;
+}
+
+void PagedHeightmap::lruPushFront(int tile)
+{
+	Tile& t = mTiles[tile];
+	t.prev = -1;
+	t.next = mLRUHead;
+	if( mLRUHead != -1 ) mTiles[mLRUHead].prev = tile;
+	mLRUHead = tile;
+	if( mLRUTail == -1 ) mLRUTail = tile;
+}
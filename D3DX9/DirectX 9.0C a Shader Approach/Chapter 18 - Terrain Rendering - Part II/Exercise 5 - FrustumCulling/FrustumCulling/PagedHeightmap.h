@@ -0,0 +1,137 @@
+//=============================================================================
+// PagedHeightmap.h.
+//
+// A heightmap kept on disk in a tiled format and paged into memory on
+// demand.  Tiles are memory mapped one at a time and held in an LRU cache,
+// so only the tiles near the camera take up address space and RAM; the
+// rest of the map stays in the file.  This lets us sample maps that are far
+// larger than memory through the same (i, j) interface as Heightmap.
+//
+// File layout: a TileFileHeader followed by the tiles, packed in row-major
+// tile order.  Each tile holds tileSize x tileSize floats (edge tiles are
+// padded by repeating their last row/column).  Views must start on the
+// system allocation granularity (64KB), which a packed tile usually
+// doesn't, so a tile's view starts at the granularity boundary below it
+// and the tile's data sits at an offset into the view.
+//=============================================================================
+
+#ifndef PAGED_HEIGHTMAP_H
+#define PAGED_HEIGHTMAP_H
+
+#include "d3dUtil.h"
+#include "Table.h"
+#include <string>
+#include <vector>
+
+class PagedHeightmap
+{
+public:
+	struct Stats
+	{
+		DWORD tileLoads;
+		DWORD tileEvictions;
+		DWORD cacheHits;
+		DWORD cacheMisses;
+		DWORD residentTiles;
+		DWORD residentBytes; // Mapped, including the lead-in to each tile.
+		DWORD radiusClamps;  // update() calls whose radius was too big.
+		float lastLoadMs;
+		float avgLoadMs;
+		float maxLoadMs;
+	};
+
+	PagedHeightmap();
+	~PagedHeightmap();
+
+	// Converts an 8-bit RAW heightmap to the tiled format, scaling and
+	// filtering the heights the same way Heightmap::loadRAW does.  The RAW
+	// file is streamed one band of tiles at a time, so the whole map is
+	// never in memory.  tileSize must be a power of two.
+	static void convertRAW(int m, int n, const std::string& rawFilename,
+		float heightScale, float heightOffset, int tileSize,
+		const std::string& tiledFilename);
+
+	// maxResidentTiles bounds the size of the page cache.
+	void open(const std::string& filename, int maxResidentTiles);
+	void close();
+
+	int numRows()const;
+	int numCols()const;
+	int tileSize()const;
+
+	// Pages in the tile holding (i, j) if it is not resident.
+	float operator()(int i, int j);
+
+	// Height at a point between the vertices, in grid coordinates (row
+	// down the rows, col along the columns), clamped to the map.  The cell
+	// is split into the same two triangles Terrain::getHeight uses.
+	float sampleHeight(float row, float col);
+
+	// Copies the heights inside R, inclusive on all sides (the same
+	// convention as the terrain sub-grid rectangles), into out.
+	void copyRegion(const RECT& R, Table<float>& out);
+
+	// Pages in every tile within radius tiles of the tile holding (i, j),
+	// and evicts resident tiles more than radius+1 tiles away.  The
+	// (2*radius+1)^2 tiles must fit in the cache, or each call would evict
+	// tiles it had just loaded; a bigger radius is clamped to
+	// maxUpdateRadius() and counted in the stats.
+	void update(int i, int j, int radius);
+	int  maxUpdateRadius()const;
+
+	const Stats& getStats()const;
+	void resetStats();
+
+private:
+	struct TileFileHeader
+	{
+		char  magic[4];  // "HTIL"
+		DWORD version;
+		DWORD rows;
+		DWORD cols;
+		DWORD tileSize;
+		DWORD tileRows;
+		DWORD tileCols;
+		DWORD headerBytes; // Offset of the first tile.
+		DWORD tileBytes;
+	};
+
+	struct Tile
+	{
+		const void*  view; // Mapped view, or 0 if the tile isn't resident.
+		const float* data; // The tile's heights, inside view.
+		int prev;          // LRU links; the head is the most recently used.
+		int next;
+	};
+
+	const float* acquireTile(int tile);
+	void loadTile(int tile);
+	void evictTile(int tile);
+	void tileView(int tile, unsigned __int64& viewOffset, DWORD& viewBytes, DWORD& dataOffset)const;
+	void lruUnlink(int tile);
+	void lruPushFront(int tile);
+
+	static DWORD allocationGranularity();
+
+private:
+	HANDLE mFile;
+	HANDLE mMapping;
+	TileFileHeader mHeader;
+	int mTileShift;
+	int mMaxResidentTiles;
+	DWORD mGranularity;
+
+	std::vector<Tile> mTiles;
+	int mLRUHead;
+	int mLRUTail;
+
+	// One entry cache in front of the LRU for the common case of many
+	// lookups in a row landing in the same tile.
+	int mLastTile;
+	const float* mLastData;
+
+	Stats mStats;
+	double mTotalLoadMs;
+};
+
+#endif // PAGED_HEIGHTMAP_H
@@ -1,52 +1,187 @@
 //=============================================================================
 // table.h by Frank Luna (C) 2004 All Rights Reserved.
-//============================================================================= 
+//
+// The memory layout of a Table is a compile-time policy.  RowMajorLayout is
+// the default and the classic i*numCols+j.  TiledLayout and MortonLayout
+// store square blocks of 2^LOG2_TILE x 2^LOG2_TILE elements contiguously
+// (the blocks themselves row-major, the elements within a block row-major
+// or in Z-order), so 2D windows such as filter kernels and sub-grids touch
+// fewer cache lines and pages.  Blocked layouts pad the table out to a
+// whole number of tiles.
+//
+// Only row-major tables have contiguous rows (Layout::ROWS_CONTIGUOUS); code
+// that walks a row with a pointer (&t(i,0) + j) must use the default layout,
+// and says so with TABLE_ASSERT_ROWS_CONTIGUOUS so it stops compiling if the
+// table's layout changes.
+//=============================================================================
 
 #ifndef TABLE_H
 #define TABLE_H
 
+#include <algorithm>
 #include <cassert>
 #include <vector>
 
-template <typename T>
+// A rectangle of a table, [row0, row1) x [col0, col1).
+struct TableTile
+{
+	int row0;
+	int col0;
+	int row1;
+	int col1;
+};
+
+class RowMajorLayout
+{
+public:
+	static const bool ROWS_CONTIGUOUS = true;
+
+	RowMajorLayout() : mRows(0), mCols(0) {}
+
+	void init(int m, int n)
+	{
+		mRows = m;
+		mCols = n;
+	}
+
+	size_t size()const { return (size_t)mRows*mCols; }
+
+	size_t index(int i, int j)const
+	{
+		return (size_t)i*mCols + j;
+	}
+
+	// A tile is one whole row.
+	int tileRows()const { return 1; }
+	int tileCols()const { return mCols; }
+
+private:
+	int mRows;
+	int mCols;
+};
+
+template <int LOG2_TILE>
+class BlockedLayoutBase
+{
+public:
+	static const bool ROWS_CONTIGUOUS = false;
+	static const int  TILE      = 1 << LOG2_TILE;
+	static const int  TILE_MASK = TILE - 1;
+
+	BlockedLayoutBase() : mTilesPerRow(0), mTilesPerCol(0) {}
+
+	void init(int m, int n)
+	{
+		mTilesPerCol = (m + TILE_MASK) >> LOG2_TILE;
+		mTilesPerRow = (n + TILE_MASK) >> LOG2_TILE;
+	}
+
+	size_t size()const
+	{
+		return ((size_t)mTilesPerCol*mTilesPerRow) << (2*LOG2_TILE);
+	}
+
+	int tileRows()const { return TILE; }
+	int tileCols()const { return TILE; }
+
+protected:
+	// Start of the tile holding (i, j).
+	size_t tileBase(int i, int j)const
+	{
+		return ((size_t)(i >> LOG2_TILE)*mTilesPerRow + (j >> LOG2_TILE)) << (2*LOG2_TILE);
+	}
+
+private:
+	int mTilesPerRow;
+	int mTilesPerCol;
+};
+
+template <int LOG2_TILE = 4>
+class TiledLayout : public BlockedLayoutBase<LOG2_TILE>
+{
+public:
+	typedef BlockedLayoutBase<LOG2_TILE> Base;
+
+	size_t index(int i, int j)const
+	{
+		return this->tileBase(i, j) +
+			((i & Base::TILE_MASK) << LOG2_TILE) + (j & Base::TILE_MASK);
+	}
+};
+
+template <int LOG2_TILE = 4>
+class MortonLayout : public BlockedLayoutBase<LOG2_TILE>
+{
+public:
+	typedef BlockedLayoutBase<LOG2_TILE> Base;
+
+	size_t index(int i, int j)const
+	{
+		// Interleave the row and column bits within the tile, so that every
+		// aligned 2^k x 2^k square inside it is contiguous too.
+		return this->tileBase(i, j) +
+			((spreadBits(i & Base::TILE_MASK) << 1) | spreadBits(j & Base::TILE_MASK));
+	}
+
+private:
+	// Moves bit b of x to bit 2b.  x must fit in 16 bits.
+	static size_t spreadBits(unsigned x)
+	{
+		x = (x | (x << 8)) & 0x00ff00ff;
+		x = (x | (x << 4)) & 0x0f0f0f0f;
+		x = (x | (x << 2)) & 0x33333333;
+		x = (x | (x << 1)) & 0x55555555;
+		return x;
+	}
+};
+
+template <typename T, typename Layout = RowMajorLayout>
 class Table
 {
 public:
+	typedef Layout LayoutType;
+
 	Table()
 		: mRows(0), mCols(0)
 	{
 	}
 
 	Table(int m, int n)
-		: mRows(m), mCols(n), mMatrix(m*n)
+		: mRows(m), mCols(n)
 	{
+		mLayout.init(m, n);
+		mMatrix.resize(mLayout.size());
 	}
 
 	Table(int m, int n, const T& value)
-		: mRows(m), mCols(n), mMatrix(m*n, value)
+		: mRows(m), mCols(n)
 	{
+		mLayout.init(m, n);
+		mMatrix.resize(mLayout.size(), value);
 	}
 
 	// For non-const objects
 	T& operator()(int i, int j)
 	{
-		return mMatrix[i*mCols+j];
+		return mMatrix[mLayout.index(i, j)];
 	}
 
 	// For const objects
 	const T& operator()(int i, int j)const
 	{
-		return mMatrix[i*mCols+j];
+		return mMatrix[mLayout.index(i, j)];
 	}
 
 	// Add typename to let compiler know type and not static variable.
 	typedef typename std::vector<T>::iterator iter;
 	typedef typename std::vector<T>::const_iterator citer;
 
+	// Iterate over the storage in memory order, including any padding a
+	// blocked layout adds.
 	// For non-const objects
 	iter begin(){ return mMatrix.begin(); }
 	iter end()	{ return mMatrix.end();   }
-	
+
 	// For const objects
 	citer begin() const { return mMatrix.begin(); }
 	citer end() const { return mMatrix.end();   }
@@ -54,24 +189,77 @@ public:
 	int numRows() const	{ return mRows;	}
 	int numCols() const	{ return mCols;	}
 
+	// Tile iteration.  Tiles are the blocks the layout keeps together in
+	// memory (whole rows for row-major), clipped to the table, so walking
+	// a tile row by row and tiles in order touches memory in order.  Tiles
+	// are disjoint, so they can also be handed out to separate jobs.
+	int numTiles()const
+	{
+		return numTileRows()*numTileCols();
+	}
+
+	TableTile tile(int t)const
+	{
+		int tr = mLayout.tileRows();
+		int tc = mLayout.tileCols();
+
+		TableTile r;
+		r.row0 = (t / numTileCols())*tr;
+		r.col0 = (t % numTileCols())*tc;
+		r.row1 = r.row0 + tr < mRows ? r.row0 + tr : mRows;
+		r.col1 = r.col0 + tc < mCols ? r.col0 + tc : mCols;
+		return r;
+	}
+
 	void resize(int m, int n)
 	{
 		mRows = m;
 		mCols = n;
-		mMatrix.resize(m*n);
+		mLayout.init(m, n);
+		mMatrix.resize(mLayout.size());
 	}
 
 	void resize(int m, int n, const T& value)
 	{
 		mRows = m;
 		mCols = n;
-		mMatrix.resize(m*n, value);
+		mLayout.init(m, n);
+		mMatrix.resize(mLayout.size(), value);
+	}
+
+	// Exchanges contents without copying the elements.
+	void swap(Table& rhs)
+	{
+		std::swap(mRows, rhs.mRows);
+		std::swap(mCols, rhs.mCols);
+		std::swap(mLayout, rhs.mLayout);
+		mMatrix.swap(rhs.mMatrix);
+	}
+
+private:
+	int numTileRows()const
+	{
+		int tr = mLayout.tileRows();
+		return tr > 0 ? (mRows + tr - 1) / tr : 0;
+	}
+
+	int numTileCols()const
+	{
+		int tc = mLayout.tileCols();
+		return tc > 0 ? (mCols + tc - 1) / tc : 0;
 	}
 
 private:
 	int mRows;
 	int mCols;
+	Layout mLayout;
 	std::vector<T> mMatrix;
 };
 
-#endif // TABLE_H
\ No newline at end of file
+// Compile-time check, for a function that takes raw row pointers into a
+// TableType, that its rows are contiguous: the array size goes negative
+// otherwise.  (VS2010's static_assert isn't C++03; this works everywhere.)
+#define TABLE_ASSERT_ROWS_CONTIGUOUS(TableType) \
+	typedef char TableRowsMustBeContiguous[TableType::LayoutType::ROWS_CONTIGUOUS ? 1 : -1]
+
+#endif // TABLE_H
@@ -4,14 +4,86 @@
 
 #include "Terrain.h"
 #include "Camera.h"
+#include "JobSystem.h"
+#include "AllocCounter.h"
+#include "OcclusionCuller.h"
+#include "PagedHeightmap.h"
 #include "d3dUtil.h"
 #include <algorithm>
-#include <list>
+#include <emmintrin.h>
+
+namespace
+{
+	// Shared state for the jobs that cut the grid up into subgrids.
+	struct SubGridBuildJob
+	{
+		const int*       patches;      // Sub-grids to build, or 0 for all.
+		const Heightmap* heightmap;
+		float            dx;
+		float            dz;
+		float            width;
+		float            depth;
+		float            originX;      // Position of vertex (0, 0).
+		float            originZ;
+		int              subGridCols;
+		VertexPNT*       subGridVerts; // NUM_VERTS per subgrid.
+		AABB*            boxes;
+	};
+
+	// Patch-local index of the k-th vertex around a patch's border, going
+	// clockwise (looking down) from the top-left corner: along row 0, down
+	// the last column, back along the last row and up column 0.
+	int EdgeVertex(int k, int rows, int cols)
+	{
+		int w = cols-1;
+		int h = rows-1;
+		if( k < w )      return k;
+		k -= w;
+		if( k < h )      return k*cols + w;
+		k -= h;
+		if( k < w )      return h*cols + w-k;
+		k -= w;
+		return (h-k)*cols;
+	}
+}
 
 Terrain::Terrain(UINT vertRows, UINT vertCols, float dx, float dz, 
 		std::string heightmap, std::string tex0, std::string tex1, 
 		std::string tex2, std::string blendMap, float heightScale, 
-		float yOffset)
+		float yOffset, Heightmap::RawFormat format, VertexFormat vertexFormat)
+{
+	init(vertRows, vertCols, dx, dz, D3DXVECTOR3(0.0f, 0.0f, 0.0f), vertexFormat);
+
+	// Only 8-bit maps need smoothing to hide their height steps.
+	int filterRadius = (format == Heightmap::RAW_8BIT) ? 1 : 0;
+	mHeightmap.loadRAW(vertRows, vertCols, heightmap, heightScale, yOffset,
+		filterRadius, Heightmap::FILTER_BOX, format);
+
+	buildGeometry();
+	createDeviceObjects(tex0, tex1, tex2, blendMap);
+}
+
+Terrain::Terrain(const Table<float>& heights, float dx, float dz, const D3DXVECTOR3& center,
+				 VertexFormat vertexFormat)
+{
+	init(heights.numRows(), heights.numCols(), dx, dz, center, vertexFormat);
+	mHeightmap.assign(heights);
+	buildGeometry();
+}
+
+Terrain::Terrain(PagedHeightmap& heights, const RECT& R, float dx, float dz,
+				 const D3DXVECTOR3& center, VertexFormat vertexFormat)
+{
+	Table<float> region;
+	heights.copyRegion(R, region);
+
+	init(region.numRows(), region.numCols(), dx, dz, center, vertexFormat);
+	mHeightmap.assign(region);
+	buildGeometry();
+}
+
+void Terrain::init(UINT vertRows, UINT vertCols, float dx, float dz, const D3DXVECTOR3& center,
+				   VertexFormat vertexFormat)
 {
 	mVertRows = vertRows;
 	mVertCols = vertCols;
@@ -22,42 +94,191 @@ Terrain::Terrain(UINT vertRows, UINT vertCols, float dx, float dz,
 	mWidth = (mVertCols-1)*mDX;
 	mDepth = (mVertRows-1)*mDZ;
 
-	mHeightmap.loadRAW(vertRows, vertCols, heightmap, heightScale, yOffset);
+	mCenter = center;
 
-	HR(D3DXCreateTextureFromFile(gd3dDevice, tex0.c_str(), &mTex0));
-	HR(D3DXCreateTextureFromFile(gd3dDevice, tex1.c_str(), &mTex1));
-	HR(D3DXCreateTextureFromFile(gd3dDevice, tex2.c_str(), &mTex2));
-	HR(D3DXCreateTextureFromFile(gd3dDevice, blendMap.c_str(), &mBlendMap));
+	mVertexFormat = vertexFormat;
+	mQuantMinH    = 0.0f;
+	mQuantMaxH    = 0.0f;
+	mEditCount    = 0;
 
 	// Default fog variable values
 	mFogColor = D3DXVECTOR3(0.5f, 0.5f, 0.5f); //Grayish
 	mFogStart = 1.0f;
 	mFogRange = 250.0f;
 
-	buildGeometry();
+	// Level of detail is off until the application turns it on.
+	mLODEnabled        = false;
+	mLODPixelError     = 4.0f;
+	mLODViewportHeight = 600.0f;
+	mNumTrisDrawn      = 0;
+	mNumDrawAllocs     = 0;
+	mLODCrackFix       = LOD_STITCH;
+
+	mOcclusion          = 0;
+	mNumPatchesOccluded = 0;
+
+	// Nothing on the device until createDeviceObjects.
+	mSubGridVB = 0;
+	mSubGridIB = 0;
+	mSkirtVB   = 0;
+	for(int i = 0; i < TerrainQuadtree::NUM_LODS; ++i)
+	{
+		for(int j = 0; j < TerrainQuadtree::NUM_STITCH_MASKS; ++j)
+		{
+			mLODIndexBuffers[i][j] = 0;
+			mLODNumTris[i][j]      = 0;
+		}
+		mSkirtIndexBuffers[i] = 0;
+		mSkirtNumTris[i]      = 0;
+	}
+
+	mTex0     = 0;
+	mTex1     = 0;
+	mTex2     = 0;
+	mBlendMap = 0;
+	mAOMap    = 0;
+	mWhiteTex = 0;
+	mFX       = 0;
+
+	mAOTexTransform = D3DXVECTOR4(1.0f, 1.0f, 0.0f, 0.0f);
+}
+
+void Terrain::createDeviceObjects(const std::string& tex0, const std::string& tex1,
+								  const std::string& tex2, const std::string& blendMap)
+{
+	HR(D3DXCreateTextureFromFile(gd3dDevice, tex0.c_str(), &mTex0));
+	HR(D3DXCreateTextureFromFile(gd3dDevice, tex1.c_str(), &mTex1));
+	HR(D3DXCreateTextureFromFile(gd3dDevice, tex2.c_str(), &mTex2));
+	HR(D3DXCreateTextureFromFile(gd3dDevice, blendMap.c_str(), &mBlendMap));
+
+	// No ambient occlusion until it is baked.
+	HR(D3DXCreateTexture(gd3dDevice, 1, 1, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &mWhiteTex));
+	D3DLOCKED_RECT lockedRect;
+	HR(mWhiteTex->LockRect(0, &lockedRect, 0, 0));
+	*(DWORD*)lockedRect.pBits = 0xffffffff;
+	HR(mWhiteTex->UnlockRect(0));
+
+	buildIndexBuffers();
 	buildEffect();
+	uploadGeometry();
+}
+
+void Terrain::createDeviceObjects(const Terrain& shareWith)
+{
+	// Everything but the vertices is the same for every terrain, so hold
+	// references to shareWith's instead of building copies.
+	mTex0     = shareWith.mTex0;     mTex0->AddRef();
+	mTex1     = shareWith.mTex1;     mTex1->AddRef();
+	mTex2     = shareWith.mTex2;     mTex2->AddRef();
+	mBlendMap = shareWith.mBlendMap; mBlendMap->AddRef();
+	mWhiteTex = shareWith.mWhiteTex; mWhiteTex->AddRef();
+
+	mSubGridIB = shareWith.mSubGridIB;
+	mSubGridIB->AddRef();
+	for(int i = 0; i < TerrainQuadtree::NUM_LODS; ++i)
+	{
+		for(int j = 0; j < TerrainQuadtree::NUM_STITCH_MASKS; ++j)
+		{
+			mLODIndexBuffers[i][j] = shareWith.mLODIndexBuffers[i][j];
+			mLODIndexBuffers[i][j]->AddRef();
+			mLODNumTris[i][j] = shareWith.mLODNumTris[i][j];
+		}
+		mSkirtIndexBuffers[i] = shareWith.mSkirtIndexBuffers[i];
+		mSkirtIndexBuffers[i]->AddRef();
+		mSkirtNumTris[i] = shareWith.mSkirtNumTris[i];
+	}
+
+	mFX = shareWith.mFX;
+	mFX->AddRef();
+	mhTech      = shareWith.mhTech;
+	mhViewProj  = shareWith.mhViewProj;
+	mhDirToSunW = shareWith.mhDirToSunW;
+	mhTex0      = shareWith.mhTex0;
+	mhTex1      = shareWith.mhTex1;
+	mhTex2      = shareWith.mhTex2;
+	mhBlendMap  = shareWith.mhBlendMap;
+	mhCompactTech = shareWith.mhCompactTech;
+	mhGridToWorld = shareWith.mhGridToWorld;
+	mhGridToTex   = shareWith.mhGridToTex;
+	mhHeightQuant = shareWith.mhHeightQuant;
+	mhAOMap          = shareWith.mhAOMap;
+	mhAOTexTransform = shareWith.mhAOTexTransform;
+	mhFogColor  = shareWith.mhFogColor;
+	mhFogStart  = shareWith.mhFogStart;
+	mhFogRange  = shareWith.mhFogRange;
+	mFogColor   = shareWith.mFogColor;
+	mFogStart   = shareWith.mFogStart;
+	mFogRange   = shareWith.mFogRange;
+
+	uploadGeometry();
 }
 
 Terrain::~Terrain()
 {
-	for(UINT i = 0; i < mSubGrids.size(); ++i)
-		ReleaseCOM(mSubGrids[i].mesh);
+	ReleaseCOM(mSubGridVB);
+	ReleaseCOM(mSubGridIB);
+
+	for(int i = 0; i < TerrainQuadtree::NUM_LODS; ++i)
+		for(int j = 0; j < TerrainQuadtree::NUM_STITCH_MASKS; ++j)
+			ReleaseCOM(mLODIndexBuffers[i][j]);
+
+	ReleaseCOM(mSkirtVB);
+	for(int i = 0; i < TerrainQuadtree::NUM_LODS; ++i)
+		ReleaseCOM(mSkirtIndexBuffers[i]);
 
 	ReleaseCOM(mFX);
 	ReleaseCOM(mTex0);
 	ReleaseCOM(mTex1);
 	ReleaseCOM(mTex2);
 	ReleaseCOM(mBlendMap);
+	ReleaseCOM(mAOMap);
+	ReleaseCOM(mWhiteTex);
 }
 
 DWORD Terrain::getNumTriangles()
 {
-	return (DWORD)mSubGrids.size()*mSubGrids[0].mesh->GetNumFaces();
+	return (DWORD)mSubGrids.size()*SubGrid::NUM_TRIS;
 }
 
 DWORD Terrain::getNumVertices()
 {
-	return (DWORD)mSubGrids.size()*mSubGrids[0].mesh->GetNumVertices();
+	return (DWORD)mSubGrids.size()*SubGrid::NUM_VERTS;
+}
+
+Terrain::VertexFormat Terrain::getVertexFormat()
+{
+	return mVertexFormat;
+}
+
+Terrain::MemoryStats Terrain::getMemoryStats()
+{
+	MemoryStats stats;
+	stats.numPatches = (DWORD)mSubGrids.size();
+
+	DWORD vertexBytes = SubGrid::NUM_VERTS*vertexStride();
+	DWORD indexBytes  = SubGrid::NUM_TRIS*3*sizeof(WORD);
+	DWORD attribBytes = SubGrid::NUM_TRIS*sizeof(DWORD);
+
+	// The saving of the compact format is the difference of these two.
+	stats.vertexBytesPerPatch     = vertexBytes;
+	stats.fullVertexBytesPerPatch = SubGrid::NUM_VERTS*sizeof(VertexPNT);
+
+	stats.bytesPerPatch       = vertexBytes + sizeof(SubGrid);
+	stats.legacyBytesPerPatch = stats.fullVertexBytesPerPatch + indexBytes + attribBytes + sizeof(AABB);
+	stats.sharedIndexBytes    = indexBytes;
+
+	stats.lodIndexBytes = 0;
+	for(int i = 0; i < TerrainQuadtree::NUM_LODS; ++i)
+		for(int j = 0; j < TerrainQuadtree::NUM_STITCH_MASKS; ++j)
+			stats.lodIndexBytes += mLODNumTris[i][j]*3*sizeof(WORD);
+
+	stats.skirtBytes = stats.numPatches*SubGrid::NUM_SKIRT_VERTS*vertexStride();
+	for(int i = 0; i < TerrainQuadtree::NUM_LODS; ++i)
+		stats.skirtBytes += mSkirtNumTris[i]*3*sizeof(WORD);
+
+	stats.totalBytes       = stats.numPatches*stats.bytesPerPatch + stats.sharedIndexBytes + stats.lodIndexBytes + stats.skirtBytes;
+	stats.legacyTotalBytes = stats.numPatches*stats.legacyBytesPerPatch + stats.lodIndexBytes + stats.skirtBytes;
+	return stats;
 }
 
 float Terrain::getWidth()
@@ -70,6 +291,26 @@ float Terrain::getDepth()
 	return mDepth;
 }
 
+float Terrain::getDX()
+{
+	return mDX;
+}
+
+float Terrain::getDZ()
+{
+	return mDZ;
+}
+
+const D3DXVECTOR3& Terrain::getCenter()
+{
+	return mCenter;
+}
+
+const Heightmap& Terrain::getHeightmap()
+{
+	return mHeightmap;
+}
+
 void Terrain::onLostDevice()
 {
 	HR(mFX->OnLostDevice());
@@ -82,13 +323,50 @@ void Terrain::onResetDevice()
 
 float Terrain::getHeight(float x, float z)
 {
-	// Transform from terrain local space to "cell" space.
+	return sampleHeight(x, z, 0);
+}
+
+void Terrain::getCell(float x, float z, int& row, int& col, float& s, float& t)
+{
+	// Transform from world space to terrain local space (centered on the
+	// origin) and then to "cell" space.
+	x -= mCenter.x;
+	z -= mCenter.z;
 	float c = (x + 0.5f*mWidth) /  mDX;
 	float d = (z - 0.5f*mDepth) / -mDZ;
 
-	// Get the row and column we are in.
-	int row = (int)floorf(d);
-	int col = (int)floorf(c);
+	// Clamp to the terrain so we never read outside the heightmap.
+	c = min(max(c, 0.0f), (float)(mVertCols-1));
+	d = min(max(d, 0.0f), (float)(mVertRows-1));
+
+	// Get the row and column we are in.  The last row/column of vertices
+	// belongs to the cell before it.
+	row = min((int)floorf(d), (int)mVertRows-2);
+	col = min((int)floorf(c), (int)mVertCols-2);
+
+	// Where we are relative to the cell.
+	s = c - (float)col;
+	t = d - (float)row;
+}
+
+void Terrain::getCellCorners(int row, int col, float corners[4])
+{
+	corners[0] = mHeightmap(row, col);
+	corners[1] = mHeightmap(row, col+1);
+	corners[2] = mHeightmap(row+1, col);
+	corners[3] = mHeightmap(row+1, col+1);
+}
+
+DWORD Terrain::getEditCount()
+{
+	return mEditCount;
+}
+
+float Terrain::sampleHeight(float x, float z, D3DXVECTOR3* normal)
+{
+	int row, col;
+	float s, t;
+	getCell(x, z, row, col, s, t);
 
 	// Grab the heights of the cell we are in.
 	// A*--*B
@@ -100,235 +378,893 @@ float Terrain::getHeight(float x, float z)
 	float C = mHeightmap(row+1, col);
 	float D = mHeightmap(row+1, col+1);
 
-	// Where we are relative to the cell.
-	float s = c - (float)col;
-	float t = d - (float)row;
-
 	// If upper triangle ABC.
 	if(t < 1.0f - s)
 	{
 		float uy = B - A;
 		float vy = C - A;
+		if( normal )
+		{
+			*normal = D3DXVECTOR3(-uy*mDZ, mDX*mDZ, vy*mDX);
+			D3DXVec3Normalize(normal, normal);
+		}
 		return A + s*uy + t*vy;
 	}
 	else // lower triangle DCB.
 	{
 		float uy = C - D;
 		float vy = B - D;
+		if( normal )
+		{
+			*normal = D3DXVECTOR3(uy*mDZ, mDX*mDZ, -vy*mDX);
+			D3DXVec3Normalize(normal, normal);
+		}
 		return D + (1.0f-s)*uy + (1.0f-t)*vy;
 	}
 }
 
+bool Terrain::intersectRay(const D3DXVECTOR3& origin, const D3DXVECTOR3& dir,
+						   D3DXVECTOR3* hit, float maxT)const
+{
+	// Into the heightmap's grid space, where cells are unit squares with
+	// columns along x and rows along z.  The map is affine, so t is the
+	// same in both spaces.
+	D3DXVECTOR3 o((origin.x - mCenter.x + 0.5f*mWidth) / mDX, origin.y,
+		(0.5f*mDepth - (origin.z - mCenter.z)) / mDZ);
+	D3DXVECTOR3 d(dir.x / mDX, dir.y, -dir.z / mDZ);
+
+	float t = 0.0f;
+	if( !mHeightmap.intersectRay(o, d, maxT, t) )
+		return false;
+
+	if( hit )
+		*hit = origin + t*dir;
+	return true;
+}
+
+void Terrain::getHeights(const float* xs, const float* zs, float* out, size_t n,
+						 D3DXVECTOR3* normals)
+{
+	// Same math as sampleHeight, four points at a time.  SSE has no gather,
+	// so the four corner heights of each point's cell are fetched with
+	// scalar loads from the (row-major) heightmap.
+	TABLE_ASSERT_ROWS_CONTIGUOUS(Heightmap::HeightTable);
+	const float* heights = &mHeightmap(0, 0);
+
+	const __m128 zero    = _mm_setzero_ps();
+	const __m128 one     = _mm_set1_ps(1.0f);
+	const __m128 centerX = _mm_set1_ps(mCenter.x);
+	const __m128 centerZ = _mm_set1_ps(mCenter.z);
+	const __m128 halfW   = _mm_set1_ps(0.5f*mWidth);
+	const __m128 halfD   = _mm_set1_ps(0.5f*mDepth);
+	const __m128 dx      = _mm_set1_ps( mDX);
+	const __m128 dz      = _mm_set1_ps(-mDZ);
+	const __m128 maxC    = _mm_set1_ps((float)(mVertCols-1));
+	const __m128 maxD    = _mm_set1_ps((float)(mVertRows-1));
+	const __m128i lastCol = _mm_set1_epi32(mVertCols-2);
+	const __m128i lastRow = _mm_set1_epi32(mVertRows-2);
+	const __m128 nx      = _mm_set1_ps(mDZ);
+	const __m128 ny      = _mm_set1_ps(mDX*mDZ);
+	const __m128 nz      = _mm_set1_ps(mDX);
+
+	_MM_ALIGN16 int   rows[4];
+	_MM_ALIGN16 int   cols[4];
+	_MM_ALIGN16 float corner[4][4]; // A, B, C, D for each of the four points.
+	_MM_ALIGN16 float N[3][4];
+
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4)
+	{
+		// Cell space, clamped to the terrain.  Divide rather than multiply
+		// by the reciprocal so points land in the same triangle as they do
+		// in sampleHeight.
+		__m128 c = _mm_div_ps(_mm_add_ps(_mm_sub_ps(_mm_loadu_ps(xs + i), centerX), halfW), dx);
+		__m128 d = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(zs + i), centerZ), halfD), dz);
+		c = _mm_min_ps(_mm_max_ps(c, zero), maxC);
+		d = _mm_min_ps(_mm_max_ps(d, zero), maxD);
+
+		// c and d are non-negative, so truncating is flooring.
+		__m128i col = _mm_cvttps_epi32(c);
+		__m128i row = _mm_cvttps_epi32(d);
+		__m128i colOver = _mm_cmpgt_epi32(col, lastCol);
+		__m128i rowOver = _mm_cmpgt_epi32(row, lastRow);
+		col = _mm_or_si128(_mm_and_si128(colOver, lastCol), _mm_andnot_si128(colOver, col));
+		row = _mm_or_si128(_mm_and_si128(rowOver, lastRow), _mm_andnot_si128(rowOver, row));
+		_mm_store_si128((__m128i*)cols, col);
+		_mm_store_si128((__m128i*)rows, row);
+
+		for(int k = 0; k < 4; ++k)
+		{
+			const float* h = heights + rows[k]*mVertCols + cols[k];
+			corner[0][k] = h[0];
+			corner[1][k] = h[1];
+			corner[2][k] = h[mVertCols];
+			corner[3][k] = h[mVertCols+1];
+		}
+		__m128 A = _mm_load_ps(corner[0]);
+		__m128 B = _mm_load_ps(corner[1]);
+		__m128 C = _mm_load_ps(corner[2]);
+		__m128 D = _mm_load_ps(corner[3]);
+
+		// Where we are relative to the cell.
+		__m128 s = _mm_sub_ps(c, _mm_cvtepi32_ps(col));
+		__m128 t = _mm_sub_ps(d, _mm_cvtepi32_ps(row));
+		__m128 oneMinusS = _mm_sub_ps(one, s);
+		__m128 oneMinusT = _mm_sub_ps(one, t);
+
+		// Evaluate both triangles and pick per point.
+		__m128 upper = _mm_cmplt_ps(t, oneMinusS);
+
+		__m128 uyABC = _mm_sub_ps(B, A);
+		__m128 vyABC = _mm_sub_ps(C, A);
+		__m128 hABC  = _mm_add_ps(_mm_add_ps(A, _mm_mul_ps(s, uyABC)), _mm_mul_ps(t, vyABC));
+
+		__m128 uyDCB = _mm_sub_ps(C, D);
+		__m128 vyDCB = _mm_sub_ps(B, D);
+		__m128 hDCB  = _mm_add_ps(_mm_add_ps(D, _mm_mul_ps(oneMinusS, uyDCB)), _mm_mul_ps(oneMinusT, vyDCB));
+
+		_mm_storeu_ps(out + i, _mm_or_ps(_mm_and_ps(upper, hABC), _mm_andnot_ps(upper, hDCB)));
+
+		if( normals )
+		{
+			// Upper: (-uy*dz, dx*dz, vy*dx), lower: (uy*dz, dx*dz, -vy*dx).
+			__m128 uy = _mm_or_ps(_mm_and_ps(upper, _mm_sub_ps(zero, uyABC)), _mm_andnot_ps(upper, uyDCB));
+			__m128 vy = _mm_or_ps(_mm_and_ps(upper, vyABC), _mm_andnot_ps(upper, _mm_sub_ps(zero, vyDCB)));
+			__m128 x  = _mm_mul_ps(uy, nx);
+			__m128 z  = _mm_mul_ps(vy, nz);
+
+			__m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(ny, ny)), _mm_mul_ps(z, z));
+			__m128 inv  = _mm_div_ps(one, _mm_sqrt_ps(len2));
+			_mm_store_ps(N[0], _mm_mul_ps(x, inv));
+			_mm_store_ps(N[1], _mm_mul_ps(ny, inv));
+			_mm_store_ps(N[2], _mm_mul_ps(z, inv));
+
+			for(int k = 0; k < 4; ++k)
+				normals[i+k] = D3DXVECTOR3(N[0][k], N[1][k], N[2][k]);
+		}
+	}
+
+	// Leftovers.
+	for(; i < n; ++i)
+		out[i] = sampleHeight(xs[i], zs[i], normals ? &normals[i] : 0);
+}
+
 void Terrain::setDirToSunW(const D3DXVECTOR3& d)
 {
 	HR(mFX->SetValue(mhDirToSunW, &d, sizeof(D3DXVECTOR3)));
 }
 
-// Sort by distance from nearest to farthest from the camera.  In this
-// way, we draw objects in front to back order to reduce overdraw 
-// (i.e., depth test will prevent them from being processed further.
-bool Terrain::SubGrid::operator<(const SubGrid& rhs) const
+void Terrain::setLODEnabled(bool enable)
 {
-	D3DXVECTOR3 d1 = box.center() - gCamera->pos();
-	D3DXVECTOR3 d2 = rhs.box.center() - gCamera->pos();
-	return D3DXVec3LengthSq(&d1) < D3DXVec3LengthSq(&d2);
+	mLODEnabled = enable;
+}
+
+bool Terrain::isLODEnabled()
+{
+	return mLODEnabled;
+}
+
+void Terrain::setLODCrackFix(LODCrackFix fix)
+{
+	mLODCrackFix = fix;
+}
+
+Terrain::LODCrackFix Terrain::getLODCrackFix()
+{
+	return mLODCrackFix;
+}
+
+void Terrain::setLODPixelError(float pixels)
+{
+	if (pixels >= 0.0f)
+		mLODPixelError = pixels;
+	else
+		mLODPixelError = 0.0f;
+}
+
+void Terrain::setLODViewportHeight(float height)
+{
+	mLODViewportHeight = height;
+}
+
+void Terrain::setOcclusionCuller(OcclusionCuller* culler)
+{
+	mOcclusion = culler;
+}
+
+DWORD Terrain::getNumPatchesOccluded()
+{
+	return mNumPatchesOccluded;
+}
+
+DWORD Terrain::getNumTrianglesDrawn()
+{
+	return mNumTrisDrawn;
+}
+
+DWORD Terrain::getNumDrawAllocs()
+{
+	return mNumDrawAllocs;
 }
 
 void Terrain::draw()
 {
-	// Frustum cull sub-grids.
-	std::list<SubGrid> visibleSubGrids;
-	for(UINT i = 0; i < mSubGrids.size(); ++i)
+	// Edits are applied before counting this frame's allocations; only
+	// drawing is expected to be allocation free.
+	if( !mDirtyPatches.empty() )
+		rebuildDirtyPatches();
+
+	LONG allocsBefore = GetNumHeapAllocs();
+
+	if( mLODEnabled )
 	{
-		if( gCamera->isVisible(mSubGrids[i].box) )
-			visibleSubGrids.push_back(mSubGrids[i]);
+		drawLOD();
+		mNumDrawAllocs = GetNumHeapAllocs() - allocsBefore;
+		return;
 	}
 
-	// Sort front-to-back from camera.
-	visibleSubGrids.sort();
+	// Frustum cull sub-grids into this frame's visible list.  The sort key
+	// is computed once per subgrid, instead of once per comparison.
+	mFrameArena.reset();
+	UINT numSubGrids = (UINT)mSubGrids.size();
+	UINT* visible   = mFrameArena.alloc<UINT>(numSubGrids);
+	DrawItem* items = mFrameArena.alloc<DrawItem>(numSubGrids);
+	DrawItem* temp  = mFrameArena.alloc<DrawItem>(numSubGrids);
 
-	HR(mFX->SetMatrix(mhViewProj, &gCamera->viewProj()));
-	HR(mFX->SetTechnique(mhTech));
-	UINT numPasses = 0;
-	HR(mFX->Begin(&numPasses, 0));
-	HR(mFX->BeginPass(0));
+	UINT numVisible = mSubGridBVH.cull(*gCamera, visible);
 
-	for(std::list<SubGrid>::iterator iter = visibleSubGrids.begin(); iter != visibleSubGrids.end(); ++iter)
-		HR(iter->mesh->DrawSubset(0));
+	// Then drop the ones hidden behind the occluders.
+	mNumPatchesOccluded = 0;
+	if( mOcclusion )
+	{
+		UINT n = 0;
+		for(UINT i = 0; i < numVisible; ++i)
+		{
+			if( mOcclusion->isVisible(mSubGrids[visible[i]].box) )
+				visible[n++] = visible[i];
+		}
+		mNumPatchesOccluded = numVisible - n;
+		numVisible = n;
+	}
+
+	const D3DXVECTOR3& eye = gCamera->pos();
+	for(UINT i = 0; i < numVisible; ++i)
+	{
+		D3DXVECTOR3 d = mSubGrids[visible[i]].box.center() - eye;
+		float distSq  = D3DXVec3LengthSq(&d);
+
+		// Non-negative floats sort like their bit patterns, so the top
+		// 16 bits make a logarithmically quantized depth.
+		items[i].key   = *(UINT*)&distSq >> 16;
+		items[i].patch = visible[i];
+	}
+
+	// Sort front-to-back from camera.  In this way, we draw objects in
+	// front to back order to reduce overdraw (i.e., depth test will
+	// prevent them from being processed further).
+	items = sortDrawItems(items, temp, numVisible);
+
+	beginEffect();
+	HR(gd3dDevice->SetStreamSource(0, mSubGridVB, 0, vertexStride()));
+	HR(gd3dDevice->SetIndices(mSubGridIB));
+
+	for(UINT i = 0; i < numVisible; ++i)
+	{
+		HR(gd3dDevice->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, mSubGrids[items[i].patch].baseVertex, 0,
+			SubGrid::NUM_VERTS, 0, SubGrid::NUM_TRIS));
+	}
 
 	HR(mFX->EndPass());
 	HR(mFX->End());
+
+	mNumTrisDrawn  = numVisible*SubGrid::NUM_TRIS;
+	mNumDrawAllocs = GetNumHeapAllocs() - allocsBefore;
 }
 
-void Terrain::buildGeometry()
+Terrain::DrawItem* Terrain::sortDrawItems(DrawItem* items, DrawItem* temp, UINT n)
 {
-	//===============================================================
-	// Create one large mesh for the grid in system memory.
-
-	DWORD numTris  = (mVertRows-1)*(mVertCols-1)*2;
-	DWORD numVerts = mVertRows*mVertCols;
+	// LSD radix sort on the 16-bit keys, one byte per pass, ping-ponging
+	// between the two arrays.  Each pass is stable, so equal keys keep
+	// their culling order.
+	for(int shift = 0; shift < 16; shift += 8)
+	{
+		UINT count[257] = {0};
+		for(UINT i = 0; i < n; ++i)
+			++count[((items[i].key >> shift) & 0xff) + 1];
+		for(int b = 0; b < 256; ++b)
+			count[b+1] += count[b];
+		for(UINT i = 0; i < n; ++i)
+			temp[count[(items[i].key >> shift) & 0xff]++] = items[i];
+
+		DrawItem* t = items;
+		items = temp;
+		temp  = t;
+	}
 
-	ID3DXMesh* mesh = 0;
-	D3DVERTEXELEMENT9 elems[MAX_FVF_DECL_SIZE];
-	UINT numElems = 0;
-	HR(VertexPNT::Decl->GetDeclaration(elems, &numElems));
+	return items;
+}
 
-	// Use Scratch pool since we are using this mesh purely for some CPU work,
-	// which will be used to create the sub-grids that the graphics card
-	// will actually draw.
-	HR(D3DXCreateMesh(numTris, numVerts, 
-		D3DPOOL_SCRATCH|D3DXMESH_32BIT, elems, gd3dDevice, &mesh));
+void Terrain::drawLOD()
+{
+	// Cull the quadtree and pick a resolution for every visible sub-grid.
+	// The patches come back roughly front to back, so no sort is needed.
+	bool skirts = mLODCrackFix == LOD_SKIRTS;
+	mQuadtree.select(*gCamera, mLODViewportHeight, mLODPixelError, mVisiblePatches, !skirts);
+
+	// Occluded patches are dropped after the levels are chosen, so their
+	// neighbours' stitching still matches the patches that are drawn.
+	mNumPatchesOccluded = 0;
+	if( mOcclusion )
+	{
+		UINT n = 0;
+		for(UINT i = 0; i < mVisiblePatches.size(); ++i)
+		{
+			if( mOcclusion->isVisible(mSubGrids[mVisiblePatches[i].patch].box) )
+				mVisiblePatches[n++] = mVisiblePatches[i];
+		}
+		mNumPatchesOccluded = (DWORD)mVisiblePatches.size() - n;
+		mVisiblePatches.resize(n);
+	}
 
+	beginEffect();
+	HR(gd3dDevice->SetStreamSource(0, mSubGridVB, 0, vertexStride()));
 
-	//===============================================================
-	// Write the grid vertices and triangles to the mesh.
+	mNumTrisDrawn = 0;
+	for(UINT i = 0; i < mVisiblePatches.size(); ++i)
+	{
+		const TerrainQuadtree::PatchLOD& p = mVisiblePatches[i];
 
-	VertexPNT* v = 0;
-	HR(mesh->LockVertexBuffer(0, (void**)&v));
-	
-	std::vector<D3DXVECTOR3> verts;
-	std::vector<DWORD> indices;
-	GenTriGrid(mVertRows, mVertCols, mDX, mDZ, D3DXVECTOR3(0.0f, 0.0f, 0.0f), verts, indices);
+		HR(gd3dDevice->SetIndices(mLODIndexBuffers[p.level][p.stitchMask]));
+		HR(gd3dDevice->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, mSubGrids[p.patch].baseVertex, 0, 
+			SubGrid::NUM_VERTS, 0, mLODNumTris[p.level][p.stitchMask]));
+		mNumTrisDrawn += mLODNumTris[p.level][p.stitchMask];
+	}
 
-	float w = mWidth;
-	float d = mDepth;
-	for(UINT i = 0; i < mesh->GetNumVertices(); ++i)
+	// Skirts go in a second loop so the stream is only switched once.
+	if( skirts )
 	{
-		// We store the grid vertices in a linear array, but we can
-		// convert the linear array index to an (r, c) matrix index.
-		int r = i / mVertCols;
-		int c = i % mVertCols;
+		HR(gd3dDevice->SetStreamSource(0, mSkirtVB, 0, vertexStride()));
 
-		v[i].pos   = verts[i];
-		v[i].pos.y = mHeightmap(r, c);
+		for(UINT i = 0; i < mVisiblePatches.size(); ++i)
+		{
+			const TerrainQuadtree::PatchLOD& p = mVisiblePatches[i];
 
-		v[i].tex0.x = (v[i].pos.x + (0.5f*w)) / w;
-		v[i].tex0.y = (v[i].pos.z - (0.5f*d)) / -d;
+			HR(gd3dDevice->SetIndices(mSkirtIndexBuffers[p.level]));
+			HR(gd3dDevice->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, p.patch*SubGrid::NUM_SKIRT_VERTS, 0,
+				SubGrid::NUM_SKIRT_VERTS, 0, mSkirtNumTris[p.level]));
+			mNumTrisDrawn += mSkirtNumTris[p.level];
+		}
 	}
 
-	// Write triangle data so we can compute normals.
+	HR(mFX->EndPass());
+	HR(mFX->End());
+}
 
-	DWORD* indexBuffPtr = 0;
-	HR(mesh->LockIndexBuffer(0, (void**)&indexBuffPtr));
-	for(UINT i = 0; i < mesh->GetNumFaces(); ++i)
+void Terrain::beginEffect()
+{
+	HR(mFX->SetMatrix(mhViewProj, &gCamera->viewProj()));
+
+	// Each terrain has its own ambient occlusion, or none.
+	HR(mFX->SetTexture(mhAOMap, mAOMap ? mAOMap : mWhiteTex));
+	HR(mFX->SetVector(mhAOTexTransform, &mAOTexTransform));
+
+	if( mVertexFormat == VERTEX_COMPACT )
 	{
-		indexBuffPtr[i*3+0] = indices[i*3+0];
-		indexBuffPtr[i*3+1] = indices[i*3+1];
-		indexBuffPtr[i*3+2] = indices[i*3+2];
+		// The effect may be shared with other terrains, so these are set
+		// every time.
+		D3DXVECTOR4 gridToWorld(mDX, -mDZ, mCenter.x - 0.5f*mWidth, mCenter.z + 0.5f*mDepth);
+		D3DXVECTOR2 gridToTex(1.0f / (mVertCols-1), 1.0f / (mVertRows-1));
+		D3DXVECTOR2 heightQuant((mQuantMaxH - mQuantMinH) / 65534.0f, 0.5f*(mQuantMinH + mQuantMaxH));
+		HR(mFX->SetVector(mhGridToWorld, &gridToWorld));
+		HR(mFX->SetValue(mhGridToTex, &gridToTex, sizeof(D3DXVECTOR2)));
+		HR(mFX->SetValue(mhHeightQuant, &heightQuant, sizeof(D3DXVECTOR2)));
+		HR(mFX->SetTechnique(mhCompactTech));
+		HR(gd3dDevice->SetVertexDeclaration(VertexTerrainQ::Decl));
+	}
+	else
+	{
+		HR(mFX->SetTechnique(mhTech));
+		HR(gd3dDevice->SetVertexDeclaration(VertexPNT::Decl));
 	}
-	HR(mesh->UnlockIndexBuffer());
 
-	// Compute Vertex Normals.
-	HR(D3DXComputeNormals(mesh, 0));
+	UINT numPasses = 0;
+	HR(mFX->Begin(&numPasses, 0));
+	HR(mFX->BeginPass(0));
+}
 
-	
+void Terrain::buildGeometry()
+{
 	//===============================================================
-	// Now break the grid up into subgrid meshes.
+	// Break the grid up into subgrid meshes.  The grid is never built
+	// as one mesh: each subgrid's positions, texture coordinates and
+	// normals are computed straight from the heightmap, so there is no
+	// full size copy of the vertices and no D3DXComputeNormals pass.
+	//
+	// Nothing here touches the device; the vertices wait in system
+	// memory until uploadGeometry copies them into vertex buffers.
 
 	// Find out the number of subgrids we'll have.  For example, if
 	// m = 513, n = 257, SUBGRID_VERT_ROWS = SUBGRID_VERT_COLS = 33,
 	// then subGridRows = 512/32 = 16 and sibGridCols = 256/32 = 8.
 	int subGridRows = (mVertRows-1) / (SubGrid::NUM_ROWS-1);
 	int subGridCols = (mVertCols-1) / (SubGrid::NUM_COLS-1);
+	int numSubGrids = subGridRows*subGridCols;
+
+	// Generate each subgrid's vertices and compute its bounding box on the
+	// job system.
+	mPendingVerts.resize(numSubGrids*SubGrid::NUM_VERTS);
+	std::vector<AABB> boxes(numSubGrids);
+
+	SubGridBuildJob job = {0, &mHeightmap, mDX, mDZ, mWidth, mDepth,
+		mCenter.x - 0.5f*mWidth, mCenter.z + 0.5f*mDepth, subGridCols,
+		&mPendingVerts[0], &boxes[0]};
+	JobSystem::run(numSubGrids, 4, buildSubGridVerts, &job);
+
+	// Save the bounding boxes and vertex offsets.  One vertex buffer holds
+	// every subgrid's vertices back to back; a subgrid is drawn by
+	// offsetting the shared indices with its base vertex.
+	mSubGrids.resize(numSubGrids);
+	for(int i = 0; i < numSubGrids; ++i)
+	{
+		mSubGrids[i].box        = boxes[i];
+		mSubGrids[i].baseVertex = i*SubGrid::NUM_VERTS;
+	}
+	mSubGridBVH.build(&boxes[0], numSubGrids);
+	mPatchDirty.assign(numSubGrids, 0);
+
+	//===============================================================
+	// Build the level of detail quadtree over the subgrids, and the
+	// skirts that hang below them.  Each patch's skirt has the patch's
+	// border vertices on top and copies of them dropped straight down
+	// below.
 
-	for(int r = 0; r < subGridRows; ++r)
+	mQuadtree.build(mHeightmap, SubGrid::NUM_ROWS, mDX, mDZ, mCenter);
+
+	mPendingSkirtVerts.resize(numSubGrids*SubGrid::NUM_SKIRT_VERTS);
+	for(int p = 0; p < numSubGrids; ++p)
 	{
-		for(int c = 0; c < subGridCols; ++c)
-		{
-			// Rectangle that indicates (via matrix indices ij) the
-			// portion of grid vertices to use for this subgrid.
-			RECT R = 
-			{
-					c * (SubGrid::NUM_COLS-1),
-					r * (SubGrid::NUM_ROWS-1),
-				(c+1) * (SubGrid::NUM_COLS-1),
-				(r+1) * (SubGrid::NUM_ROWS-1)
-			};
+		fillSkirt(p, &mPendingVerts[p*SubGrid::NUM_VERTS],
+			&mPendingSkirtVerts[p*SubGrid::NUM_SKIRT_VERTS]);
+	}
 
-			buildSubGridMesh(R, v); 
-		}
+	//===============================================================
+	// Compact vertices quantize their heights over a range that covers
+	// the skirts' bottoms as well, padded so that most edits fit without
+	// re-encoding the whole terrain.
+
+	if( mVertexFormat == VERTEX_COMPACT )
+	{
+		float lo = mPendingVerts[0].pos.y;
+		float hi = lo;
+		for(size_t i = 0; i < mPendingVerts.size(); ++i)
+			hi = max(hi, mPendingVerts[i].pos.y);
+		for(size_t i = 0; i < mPendingSkirtVerts.size(); ++i)
+			lo = min(lo, mPendingSkirtVerts[i].pos.y);
+
+		float pad  = 0.25f*(hi - lo) + 1.0f;
+		mQuantMinH = lo - pad;
+		mQuantMaxH = hi + pad;
+	}
+}
+
+void Terrain::uploadGeometry()
+{
+	UINT numVerts = (UINT)mPendingVerts.size();
+	HR(gd3dDevice->CreateVertexBuffer(numVerts*vertexStride(), D3DUSAGE_WRITEONLY,
+		0, D3DPOOL_MANAGED, &mSubGridVB, 0));
+	writeVerts(mSubGridVB, 0, &mPendingVerts[0], numVerts);
+
+	UINT numSkirtVerts = (UINT)mPendingSkirtVerts.size();
+	HR(gd3dDevice->CreateVertexBuffer(numSkirtVerts*vertexStride(), D3DUSAGE_WRITEONLY,
+		0, D3DPOOL_MANAGED, &mSkirtVB, 0));
+	writeVerts(mSkirtVB, 0, &mPendingSkirtVerts[0], numSkirtVerts);
+
+	// The managed buffers keep their own system memory copies.
+	std::vector<VertexPNT>().swap(mPendingVerts);
+	std::vector<VertexPNT>().swap(mPendingSkirtVerts);
+}
+
+UINT Terrain::vertexStride()const
+{
+	return mVertexFormat == VERTEX_COMPACT ? sizeof(VertexTerrainQ) : sizeof(VertexPNT);
+}
+
+void Terrain::writeVerts(IDirect3DVertexBuffer9* vb, UINT first, const VertexPNT* src, UINT n)
+{
+	UINT stride = vertexStride();
+	void* dst = 0;
+	HR(vb->Lock(first*stride, n*stride, &dst, 0));
+
+	if( mVertexFormat == VERTEX_FULL )
+	{
+		memcpy(dst, src, n*sizeof(VertexPNT));
 	}
+	else
+	{
+		// Skirt vertices sit on their border vertex's column and row, so
+		// every vertex's grid position can be read back off its x and z.
+		float originX = mCenter.x - 0.5f*mWidth;
+		float originZ = mCenter.z + 0.5f*mDepth;
 
-	HR(mesh->UnlockVertexBuffer());
+		VertexTerrainQ* q = (VertexTerrainQ*)dst;
+		for(UINT i = 0; i < n; ++i)
+		{
+			q[i].col    = (short)floorf((src[i].pos.x - originX) / mDX + 0.5f);
+			q[i].row    = (short)floorf((originZ - src[i].pos.z) / mDZ + 0.5f);
+			q[i].height = QuantizeHeight(src[i].pos.y, mQuantMinH, mQuantMaxH);
+			q[i].normal = EncodeOctNormal(src[i].normal);
+		}
+	}
 
-	ReleaseCOM(mesh); // Done with global mesh.
+	HR(vb->Unlock());
 }
 
-void Terrain::buildSubGridMesh(RECT& R, VertexPNT* gridVerts)
+void Terrain::buildIndexBuffers()
 {
 	//===============================================================
-	// Get indices for subgrid (we don't use the verts here--the verts
-	// are given by the parameter gridVerts).
-
+	// Every subgrid has the same topology, so optimize its index list for
+	// the vertex cache once and share the result.  Only the faces are
+	// reordered: the LOD index buffers rely on the vertices staying in
+	// row-major order.
 	std::vector<D3DXVECTOR3> tempVerts;
 	std::vector<DWORD> tempIndices;
 	GenTriGrid(SubGrid::NUM_ROWS, SubGrid::NUM_COLS, mDX, mDZ, 
 		D3DXVECTOR3(0.0f, 0.0f, 0.0f), tempVerts, tempIndices);
 
-	ID3DXMesh* subMesh = 0;
-	D3DVERTEXELEMENT9 elems[MAX_FVF_DECL_SIZE];
-	UINT numElems = 0;
-	HR(VertexPNT::Decl->GetDeclaration(elems, &numElems));
-	HR(D3DXCreateMesh(SubGrid::NUM_TRIS, SubGrid::NUM_VERTS, 
-		D3DXMESH_MANAGED, elems, gd3dDevice, &subMesh));
+	std::vector<WORD> indices(tempIndices.begin(), tempIndices.end());
+	std::vector<DWORD> faceRemap(SubGrid::NUM_TRIS);
+	HR(D3DXOptimizeFaces(&indices[0], SubGrid::NUM_TRIS, SubGrid::NUM_VERTS,
+		FALSE, &faceRemap[0]));
 
+	UINT ibBytes = SubGrid::NUM_TRIS*3*sizeof(WORD);
+	HR(gd3dDevice->CreateIndexBuffer(ibBytes, D3DUSAGE_WRITEONLY,
+		D3DFMT_INDEX16, D3DPOOL_MANAGED, &mSubGridIB, 0));
+
+	WORD* k = 0;
+	HR(mSubGridIB->Lock(0, 0, (void**)&k, 0));
+	for(int i = 0; i < SubGrid::NUM_TRIS; ++i)
+	{
+		DWORD f = faceRemap[i];
+		k[i*3+0] = (WORD)tempIndices[f*3+0];
+		k[i*3+1] = (WORD)tempIndices[f*3+1];
+		k[i*3+2] = (WORD)tempIndices[f*3+2];
+	}
+	HR(mSubGridIB->Unlock());
 
 	//===============================================================
-	// Build Vertex Buffer.  Copy rectangle of vertices from the
-	// grid into the subgrid structure.
-	VertexPNT* v = 0;
-	HR(subMesh->LockVertexBuffer(0, (void**)&v));
-	int k = 0;
-	for(int i = R.top; i <= R.bottom; ++i)
-	{
-		for(int j = R.left; j <= R.right; ++j)
+	// The index buffers level of detail selects between.
+	buildLODIndexBuffers();
+	buildSkirtIndexBuffers();
+}
+
+void Terrain::buildLODIndexBuffers()
+{
+	// Every subgrid has the same vertex layout, so one index buffer per
+	// resolution and stitch mask serves all of them.
+	std::vector<WORD>  indices;
+	std::vector<DWORD> faceRemap;
+	for(int L = 0; L < TerrainQuadtree::NUM_LODS; ++L)
+	{
+		for(int m = 0; m < TerrainQuadtree::NUM_STITCH_MASKS; ++m)
 		{
-			v[k++] = gridVerts[i*mVertCols+j];
+			TerrainQuadtree::buildIndices(SubGrid::NUM_ROWS, L, m, indices);
+			DWORD numTris = (DWORD)indices.size() / 3;
+
+			// Reorder the triangles for the vertex cache.
+			faceRemap.resize(numTris);
+			HR(D3DXOptimizeFaces(&indices[0], numTris, SubGrid::NUM_VERTS, 
+				FALSE, &faceRemap[0]));
+
+			IDirect3DIndexBuffer9* ib = 0;
+			HR(gd3dDevice->CreateIndexBuffer(numTris*3*sizeof(WORD), D3DUSAGE_WRITEONLY,
+				D3DFMT_INDEX16, D3DPOOL_MANAGED, &ib, 0));
+
+			WORD* k = 0;
+			HR(ib->Lock(0, 0, (void**)&k, 0));
+			for(DWORD i = 0; i < numTris; ++i)
+			{
+				DWORD f = faceRemap[i];
+				k[i*3+0] = indices[f*3+0];
+				k[i*3+1] = indices[f*3+1];
+				k[i*3+2] = indices[f*3+2];
+			}
+			HR(ib->Unlock());
+
+			mLODIndexBuffers[L][m] = ib;
+			mLODNumTris[L][m]      = numTris;
 		}
 	}
+}
 
+void Terrain::buildSkirtIndexBuffers()
+{
 	//===============================================================
-	// Compute the bounding box before unlocking the vertex buffer.
-	AABB bndBox;
-	HR(D3DXComputeBoundingBox((D3DXVECTOR3*)v, subMesh->GetNumVertices(), 
-		sizeof(VertexPNT), &bndBox.minPt, &bndBox.maxPt));
+	// A level uses every 2^L-th border vertex, the same ones its patch
+	// does, and joins neighbouring pairs with a quad.  The border runs
+	// clockwise, so (top k, bottom k, top k+1) faces outward.
 
-	HR(subMesh->UnlockVertexBuffer());
+	const int numEdge = SubGrid::NUM_EDGE_VERTS;
+	std::vector<WORD> indices;
+	for(int L = 0; L < TerrainQuadtree::NUM_LODS; ++L)
+	{
+		int s = 1 << L;
 
+		indices.clear();
+		for(int k = 0; k < numEdge; k += s)
+		{
+			WORD a  = (WORD)k;
+			WORD b  = (WORD)((k+s) % numEdge);
+			WORD a2 = (WORD)(a+numEdge);
+			WORD b2 = (WORD)(b+numEdge);
 
-	//===============================================================
-	// Build Index and Attribute Buffer.
-	WORD* indices  = 0;
-	DWORD* attBuff = 0;
-	HR(subMesh->LockIndexBuffer(0, (void**)&indices));
-	HR(subMesh->LockAttributeBuffer(0, &attBuff));
-	for(int i = 0; i < SubGrid::NUM_TRIS; ++i)
+			indices.push_back(a); indices.push_back(a2); indices.push_back(b);
+			indices.push_back(b); indices.push_back(a2); indices.push_back(b2);
+		}
+
+		UINT ibBytes = (UINT)(indices.size()*sizeof(WORD));
+		HR(gd3dDevice->CreateIndexBuffer(ibBytes, D3DUSAGE_WRITEONLY,
+			D3DFMT_INDEX16, D3DPOOL_MANAGED, &mSkirtIndexBuffers[L], 0));
+
+		WORD* k = 0;
+		HR(mSkirtIndexBuffers[L]->Lock(0, 0, (void**)&k, 0));
+		memcpy(k, &indices[0], ibBytes);
+		HR(mSkirtIndexBuffers[L]->Unlock());
+
+		mSkirtNumTris[L] = (DWORD)indices.size() / 3;
+	}
+}
+
+void Terrain::fillSkirt(int patch, const VertexPNT* patchVerts, VertexPNT* skirtVerts)
+{
+	// A crack is at most as tall as the coarsest level's error on either
+	// side of it, so that (plus a margin) is how far the skirt hangs.
+	const int numEdge = SubGrid::NUM_EDGE_VERTS;
+	int patchCols = mQuadtree.numPatchCols();
+	int patchRows = mQuadtree.numPatchRows();
+	int pr = patch / patchCols;
+	int pc = patch % patchCols;
+
+	const int coarsest = TerrainQuadtree::NUM_LODS-1;
+	float depth = mQuadtree.getPatchError(patch, coarsest);
+	if( pr > 0 )           depth = max(depth, mQuadtree.getPatchError(patch-patchCols, coarsest));
+	if( pr < patchRows-1 ) depth = max(depth, mQuadtree.getPatchError(patch+patchCols, coarsest));
+	if( pc > 0 )           depth = max(depth, mQuadtree.getPatchError(patch-1, coarsest));
+	if( pc < patchCols-1 ) depth = max(depth, mQuadtree.getPatchError(patch+1, coarsest));
+	depth += max(mDX, mDZ);
+
+	for(int k = 0; k < numEdge; ++k)
 	{
-		indices[i*3+0] = (WORD)tempIndices[i*3+0];
-		indices[i*3+1] = (WORD)tempIndices[i*3+1];
-		indices[i*3+2] = (WORD)tempIndices[i*3+2];
+		skirtVerts[k]         = patchVerts[EdgeVertex(k, SubGrid::NUM_ROWS, SubGrid::NUM_COLS)];
+		skirtVerts[k+numEdge] = skirtVerts[k];
+		skirtVerts[k+numEdge].pos.y -= depth;
+	}
+}
 
-		attBuff[i] = 0; // All in subset 0.
+void Terrain::modifyHeights(const RECT& R, const HeightBrush& brush)
+{
+	RECT changed = mHeightmap.modify(R, brush);
+	if( changed.right < changed.left )
+		return;
+	++mEditCount;
+
+	// A vertex's normal reads the heights one vertex out, so the vertices
+	// to rebuild reach one further than the heights that changed.
+	int top    = max((int)changed.top - 1, 0);
+	int left   = max((int)changed.left - 1, 0);
+	int bottom = min((int)changed.bottom + 1, (int)mVertRows-1);
+	int right  = min((int)changed.right + 1, (int)mVertCols-1);
+
+	// Sub-grids share their border vertices, so a vertex on a border
+	// belongs to the sub-grids on both sides of it.
+	int cells     = SubGrid::NUM_ROWS-1;
+	int patchRows = mQuadtree.numPatchRows();
+	int patchCols = mQuadtree.numPatchCols();
+	int pr0 = top  > 0 ? (top-1)/cells  : 0;
+	int pc0 = left > 0 ? (left-1)/cells : 0;
+	int pr1 = min(bottom/cells, patchRows-1);
+	int pc1 = min(right/cells,  patchCols-1);
+
+	for(int pr = pr0; pr <= pr1; ++pr)
+	{
+		for(int pc = pc0; pc <= pc1; ++pc)
+		{
+			int p = pr*patchCols + pc;
+			if( !mPatchDirty[p] )
+			{
+				mPatchDirty[p] = 1;
+				mDirtyPatches.push_back(p);
+			}
+		}
 	}
-	HR(subMesh->UnlockIndexBuffer());
-	HR(subMesh->UnlockAttributeBuffer());
+}
 
+HorizonBaker::Stats Terrain::bakeAmbientOcclusion(int maxSteps, const std::string& cacheDir,
+												  HorizonBaker::ProgressFunc progress, void* context)
+{
+	Table<float> ao;
+	HorizonBaker::Stats stats;
+	HorizonBaker::bakeCached(mHeightmap, mDX, mDZ, maxSteps, cacheDir, ao, progress, context, &stats);
+
+	// One texel per vertex.  The device may round the size up, so find
+	// out what we got; the extra texels repeat the last row and column.
+	ReleaseCOM(mAOMap);
+	HR(D3DXCreateTexture(gd3dDevice, mVertCols, mVertRows, 1, 0, D3DFMT_L8,
+		D3DPOOL_MANAGED, &mAOMap));
+
+	D3DSURFACE_DESC desc;
+	HR(mAOMap->GetLevelDesc(0, &desc));
+	bool luminance = desc.Format == D3DFMT_L8;
+	if( !luminance && desc.Format != D3DFMT_A8R8G8B8 && desc.Format != D3DFMT_X8R8G8B8 )
+	{
+		ReleaseCOM(mAOMap);
+		HR(D3DXCreateTexture(gd3dDevice, mVertCols, mVertRows, 1, 0, D3DFMT_A8R8G8B8,
+			D3DPOOL_MANAGED, &mAOMap));
+		HR(mAOMap->GetLevelDesc(0, &desc));
+	}
 
-	//===============================================================
-	// Optimize for the vertex cache and build attribute table.
-	DWORD* adj = new DWORD[subMesh->GetNumFaces()*3];
-	HR(subMesh->GenerateAdjacency(EPSILON, adj));
-	HR(subMesh->OptimizeInplace(D3DXMESHOPT_VERTEXCACHE|D3DXMESHOPT_ATTRSORT,
-		adj, 0, 0, 0));
-	delete[] adj;
-
-	
-	//===============================================================
-	// Save the mesh and bounding box.
-	SubGrid g;
-	g.mesh = subMesh;
-	g.box  = bndBox;
-	mSubGrids.push_back(g);
+	D3DLOCKED_RECT lockedRect;
+	HR(mAOMap->LockRect(0, &lockedRect, 0, 0));
+	for(UINT i = 0; i < desc.Height; ++i)
+	{
+		BYTE* row = (BYTE*)lockedRect.pBits + i*lockedRect.Pitch;
+		int r = min((int)i, (int)mVertRows-1);
+		for(UINT j = 0; j < desc.Width; ++j)
+		{
+			int c = min((int)j, (int)mVertCols-1);
+			BYTE v = (BYTE)(ao(r, c)*255.0f + 0.5f);
+			if( luminance )
+				row[j] = v;
+			else
+				((DWORD*)row)[j] = D3DCOLOR_XRGB(v, v, v);
+		}
+	}
+	HR(mAOMap->UnlockRect(0));
+
+	// The blend map coordinates run from 0 to 1 across the terrain; map
+	// them onto the centers of the first mVertCols x mVertRows texels.
+	mAOTexTransform.x = (float)(mVertCols-1) / desc.Width;
+	mAOTexTransform.y = (float)(mVertRows-1) / desc.Height;
+	mAOTexTransform.z = 0.5f / desc.Width;
+	mAOTexTransform.w = 0.5f / desc.Height;
+
+	return stats;
+}
+
+void Terrain::rebuildDirtyPatches()
+{
+	int patchRows = mQuadtree.numPatchRows();
+	int patchCols = mQuadtree.numPatchCols();
+
+	// The LOD errors and bounds of the dirty patches come first: skirts
+	// hang by the coarsest error of their patch and its neighbours, so the
+	// neighbours' skirts have to be redone as well.
+	std::vector<int> patches(mDirtyPatches);
+	for(size_t i = 0; i < mDirtyPatches.size(); ++i)
+	{
+		int p  = mDirtyPatches[i];
+		int pr = p / patchCols;
+		int pc = p % patchCols;
+		mQuadtree.updatePatch(mHeightmap, p);
+
+		int neighbours[4] = {
+			pr > 0           ? p-patchCols : -1,
+			pr < patchRows-1 ? p+patchCols : -1,
+			pc > 0           ? p-1 : -1,
+			pc < patchCols-1 ? p+1 : -1 };
+		for(int k = 0; k < 4; ++k)
+		{
+			if( neighbours[k] >= 0 && !mPatchDirty[neighbours[k]] )
+			{
+				mPatchDirty[neighbours[k]] = 2; // Skirt only.
+				patches.push_back(neighbours[k]);
+			}
+		}
+	}
+	mQuadtree.refit();
+
+	// Regenerate the vertices of all of them on the job system, the same
+	// way buildGeometry does.
+	int numPatches = (int)patches.size();
+	std::vector<VertexPNT> verts(numPatches*SubGrid::NUM_VERTS);
+	std::vector<AABB> boxes(numPatches);
+
+	SubGridBuildJob job = {&patches[0], &mHeightmap, mDX, mDZ, mWidth, mDepth,
+		mCenter.x - 0.5f*mWidth, mCenter.z + 0.5f*mDepth, patchCols,
+		&verts[0], &boxes[0]};
+	JobSystem::run(numPatches, 1, buildSubGridVerts, &job);
+
+	std::vector<VertexPNT> skirts(numPatches*SubGrid::NUM_SKIRT_VERTS);
+	for(int i = 0; i < numPatches; ++i)
+		fillSkirt(patches[i], &verts[i*SubGrid::NUM_VERTS], &skirts[i*SubGrid::NUM_SKIRT_VERTS]);
+
+	// An edit that leaves the compact format's height range needs a new
+	// range, and with it every vertex re-encoded.
+	if( mVertexFormat == VERTEX_COMPACT )
+	{
+		bool inRange = true;
+		for(size_t i = 0; i < verts.size() && inRange; ++i)
+			inRange = verts[i].pos.y <= mQuantMaxH;
+		for(size_t i = 0; i < skirts.size() && inRange; ++i)
+			inRange = skirts[i].pos.y >= mQuantMinH;
+
+		if( !inRange )
+		{
+			ReleaseCOM(mSubGridVB);
+			ReleaseCOM(mSkirtVB);
+			mDirtyPatches.clear();
+			buildGeometry();
+			uploadGeometry();
+			return;
+		}
+	}
+
+	// Copy them over each patch's own range of the buffers.
+	for(int i = 0; i < numPatches; ++i)
+	{
+		int p = patches[i];
+
+		if( mPatchDirty[p] == 1 )
+		{
+			writeVerts(mSubGridVB, mSubGrids[p].baseVertex, &verts[i*SubGrid::NUM_VERTS], SubGrid::NUM_VERTS);
+			mSubGrids[p].box = boxes[i];
+		}
+
+		writeVerts(mSkirtVB, p*SubGrid::NUM_SKIRT_VERTS, &skirts[i*SubGrid::NUM_SKIRT_VERTS],
+			SubGrid::NUM_SKIRT_VERTS);
+
+		mPatchDirty[p] = 0;
+	}
+	mDirtyPatches.clear();
+
+	// The culling hierarchy keeps its shape and only has its boxes redone.
+	std::vector<AABB> allBoxes(mSubGrids.size());
+	for(size_t i = 0; i < mSubGrids.size(); ++i)
+		allBoxes[i] = mSubGrids[i].box;
+	mSubGridBVH.refit(&allBoxes[0]);
+}
+
+void Terrain::buildSubGridVerts(void* context, int begin, int end)
+{
+	const SubGridBuildJob& job = *(const SubGridBuildJob*)context;
+
+	for(int g = begin; g < end; ++g)
+	{
+		// Rectangle that indicates (via matrix indices ij) the
+		// portion of grid vertices to use for this subgrid.
+		int patch = job.patches ? job.patches[g] : g;
+		int top   = (patch / job.subGridCols) * (SubGrid::NUM_ROWS-1);
+		int left  = (patch % job.subGridCols) * (SubGrid::NUM_COLS-1);
+
+		VertexPNT* v = job.subGridVerts + g*SubGrid::NUM_VERTS;
+		AABB& box = job.boxes[g];
+		box = AABB();
+
+		float w = job.width;
+		float d = job.depth;
+
+		int k = 0;
+		for(int i = top; i < top + SubGrid::NUM_ROWS; ++i)
+		{
+			job.heightmap->computeNormals(i, left, SubGrid::NUM_COLS,
+				job.dx, job.dz, &v[k].normal, sizeof(VertexPNT));
+
+			for(int j = left; j < left + SubGrid::NUM_COLS; ++j)
+			{
+				// Same placement as GenTriGrid: centered on the terrain's
+				// center, rows running down -z.
+				v[k].pos.x = (float)j*job.dx + job.originX;
+				v[k].pos.y = (*job.heightmap)(i, j);
+				v[k].pos.z = -(float)i*job.dz + job.originZ;
+
+				v[k].tex0.x = (v[k].pos.x - job.originX) / w;
+				v[k].tex0.y = (v[k].pos.z - job.originZ) / -d;
+
+				D3DXVec3Minimize(&box.minPt, &box.minPt, &v[k].pos);
+				D3DXVec3Maximize(&box.maxPt, &box.maxPt, &v[k].pos);
+				++k;
+			}
+		}
+	}
 }
 
 void Terrain::buildEffect()
@@ -346,6 +1282,12 @@ void Terrain::buildEffect()
 	mhTex1      = mFX->GetParameterByName(0, "gTex1");
 	mhTex2      = mFX->GetParameterByName(0, "gTex2");
 	mhBlendMap  = mFX->GetParameterByName(0, "gBlendMap");
+	mhCompactTech = mFX->GetTechniqueByName("TerrainCompactTech");
+	mhGridToWorld = mFX->GetParameterByName(0, "gGridToWorld");
+	mhGridToTex   = mFX->GetParameterByName(0, "gGridToTex");
+	mhHeightQuant = mFX->GetParameterByName(0, "gHeightQuant");
+	mhAOMap          = mFX->GetParameterByName(0, "gAOMap");
+	mhAOTexTransform = mFX->GetParameterByName(0, "gAOTexTransform");
 	mhFogColor  = mFX->GetParameterByName(0, "gFogColor");
 	mhFogStart  = mFX->GetParameterByName(0, "gFogStart");
 	mhFogRange  = mFX->GetParameterByName(0, "gFogRange");
@@ -1,8 +1,11 @@
 //=============================================================================
 // Terrain.h by Frank Luna (C) 2004 All Rights Reserved.
 //
-// Assumptions: In this book, we only use one terrain per demo and we 
-//              construct the terrain geometry directly in world space.
+// Assumptions: We construct the terrain geometry directly in world space,
+//              centered on getCenter() in the xz-plane (the origin unless
+//              a center is given).  Several terrains can tile a world by
+//              sharing their textures, effect and index buffers; see
+//              TerrainWorld.
 //=============================================================================
 
 #ifndef TERRAIN_H
@@ -11,28 +14,135 @@
 #include "Heightmap.h"
 #include "d3dUtil.h"
 #include "Vertex.h"
+#include "TerrainQuadtree.h"
+#include "FrameArena.h"
+#include "CullingBVH.h"
+#include "HorizonBaker.h"
 
+class OcclusionCuller;
+class PagedHeightmap;
  
 class Terrain
 {
 public:
+	// How the vertex buffers store the vertices.  VERTEX_FULL is a
+	// VertexPNT per vertex.  VERTEX_COMPACT is a VertexTerrainQ, a quarter
+	// the size: x, z and the texture coordinates come from the vertex's
+	// place in the grid, and the height and normal are quantized.
+	enum VertexFormat
+	{
+		VERTEX_FULL,
+		VERTEX_COMPACT
+	};
+
 	Terrain(UINT vertRows, UINT vertCols, float dx, float dz, 
 		std::string heightmap, std::string tex0, std::string tex1, 
 		std::string tex2, std::string blendMap, float heightScale, 
-		float yOffset);
+		float yOffset, Heightmap::RawFormat format = Heightmap::RAW_8BIT,
+		VertexFormat vertexFormat = VERTEX_FULL);
+
+	// Builds a terrain over the given heights (already scaled and
+	// filtered) without touching the device, so it can run on a worker
+	// thread.  One of the createDeviceObjects must be called on the device
+	// thread before the terrain is drawn.
+	Terrain(const Table<float>& heights, float dx, float dz, const D3DXVECTOR3& center,
+		VertexFormat vertexFormat = VERTEX_FULL);
+
+	// Same, over the heights inside R (inclusive) of a paged heightmap.
+	// Only the tiles under R are paged in, so the map can be far bigger
+	// than memory; see TerrainWorld.
+	Terrain(PagedHeightmap& heights, const RECT& R, float dx, float dz,
+		const D3DXVECTOR3& center, VertexFormat vertexFormat = VERTEX_FULL);
+
+	// Creates the textures, effect and buffers, and copies the vertices
+	// into the buffers.
+	void createDeviceObjects(const std::string& tex0, const std::string& tex1,
+		const std::string& tex2, const std::string& blendMap);
+
+	// Same, but shares the textures, effect and index buffers of another
+	// terrain with the same dx and dz instead of creating its own.  The
+	// effect's device reset is then handled through either of them, once.
+	void createDeviceObjects(const Terrain& shareWith);
+
 	~Terrain();
 
 	DWORD getNumTriangles();
 	DWORD getNumVertices();
+	VertexFormat getVertexFormat();
+
+	// CPU-side accounting of the terrain geometry (the system memory copies
+	// of the managed buffers).  "Legacy" is what the same patches would
+	// cost if each one owned a full ID3DXMesh, for comparison.
+	struct MemoryStats
+	{
+		DWORD numPatches;
+		DWORD vertexBytesPerPatch;     // In the terrain's vertex format.
+		DWORD fullVertexBytesPerPatch; // The same vertices as VertexPNT.
+		DWORD bytesPerPatch;       // Vertices plus bounds.
+		DWORD legacyBytesPerPatch; // Vertices, indices, attributes, bounds.
+		DWORD sharedIndexBytes;    // Full resolution index buffer.
+		DWORD lodIndexBytes;       // All the LOD index buffers.
+		DWORD skirtBytes;          // Skirt vertices and index buffers.
+		DWORD totalBytes;
+		DWORD legacyTotalBytes;
+	};
+	MemoryStats getMemoryStats();
 
 	float getWidth();
 	float getDepth();
+	float getDX();
+	float getDZ();
+	const D3DXVECTOR3& getCenter();
+	const Heightmap& getHeightmap();
 
 	void onLostDevice();
 	void onResetDevice();
 
-	// (x, z) relative to terrain's local space.
+	// (x, z) in world space.  Points off the terrain are clamped to its
+	// edge.
 	float getHeight(float x, float z);
+
+	// Batched getHeight for many points at once.  xs, zs and out are
+	// separate arrays of n entries each.  If normals is not null it
+	// receives the normal of the triangle under each point.
+	void getHeights(const float* xs, const float* zs, float* out, size_t n,
+		D3DXVECTOR3* normals = 0);
+
+	// The pieces of getHeight, for callers that keep cells around (see
+	// GroundQuery).  getCell finds the heightmap cell under world (x, z),
+	// clamped to the terrain, and how far across it (x, z) is: s along the
+	// columns and t along the rows.  getCellCorners returns the cell's
+	// heights, top-left, top-right, bottom-left, bottom-right.
+	void getCell(float x, float z, int& row, int& col, float& s, float& t);
+	void getCellCorners(int row, int col, float corners[4]);
+
+	// Goes up by one every time modifyHeights changes the heights, so
+	// anything holding on to heights can tell when they are stale.
+	DWORD getEditCount();
+
+	// Intersects the ray origin + t*dir, 0 <= t <= maxT, with the terrain
+	// surface, in world space.  Returns whether it hits and writes
+	// the nearest hit point to hit if it is not null.  For line of sight
+	// from p to q, cast from p along q - p with maxT = 1.  Safe to call
+	// from several threads at once.
+	bool intersectRay(const D3DXVECTOR3& origin, const D3DXVECTOR3& dir,
+		D3DXVECTOR3* hit, float maxT = INFINITY)const;
+
+	// Applies the brush to the heightmap vertices in R (rows top to bottom,
+	// columns left to right, inclusive); see Heightmap::modify.  Height
+	// queries and ray casts see the edit at once.  The sub-grids it touches
+	// are marked dirty and only their vertices, bounds and skirts are
+	// rebuilt, at the start of the next draw(), so an edit costs in
+	// proportion to the brush rather than the map.
+	void modifyHeights(const RECT& R, const HeightBrush& brush);
+
+	// Bakes ambient occlusion from the heightmap (see HorizonBaker) into a
+	// texture that darkens the terrain's shading, marching maxSteps
+	// vertices out from each vertex.  The bake is cached in cacheDir.
+	// Call on the device thread after createDeviceObjects; edits made
+	// afterwards aren't seen until it is called again.
+	HorizonBaker::Stats bakeAmbientOcclusion(int maxSteps, const std::string& cacheDir,
+		HorizonBaker::ProgressFunc progress = 0, void* context = 0);
 	
 	void setDirToSunW(const D3DXVECTOR3& d);
 	void setFogColor(const D3DXVECTOR3& col);
@@ -42,29 +152,119 @@ public:
 	float getFogStart();
 	float getFogRange();
 
+	// Level of detail.  When enabled, each visible sub-grid is drawn at the
+	// coarsest resolution whose error projects to no more than the given
+	// number of pixels on a viewport of the given height.
+	void setLODEnabled(bool enable);
+	bool isLODEnabled();
+
+	// How level of detail hides the cracks where patches of different
+	// resolutions meet.  Stitching keeps neighbours within one level and
+	// drops vertices along the finer patch's edges.  Skirts hang a strip
+	// of vertical triangles below every patch edge, which lets each patch
+	// pick its level on its own at the cost of the extra triangles.
+	enum LODCrackFix
+	{
+		LOD_STITCH,
+		LOD_SKIRTS
+	};
+	void setLODCrackFix(LODCrackFix fix);
+	LODCrackFix getLODCrackFix();
+	void setLODPixelError(float pixels);
+	void setLODViewportHeight(float height);
+
+	// Sub-grids that pass frustum culling are also tested against the
+	// culler's depth buffer, if one is set, and skipped when hidden.  The
+	// caller renders the culler for the frame before draw().  0 turns
+	// occlusion culling off.
+	void setOcclusionCuller(OcclusionCuller* culler);
+
+	// Sub-grids in the frustum that the last call to draw() found occluded.
+	DWORD getNumPatchesOccluded();
+
+	// Triangles submitted by the last call to draw().
+	DWORD getNumTrianglesDrawn();
+
+	// Heap allocations the last call to draw() made on its own thread.
+	// Zero once the frame arena has grown to fit the visible set.
+	DWORD getNumDrawAllocs();
+
 	void draw();
 
 private:
+	// Make private to prevent copying of members of this class.
+	Terrain(const Terrain& rhs);
+	Terrain& operator=(const Terrain& rhs);
+
+	void init(UINT vertRows, UINT vertCols, float dx, float dz, const D3DXVECTOR3& center,
+		VertexFormat vertexFormat);
+	float sampleHeight(float x, float z, D3DXVECTOR3* normal);
+
+	// buildGeometry does the CPU side work and leaves the vertices in
+	// mPendingVerts and mPendingSkirtVerts for uploadGeometry.
 	void buildGeometry();
-	void buildSubGridMesh(RECT& R, VertexPNT* gridVerts); 
+	void uploadGeometry();
+	void buildIndexBuffers();
+
+	// Copies n vertices into vb starting at vertex first, encoding them if
+	// the terrain is compact.
+	void writeVerts(IDirect3DVertexBuffer9* vb, UINT first, const VertexPNT* src, UINT n);
+	UINT vertexStride()const;
+
+	// Sets the technique and its per terrain constants, and begins its pass.
+	void beginEffect();
+
+	void rebuildDirtyPatches();
+	void fillSkirt(int patch, const VertexPNT* patchVerts, VertexPNT* skirtVerts);
+
+	static void buildSubGridVerts(void* context, int begin, int end);
+
+	// A visible subgrid and its sort key for the front to back sort.
+	struct DrawItem
+	{
+		UINT key;
+		UINT  patch;
+	};
+	DrawItem* sortDrawItems(DrawItem* items, DrawItem* temp, UINT n);
 	void buildEffect();
+	void buildLODIndexBuffers();
+	void buildSkirtIndexBuffers();
+	void drawLOD();
 
+	// A patch of the terrain.  All patches share mSubGridIB; each one owns
+	// NUM_VERTS row-major vertices of mSubGridVB starting at baseVertex.
 	struct SubGrid
 	{
-		ID3DXMesh* mesh;
 		AABB box;
-
-		// For sorting.
-		bool operator<(const SubGrid& rhs)const;
+		UINT baseVertex;
 
 		const static int NUM_ROWS  = 33;
 		const static int NUM_COLS  = 33;
 		const static int NUM_TRIS  = (NUM_ROWS-1)*(NUM_COLS-1)*2;
 		const static int NUM_VERTS = NUM_ROWS*NUM_COLS;
+
+		// Vertices around the patch's border, and the skirt's top and
+		// bottom copies of them.
+		const static int NUM_EDGE_VERTS  = 2*(NUM_ROWS-1) + 2*(NUM_COLS-1);
+		const static int NUM_SKIRT_VERTS = 2*NUM_EDGE_VERTS;
 	};
 private:
 	Heightmap mHeightmap;
 	std::vector<SubGrid> mSubGrids;
+	IDirect3DVertexBuffer9* mSubGridVB;
+	IDirect3DIndexBuffer9*  mSubGridIB;
+
+	// Vertices built but not yet copied into mSubGridVB and mSkirtVB.
+	std::vector<VertexPNT> mPendingVerts;
+	std::vector<VertexPNT> mPendingSkirtVerts;
+
+	// Hierarchy over the sub-grid boxes for frustum culling.
+	CullingBVH mSubGridBVH;
+
+	// Sub-grids whose heights modifyHeights changed since the last draw().
+	std::vector<int>  mDirtyPatches;
+	std::vector<char> mPatchDirty;
+	DWORD mEditCount;
 
 	DWORD mVertRows;
 	DWORD mVertCols;
@@ -75,10 +275,47 @@ private:
 	float mDX;
 	float mDZ;
 
+	D3DXVECTOR3 mCenter;
+
+	// Compact vertices quantize their heights over [mQuantMinH,
+	// mQuantMaxH], which has room to spare for edits.
+	VertexFormat mVertexFormat;
+	float mQuantMinH;
+	float mQuantMaxH;
+
+	// Level of detail.  The index buffers are shared by every sub-grid, one
+	// per resolution and stitch mask.
+	TerrainQuadtree mQuadtree;
+	std::vector<TerrainQuadtree::PatchLOD> mVisiblePatches;
+	IDirect3DIndexBuffer9* mLODIndexBuffers[TerrainQuadtree::NUM_LODS][TerrainQuadtree::NUM_STITCH_MASKS];
+	DWORD mLODNumTris[TerrainQuadtree::NUM_LODS][TerrainQuadtree::NUM_STITCH_MASKS];
+	bool  mLODEnabled;
+	float mLODPixelError;
+	float mLODViewportHeight;
+	DWORD mNumTrisDrawn;
+
+	// Skirts.  Patch i's skirt vertices start at i*NUM_SKIRT_VERTS in
+	// mSkirtVB; one index buffer per level serves every patch.
+	LODCrackFix mLODCrackFix;
+	IDirect3DVertexBuffer9* mSkirtVB;
+	IDirect3DIndexBuffer9*  mSkirtIndexBuffers[TerrainQuadtree::NUM_LODS];
+	DWORD mSkirtNumTris[TerrainQuadtree::NUM_LODS];
+
+	// Per frame scratch memory for the visible list.
+	FrameArena mFrameArena;
+	DWORD mNumDrawAllocs;
+
+	// Not owned.
+	OcclusionCuller* mOcclusion;
+	DWORD mNumPatchesOccluded;
+
 	IDirect3DTexture9* mTex0;
 	IDirect3DTexture9* mTex1;
 	IDirect3DTexture9* mTex2;
 	IDirect3DTexture9* mBlendMap;
+	IDirect3DTexture9* mAOMap;    // 0 until bakeAmbientOcclusion.
+	IDirect3DTexture9* mWhiteTex; // Stands in for mAOMap before then.
+	D3DXVECTOR4        mAOTexTransform;
 	ID3DXEffect*       mFX;
 	D3DXHANDLE         mhTech;
 	D3DXHANDLE         mhViewProj;
@@ -87,6 +324,12 @@ private:
 	D3DXHANDLE         mhTex1;
 	D3DXHANDLE         mhTex2;
 	D3DXHANDLE         mhBlendMap;
+	D3DXHANDLE         mhCompactTech;
+	D3DXHANDLE         mhGridToWorld;
+	D3DXHANDLE         mhGridToTex;
+	D3DXHANDLE         mhHeightQuant;
+	D3DXHANDLE         mhAOMap;
+	D3DXHANDLE         mhAOTexTransform;
 
 	// Fog variables
 	D3DXVECTOR3 mFogColor;
@@ -0,0 +1,430 @@
+//=============================================================================
+// TerrainQuadtree.cpp.
+//=============================================================================
+
+#include "TerrainQuadtree.h"
+#include "Camera.h"
+
+TerrainQuadtree::TerrainQuadtree()
+: mPatchVerts(0), mPatchRows(0), mPatchCols(0), mRoot(-1)
+{
+	mStats.nodesVisited   = 0;
+	mStats.patchesVisible = 0;
+	mStats.numTriangles   = 0;
+}
+
+void TerrainQuadtree::build(const Heightmap& heightmap, int patchVerts, float dx, float dz,
+							const D3DXVECTOR3& center)
+{
+	mPatchVerts = patchVerts;
+	mPatchRows  = (heightmap.numRows()-1) / (patchVerts-1);
+	mPatchCols  = (heightmap.numCols()-1) / (patchVerts-1);
+
+	float width = (heightmap.numCols()-1)*dx;
+	float depth = (heightmap.numRows()-1)*dz;
+
+	mPatchBoxes.resize(numPatches());
+	mPatchErrors.resize(numPatches()*NUM_LODS);
+	mLevels.resize(numPatches());
+	mVisiblePatches.reserve(numPatches());
+
+	//===============================================================
+	// Bounding box and per level geometric error of each patch.
+
+	int cells = patchVerts-1;
+	for(int pr = 0; pr < mPatchRows; ++pr)
+	{
+		for(int pc = 0; pc < mPatchCols; ++pc)
+		{
+			int p  = pr*mPatchCols + pc;
+			int r0 = pr*cells;
+			int c0 = pc*cells;
+
+			// Same placement as GenTriGrid: centered about center, rows
+			// running down the -z axis.
+			AABB& box = mPatchBoxes[p];
+			box.minPt.x = center.x - 0.5f*width + c0*dx;
+			box.maxPt.x = center.x - 0.5f*width + (c0+cells)*dx;
+			box.maxPt.z = center.z + 0.5f*depth - r0*dz;
+			box.minPt.z = center.z + 0.5f*depth - (r0+cells)*dz;
+
+			updatePatch(heightmap, p);
+		}
+	}
+
+	//===============================================================
+	// Build the tree over the patch rectangle.
+
+	mNodes.clear();
+	mNodes.reserve(numPatches()*2);
+	mRoot = buildNode(0, 0, mPatchRows, mPatchCols);
+}
+
+void TerrainQuadtree::refit()
+{
+	// Children are built after their parent, so walking the nodes backwards
+	// visits every child before the node that holds it.
+	for(int i = (int)mNodes.size()-1; i >= 0; --i)
+	{
+		Node& n = mNodes[i];
+		if( n.patch >= 0 )
+		{
+			n.box = mPatchBoxes[n.patch];
+			continue;
+		}
+
+		n.box = AABB();
+		for(int k = 0; k < 4 && n.child[k] >= 0; ++k)
+		{
+			const AABB& cb = mNodes[n.child[k]].box;
+			D3DXVec3Minimize(&n.box.minPt, &n.box.minPt, &cb.minPt);
+			D3DXVec3Maximize(&n.box.maxPt, &n.box.maxPt, &cb.maxPt);
+		}
+	}
+}
+
+void TerrainQuadtree::updatePatch(const Heightmap& heightmap, int p)
+{
+	int cells = mPatchVerts-1;
+	int r0 = (p / mPatchCols)*cells;
+	int c0 = (p % mPatchCols)*cells;
+	// Patches line up with the heightmap's min/max pyramid, so the height
+	// range is a single lookup.
+	AABB& box = mPatchBoxes[p];
+	Heightmap::HeightRange range = heightmap.minMaxRegion(r0, c0, r0+cells, c0+cells);
+	box.minPt.y = range.minH;
+	box.maxPt.y = range.maxH;
+
+	// The error of a level is the largest vertical distance between
+	// the full resolution surface and the surface interpolated from
+	// that level's vertices.  Keep it monotonic so coarser levels
+	// are never considered more accurate than finer ones.
+	float* err = &mPatchErrors[p*NUM_LODS];
+	err[0] = 0.0f;
+	for(int L = 1; L < NUM_LODS; ++L)
+	{
+		int s = 1 << L;
+		float maxErr = err[L-1];
+		for(int i = 0; i <= cells; ++i)
+		{
+			int   i0 = min((i/s)*s, cells-s);
+			float t  = (float)(i-i0) / s;
+			for(int j = 0; j <= cells; ++j)
+			{
+				int   j0 = min((j/s)*s, cells-s);
+				float u  = (float)(j-j0) / s;
+
+				float A = heightmap(r0+i0,   c0+j0);
+				float B = heightmap(r0+i0,   c0+j0+s);
+				float C = heightmap(r0+i0+s, c0+j0);
+				float D = heightmap(r0+i0+s, c0+j0+s);
+				float h = (A*(1.0f-u) + B*u)*(1.0f-t) + (C*(1.0f-u) + D*u)*t;
+
+				maxErr = max(maxErr, fabsf(h - heightmap(r0+i, c0+j)));
+			}
+		}
+		err[L] = maxErr;
+	}
+}
+
+int TerrainQuadtree::buildNode(int r0, int c0, int r1, int c1)
+{
+	int index = (int)mNodes.size();
+	mNodes.push_back(Node());
+
+	Node n;
+	n.child[0] = n.child[1] = n.child[2] = n.child[3] = -1;
+	n.patch = -1;
+
+	if( r1-r0 == 1 && c1-c0 == 1 )
+	{
+		n.patch = r0*mPatchCols + c0;
+		n.box   = mPatchBoxes[n.patch];
+	}
+	else
+	{
+		// Split each axis in half (an axis of length one is not split).
+		int rm = (r1-r0 > 1) ? (r0+r1)/2 : r1;
+		int cm = (c1-c0 > 1) ? (c0+c1)/2 : c1;
+
+		int k = 0;
+		n.child[k++] = buildNode(r0, c0, rm, cm);
+		if( cm < c1 )            n.child[k++] = buildNode(r0, cm, rm, c1);
+		if( rm < r1 )            n.child[k++] = buildNode(rm, c0, r1, cm);
+		if( rm < r1 && cm < c1 ) n.child[k++] = buildNode(rm, cm, r1, c1);
+
+		for(int i = 0; i < k; ++i)
+		{
+			const AABB& cb = mNodes[n.child[i]].box;
+			D3DXVec3Minimize(&n.box.minPt, &n.box.minPt, &cb.minPt);
+			D3DXVec3Maximize(&n.box.maxPt, &n.box.maxPt, &cb.maxPt);
+		}
+	}
+
+	mNodes[index] = n;
+	return index;
+}
+
+void TerrainQuadtree::select(const Camera& camera, float viewportHeight,
+	float pixelError, std::vector<PatchLOD>& out, bool stitch)
+{
+	out.clear();
+	mVisiblePatches.clear();
+	mStats.nodesVisited   = 0;
+	mStats.patchesVisible = 0;
+	mStats.numTriangles   = 0;
+
+	if( mRoot < 0 )
+		return;
+
+	const D3DXVECTOR3& eye = camera.pos();
+
+	// A world space error e at distance d projects to e*K/d pixels, where
+	// K = (viewportHeight/2) / tan(fovY/2).  The projection matrix stores
+	// 1/tan(fovY/2) in its (1,1) entry.
+	float K = 0.5f*viewportHeight*camera.proj()(1,1);
+
+	// When stitching, levels are needed for every patch, not just the
+	// visible ones, since an off-screen neighbour can still force a visible
+	// patch to stitch.  Otherwise only the visible patches need one.
+	if( stitch )
+	{
+		for(int p = 0; p < numPatches(); ++p)
+			mLevels[p] = desiredLevel(p, eye, K, pixelError);
+		balanceLevels();
+	}
+
+	selectNode(mRoot, camera, eye);
+
+	for(UINT i = 0; i < mVisiblePatches.size(); ++i)
+	{
+		int p  = mVisiblePatches[i];
+		int pr = p / mPatchCols;
+		int pc = p % mPatchCols;
+		int L  = stitch ? mLevels[p] : desiredLevel(p, eye, K, pixelError);
+
+		PatchLOD lod;
+		lod.patch      = p;
+		lod.level      = L;
+		lod.stitchMask = 0;
+		if( stitch )
+		{
+			if( pr > 0 && mLevels[p-mPatchCols] > L )
+				lod.stitchMask |= STITCH_NORTH;
+			if( pc < mPatchCols-1 && mLevels[p+1] > L )
+				lod.stitchMask |= STITCH_EAST;
+			if( pr < mPatchRows-1 && mLevels[p+mPatchCols] > L )
+				lod.stitchMask |= STITCH_SOUTH;
+			if( pc > 0 && mLevels[p-1] > L )
+				lod.stitchMask |= STITCH_WEST;
+		}
+
+		out.push_back(lod);
+		mStats.numTriangles += numTriangles(mPatchVerts, lod.level, lod.stitchMask);
+	}
+	mStats.patchesVisible = (int)out.size();
+}
+
+void TerrainQuadtree::selectNode(int node, const Camera& camera, const D3DXVECTOR3& eye)
+{
+	const Node& n = mNodes[node];
+	++mStats.nodesVisited;
+
+	// Whole subtree is outside the frustum.
+	if( !camera.isVisible(n.box) )
+		return;
+
+	if( n.patch >= 0 )
+	{
+		mVisiblePatches.push_back(n.patch);
+		return;
+	}
+
+	// Visit the nearest children first so the output is roughly sorted
+	// front to back without a separate sort.
+	int   order[4];
+	float dist[4];
+	int   k = 0;
+	for(int i = 0; i < 4; ++i)
+	{
+		if( n.child[i] < 0 )
+			continue;
+		D3DXVECTOR3 d = mNodes[n.child[i]].box.center() - eye;
+		float dsq = D3DXVec3LengthSq(&d);
+
+		// Insertion sort; there are at most four children.
+		int j = k++;
+		for(; j > 0 && dist[j-1] > dsq; --j)
+		{
+			dist[j]  = dist[j-1];
+			order[j] = order[j-1];
+		}
+		dist[j]  = dsq;
+		order[j] = n.child[i];
+	}
+
+	for(int i = 0; i < k; ++i)
+		selectNode(order[i], camera, eye);
+}
+
+int TerrainQuadtree::desiredLevel(int patch, const D3DXVECTOR3& eye, float K, float pixelError)const
+{
+	float d = distanceToBox(mPatchBoxes[patch], eye);
+	if( d <= EPSILON )
+		return 0;
+
+	// Coarsest level whose error projects to no more than pixelError pixels.
+	// Errors grow with the level, so walk down from the coarsest.
+	float maxErr = pixelError*d/K;
+	const float* err = &mPatchErrors[patch*NUM_LODS];
+	for(int L = NUM_LODS-1; L > 0; --L)
+	{
+		if( err[L] <= maxErr )
+			return L;
+	}
+	return 0;
+}
+
+void TerrainQuadtree::balanceLevels()
+{
+	// Neighbours may differ by at most one level, otherwise a single stitched
+	// edge can't match them up.  Pull levels down until that holds; each pass
+	// fixes at least one level of difference, so this ends quickly.
+	bool changed = true;
+	while( changed )
+	{
+		changed = false;
+		for(int pr = 0; pr < mPatchRows; ++pr)
+		{
+			for(int pc = 0; pc < mPatchCols; ++pc)
+			{
+				int p = pr*mPatchCols + pc;
+				int m = mLevels[p];
+				if( pr > 0 )            m = min(m, mLevels[p-mPatchCols]+1);
+				if( pr < mPatchRows-1 ) m = min(m, mLevels[p+mPatchCols]+1);
+				if( pc > 0 )            m = min(m, mLevels[p-1]+1);
+				if( pc < mPatchCols-1 ) m = min(m, mLevels[p+1]+1);
+				if( m != mLevels[p] )
+				{
+					mLevels[p] = m;
+					changed = true;
+				}
+			}
+		}
+	}
+}
+
+float TerrainQuadtree::distanceToBox(const AABB& box, const D3DXVECTOR3& p)const
+{
+	D3DXVECTOR3 q;
+	D3DXVec3Maximize(&q, &p, &box.minPt);
+	D3DXVec3Minimize(&q, &q, &box.maxPt);
+	D3DXVECTOR3 d = q - p;
+	return D3DXVec3Length(&d);
+}
+
+int TerrainQuadtree::numPatches()const
+{
+	return mPatchRows*mPatchCols;
+}
+
+int TerrainQuadtree::numPatchRows()const
+{
+	return mPatchRows;
+}
+
+int TerrainQuadtree::numPatchCols()const
+{
+	return mPatchCols;
+}
+
+const AABB& TerrainQuadtree::getPatchBox(int patch)const
+{
+	return mPatchBoxes[patch];
+}
+
+float TerrainQuadtree::getPatchError(int patch, int level)const
+{
+	return mPatchErrors[patch*NUM_LODS + level];
+}
+
+const TerrainQuadtree::Stats& TerrainQuadtree::getStats()const
+{
+	return mStats;
+}
+
+void TerrainQuadtree::buildIndices(int patchVerts, int level, int stitchMask,
+	std::vector<WORD>& indices)
+{
+	// The patch is tiled with blocks of 2x2 cells at the level's spacing, and
+	// each block is drawn as a fan of eight triangles around its center
+	// vertex.  To stitch an edge against a neighbour one level coarser, the
+	// midpoint of every block side lying on that edge is dropped, which
+	// merges its two triangles into one.  What remains on the edge are the
+	// block corners--exactly the vertices the coarser neighbour uses.
+	//
+	//  TL---TM---TR
+	//   | \  |  / |
+	//  LM---C----RM
+	//   | /  |  \ |
+	//  BL---BM---BR
+	//
+	// The ring is listed clockwise (looking down on the terrain), which gives
+	// the same winding as GenTriGrid.
+
+	int cells  = patchVerts-1;
+	int s      = 1 << level;
+	int blocks = cells / (2*s);
+
+	indices.clear();
+	indices.reserve(blocks*blocks*8*3);
+
+	for(int br = 0; br < blocks; ++br)
+	{
+		for(int bc = 0; bc < blocks; ++bc)
+		{
+			int r = br*2*s;
+			int c = bc*2*s;
+
+			bool dropTop    = br == 0        && (stitchMask & STITCH_NORTH) != 0;
+			bool dropRight  = bc == blocks-1 && (stitchMask & STITCH_EAST)  != 0;
+			bool dropBottom = br == blocks-1 && (stitchMask & STITCH_SOUTH) != 0;
+			bool dropLeft   = bc == 0        && (stitchMask & STITCH_WEST)  != 0;
+
+			WORD ring[8];
+			int  n = 0;
+			ring[n++] = (WORD)( r      *patchVerts + c);
+			if( !dropTop )
+				ring[n++] = (WORD)( r      *patchVerts + c+s);
+			ring[n++] = (WORD)( r      *patchVerts + c+2*s);
+			if( !dropRight )
+				ring[n++] = (WORD)((r+s)  *patchVerts + c+2*s);
+			ring[n++] = (WORD)((r+2*s)*patchVerts + c+2*s);
+			if( !dropBottom )
+				ring[n++] = (WORD)((r+2*s)*patchVerts + c+s);
+			ring[n++] = (WORD)((r+2*s)*patchVerts + c);
+			if( !dropLeft )
+				ring[n++] = (WORD)((r+s)  *patchVerts + c);
+
+			WORD center = (WORD)((r+s)*patchVerts + c+s);
+			for(int k = 0; k < n; ++k)
+			{
+				indices.push_back(center);
+				indices.push_back(ring[k]);
+				indices.push_back(ring[(k+1) % n]);
+			}
+		}
+	}
+}
+
+DWORD TerrainQuadtree::numTriangles(int patchVerts, int level, int stitchMask)
+{
+	int blocks = (patchVerts-1) / (2 << level);
+
+	int stitchedSides = 0;
+	for(int bit = 0; bit < 4; ++bit)
+		if( stitchMask & (1 << bit) )
+			++stitchedSides;
+
+	return (DWORD)(blocks*blocks*8 - stitchedSides*blocks);
+}
@@ -0,0 +1,124 @@
+//=============================================================================
+// TerrainQuadtree.h.
+//
+// CPU side level of detail selection for the terrain sub-grids.  The
+// sub-grids are the leaves of a quadtree; every node stores a bounding box
+// and every leaf stores the geometric error of each of its index buffer
+// resolutions, measured against the heightmap.  select() walks the tree,
+// culls it against the camera frustum and picks, for each visible leaf, the
+// coarsest resolution whose projected error stays below a pixel tolerance.
+// Neighbouring leaves never differ by more than one level, and an edge that
+// borders a coarser neighbour is stitched so that no cracks appear.
+//
+// Nothing in here touches the device, so the selection can be run and
+// timed without a window against any Camera.
+//=============================================================================
+
+#ifndef TERRAIN_QUADTREE_H
+#define TERRAIN_QUADTREE_H
+
+#include "d3dUtil.h"
+#include "Heightmap.h"
+#include <vector>
+
+class Camera;
+
+class TerrainQuadtree
+{
+public:
+	// Each leaf keeps NUM_LODS resolutions.  Level 0 uses every vertex of
+	// the patch, level k uses every 2^k-th vertex.
+	static const int NUM_LODS = 5;
+
+	// Stitch mask bits.  A bit is set when the neighbour on that side is one
+	// level coarser, so the shared edge must skip every other vertex.
+	static const int STITCH_NORTH = 1; // Row 0 (+z edge).
+	static const int STITCH_EAST  = 2; // Last column (+x edge).
+	static const int STITCH_SOUTH = 4; // Last row (-z edge).
+	static const int STITCH_WEST  = 8; // Column 0 (-x edge).
+	static const int NUM_STITCH_MASKS = 16;
+
+	struct PatchLOD
+	{
+		int patch;      // Index into the row-major sub-grid array.
+		int level;      // Resolution to draw the patch with.
+		int stitchMask; // Combination of the STITCH_* bits.
+	};
+
+	struct Stats
+	{
+		int   nodesVisited;
+		int   patchesVisible;
+		DWORD numTriangles;
+	};
+
+	TerrainQuadtree();
+
+	// patchVerts is the number of vertices along one side of a patch and
+	// must be 2^NUM_LODS+1 (i.e., 33).  Patches are numbered row-major, the
+	// same way Terrain lays out its sub-grids.  The patch boxes are placed
+	// with the grid centered on center in the xz-plane.
+	void build(const Heightmap& heightmap, int patchVerts, float dx, float dz,
+		const D3DXVECTOR3& center = D3DXVECTOR3(0.0f, 0.0f, 0.0f));
+
+	// Recomputes a patch's height range and errors (build does this for
+	// every patch) after its heights have changed.  Call refit once the
+	// patches are up to date to bring the interior nodes' boxes along.
+	void updatePatch(const Heightmap& heightmap, int patch);
+	void refit();
+
+	// pixelError is the largest projected error, in pixels, allowed for a
+	// viewport that is viewportHeight pixels tall.  The visible patches are
+	// written to out roughly front to back.  If stitch is false every patch
+	// keeps the level it wants and no stitch masks are set; the caller must
+	// hide the cracks some other way (e.g., skirts).
+	void select(const Camera& camera, float viewportHeight, float pixelError,
+		std::vector<PatchLOD>& out, bool stitch = true);
+
+	int numPatches()const;
+	int numPatchRows()const;
+	int numPatchCols()const;
+
+	const AABB& getPatchBox(int patch)const;
+	float getPatchError(int patch, int level)const;
+
+	const Stats& getStats()const;
+
+	// Triangle list for a patch drawn at the given level and stitch mask.
+	// Indices are relative to the patch's own row-major block of vertices.
+	static void buildIndices(int patchVerts, int level, int stitchMask,
+		std::vector<WORD>& indices);
+	static DWORD numTriangles(int patchVerts, int level, int stitchMask);
+
+private:
+	struct Node
+	{
+		AABB box;
+		int  child[4]; // -1 if absent.
+		int  patch;    // Patch index for leaves, -1 for interior nodes.
+	};
+
+	int   buildNode(int r0, int c0, int r1, int c1);
+	void  selectNode(int node, const Camera& camera, const D3DXVECTOR3& eye);
+	int   desiredLevel(int patch, const D3DXVECTOR3& eye, float K, float pixelError)const;
+	void  balanceLevels();
+	float distanceToBox(const AABB& box, const D3DXVECTOR3& p)const;
+
+private:
+	int mPatchVerts;
+	int mPatchRows;
+	int mPatchCols;
+	int mRoot;
+
+	std::vector<AABB>  mPatchBoxes;
+	std::vector<float> mPatchErrors; // NUM_LODS entries per patch.
+	std::vector<Node>  mNodes;
+
+	// Per frame scratch space, kept around so select() does not allocate.
+	std::vector<int> mLevels;
+	std::vector<int> mVisiblePatches;
+
+	Stats mStats;
+};
+
+#endif // TERRAIN_QUADTREE_H
@@ -0,0 +1,430 @@
+//=============================================================================
+// TerrainWorld.cpp.
+//=============================================================================
+
+#include <process.h>
+#include <algorithm>
+#include <cmath>
+#include "TerrainWorld.h"
+
+namespace
+{
+	// Heightmap pages the loader keeps mapped.  copyRegion walks a tile a
+	// row at a time, so this only needs to cover one row of pages across a
+	// tile, but it also bounds how far around the eye pages can be kept.
+	const int MAX_RESIDENT_PAGES = 64;
+
+	// Pages getHeight keeps mapped for the tiles that aren't loaded.
+	// Queries cluster around the camera, so a few are enough.
+	const int MAX_QUERY_PAGES = 16;
+
+	// Orders tile indices by their distance from the eye.
+	struct NearerTile
+	{
+		const float* dist;
+
+		bool operator()(int a, int b)const
+		{
+			return dist[a] < dist[b];
+		}
+	};
+}
+
+TerrainWorld::TerrainWorld(const std::string& tiledHeightmap, int tileVerts, float dx, float dz,
+						   const std::string& tex0, const std::string& tex1, const std::string& tex2,
+						   const std::string& blendMap, float loadRadius, float evictRadius,
+						   Terrain::VertexFormat vertexFormat)
+: mTileVerts(tileVerts), mDX(dx), mDZ(dz), mLoadRadius(loadRadius),
+  mEvictRadius(max(evictRadius, loadRadius)), mVertexFormat(vertexFormat), mEyePage(-1),
+  mTex0(tex0), mTex1(tex1), mTex2(tex2),
+  mBlendMap(blendMap), mDirToSunW(0.0f, 1.0f, 0.0f), mLODEnabled(false),
+  mLODCrackFix(Terrain::LOD_SKIRTS), mLODPixelError(4.0f), mLODViewportHeight(600.0f),
+  mEyeRow(0), mEyeCol(0), mEyeMoved(false), mWake(0), mLoader(0), mQuit(0)
+{
+	ZeroMemory(&mStats, sizeof(mStats));
+	ZeroMemory(&mPageStats, sizeof(mPageStats));
+
+	mHeights.open(tiledHeightmap, MAX_RESIDENT_PAGES);
+	mQueryHeights.open(tiledHeightmap, MAX_QUERY_PAGES);
+	mTileRows = (mHeights.numRows()-1) / (tileVerts-1);
+	mTileCols = (mHeights.numCols()-1) / (tileVerts-1);
+	mWidth    = mTileCols*(tileVerts-1)*dx;
+	mDepth    = mTileRows*(tileVerts-1)*dz;
+
+	// Enough pages to cover the evict radius, as far as the cache allows.
+	mPageSize   = mHeights.tileSize();
+	mPageRadius = (int)ceilf(mEvictRadius / (mPageSize*min(dx, dz)));
+	mPageRadius = min(mPageRadius, mHeights.maxUpdateRadius());
+
+	Tile empty = {0, false, false};
+	mTiles.resize(mTileRows*mTileCols, empty);
+
+	InitializeCriticalSection(&mLock);
+	mWake = CreateEvent(0, FALSE, FALSE, 0);
+	if( mWake == 0 ) HR(E_FAIL);
+
+	// From here on only the loader thread uses mHeights.
+	mLoader = (HANDLE)_beginthreadex(0, 0, loaderMain, this, 0, 0);
+	if( mLoader == 0 ) HR(E_FAIL);
+}
+
+TerrainWorld::~TerrainWorld()
+{
+	// The loader finishes the tile it is on, if any, before it sees mQuit.
+	InterlockedExchange(&mQuit, 1);
+	SetEvent(mWake);
+	WaitForSingleObject(mLoader, INFINITE);
+	CloseHandle(mLoader);
+	CloseHandle(mWake);
+	DeleteCriticalSection(&mLock);
+
+	for(size_t i = 0; i < mFinished.size(); ++i)
+		delete mFinished[i].terrain;
+	for(size_t i = 0; i < mTiles.size(); ++i)
+		delete mTiles[i].terrain;
+}
+
+float TerrainWorld::getWidth()
+{
+	return mWidth;
+}
+
+float TerrainWorld::getDepth()
+{
+	return mDepth;
+}
+
+D3DXVECTOR3 TerrainWorld::tileCenter(int t)const
+{
+	int r = t / mTileCols;
+	int c = t % mTileCols;
+	float tileW = (mTileVerts-1)*mDX;
+	float tileD = (mTileVerts-1)*mDZ;
+
+	// Same placement as a single Terrain: centered on the origin, rows
+	// running down -z.
+	return D3DXVECTOR3(-0.5f*mWidth + (c + 0.5f)*tileW, 0.0f,
+		0.5f*mDepth - (r + 0.5f)*tileD);
+}
+
+float TerrainWorld::tileDistance(int t, const D3DXVECTOR3& p)const
+{
+	D3DXVECTOR3 c = tileCenter(t);
+	float ex = max(fabsf(p.x - c.x) - 0.5f*(mTileVerts-1)*mDX, 0.0f);
+	float ez = max(fabsf(p.z - c.z) - 0.5f*(mTileVerts-1)*mDZ, 0.0f);
+	return sqrtf(ex*ex + ez*ez);
+}
+
+void TerrainWorld::update(const D3DXVECTOR3& eye)
+{
+	int numTiles = (int)mTiles.size();
+
+	// Take back the requests the loader hasn't started, so they can be
+	// reordered for where the eye is now, and collect what it finished.
+	// If the eye has moved to another heightmap page, have the loader
+	// page the heights around it.
+	int eyeRow = (int)((0.5f*mDepth - eye.z) / mDZ);
+	int eyeCol = (int)((eye.x + 0.5f*mWidth) / mDX);
+	eyeRow = min(max(eyeRow, 0), mQueryHeights.numRows()-1);
+	eyeCol = min(max(eyeCol, 0), mQueryHeights.numCols()-1);
+	int eyePage = (eyeRow / mPageSize)*((mQueryHeights.numCols() + mPageSize-1) / mPageSize) + eyeCol / mPageSize;
+	bool eyeMoved = eyePage != mEyePage;
+	mEyePage = eyePage;
+
+	std::vector<FinishedTile>& finished = mFinishedScratch;
+	finished.clear();
+	EnterCriticalSection(&mLock);
+	for(size_t i = 0; i < mRequests.size(); ++i)
+		mTiles[mRequests[i]].pending = false;
+	mRequests.clear();
+	finished.swap(mFinished);
+	if( eyeMoved )
+	{
+		mEyeRow   = eyeRow;
+		mEyeCol   = eyeCol;
+		mEyeMoved = true;
+	}
+	mStats.residentPages = mPageStats.residentTiles;
+	mStats.pagesEvicted  = mPageStats.tileEvictions;
+	LeaveCriticalSection(&mLock);
+
+	std::vector<float>& dist = mDistScratch;
+	dist.resize(numTiles);
+	for(int t = 0; t < numTiles; ++t)
+		dist[t] = tileDistance(t, eye);
+
+	// Finished tiles wait for their upload below, unless the eye has
+	// already moved away from them.
+	for(size_t i = 0; i < finished.size(); ++i)
+	{
+		Tile& tile = mTiles[finished[i].tile];
+		tile.pending = false;
+		if( dist[finished[i].tile] > mEvictRadius )
+			delete finished[i].terrain;
+		else
+			tile.terrain = finished[i].terrain;
+	}
+
+	// Free the tiles that are too far away.
+	for(int t = 0; t < numTiles; ++t)
+	{
+		if( mTiles[t].terrain && dist[t] > mEvictRadius )
+		{
+			if( mTiles[t].onDevice )
+				++mStats.tilesEvicted;
+			freeTile(t);
+		}
+	}
+
+	// Upload the nearest built tile.
+	int nearest = -1;
+	for(int t = 0; t < numTiles; ++t)
+	{
+		if( mTiles[t].terrain && !mTiles[t].onDevice &&
+			(nearest < 0 || dist[t] < dist[nearest]) )
+			nearest = t;
+	}
+	if( nearest >= 0 )
+		uploadTile(nearest);
+
+	// Request the missing tiles in range, nearest first.
+	mRequestScratch.clear();
+	for(int t = 0; t < numTiles; ++t)
+	{
+		if( !mTiles[t].terrain && !mTiles[t].pending && dist[t] <= mLoadRadius )
+			mRequestScratch.push_back(t);
+	}
+	NearerTile nearer = {&dist[0]};
+	std::sort(mRequestScratch.begin(), mRequestScratch.end(), nearer);
+
+	for(size_t i = 0; i < mRequestScratch.size(); ++i)
+		mTiles[mRequestScratch[i]].pending = true;
+
+	if( !mRequestScratch.empty() )
+	{
+		EnterCriticalSection(&mLock);
+		mRequests.assign(mRequestScratch.begin(), mRequestScratch.end());
+		LeaveCriticalSection(&mLock);
+	}
+	if( !mRequestScratch.empty() || eyeMoved )
+		SetEvent(mWake);
+
+	mStats.residentTiles = 0;
+	mStats.pendingTiles  = 0;
+	for(int t = 0; t < numTiles; ++t)
+	{
+		if( mTiles[t].onDevice )
+			++mStats.residentTiles;
+		else if( mTiles[t].pending || mTiles[t].terrain )
+			++mStats.pendingTiles;
+	}
+}
+
+void TerrainWorld::uploadTile(int t)
+{
+	Terrain* terrain = mTiles[t].terrain;
+
+	// Share the device objects of any tile that already has them.
+	const Terrain* shareWith = 0;
+	for(size_t i = 0; i < mTiles.size() && !shareWith; ++i)
+	{
+		if( mTiles[i].onDevice )
+			shareWith = mTiles[i].terrain;
+	}
+
+	if( shareWith )
+		terrain->createDeviceObjects(*shareWith);
+	else
+		terrain->createDeviceObjects(mTex0, mTex1, mTex2, mBlendMap);
+
+	applySettings(terrain);
+	mTiles[t].onDevice = true;
+	++mStats.tilesLoaded;
+}
+
+void TerrainWorld::freeTile(int t)
+{
+	delete mTiles[t].terrain;
+	mTiles[t].terrain  = 0;
+	mTiles[t].onDevice = false;
+}
+
+void TerrainWorld::applySettings(Terrain* terrain)
+{
+	terrain->setDirToSunW(mDirToSunW);
+	terrain->setLODEnabled(mLODEnabled);
+	terrain->setLODCrackFix(mLODCrackFix);
+	terrain->setLODPixelError(mLODPixelError);
+	terrain->setLODViewportHeight(mLODViewportHeight);
+}
+
+void TerrainWorld::draw()
+{
+	mStats.numTrisDrawn  = 0;
+	mStats.numDrawAllocs = 0;
+	for(size_t i = 0; i < mTiles.size(); ++i)
+	{
+		if( mTiles[i].onDevice )
+		{
+			mTiles[i].terrain->draw();
+			mStats.numTrisDrawn  += mTiles[i].terrain->getNumTrianglesDrawn();
+			mStats.numDrawAllocs += mTiles[i].terrain->getNumDrawAllocs();
+		}
+	}
+}
+
+void TerrainWorld::onLostDevice()
+{
+	// The tiles share one effect, so one call covers all of them.
+	for(size_t i = 0; i < mTiles.size(); ++i)
+	{
+		if( mTiles[i].onDevice )
+		{
+			mTiles[i].terrain->onLostDevice();
+			return;
+		}
+	}
+}
+
+void TerrainWorld::onResetDevice()
+{
+	for(size_t i = 0; i < mTiles.size(); ++i)
+	{
+		if( mTiles[i].onDevice )
+		{
+			mTiles[i].terrain->onResetDevice();
+			return;
+		}
+	}
+}
+
+bool TerrainWorld::getHeight(float x, float z, float& h)
+{
+	float c = (x + 0.5f*mWidth) / ((mTileVerts-1)*mDX);
+	float r = (0.5f*mDepth - z) / ((mTileVerts-1)*mDZ);
+	if( c < 0.0f || r < 0.0f || c > (float)mTileCols || r > (float)mTileRows )
+		return false;
+
+	// The far edges belong to the last tile.
+	int t = min((int)r, mTileRows-1)*mTileCols + min((int)c, mTileCols-1);
+	if( mTiles[t].terrain )
+		h = mTiles[t].terrain->getHeight(x, z);
+	else
+		h = mQueryHeights.sampleHeight((0.5f*mDepth - z) / mDZ, (x + 0.5f*mWidth) / mDX);
+	return true;
+}
+
+void TerrainWorld::setDirToSunW(const D3DXVECTOR3& d)
+{
+	mDirToSunW = d;
+	for(size_t i = 0; i < mTiles.size(); ++i)
+	{
+		if( mTiles[i].onDevice )
+			mTiles[i].terrain->setDirToSunW(d);
+	}
+}
+
+void TerrainWorld::setLODEnabled(bool enable)
+{
+	mLODEnabled = enable;
+	for(size_t i = 0; i < mTiles.size(); ++i)
+	{
+		if( mTiles[i].onDevice )
+			mTiles[i].terrain->setLODEnabled(enable);
+	}
+}
+
+void TerrainWorld::setLODCrackFix(Terrain::LODCrackFix fix)
+{
+	mLODCrackFix = fix;
+	for(size_t i = 0; i < mTiles.size(); ++i)
+	{
+		if( mTiles[i].onDevice )
+			mTiles[i].terrain->setLODCrackFix(fix);
+	}
+}
+
+void TerrainWorld::setLODPixelError(float pixels)
+{
+	mLODPixelError = pixels;
+	for(size_t i = 0; i < mTiles.size(); ++i)
+	{
+		if( mTiles[i].onDevice )
+			mTiles[i].terrain->setLODPixelError(pixels);
+	}
+}
+
+void TerrainWorld::setLODViewportHeight(float height)
+{
+	mLODViewportHeight = height;
+	for(size_t i = 0; i < mTiles.size(); ++i)
+	{
+		if( mTiles[i].onDevice )
+			mTiles[i].terrain->setLODViewportHeight(height);
+	}
+}
+
+const TerrainWorld::Stats& TerrainWorld::getStats()const
+{
+	return mStats;
+}
+
+unsigned __stdcall TerrainWorld::loaderMain(void* param)
+{
+	((TerrainWorld*)param)->runLoader();
+	return 0;
+}
+
+void TerrainWorld::runLoader()
+{
+	int cells = mTileVerts-1;
+
+	while( !mQuit )
+	{
+		WaitForSingleObject(mWake, INFINITE);
+
+		// Build tiles until the queue runs dry.
+		while( !mQuit )
+		{
+			EnterCriticalSection(&mLock);
+			bool eyeMoved = mEyeMoved;
+			int  eyeRow   = mEyeRow;
+			int  eyeCol   = mEyeCol;
+			mEyeMoved = false;
+			int t = -1;
+			if( !mRequests.empty() )
+			{
+				t = mRequests.front();
+				mRequests.pop_front();
+			}
+			LeaveCriticalSection(&mLock);
+
+			// Unmap the pages the eye has left behind and map the ones
+			// around it, before building tiles from them.
+			if( eyeMoved )
+			{
+				mHeights.update(eyeRow, eyeCol, mPageRadius);
+				EnterCriticalSection(&mLock);
+				mPageStats = mHeights.getStats();
+				LeaveCriticalSection(&mLock);
+			}
+			if( t < 0 )
+				break;
+
+			RECT R;
+			R.top    = (t / mTileCols)*cells;
+			R.left   = (t % mTileCols)*cells;
+			R.bottom = R.top  + cells;
+			R.right  = R.left + cells;
+
+			FinishedTile done;
+			done.tile    = t;
+			done.terrain = new Terrain(mHeights, R, mDX, mDZ, tileCenter(t), mVertexFormat);
+
+			EnterCriticalSection(&mLock);
+			mFinished.push_back(done);
+			mPageStats = mHeights.getStats();
+			LeaveCriticalSection(&mLock);
+		}
+	}
+}
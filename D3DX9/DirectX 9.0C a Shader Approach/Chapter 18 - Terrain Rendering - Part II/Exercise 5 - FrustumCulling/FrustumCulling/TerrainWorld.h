@@ -0,0 +1,167 @@
+//=============================================================================
+// TerrainWorld.h.
+//
+// A world too big for one Terrain, cut into a grid of square Terrain tiles
+// that are streamed in and out around the camera.  The heights come from a
+// tiled heightmap file (see PagedHeightmap::convertRAW) and the world is
+// centered on the origin, the same way a single Terrain is.
+//
+// Tiles within the load radius of the eye are requested nearest first from
+// a background thread, which copies their heights out of the file and
+// builds their vertices, bounds and LOD data (everything that doesn't need
+// the device).  update() then puts at most one finished tile a frame on the
+// device, so streaming never stalls a frame for long.  All the tiles share
+// one set of textures, one effect and one set of index buffers.  Tiles
+// beyond the (larger) evict radius are freed; the gap between the two radii
+// keeps a tile on the boundary from loading and unloading every frame.
+// When the eye crosses into another heightmap page, the loader also pages
+// in the heights within the evict radius and unmaps the pages beyond it.
+//
+// Neighbouring tiles share their border vertices.  Each tile picks its LOD
+// levels on its own, so the world defaults to skirts to hide the cracks
+// where tiles of different resolutions meet.  Normals along a tile's edge
+// only see that tile's heights, which can leave a faint lighting seam.
+//=============================================================================
+
+#ifndef TERRAIN_WORLD_H
+#define TERRAIN_WORLD_H
+
+#include "Terrain.h"
+#include "PagedHeightmap.h"
+#include <deque>
+#include <string>
+#include <vector>
+
+class TerrainWorld
+{
+public:
+	struct Stats
+	{
+		DWORD residentTiles; // On the device and drawn.
+		DWORD pendingTiles;  // Requested, being built or waiting to upload.
+		DWORD tilesLoaded;   // Totals since construction.
+		DWORD tilesEvicted;
+		DWORD numTrisDrawn;  // By the last call to draw().
+		DWORD numDrawAllocs; // Heap allocations the tiles made in it.
+		DWORD residentPages; // Heightmap pages the loader has mapped.
+		DWORD pagesEvicted;  // Since construction.
+	};
+
+	// tileVerts is the number of vertices along a tile's side, and
+	// tileVerts-1 must be a multiple of 32 (the sub-grid size).  The world
+	// keeps as many whole tiles as fit in the heightmap.
+	TerrainWorld(const std::string& tiledHeightmap, int tileVerts, float dx, float dz,
+		const std::string& tex0, const std::string& tex1, const std::string& tex2,
+		const std::string& blendMap, float loadRadius, float evictRadius,
+		Terrain::VertexFormat vertexFormat = Terrain::VERTEX_FULL);
+	~TerrainWorld();
+
+	float getWidth();
+	float getDepth();
+
+	// Call once a frame, on the device thread, before draw().
+	void update(const D3DXVECTOR3& eye);
+	void draw();
+
+	void onLostDevice();
+	void onResetDevice();
+
+	// Height of the terrain at world (x, z).  Tiles that aren't loaded
+	// are sampled straight from the heightmap file.  Returns false, and
+	// leaves h alone, if (x, z) is off the world.
+	bool getHeight(float x, float z, float& h);
+
+	// These are kept and applied to every tile, including ones that are
+	// loaded later.
+	void setDirToSunW(const D3DXVECTOR3& d);
+	void setLODEnabled(bool enable);
+	void setLODCrackFix(Terrain::LODCrackFix fix);
+	void setLODPixelError(float pixels);
+	void setLODViewportHeight(float height);
+
+	const Stats& getStats()const;
+
+private:
+	// Make private to prevent copying of members of this class.
+	TerrainWorld(const TerrainWorld& rhs);
+	TerrainWorld& operator=(const TerrainWorld& rhs);
+
+	struct Tile
+	{
+		Terrain* terrain;  // Built (on the device if onDevice), or 0.
+		bool     pending;  // Queued for or being built by the loader.
+		bool     onDevice;
+	};
+
+	struct FinishedTile
+	{
+		int      tile;
+		Terrain* terrain;
+	};
+
+	// Distance in the xz-plane from p to tile t's rectangle.
+	float tileDistance(int t, const D3DXVECTOR3& p)const;
+	D3DXVECTOR3 tileCenter(int t)const;
+	void applySettings(Terrain* terrain);
+	void uploadTile(int t);
+	void freeTile(int t);
+
+	static unsigned __stdcall loaderMain(void* param);
+	void runLoader();
+
+private:
+	int   mTileVerts;
+	int   mTileRows;
+	int   mTileCols;
+	float mDX;
+	float mDZ;
+	float mWidth;
+	float mDepth;
+	float mLoadRadius;
+	float mEvictRadius;
+	Terrain::VertexFormat mVertexFormat;
+
+	// Heightmap pages within mPageRadius pages of the eye's stay mapped.
+	int   mPageSize;
+	int   mPageRadius;
+	int   mEyePage;
+
+	std::string mTex0;
+	std::string mTex1;
+	std::string mTex2;
+	std::string mBlendMap;
+
+	// Only the device thread reads or writes these.  The scratch vectors
+	// keep their memory from frame to frame.
+	std::vector<Tile> mTiles;
+	std::vector<int>  mRequestScratch;
+	std::vector<float> mDistScratch;
+	std::vector<FinishedTile> mFinishedScratch;
+
+	D3DXVECTOR3 mDirToSunW;
+	bool  mLODEnabled;
+	Terrain::LODCrackFix mLODCrackFix;
+	float mLODPixelError;
+	float mLODViewportHeight;
+
+	Stats mStats;
+
+	// Shared with the loader thread; guarded by mLock.
+	CRITICAL_SECTION mLock;
+	std::deque<int> mRequests;           // Tiles to build, nearest first.
+	std::vector<FinishedTile> mFinished; // Built, waiting for update().
+	int  mEyeRow;                        // Heightmap vertex under the eye,
+	int  mEyeCol;                        // set when it changes page.
+	bool mEyeMoved;
+	PagedHeightmap::Stats mPageStats;    // The loader's, after its last job.
+	HANDLE mWake;                        // Set when there's work queued.
+	HANDLE mLoader;
+	volatile LONG mQuit;
+
+	// Only the loader thread touches the heightmap once it is running.
+	// getHeight has its own view of the file, so it needs no lock.
+	PagedHeightmap mHeights;
+	PagedHeightmap mQueryHeights;
+};
+
+#endif // TERRAIN_WORLD_H
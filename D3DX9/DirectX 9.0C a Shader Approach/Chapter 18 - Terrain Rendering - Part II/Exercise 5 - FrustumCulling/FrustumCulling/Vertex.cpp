@@ -4,13 +4,16 @@
 
 #include "Vertex.h"
 #include "d3dUtil.h"
+#include <cmath>
 
 // Initialize static variables.
 IDirect3DVertexDeclaration9* VertexPos::Decl = 0;
 IDirect3DVertexDeclaration9* VertexCol::Decl = 0;
 IDirect3DVertexDeclaration9* VertexPN::Decl  = 0;
 IDirect3DVertexDeclaration9* VertexPNT::Decl = 0;
+IDirect3DVertexDeclaration9* VertexTerrainQ::Decl = 0;
 IDirect3DVertexDeclaration9* GrassVertex::Decl = 0;
+IDirect3DVertexDeclaration9* InstanceWorld::Decl = 0;
 
 void InitAllVertexDeclarations()
 {
@@ -58,6 +61,16 @@ void InitAllVertexDeclarations()
 	};	
 	HR(gd3dDevice->CreateVertexDeclaration(VertexPNTElements, &VertexPNT::Decl));
 
+	//===============================================================
+	// VertexTerrainQ
+
+	D3DVERTEXELEMENT9 VertexTerrainQElements[] = 
+	{
+		{0, 0,  D3DDECLTYPE_SHORT4, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0},
+		D3DDECL_END()
+	};	
+	HR(gd3dDevice->CreateVertexDeclaration(VertexTerrainQElements, &VertexTerrainQ::Decl));
+
 	//===============================================================
 	// GrassVertex
 
@@ -71,6 +84,22 @@ void InitAllVertexDeclarations()
 		D3DDECL_END()
 	};	
 	HR(gd3dDevice->CreateVertexDeclaration(GrassVertexElements, &GrassVertex::Decl));
+
+	//===============================================================
+	// InstanceWorld
+
+	D3DVERTEXELEMENT9 InstanceWorldElements[] = 
+	{
+		{0, 0,  D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0},
+		{0, 12, D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_NORMAL, 0},
+		{0, 24, D3DDECLTYPE_FLOAT2, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 0},
+		{1, 0,  D3DDECLTYPE_FLOAT4, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 1},
+		{1, 16, D3DDECLTYPE_FLOAT4, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 2},
+		{1, 32, D3DDECLTYPE_FLOAT4, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 3},
+		{1, 48, D3DDECLTYPE_FLOAT4, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 4},
+		D3DDECL_END()
+	};	
+	HR(gd3dDevice->CreateVertexDeclaration(InstanceWorldElements, &InstanceWorld::Decl));
 }
 
 void DestroyAllVertexDeclarations()
@@ -79,5 +108,66 @@ void DestroyAllVertexDeclarations()
 	ReleaseCOM(VertexCol::Decl);
 	ReleaseCOM(VertexPN::Decl);
 	ReleaseCOM(VertexPNT::Decl);
+	ReleaseCOM(VertexTerrainQ::Decl);
 	ReleaseCOM(GrassVertex::Decl);
-}
\ No newline at end of file
+	ReleaseCOM(InstanceWorld::Decl);
+}
+
+short QuantizeHeight(float h, float minH, float maxH)
+{
+	float scale = (maxH - minH) / 65534.0f;
+	float bias  = 0.5f*(minH + maxH);
+
+	float q = floorf((h - bias) / scale + 0.5f);
+	q = min(max(q, -32767.0f), 32767.0f);
+	return (short)q;
+}
+
+float DequantizeHeight(short q, float minH, float maxH)
+{
+	// Same arithmetic as Terrain.fx.
+	float scale = (maxH - minH) / 65534.0f;
+	float bias  = 0.5f*(minH + maxH);
+	return (float)q*scale + bias;
+}
+
+short EncodeOctNormal(const D3DXVECTOR3& n)
+{
+	float s = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	if( s == 0.0f )
+		return 0;
+
+	float ex = n.x / s;
+	float ez = n.z / s;
+	if( n.y < 0.0f )
+	{
+		float fx = (1.0f - fabsf(ez)) * (ex >= 0.0f ? 1.0f : -1.0f);
+		float fz = (1.0f - fabsf(ex)) * (ez >= 0.0f ? 1.0f : -1.0f);
+		ex = fx;
+		ez = fz;
+	}
+
+	int qx = (int)floorf(ex*127.0f + 0.5f);
+	int qz = (int)floorf(ez*127.0f + 0.5f);
+	return (short)(qx*256 + qz);
+}
+
+D3DXVECTOR3 DecodeOctNormal(short e)
+{
+	// Same arithmetic as Terrain.fx.  z is in [-127, 127], so adding 128
+	// before dividing keeps it from borrowing from x.
+	float qx = floorf(((float)e + 128.0f) / 256.0f);
+	float qz = (float)e - qx*256.0f;
+
+	D3DXVECTOR3 n(qx / 127.0f, 0.0f, qz / 127.0f);
+	n.y = 1.0f - fabsf(n.x) - fabsf(n.z);
+	if( n.y < 0.0f )
+	{
+		float fx = (1.0f - fabsf(n.z)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+		float fz = (1.0f - fabsf(n.x)) * (n.z >= 0.0f ? 1.0f : -1.0f);
+		n.x = fx;
+		n.z = fz;
+	}
+	D3DXVec3Normalize(&n, &n);
+	return n;
+}
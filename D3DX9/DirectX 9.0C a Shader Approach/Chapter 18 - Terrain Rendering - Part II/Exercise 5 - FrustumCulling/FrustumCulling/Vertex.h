@@ -74,6 +74,37 @@ struct VertexPNT
 	static IDirect3DVertexDeclaration9* Decl;
 };
 
+//===============================================================
+// Compact terrain vertex, 8 bytes instead of VertexPNT's 32.  The
+// vertex's column and row in its terrain's grid give x, z and the
+// texture coordinates; the height is quantized to 16 bits over the
+// terrain's height range; the normal is octahedral encoded in two
+// signed bytes.  All four are read as one SHORT4 and expanded by
+// Terrain.fx's compact technique.
+struct VertexTerrainQ
+{
+	short col;
+	short row;
+	short height; // See QuantizeHeight.
+	short normal; // See EncodeOctNormal.
+
+	static IDirect3DVertexDeclaration9* Decl;
+};
+
+// Heights in [minH, maxH] map to [-32767, 32767] and back as
+// q*scale + bias, with scale = (maxH-minH)/65534 and bias the middle of
+// the range.  Heights outside the range are clamped.
+short QuantizeHeight(float h, float minH, float maxH);
+float DequantizeHeight(short q, float minH, float maxH);
+
+// Octahedral normal encoding: the unit vector is projected onto the
+// octahedron |x|+|y|+|z| = 1, the lower half (y < 0) is folded out over
+// the upper half's diamond, and the diamond's (x, z) are stored as two
+// signed bytes, x*256 + z.  Decoding gives back a unit vector within
+// about a degree of the original.
+short EncodeOctNormal(const D3DXVECTOR3& n);
+D3DXVECTOR3 DecodeOctNormal(short e);
+
 //===============================================================
 struct GrassVertex
 {
@@ -93,4 +124,14 @@ struct GrassVertex
 	static IDirect3DVertexDeclaration9* Decl;
 };
 
+//===============================================================
+// Per instance data for hardware instancing.  It is read from stream 1
+// alongside a VertexPNT mesh in stream 0, and Decl describes both streams.
+struct InstanceWorld
+{
+	D3DXMATRIX world;
+
+	static IDirect3DVertexDeclaration9* Decl;
+};
+
 #endif // VERTEX_H
\ No newline at end of file
@@ -186,6 +186,20 @@ void LoadXFile(
 	ReleaseCOM(mtrlBuffer); // done w/ buffer
 }
 
+std::string GetScratchDirectory(const std::string& appName)
+{
+	char temp[MAX_PATH];
+	DWORD n = GetTempPath(MAX_PATH, temp);
+	if( n == 0 || n > MAX_PATH )
+		return "";
+
+	std::string dir = std::string(temp) + appName + "\\";
+
+	// Fails harmlessly if the directory is already there.
+	CreateDirectory(dir.c_str(), 0);
+	return dir;
+}
+
 float GetRandomFloat(float a, float b)
 {
 	if( a >= b ) // bad input
@@ -84,6 +84,14 @@ void LoadXFile(
 	std::vector<Mtrl>& mtrls, 
 	std::vector<IDirect3DTexture9*>& texs);
 
+//===============================================================
+// Files
+
+// Directory for the files a demo writes for itself, such as caches and
+// recordings: appName under the user's temp directory, created if need
+// be.  Ends with a backslash.
+std::string GetScratchDirectory(const std::string& appName);
+
 //===============================================================
 // Math Constants
 
@@ -151,6 +159,26 @@ struct BoundingSphere
 	float radius;
 };
 
+// Many bounding volumes stored as structure of arrays, so they can be
+// tested several at a time with SIMD.  The arrays are not owned.
+struct AABBSoA
+{
+	const float* minX;
+	const float* minY;
+	const float* minZ;
+	const float* maxX;
+	const float* maxY;
+	const float* maxZ;
+};
+
+struct BoundingSphereSoA
+{
+	const float* x;
+	const float* y;
+	const float* z;
+	const float* radius;
+};
+
 //===============================================================
 // Debug
 
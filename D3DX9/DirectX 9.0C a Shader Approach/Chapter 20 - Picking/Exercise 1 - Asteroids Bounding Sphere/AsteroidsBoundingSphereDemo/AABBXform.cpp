@@ -0,0 +1,69 @@
+//=============================================================================
+// AABBXform.cpp.
+//=============================================================================
+
+#include "AABBXform.h"
+#include <emmintrin.h>
+
+AffineMatrix::AffineMatrix(const D3DXMATRIX& M)
+{
+	for(int i = 0; i < 4; ++i)
+		for(int j = 0; j < 3; ++j)
+			m[i*3 + j] = M(i, j);
+}
+
+namespace
+{
+	// The center/extent form of AABB::xform: the center goes through the
+	// whole matrix, the extent through the absolute value of its upper
+	// 3x3.  Lane 3 of the result is unused.
+	inline void XformAABB(float cx, float cy, float cz, float ex, float ey, float ez,
+						  const AffineMatrix& M, AABB& out)
+	{
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+		// Unaligned loads three floats apart pick out the rows; the
+		// fourth lane spills into the next row and is ignored.
+		__m128 r0 = _mm_loadu_ps(M.m);
+		__m128 r1 = _mm_loadu_ps(M.m + 3);
+		__m128 r2 = _mm_loadu_ps(M.m + 6);
+		__m128 r3 = _mm_loadu_ps(M.m + 8);
+		r3 = _mm_shuffle_ps(r3, r3, _MM_SHUFFLE(3, 3, 2, 1));
+
+		__m128 c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(cx), r0), _mm_mul_ps(_mm_set1_ps(cy), r1)),
+							  _mm_add_ps(_mm_mul_ps(_mm_set1_ps(cz), r2), r3));
+		__m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(ex), _mm_and_ps(r0, absMask)),
+										 _mm_mul_ps(_mm_set1_ps(ey), _mm_and_ps(r1, absMask))),
+							  _mm_mul_ps(_mm_set1_ps(ez), _mm_and_ps(r2, absMask)));
+
+		__m128 lo = _mm_sub_ps(c, e);
+		__m128 hi = _mm_add_ps(c, e);
+
+		// minPt and maxPt are six floats in a row: write lo.xyz and hi.x
+		// together, then hi.yz, so nothing past the box is touched.
+		__m128 t  = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(0, 0, 2, 2));
+		__m128 v0 = _mm_shuffle_ps(lo, t, _MM_SHUFFLE(2, 0, 1, 0));
+		__m128 v1 = _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(3, 3, 2, 1));
+		_mm_storeu_ps(&out.minPt.x, v0);
+		_mm_storel_pi((__m64*)&out.maxPt.y, v1);
+	}
+}
+
+void XformAABBs(const AABB* boxes, const AffineMatrix* matrices, AABB* out, UINT n)
+{
+	for(UINT i = 0; i < n; ++i)
+	{
+		const AABB& b = boxes[i];
+		XformAABB(0.5f*(b.minPt.x + b.maxPt.x), 0.5f*(b.minPt.y + b.maxPt.y), 0.5f*(b.minPt.z + b.maxPt.z),
+				  0.5f*(b.maxPt.x - b.minPt.x), 0.5f*(b.maxPt.y - b.minPt.y), 0.5f*(b.maxPt.z - b.minPt.z),
+				  matrices[i], out[i]);
+	}
+}
+
+void XformAABBs(const AABB& box, const AffineMatrix* matrices, AABB* out, UINT n)
+{
+	D3DXVECTOR3 c = box.center();
+	D3DXVECTOR3 e = box.extent();
+	for(UINT i = 0; i < n; ++i)
+		XformAABB(c.x, c.y, c.z, e.x, e.y, e.z, matrices[i], out[i]);
+}
@@ -0,0 +1,30 @@
+//=============================================================================
+// AABBXform.h.
+//
+// Transforms many AABBs to world space at once with SSE, for the asteroids
+// and anything else that moves its boxes every frame.
+//=============================================================================
+
+#ifndef AABB_XFORM_H
+#define AABB_XFORM_H
+
+#include "d3dUtil.h"
+
+// The affine part of a world matrix, _11 to _43 row by row: three floats
+// per row instead of four.
+struct AffineMatrix
+{
+	AffineMatrix(){}
+	AffineMatrix(const D3DXMATRIX& M);
+
+	float m[12];
+};
+
+// out[i] = boxes[i] transformed by matrices[i], the same box AABB::xform
+// gives, but for many boxes at once and with SSE.  out may be boxes.
+void XformAABBs(const AABB* boxes, const AffineMatrix* matrices, AABB* out, UINT n);
+
+// Same, with one box under every matrix, as for many instances of a mesh.
+void XformAABBs(const AABB& box, const AffineMatrix* matrices, AABB* out, UINT n);
+
+#endif // AABB_XFORM_H
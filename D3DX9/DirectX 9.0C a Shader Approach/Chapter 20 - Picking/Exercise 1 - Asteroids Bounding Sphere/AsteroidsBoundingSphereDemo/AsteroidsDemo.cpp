@@ -59,6 +59,11 @@ AsteroidsDemo::AsteroidsDemo(HINSTANCE hInstance, std::string winCaption, D3DDEV
 		&mAsteroidSphere.pos, &mAsteroidSphere.radius));
 	HR(mAsteroidMesh->UnlockVertexBuffer());
 
+	// The asteroids turn about their local origin, so their spheres are
+	// centered there, and cells twice as wide suit the grid best.
+	mAsteroidRadius = D3DXVec3Length(&mAsteroidSphere.pos) + mAsteroidSphere.radius;
+	mAsteroidGrid   = new SpatialHash(2.0f*mAsteroidRadius, 1024);
+
 	// Initialize camera.
 	gCamera->pos() = D3DXVECTOR3(0.0f, 0.0f, 0.0f);
 	gCamera->setSpeed(40.0f);
@@ -96,6 +101,7 @@ AsteroidsDemo::AsteroidsDemo(HINSTANCE hInstance, std::string winCaption, D3DDEV
 AsteroidsDemo::~AsteroidsDemo()
 {
 	delete mGfxStats;
+	delete mAsteroidGrid;
 	ReleaseCOM(mWhiteTex);
 	ReleaseCOM(mFX);
 	delete mFireWork;
@@ -155,12 +161,12 @@ void AsteroidsDemo::updateScene(float dt)
 	gCamera->update(dt, 0, 0);
 
 	// Update the asteroids' orientation and position.
-	std::list<Asteroid>::iterator asteroidIter = mAsteroids.begin();
-	while( asteroidIter != mAsteroids.end() )
+	for(UINT i = 0; i < mAsteroids.size(); ++i)
 	{
-		asteroidIter->theta += 4.0f*dt;
-		asteroidIter->pos += asteroidIter->vel*dt;
-		++asteroidIter;
+		Asteroid& a = mAsteroids[i];
+		a.theta += 4.0f*dt;
+		a.pos += a.vel*dt;
+		mAsteroidGrid->move(a.gridHandle, a.pos);
 	}
 
 
@@ -192,63 +198,43 @@ void AsteroidsDemo::drawScene()
 	HR(mFX->BeginPass(0));
 
 	// Did we pick anything?
-	D3DXVECTOR3 originW(0.0f, 0.0f, 0.0f);
-	D3DXVECTOR3 dirW(0.0f, 0.0f, 0.0f);
-
-	BOOL hasHit = false;
-	bool asteroidHit = false;
-	float distanceToCollision;
-	float closestHit = FLT_MAX;
-	std::list<Asteroid>::iterator iterAsteroidHit;
-	std::list<Asteroid>::iterator iter = mAsteroids.begin();
-	while( iter != mAsteroids.end() )
+	if( gDInput->mouseButtonPressed(0) )
+		pickAsteroid();
+
+	// Rule out asteroids by their spheres first: a sphere holds its
+	// asteroid however it is turned, so needs no transform.  Only the rest
+	// need their AABBs in world space, all transformed in one go.  With
+	// the asteroids spread over the whole view, scanning them all beats
+	// asking mAsteroidGrid for the ones near the frustum (see the
+	// HeadlessBench hash suite).
+	mAsteroidsInView.clear();
+	for(UINT i = 0; i < (UINT)mAsteroids.size(); ++i)
 	{
-		// Build world matrix based on current rotation and position settings.
-		D3DXMATRIX R, T;
-		D3DXMatrixRotationAxis(&R, &iter->axis, iter->theta);
-		D3DXMatrixTranslation(&T, iter->pos.x, iter->pos.y, iter->pos.z);
-
-		D3DXMATRIX toWorld = R*T;
+		BoundingSphere sphere;
+		sphere.pos    = mAsteroids[i].pos;
+		sphere.radius = mAsteroidRadius;
+		if( gCamera->isVisible(sphere) )
+			mAsteroidsInView.push_back(i);
+	}
+	UINT numInView = (UINT)mAsteroidsInView.size();
+	mAsteroidWorlds.resize(numInView);
+	mAsteroidXforms.resize(numInView);
+	mAsteroidBoxes.resize(numInView);
+	for(UINT i = 0; i < numInView; ++i)
+	{
+		mAsteroidWorlds[i] = getAsteroidWorld(mAsteroids[mAsteroidsInView[i]]);
+		mAsteroidXforms[i] = AffineMatrix(mAsteroidWorlds[i]);
+	}
+	if( numInView > 0 )
+		XformAABBs(mAsteroidBox, &mAsteroidXforms[0], &mAsteroidBoxes[0], numInView);
 
-		// Transform AABB to world space.
-		AABB box;
-		mAsteroidBox.xform(toWorld, box);
+	for(UINT i = 0; i < numInView; ++i)
+	{
+		const D3DXMATRIX& toWorld = mAsteroidWorlds[i];
 
-		// Only draw if AABB is visible and only do the picking check if the AABB is visible.
-		if( gCamera->isVisible( box ) )
+		// Only draw if AABB is visible.
+		if( gCamera->isVisible( mAsteroidBoxes[i] ) )
 		{
-			if( gDInput->mouseButtonPressed(0) ) //If the left-mouse button was pressed
-			{
-				getWorldPickingRay(originW, dirW);
-				// Did we pick it?
-				if(D3DXBoxBoundProbe(&box.minPt, &box.maxPt, &originW, &dirW))
-				{
-					//Ray intersects the bounding volume, now check if it actually intersects the model's mesh
-					D3DXMATRIX invView;
-					D3DXVECTOR3 originL, dirL;
-					D3DXMatrixInverse(&invView, 0, &toWorld);
-
-					// Transform picking ray to model's local space.
-					D3DXVec3TransformCoord(&originL, &originW, &invView);
-					D3DXVec3TransformNormal(&dirL, &dirW, &invView);
-					D3DXVec3Normalize(&dirL, &dirL);
-
-					D3DXIntersect(mAsteroidMesh, &originL, &dirL, &hasHit, NULL, NULL, NULL, &distanceToCollision, NULL, NULL);
-					if (hasHit){
-						asteroidHit = true; //used to determine whether or not to explode an asteroid
-						if (distanceToCollision < closestHit){
-							iterAsteroidHit = iter;
-							// Create a firework instance.
-							FireWorkInstance inst;
-							inst.time = 0.0f;
-							inst.toWorld = toWorld;
-							mFireWorkInstances.clear();
-							mFireWorkInstances.push_back(inst);
-						}
-					}
-				}
-			}
-
 			HR(mFX->SetMatrix(mhWVP, &(toWorld*gCamera->viewProj())));
 			D3DXMATRIX worldInvTrans;
 			D3DXMatrixInverse(&worldInvTrans, 0, &toWorld);
@@ -278,13 +264,6 @@ void AsteroidsDemo::drawScene()
 				HR(mAsteroidMesh->DrawSubset(j));
 			}
 		}
-			++iter;
-	}
-	if (asteroidHit)
-	{
-		// Remove asteroid from list
-		iter = mAsteroids.erase(iterAsteroidHit);
-		asteroidHit = false;
 	}
 	 
 	HR(mFX->EndPass());
@@ -331,10 +310,87 @@ void AsteroidsDemo::initAsteroids()
 		GetRandomVec(dir);
 		a.vel = speed*dir;
 
+		a.gridHandle = mAsteroidGrid->insert(a.pos, mAsteroidRadius, (UINT)mAsteroids.size());
 		mAsteroids.push_back(a);
 	}
 }
 
+void AsteroidsDemo::pickAsteroid()
+{
+	D3DXVECTOR3 originW, dirW;
+	getWorldPickingRay(originW, dirW);
+
+	// The asteroids whose bounding spheres the ray passes through before
+	// the far plane, nearest first.
+	mPickHits.clear();
+	mAsteroidGrid->queryRay(originW, dirW, 5000.0f, mPickHits);
+
+	int   hitAsteroid = -1;
+	float closestHit  = FLT_MAX;
+	for(UINT i = 0; i < mPickHits.size(); ++i)
+	{
+		// The mesh is inside its sphere, so once the spheres start past
+		// the nearest hit, so do the meshes.
+		if( mPickHits[i].t > closestHit )
+			break;
+
+		UINT a = mAsteroidGrid->getData(mPickHits[i].handle);
+		D3DXMATRIX toWorld = getAsteroidWorld(mAsteroids[a]);
+
+		// Transform picking ray to model's local space.
+		D3DXMATRIX invWorld;
+		D3DXVECTOR3 originL, dirL;
+		D3DXMatrixInverse(&invWorld, 0, &toWorld);
+		D3DXVec3TransformCoord(&originL, &originW, &invWorld);
+		D3DXVec3TransformNormal(&dirL, &dirW, &invWorld);
+		D3DXVec3Normalize(&dirL, &dirL);
+
+		// The world matrix has no scaling, so the distance is the same in
+		// both spaces.
+		BOOL hasHit = false;
+		float distanceToCollision = 0.0f;
+		HR(D3DXIntersect(mAsteroidMesh, &originL, &dirL, &hasHit, 0, 0, 0, &distanceToCollision, 0, 0));
+		if( hasHit && distanceToCollision < closestHit )
+		{
+			closestHit  = distanceToCollision;
+			hitAsteroid = (int)a;
+		}
+	}
+
+	if( hitAsteroid >= 0 )
+	{
+		// Create a firework instance.
+		FireWorkInstance inst;
+		inst.time = 0.0f;
+		inst.toWorld = getAsteroidWorld(mAsteroids[hitAsteroid]);
+		mFireWorkInstances.clear();
+		mFireWorkInstances.push_back(inst);
+
+		removeAsteroid(hitAsteroid);
+	}
+}
+
+void AsteroidsDemo::removeAsteroid(UINT i)
+{
+	// Move the last asteroid into the hole to keep the array packed.
+	mAsteroidGrid->remove(mAsteroids[i].gridHandle);
+	if( i + 1 < mAsteroids.size() )
+	{
+		mAsteroids[i] = mAsteroids.back();
+		mAsteroidGrid->setData(mAsteroids[i].gridHandle, i);
+	}
+	mAsteroids.pop_back();
+}
+
+D3DXMATRIX AsteroidsDemo::getAsteroidWorld(const Asteroid& a)const
+{
+	// Build world matrix based on current rotation and position settings.
+	D3DXMATRIX R, T;
+	D3DXMatrixRotationAxis(&R, &a.axis, a.theta);
+	D3DXMatrixTranslation(&T, a.pos.x, a.pos.y, a.pos.z);
+	return R*T;
+}
+
 void AsteroidsDemo::buildFX()
 {
 	// Create the FX from a .fx file.
@@ -8,6 +8,8 @@
 #include "Terrain.h"
 #include "Camera.h"
 #include "FireWork.h"
+#include "SpatialHash.h"
+#include "AABBXform.h"
 
 // In order to not duplicate firework systems, we create
 // a firework "instance" structure, which stores the position of
@@ -29,6 +31,7 @@ struct Asteroid
 	float theta;
 	D3DXVECTOR3 pos;
 	D3DXVECTOR3 vel;
+	UINT gridHandle; // In AsteroidsDemo::mAsteroidGrid.
 };
 
 class AsteroidsDemo : public D3DApp
@@ -46,6 +49,9 @@ public:
 	void initAsteroids();
 	void buildFX();
 	void getWorldPickingRay(D3DXVECTOR3& originW, D3DXVECTOR3& dirW);
+	void pickAsteroid();
+	void removeAsteroid(UINT i);
+	D3DXMATRIX getAsteroidWorld(const Asteroid& a)const;
 
 private:
 	GfxStats* mGfxStats;
@@ -58,9 +64,21 @@ private:
 	// A list of firework *instances*
 	std::list<FireWorkInstance> mFireWorkInstances;
 
-	// A list of asteroids.
+	// The asteroids, and a grid over their bounding spheres for finding
+	// the ones under the cursor.  The grid's data for an asteroid is its
+	// index in mAsteroids.
 	static const int NUM_ASTEROIDS = 300;
-	std::list<Asteroid> mAsteroids;
+	std::vector<Asteroid> mAsteroids;
+	SpatialHash* mAsteroidGrid;
+	float mAsteroidRadius; // Around Asteroid::pos, however it is turned.
+	std::vector<SpatialHash::RayHit> mPickHits;
+	std::vector<UINT> mAsteroidsInView; // Whose spheres are, this frame.
+
+	// This frame's world matrices and world boxes of the asteroids whose
+	// spheres are in view, in the order of mAsteroidsInView.
+	std::vector<D3DXMATRIX>   mAsteroidWorlds;
+	std::vector<AffineMatrix> mAsteroidXforms;
+	std::vector<AABB>         mAsteroidBoxes;
 
 	// We only need one actual mesh, as we just draw the same mesh several
 	// times per frame in different positions to simulate multiple asteroids.
@@ -147,6 +147,19 @@ bool Camera::isVisible(const AABB& box)const
 	return true;
 }
 
+bool Camera::isVisible(const BoundingSphere& sphere)const
+{
+	// Calculate distances between sphere and each of the planes
+	for (UINT i = 0; i < 6; ++i)
+	{
+		//Find distance to this plane - Assumes frustum planes are already normalised
+		if (D3DXPlaneDotCoord(&mFrustumPlanes[i], &sphere.pos) + sphere.radius < 0)
+			return false;
+	}
+
+	return true;
+}
+
 void Camera::update(float dt, Terrain* terrain, float offsetHeight)
 {
 	// Find the net direction the camera is traveling in (since the
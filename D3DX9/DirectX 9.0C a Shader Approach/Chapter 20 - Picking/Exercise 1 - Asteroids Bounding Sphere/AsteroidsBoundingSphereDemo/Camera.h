@@ -32,6 +32,8 @@ public:
 
 	// Box coordinates should be relative to world space.
 	bool isVisible(const AABB& box)const;
+	// Sphere coordinates should be relative to world space.
+	bool isVisible(const BoundingSphere& sphere)const;
 
 	void update(float dt, Terrain* terrain, float offsetHeight);
 
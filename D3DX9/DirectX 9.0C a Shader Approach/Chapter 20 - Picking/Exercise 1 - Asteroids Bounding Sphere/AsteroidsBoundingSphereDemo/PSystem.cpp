@@ -6,6 +6,7 @@
 #include "Camera.h"
 #include "d3dApp.h"
 #include "d3dUtil.h"
+#include "AABBXform.h"
 #include <cassert>
 
 PSystem::PSystem(const std::string& fxName, 
@@ -202,7 +203,8 @@ void PSystem::draw()
 	HR(gd3dDevice->SetVertexDeclaration(Particle::Decl));
 
 	AABB boxWorld;
-	mBox.xform(mWorld, boxWorld);
+	AffineMatrix world(mWorld);
+	XformAABBs(mBox, &world, &boxWorld, 1);
 	if( gCamera->isVisible( boxWorld ) )
 	{
 		// Initial lock of VB for writing.
@@ -0,0 +1,444 @@
+//=============================================================================
+// SpatialHash.cpp.
+//=============================================================================
+
+#include "SpatialHash.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+	// Keeps cell coordinates far from overflowing for any sane position.
+	const float MAX_CELL = 1.0e9f;
+
+	bool NearerHit(const SpatialHash::RayHit& a, const SpatialHash::RayHit& b)
+	{
+		return a.t < b.t;
+	}
+
+	float Axis(const D3DXVECTOR3& v, int a)
+	{
+		return (&v.x)[a];
+	}
+}
+
+SpatialHash::SpatialHash(float cellSize, UINT numBuckets)
+: mCellSize(cellSize), mInvCellSize(1.0f / cellSize), mFreeHead(NONE), mNumObjects(0),
+  mMaxRadius(0.0f), mStamp(0)
+{
+	UINT n = 1;
+	while( n < numBuckets )
+		n <<= 1;
+	mBucketMask = n - 1;
+
+	mBuckets.resize(n, NONE);
+	mBucketStamps.resize(n, 0);
+	ZeroMemory(&mStats, sizeof(mStats));
+}
+
+int SpatialHash::cellOf(float x)const
+{
+	float c = floorf(x * mInvCellSize);
+	return (int)max(-MAX_CELL, min(c, MAX_CELL));
+}
+
+UINT SpatialHash::bucketOf(int x, int y, int z)const
+{
+	return ((UINT)x*73856093u ^ (UINT)y*19349663u ^ (UINT)z*83492791u) & mBucketMask;
+}
+
+void SpatialHash::link(UINT handle, UINT bucket)
+{
+	Entry& e = mEntries[handle];
+	e.bucket = bucket;
+	e.prev   = NONE;
+	e.next   = mBuckets[bucket];
+	if( e.next != NONE )
+		mEntries[e.next].prev = handle;
+	mBuckets[bucket] = handle;
+}
+
+void SpatialHash::unlink(UINT handle)
+{
+	Entry& e = mEntries[handle];
+	if( e.prev != NONE )
+		mEntries[e.prev].next = e.next;
+	else
+		mBuckets[e.bucket] = e.next;
+	if( e.next != NONE )
+		mEntries[e.next].prev = e.prev;
+}
+
+UINT SpatialHash::insert(const D3DXVECTOR3& pos, float radius, UINT data)
+{
+	UINT handle;
+	if( mFreeHead != NONE )
+	{
+		handle    = mFreeHead;
+		mFreeHead = mEntries[handle].next;
+	}
+	else
+	{
+		handle = (UINT)mEntries.size();
+		mEntries.push_back(Entry());
+	}
+
+	Entry& e = mEntries[handle];
+	e.pos    = pos;
+	e.radius = radius;
+	e.data   = data;
+	link(handle, bucketOf(cellOf(pos.x), cellOf(pos.y), cellOf(pos.z)));
+	++mNumObjects;
+
+	mMaxRadius = max(mMaxRadius, radius);
+	D3DXVec3Minimize(&mBounds.minPt, &mBounds.minPt, &pos);
+	D3DXVec3Maximize(&mBounds.maxPt, &mBounds.maxPt, &pos);
+	return handle;
+}
+
+void SpatialHash::move(UINT handle, const D3DXVECTOR3& pos)
+{
+	Entry& e = mEntries[handle];
+	e.pos = pos;
+	D3DXVec3Minimize(&mBounds.minPt, &mBounds.minPt, &pos);
+	D3DXVec3Maximize(&mBounds.maxPt, &mBounds.maxPt, &pos);
+
+	// Queries test every object in a bucket, so moving between cells that
+	// share a bucket needs no relinking.
+	UINT bucket = bucketOf(cellOf(pos.x), cellOf(pos.y), cellOf(pos.z));
+	if( bucket != e.bucket )
+	{
+		unlink(handle);
+		link(handle, bucket);
+	}
+}
+
+void SpatialHash::remove(UINT handle)
+{
+	unlink(handle);
+
+	Entry& e  = mEntries[handle];
+	e.bucket  = NONE;
+	e.next    = mFreeHead;
+	mFreeHead = handle;
+	--mNumObjects;
+}
+
+void SpatialHash::clear()
+{
+	mEntries.clear();
+	std::fill(mBuckets.begin(), mBuckets.end(), NONE);
+	mFreeHead   = NONE;
+	mNumObjects = 0;
+	mMaxRadius  = 0.0f;
+	mBounds     = AABB();
+}
+
+UINT SpatialHash::size()const
+{
+	return mNumObjects;
+}
+
+const D3DXVECTOR3& SpatialHash::getPos(UINT handle)const
+{
+	return mEntries[handle].pos;
+}
+
+float SpatialHash::getRadius(UINT handle)const
+{
+	return mEntries[handle].radius;
+}
+
+UINT SpatialHash::getData(UINT handle)const
+{
+	return mEntries[handle].data;
+}
+
+void SpatialHash::setData(UINT handle, UINT data)
+{
+	mEntries[handle].data = data;
+}
+
+void SpatialHash::newQuery()
+{
+	mVisit.clear();
+
+	// On wrapping around, stamps from 2^32 queries ago could match again.
+	if( ++mStamp == 0 )
+	{
+		std::fill(mBucketStamps.begin(), mBucketStamps.end(), 0);
+		mStamp = 1;
+	}
+}
+
+void SpatialHash::gatherBucket(UINT bucket)
+{
+	if( mBucketStamps[bucket] != mStamp )
+	{
+		mBucketStamps[bucket] = mStamp;
+		mVisit.push_back(bucket);
+	}
+}
+
+void SpatialHash::gatherCells(const int lo[3], const int hi[3])
+{
+	// Past one cell per bucket, every bucket is visited anyway.
+	double numCells = 1.0;
+	for(int a = 0; a < 3; ++a)
+		numCells *= (double)hi[a] - lo[a] + 1;
+
+	if( numCells >= mBuckets.size() )
+	{
+		for(UINT b = 0; b < mBuckets.size(); ++b)
+			gatherBucket(b);
+		return;
+	}
+
+	for(int z = lo[2]; z <= hi[2]; ++z)
+		for(int y = lo[1]; y <= hi[1]; ++y)
+			for(int x = lo[0]; x <= hi[0]; ++x)
+				gatherBucket(bucketOf(x, y, z));
+}
+
+UINT SpatialHash::queryBox(const AABB& box, std::vector<UINT>& out)
+{
+	ZeroMemory(&mStats, sizeof(mStats));
+	newQuery();
+	if( mNumObjects == 0 )
+		return 0;
+
+	// Only the cells where objects can be, so a box much bigger than the
+	// objects' spread costs no more than the spread.
+	int lo[3], hi[3];
+	for(int a = 0; a < 3; ++a)
+	{
+		float boxLo = max(Axis(box.minPt, a), Axis(mBounds.minPt, a)) - mMaxRadius;
+		float boxHi = min(Axis(box.maxPt, a), Axis(mBounds.maxPt, a)) + mMaxRadius;
+		if( boxLo > boxHi )
+			return 0;
+		lo[a] = cellOf(boxLo);
+		hi[a] = cellOf(boxHi);
+	}
+	gatherCells(lo, hi);
+
+	UINT count = 0;
+	for(size_t v = 0; v < mVisit.size(); ++v)
+	{
+		for(UINT h = mBuckets[mVisit[v]]; h != NONE; h = mEntries[h].next)
+		{
+			const Entry& e = mEntries[h];
+			++mStats.numObjectsTested;
+
+			// Distance from the center to the nearest point of the box.
+			D3DXVECTOR3 q;
+			D3DXVec3Maximize(&q, &box.minPt, &e.pos);
+			D3DXVec3Minimize(&q, &box.maxPt, &q);
+			D3DXVECTOR3 d = q - e.pos;
+			if( D3DXVec3LengthSq(&d) <= e.radius*e.radius )
+			{
+				out.push_back(h);
+				++count;
+			}
+		}
+	}
+	mStats.numBucketsVisited = (DWORD)mVisit.size();
+	return count;
+}
+
+UINT SpatialHash::querySphere(const D3DXVECTOR3& center, float radius, std::vector<UINT>& out)
+{
+	ZeroMemory(&mStats, sizeof(mStats));
+	newQuery();
+
+	int lo[3], hi[3];
+	float reach = radius + mMaxRadius;
+	for(int a = 0; a < 3; ++a)
+	{
+		lo[a] = cellOf(Axis(center, a) - reach);
+		hi[a] = cellOf(Axis(center, a) + reach);
+	}
+	gatherCells(lo, hi);
+
+	UINT count = 0;
+	for(size_t v = 0; v < mVisit.size(); ++v)
+	{
+		for(UINT h = mBuckets[mVisit[v]]; h != NONE; h = mEntries[h].next)
+		{
+			const Entry& e = mEntries[h];
+			++mStats.numObjectsTested;
+
+			D3DXVECTOR3 d = e.pos - center;
+			float r = e.radius + radius;
+			if( D3DXVec3LengthSq(&d) <= r*r )
+			{
+				out.push_back(h);
+				++count;
+			}
+		}
+	}
+	mStats.numBucketsVisited = (DWORD)mVisit.size();
+	return count;
+}
+
+UINT SpatialHash::queryRay(const D3DXVECTOR3& origin, const D3DXVECTOR3& dir, float maxT,
+						   std::vector<RayHit>& out)
+{
+	ZeroMemory(&mStats, sizeof(mStats));
+	newQuery();
+	if( mNumObjects == 0 )
+		return 0;
+
+	// Clip the ray to where objects can be, which also makes it finite.
+	float t0 = 0.0f;
+	float t1 = maxT;
+	for(int a = 0; a < 3; ++a)
+	{
+		float o  = Axis(origin, a);
+		float d  = Axis(dir, a);
+		float lo = Axis(mBounds.minPt, a) - mMaxRadius;
+		float hi = Axis(mBounds.maxPt, a) + mMaxRadius;
+		if( fabsf(d) < 1e-12f )
+		{
+			if( o < lo || o > hi )
+				return 0;
+			continue;
+		}
+
+		float ta = (lo - o) / d;
+		float tb = (hi - o) / d;
+		t0 = max(t0, min(ta, tb));
+		t1 = min(t1, max(ta, tb));
+		if( t0 > t1 )
+			return 0;
+	}
+
+	// Walk the cells the clipped ray crosses, gathering the cells around
+	// each one out to the largest radius.
+	int ring = (int)ceilf(mMaxRadius * mInvCellSize);
+	int cell[3], last[3], step[3];
+	float tNext[3], tDelta[3];
+	int numSteps = 0;
+	for(int a = 0; a < 3; ++a)
+	{
+		float o = Axis(origin, a);
+		float d = Axis(dir, a);
+		cell[a] = cellOf(o + t0*d);
+		last[a] = cellOf(o + t1*d);
+		numSteps += abs(last[a] - cell[a]);
+
+		if( d > 0.0f )
+		{
+			step[a]   = 1;
+			tNext[a]  = ((cell[a] + 1)*mCellSize - o) / d;
+			tDelta[a] = mCellSize / d;
+		}
+		else if( d < 0.0f )
+		{
+			step[a]   = -1;
+			tNext[a]  = (cell[a]*mCellSize - o) / d;
+			tDelta[a] = -mCellSize / d;
+		}
+		else
+		{
+			step[a]   = 0;
+			tNext[a]  = INFINITY;
+			tDelta[a] = INFINITY;
+		}
+	}
+
+	// Rounding can leave the walk a cell short of or past last; the
+	// step count bounds it either way.
+	for(int s = 0; s <= numSteps; ++s)
+	{
+		int lo[3] = { cell[0] - ring, cell[1] - ring, cell[2] - ring };
+		int hi[3] = { cell[0] + ring, cell[1] + ring, cell[2] + ring };
+		gatherCells(lo, hi);
+
+		int a = 0;
+		if( tNext[1] < tNext[a] ) a = 1;
+		if( tNext[2] < tNext[a] ) a = 2;
+		if( tNext[a] > t1 )
+			break;
+		cell[a]  += step[a];
+		tNext[a] += tDelta[a];
+	}
+
+	size_t first = out.size();
+	for(size_t v = 0; v < mVisit.size(); ++v)
+	{
+		for(UINT h = mBuckets[mVisit[v]]; h != NONE; h = mEntries[h].next)
+		{
+			const Entry& e = mEntries[h];
+			++mStats.numObjectsTested;
+
+			D3DXVECTOR3 m = e.pos - origin;
+			float b = D3DXVec3Dot(&m, &dir);
+			float c = D3DXVec3LengthSq(&m) - e.radius*e.radius;
+			float disc = b*b - c;
+			if( disc < 0.0f || (c > 0.0f && b < 0.0f) )
+				continue;
+
+			RayHit hit;
+			hit.handle = h;
+			hit.t      = max(b - sqrtf(disc), 0.0f);
+			if( hit.t <= maxT )
+				out.push_back(hit);
+		}
+	}
+	mStats.numBucketsVisited = (DWORD)mVisit.size();
+
+	std::sort(out.begin() + first, out.end(), NearerHit);
+	return (UINT)(out.size() - first);
+}
+
+UINT SpatialHash::findPairs(std::vector<Pair>& out)
+{
+	ZeroMemory(&mStats, sizeof(mStats));
+
+	UINT count = 0;
+	for(UINT i = 0; i < (UINT)mEntries.size(); ++i)
+	{
+		const Entry& e = mEntries[i];
+		if( e.bucket == NONE )
+			continue;
+
+		newQuery();
+		int lo[3], hi[3];
+		float reach = e.radius + mMaxRadius;
+		for(int a = 0; a < 3; ++a)
+		{
+			lo[a] = cellOf(Axis(e.pos, a) - reach);
+			hi[a] = cellOf(Axis(e.pos, a) + reach);
+		}
+		gatherCells(lo, hi);
+		mStats.numBucketsVisited += (DWORD)mVisit.size();
+
+		// Each pair is found from both ends; keep it from the lower handle.
+		for(size_t v = 0; v < mVisit.size(); ++v)
+		{
+			for(UINT h = mBuckets[mVisit[v]]; h != NONE; h = mEntries[h].next)
+			{
+				if( h <= i )
+					continue;
+
+				const Entry& f = mEntries[h];
+				++mStats.numObjectsTested;
+
+				D3DXVECTOR3 d = f.pos - e.pos;
+				float r = e.radius + f.radius;
+				if( D3DXVec3LengthSq(&d) <= r*r )
+				{
+					Pair p = { i, h };
+					out.push_back(p);
+					++count;
+				}
+			}
+		}
+	}
+	return count;
+}
+
+const SpatialHash::Stats& SpatialHash::getStats()const
+{
+	return mStats;
+}
@@ -0,0 +1,137 @@
+//=============================================================================
+// SpatialHash.h.
+//
+// A uniform grid over all of space for objects that move every frame
+// (asteroids, bullets, particles), so finding the ones near a point, in a
+// box or along a ray doesn't mean looking at every object.
+//
+// Each object is a sphere filed under the cell holding its center; the
+// grid is "loose", so a query looks in the cells around the ones it covers
+// far enough to catch spheres reaching in from outside.  Cells aren't
+// stored: a cell's coordinates hash to one of a fixed number of buckets,
+// and the objects in a bucket are linked through the object array.  So
+// the grid has no bounds, and inserting, moving and removing an object are
+// a few index writes.  Cells that share a bucket only cost a query extra
+// sphere tests.
+//
+// Objects live in one array, indexed by the handle insert returns.  Slots
+// freed by remove are reused by later inserts, so handles stay put.
+//
+// Queries reuse scratch space in the grid, so only one may run at a time.
+//=============================================================================
+
+#ifndef SPATIAL_HASH_H
+#define SPATIAL_HASH_H
+
+#include "d3dUtil.h"
+#include <vector>
+
+class SpatialHash
+{
+public:
+	struct RayHit
+	{
+		UINT  handle;
+		float t; // Where the ray enters the object's sphere.
+	};
+
+	struct Pair
+	{
+		UINT a;
+		UINT b;
+	};
+
+	// Work done by the last query.
+	struct Stats
+	{
+		DWORD numBucketsVisited;
+		DWORD numObjectsTested;
+	};
+
+	// Queries are fastest when cellSize is about twice the largest radius.
+	// numBuckets is rounded up to a power of two.
+	SpatialHash(float cellSize, UINT numBuckets = 4096);
+
+	// data is the caller's, for finding its own object from a handle.
+	UINT insert(const D3DXVECTOR3& pos, float radius, UINT data);
+	void move(UINT handle, const D3DXVECTOR3& pos);
+	void remove(UINT handle);
+	void clear();
+
+	UINT size()const;
+	const D3DXVECTOR3& getPos(UINT handle)const;
+	float getRadius(UINT handle)const;
+	UINT getData(UINT handle)const;
+	void setData(UINT handle, UINT data);
+
+	// The queries append the handles of the objects found to out, in no
+	// particular order, and return how many they added.
+	UINT queryBox(const AABB& box, std::vector<UINT>& out);
+	UINT querySphere(const D3DXVECTOR3& center, float radius, std::vector<UINT>& out);
+
+	// Objects the ray origin + t*dir, 0 <= t <= maxT, passes through, dir
+	// unit length, nearest first.  maxT may be INFINITY.
+	UINT queryRay(const D3DXVECTOR3& origin, const D3DXVECTOR3& dir, float maxT,
+		std::vector<RayHit>& out);
+
+	// Every pair of overlapping objects, once each, for collisions.
+	UINT findPairs(std::vector<Pair>& out);
+
+	const Stats& getStats()const;
+
+private:
+	// Make private to prevent copying of members of this class.
+	SpatialHash(const SpatialHash& rhs);
+	SpatialHash& operator=(const SpatialHash& rhs);
+
+	// An object, linked into its bucket's list.  Free slots are linked
+	// through next instead, with bucket NONE.
+	struct Entry
+	{
+		D3DXVECTOR3 pos;
+		float radius;
+		UINT  data;
+		UINT  bucket;
+		UINT  next;
+		UINT  prev;
+	};
+
+	const static UINT NONE = 0xffffffff;
+
+	int  cellOf(float x)const;
+	UINT bucketOf(int x, int y, int z)const;
+	void link(UINT handle, UINT bucket);
+	void unlink(UINT handle);
+
+	// Collects the buckets of the cells from lo to hi, inclusive, into
+	// mVisit, skipping any already collected since the last newQuery.
+	void newQuery();
+	void gatherCells(const int lo[3], const int hi[3]);
+	void gatherBucket(UINT bucket);
+
+private:
+	float mCellSize;
+	float mInvCellSize;
+	UINT  mBucketMask;
+
+	std::vector<Entry> mEntries;
+	std::vector<UINT>  mBuckets; // First entry in each, or NONE.
+	UINT mFreeHead;
+	UINT mNumObjects;
+
+	// Never shrink, so queries look far enough for any object that was
+	// ever in the grid.  mBounds holds every position given so far; rays
+	// and boxes are clipped to it.
+	float mMaxRadius;
+	AABB  mBounds;
+
+	// Query scratch.  A bucket is in mVisit this query if its stamp
+	// matches mStamp.
+	std::vector<DWORD> mBucketStamps;
+	DWORD mStamp;
+	std::vector<UINT> mVisit;
+
+	Stats mStats;
+};
+
+#endif // SPATIAL_HASH_H
@@ -0,0 +1,190 @@
+//=============================================================================
+// AOBench.cpp.
+//
+// Bakes the castle map's ambient occlusion with HorizonBaker and checks
+// every vertex bit for bit against a plain one-vertex-at-a-time bake, on
+// maps wide enough for the SSE interior and too narrow for it.  Checks
+// that bakeCached writes its cache to the directory it is given (and not
+// the current one), that reading the cache back gives the bake exactly,
+// and that a changed map misses.  Then times the bake against the plain
+// one and the cache read.
+//=============================================================================
+
+#include "Bench.h"
+#include "HorizonBaker.h"
+#include <cstdio>
+
+namespace
+{
+	bool sameAO(const Table<float>& a, const Table<float>& b)
+	{
+		if( a.numRows() != b.numRows() || a.numCols() != b.numCols() )
+			return false;
+
+		for(int i = 0; i < a.numRows(); ++i)
+			for(int j = 0; j < a.numCols(); ++j)
+				if( a(i, j) != b(i, j) )
+					return false;
+		return true;
+	}
+
+	bool fileExists(const std::string& filename)
+	{
+		return GetFileAttributes(filename.c_str()) != INVALID_FILE_ATTRIBUTES;
+	}
+
+	// HorizonBaker's scalar edge path, for every vertex: the highest
+	// slope along each of the eight grid directions, up to maxSteps or the
+	// edge of the map.
+	void referenceBake(const Heightmap& h, float dx, float dz, int maxSteps, Table<float>& ao)
+	{
+		const int dirCols[8] = { 1, 1, 0, -1, -1, -1,  0,  1 };
+		const int dirRows[8] = { 0, 1, 1,  1,  0, -1, -1, -1 };
+		int m = h.numRows();
+		int n = h.numCols();
+		ao.resize(m, n);
+		for(int i = 0; i < m; ++i)
+		{
+			for(int j = 0; j < n; ++j)
+			{
+				float sum = 0.0f;
+				for(int d = 0; d < 8; ++d)
+				{
+					float sx = dirCols[d]*dx;
+					float sz = dirRows[d]*dz;
+					float stepDist = sqrtf(sx*sx + sz*sz);
+
+					float maxSlope = 0.0f;
+					for(int k = 1; k <= maxSteps; ++k)
+					{
+						int r = i + k*dirRows[d];
+						int c = j + k*dirCols[d];
+						if( r < 0 || r >= m || c < 0 || c >= n )
+							break;
+						maxSlope = max(maxSlope, (h(r, c) - h(i, j)) / (k*stepDist));
+					}
+					sum += 1.0f - maxSlope / sqrtf(1.0f + maxSlope*maxSlope);
+				}
+				ao(i, j) = sum * (1.0f / 8);
+			}
+		}
+	}
+
+	int countDifferent(const Table<float>& a, const Table<float>& b)
+	{
+		int numDifferent = 0;
+		for(int i = 0; i < a.numRows(); ++i)
+			for(int j = 0; j < a.numCols(); ++j)
+				if( memcmp(&a(i, j), &b(i, j), sizeof(float)) != 0 )
+					++numDifferent;
+		return numDifferent;
+	}
+
+	bool checkAgainstReference(const Heightmap& heightmap, float dx, float dz, int maxSteps)
+	{
+		Table<float> baked, expected;
+		HorizonBaker::bake(heightmap, dx, dz, maxSteps, baked);
+		referenceBake(heightmap, dx, dz, maxSteps, expected);
+		int numDifferent = countDifferent(baked, expected);
+		printf("  %dx%d, %d steps: %d of %d vertices differ\n", heightmap.numRows(), heightmap.numCols(),
+			maxSteps, numDifferent, heightmap.numRows()*heightmap.numCols());
+		return numDifferent == 0;
+	}
+
+	std::string cacheName(const Heightmap& heightmap, float dx, float dz, int maxSteps)
+	{
+		unsigned __int64 key = HorizonBaker::hash(heightmap, dx, dz, maxSteps);
+		char name[32];
+		sprintf(name, "ao_%08x%08x.bin", (DWORD)(key >> 32), (DWORD)(key & 0xffffffff));
+		return name;
+	}
+}
+
+void AOSuite(const BenchOptions& options)
+{
+	std::string castleFile = BenchArtFile(options, "castlehm257.raw");
+	if( castleFile.empty() )
+		return;
+
+	// The demo's settings.
+	const float dx = 2.0f;
+	const float dz = 2.0f;
+	const int maxSteps = 64;
+	Heightmap heightmap(257, 257, castleFile, 0.5f, 0.0f);
+
+	std::string name = cacheName(heightmap, dx, dz, maxSteps);
+	std::string cacheFile = options.scratchDir + name;
+	DeleteFile(cacheFile.c_str());
+	bool strayBefore = fileExists(name);
+
+	// The castle map takes the SSE loop over most of each row; the small
+	// maps have every count of columns left over for the edge path, and
+	// the narrowest are too narrow for the SSE loop at all.
+	BenchHeading("against the scalar path");
+	BENCH_CHECK(checkAgainstReference(heightmap, dx, dz, maxSteps));
+	BENCH_CHECK(checkAgainstReference(heightmap, dx, dz, 5));
+	srand(19);
+	bool allSame = true;
+	for(int n = 15; n <= 24; ++n)
+	{
+		Heightmap small(12, n);
+		for(int i = 0; i < small.numRows(); ++i)
+			for(int j = 0; j < small.numCols(); ++j)
+				small(i, j) = GetRandomFloat(0.0f, 20.0f);
+		Table<float> baked, expected;
+		HorizonBaker::bake(small, 1.5f, 2.5f, 6, baked);
+		referenceBake(small, 1.5f, 2.5f, 6, expected);
+		allSame = countDifferent(baked, expected) == 0 && allSame;
+	}
+	BENCH_CHECK(allSame);
+
+	BenchHeading("cache");
+	Table<float> baked;
+	HorizonBaker::bake(heightmap, dx, dz, maxSteps, baked);
+
+	Table<float> missed;
+	HorizonBaker::Stats missStats;
+	HorizonBaker::bakeCached(heightmap, dx, dz, maxSteps, options.scratchDir, missed, 0, 0, &missStats);
+	BENCH_CHECK(!missStats.cacheHit);
+	BENCH_CHECK(sameAO(baked, missed));
+	BENCH_CHECK(fileExists(cacheFile));
+	BENCH_CHECK(strayBefore || !fileExists(name));
+
+	Table<float> hit;
+	HorizonBaker::Stats hitStats;
+	HorizonBaker::bakeCached(heightmap, dx, dz, maxSteps, options.scratchDir, hit, 0, 0, &hitStats);
+	BENCH_CHECK(hitStats.cacheHit);
+	BENCH_CHECK(sameAO(baked, hit));
+	printf("  baked in %.1f ms, read back in %.1f ms\n", missStats.bakeMs, hitStats.bakeMs);
+
+	// Any edit changes the hash, so the old bake isn't used.
+	Heightmap edited(257, 257, castleFile, 0.5f, 0.0f);
+	RECT R = {100, 100, 120, 120};
+	edited.modify(R, RaiseBrush(110.0f, 110.0f, 8.0f, 5.0f));
+	Table<float> editedAO;
+	HorizonBaker::Stats editedStats;
+	HorizonBaker::bakeCached(edited, dx, dz, maxSteps, options.scratchDir, editedAO, 0, 0, &editedStats);
+	BENCH_CHECK(!editedStats.cacheHit);
+	BENCH_CHECK(!sameAO(baked, editedAO));
+	DeleteFile((options.scratchDir + cacheName(edited, dx, dz, maxSteps)).c_str());
+
+	BenchHeading("timings");
+	int reps = options.quick ? 2 : 10;
+	BenchTimer timer;
+	for(int k = 0; k < reps; ++k)
+		HorizonBaker::bake(heightmap, dx, dz, maxSteps, baked);
+	BenchReport("bake (per map)", timer.elapsedMs(), reps);
+
+	Table<float> plain;
+	timer.start();
+	for(int k = 0; k < reps; ++k)
+		referenceBake(heightmap, dx, dz, maxSteps, plain);
+	BenchReport("one vertex at a time (per map)", timer.elapsedMs(), reps);
+
+	timer.start();
+	for(int k = 0; k < reps; ++k)
+		HorizonBaker::bakeCached(heightmap, dx, dz, maxSteps, options.scratchDir, hit);
+	BenchReport("bakeCached, hit (per map)", timer.elapsedMs(), reps);
+
+	DeleteFile(cacheFile.c_str());
+}
@@ -0,0 +1,168 @@
+//=============================================================================
+// BVHBench.cpp.
+//
+// Culls 100k and 1M scattered boxes along a camera path with CullingBVH,
+// with and without temporal coherence, and checks every frame's result
+// against Camera::isVisible on each box.  Times both against the linear
+// scan.
+//=============================================================================
+
+#include "Bench.h"
+#include "CullingBVH.h"
+#include "Camera.h"
+#include "CameraPath.h"
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+	const float WORLD_SIZE = 4000.0f;
+
+	void scatterBoxes(std::vector<AABB>& boxes, UINT n)
+	{
+		srand(8);
+		boxes.resize(n);
+		for(UINT i = 0; i < n; ++i)
+		{
+			D3DXVECTOR3 c(GetRandomFloat(-0.5f, 0.5f)*WORLD_SIZE, GetRandomFloat(0.0f, 30.0f),
+				GetRandomFloat(-0.5f, 0.5f)*WORLD_SIZE);
+			D3DXVECTOR3 e(GetRandomFloat(0.5f, 4.0f), GetRandomFloat(1.0f, 8.0f), GetRandomFloat(0.5f, 4.0f));
+			boxes[i].minPt = c - e;
+			boxes[i].maxPt = c + e;
+		}
+	}
+
+	// Walks a circle at head height, turning a little faster than it
+	// moves, so the view sweeps across the scene.
+	void walkPath(CameraPath& path, int numFrames)
+	{
+		path.clear();
+		for(int i = 0; i < numFrames; ++i)
+		{
+			float a = 2.0f*D3DX_PI*i / numFrames;
+			float b = 3.0f*a;
+			path.addFrame(D3DXVECTOR3(0.25f*WORLD_SIZE*cosf(a), 5.0f, 0.25f*WORLD_SIZE*sinf(a)),
+				D3DXVECTOR3(cosf(b), -0.05f, sinf(b)));
+		}
+	}
+
+	// Signed distance from the box's corner furthest along the plane's
+	// normal to the plane, over the plane the box is furthest outside of.
+	// Results that disagree for boxes this close to a plane are rounding.
+	float worstPlaneDistance(const Camera& camera, const AABB& box)
+	{
+		const D3DXPLANE* planes = camera.frustumPlanes();
+		float worst = FLT_MAX;
+		for(int p = 0; p < 6; ++p)
+		{
+			D3DXVECTOR3 q(planes[p].a >= 0.0f ? box.maxPt.x : box.minPt.x,
+			              planes[p].b >= 0.0f ? box.maxPt.y : box.minPt.y,
+			              planes[p].c >= 0.0f ? box.maxPt.z : box.minPt.z);
+			worst = min(worst, D3DXPlaneDotCoord(&planes[p], &q));
+		}
+		return worst;
+	}
+
+	void run(UINT numBoxes, int numFrames)
+	{
+		char name[64];
+		sprintf(name, "%u boxes", numBoxes);
+		BenchHeading(name);
+
+		std::vector<AABB> boxes;
+		scatterBoxes(boxes, numBoxes);
+
+		CullingBVH bvh;
+		BenchTimer timer;
+		bvh.build(&boxes[0], numBoxes);
+		BenchReport("build", timer.elapsedMs(), numBoxes);
+		timer.start();
+		bvh.refit(&boxes[0]);
+		BenchReport("refit", timer.elapsedMs(), numBoxes);
+
+		Camera camera;
+		camera.setLens(D3DX_PI * 0.25f, 800.0f/600.0f, 1.0f, 1000.0f);
+		CameraPath path;
+		walkPath(path, numFrames);
+
+		std::vector<UINT> visible(numBoxes);
+		std::vector<char> linear(numBoxes);
+		std::vector<char> fromBVH(numBoxes);
+
+		// Checked passes: the hierarchy finds the same boxes as testing
+		// each one, with and without coherence.
+		for(int coherent = 0; coherent <= 1; ++coherent)
+		{
+			bvh.setTemporalCoherence(coherent != 0);
+			UINT numClose = 0;
+			for(UINT f = 0; f < path.numFrames(); ++f)
+			{
+				path.apply(f, camera);
+				for(UINT i = 0; i < numBoxes; ++i)
+				{
+					linear[i]  = camera.isVisible(boxes[i]);
+					fromBVH[i] = 0;
+				}
+				UINT n = bvh.cull(camera, &visible[0]);
+				for(UINT k = 0; k < n; ++k)
+				{
+					BENCH_CHECK(!fromBVH[visible[k]]);
+					fromBVH[visible[k]] = 1;
+				}
+				for(UINT i = 0; i < numBoxes; ++i)
+				{
+					if( linear[i] == fromBVH[i] )
+						continue;
+					if( fabsf(worstPlaneDistance(camera, boxes[i])) < 1e-3f )
+						++numClose;
+					else
+						BENCH_CHECK(linear[i] == fromBVH[i]);
+				}
+			}
+			if( numClose > 0 )
+				printf("  %u results differ from the linear scan by rounding, on a plane\n", numClose);
+		}
+
+		// Timed passes.
+		timer.start();
+		UINT sink = 0;
+		for(UINT f = 0; f < path.numFrames(); ++f)
+		{
+			path.apply(f, camera);
+			for(UINT i = 0; i < numBoxes; ++i)
+				sink += camera.isVisible(boxes[i]);
+		}
+		BenchReport("linear Camera::isVisible (per frame)", timer.elapsedMs(), numFrames);
+		printf("  %.1f boxes visible per frame\n", (double)sink / numFrames);
+
+		for(int coherent = 0; coherent <= 1; ++coherent)
+		{
+			bvh.setTemporalCoherence(coherent != 0);
+			double planeTests = 0.0;
+			double nodes      = 0.0;
+			timer.start();
+			for(UINT f = 0; f < path.numFrames(); ++f)
+			{
+				path.apply(f, camera);
+				bvh.cull(camera, &visible[0]);
+				planeTests += bvh.getStats().planeTests;
+				nodes      += bvh.getStats().nodesVisited;
+			}
+			BenchReport(coherent ? "CullingBVH, coherent (per frame)" : "CullingBVH (per frame)",
+				timer.elapsedMs(), numFrames);
+			printf("  %.0f nodes visited, %.0f plane tests per frame (linear: %u)\n",
+				nodes / numFrames, planeTests / numFrames, 6*numBoxes);
+		}
+	}
+}
+
+void BVHSuite(const BenchOptions& options)
+{
+	if( options.quick )
+	{
+		run(10000, 30);
+		return;
+	}
+	run(100000, 200);
+	run(1000000, 50);
+}
@@ -0,0 +1,78 @@
+//=============================================================================
+// Bench.cpp.
+//=============================================================================
+
+#include "Bench.h"
+#include <cstdio>
+#include <fstream>
+
+namespace
+{
+	int gNumFailures = 0;
+}
+
+void BenchFail(const char* file, int line, const char* expr)
+{
+	++gNumFailures;
+
+	// Only the file's name; the full paths are long.
+	const char* name = file;
+	for(const char* p = file; *p; ++p)
+	{
+		if( *p == '\\' || *p == '/' )
+			name = p+1;
+	}
+	printf("FAILED %s(%d): %s\n", name, line, expr);
+}
+
+int BenchNumFailures()
+{
+	return gNumFailures;
+}
+
+std::string BenchArtFile(const BenchOptions& options, const char* name)
+{
+	std::string filename = options.artDir + name;
+	std::ifstream inFile(filename.c_str(), std::ios_base::binary);
+	if( !inFile )
+	{
+		BenchFail(__FILE__, __LINE__, "art file opens");
+		printf("  Can't open %s; use -art to point at FrustumCulling's Art folder.\n",
+			filename.c_str());
+		return "";
+	}
+	return filename;
+}
+
+void BenchHeading(const char* name)
+{
+	printf("\n== %s\n", name);
+}
+
+void BenchReport(const char* label, double ms, int numItems)
+{
+	if( numItems > 0 )
+		printf("  %-44s %10.3f ms  %10.3f us each\n", label, ms, 1000.0*ms/numItems);
+	else
+		printf("  %-44s %10.3f ms\n", label, ms);
+}
+
+BenchTimer::BenchTimer()
+{
+	__int64 cntsPerSec = 0;
+	QueryPerformanceFrequency((LARGE_INTEGER*)&cntsPerSec);
+	mMsPerCount = 1000.0 / (double)cntsPerSec;
+	start();
+}
+
+void BenchTimer::start()
+{
+	QueryPerformanceCounter((LARGE_INTEGER*)&mStart);
+}
+
+double BenchTimer::elapsedMs()const
+{
+	__int64 now = 0;
+	QueryPerformanceCounter((LARGE_INTEGER*)&now);
+	return (now - mStart)*mMsPerCount;
+}
@@ -0,0 +1,82 @@
+//=============================================================================
+// Bench.h.
+//
+// HeadlessBench runs the CPU side of the terrain, picking and culling code
+// from the demos without a window or a device.  Each suite checks its code
+// against a simple reference implementation and then times it.
+//
+//     HeadlessBench [-quick] [-art dir] [-golden dir] [-path file] [suite...]
+//
+// With no suite names every suite runs.  -quick shrinks the problem sizes
+// for a fast pass/fail run, -art points at FrustumCulling's Art folder if
+// the program isn't run from its project directory, -golden does the same
+// for the known good images in Golden, and -path replays a camera path
+// recorded in FrustumCulling (with 'P') instead of the scripted one.  The
+// exit code is the number of failed checks.
+//=============================================================================
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <windows.h>
+#include <string>
+
+struct BenchOptions
+{
+	std::string artDir;     // FrustumCulling's Art folder, with a trailing slash.
+	std::string goldenDir;  // Known good images, with a trailing slash.
+	std::string scratchDir; // Where suites may write files.
+	std::string cameraPath; // Recorded camera path, or empty.
+	bool quick;
+};
+
+// Records a failed check and carries on, so one run reports every failure.
+#define BENCH_CHECK(expr) \
+	((expr) ? (void)0 : BenchFail(__FILE__, __LINE__, #expr))
+
+void BenchFail(const char* file, int line, const char* expr);
+int  BenchNumFailures();
+
+// Full path of a file in the Art folder.  If it can't be opened, this
+// records a failure, says to use -art, and returns an empty string.
+std::string BenchArtFile(const BenchOptions& options, const char* name);
+
+// Prints the heading of a suite or a part of one.
+void BenchHeading(const char* name);
+
+// Prints a timing: the total and the time per item.
+void BenchReport(const char* label, double ms, int numItems);
+
+class BenchTimer
+{
+public:
+	BenchTimer();
+
+	void   start();
+	double elapsedMs()const;
+
+private:
+	__int64 mStart;
+	double  mMsPerCount;
+};
+
+//===============================================================
+// Suites.
+
+void QuadtreeSuite(const BenchOptions& options);
+void PagedSuite(const BenchOptions& options);
+void BVHSuite(const BenchOptions& options);
+void SoASuite(const BenchOptions& options);
+void LayoutSuite(const BenchOptions& options);
+void RaySuite(const BenchOptions& options);
+void BrushSuite(const BenchOptions& options);
+void FilterSuite(const BenchOptions& options);
+void HeightsSuite(const BenchOptions& options);
+void GroundSuite(const BenchOptions& options);
+void VertexSuite(const BenchOptions& options);
+void AOSuite(const BenchOptions& options);
+void OcclusionSuite(const BenchOptions& options);
+void HashSuite(const BenchOptions& options);
+void XformSuite(const BenchOptions& options);
+
+#endif // BENCH_H
@@ -0,0 +1,130 @@
+//=============================================================================
+// BrushBench.cpp.
+//
+// Brushes a filtered map with Heightmap::modify and checks the result, and
+// its min/max pyramid, against brushing the unfiltered heights and
+// filtering the whole map afterwards; the two must be identical.  Then
+// times a brush stroke against filtering the whole map.
+//=============================================================================
+
+#include "Bench.h"
+#include "Heightmap.h"
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+	struct Stroke
+	{
+		RECT R;
+		RaiseBrush brush;
+	};
+
+	// Overlapping dabs, some hanging off the edges of the map.
+	void makeStrokes(int n, int numStrokes, std::vector<Stroke>& strokes)
+	{
+		srand(16);
+		strokes.clear();
+		for(int k = 0; k < numStrokes; ++k)
+		{
+			float row    = GetRandomFloat(-5.0f, n + 5.0f);
+			float col    = GetRandomFloat(-5.0f, n + 5.0f);
+			float radius = GetRandomFloat(2.0f, 12.0f);
+			float amount = GetRandomFloat(-8.0f, 8.0f);
+
+			RECT R;
+			R.left   = (LONG)floorf(col - radius);
+			R.top    = (LONG)floorf(row - radius);
+			R.right  = (LONG)ceilf(col + radius);
+			R.bottom = (LONG)ceilf(row + radius);
+			Stroke s = {R, RaiseBrush(row, col, radius, amount)};
+			strokes.push_back(s);
+		}
+	}
+
+	bool sameHeights(const Heightmap& a, const Heightmap& b)
+	{
+		for(int i = 0; i < a.numRows(); ++i)
+			for(int j = 0; j < a.numCols(); ++j)
+				if( a(i, j) != b(i, j) )
+					return false;
+		return true;
+	}
+
+	bool samePyramid(const Heightmap& a, const Heightmap& b)
+	{
+		if( a.numMinMaxLevels() != b.numMinMaxLevels() )
+			return false;
+
+		for(int L = 0; L < a.numMinMaxLevels(); ++L)
+		{
+			int size = 1 << L;
+			for(int r = 0; r*size < a.numRows()-1; ++r)
+			{
+				for(int c = 0; c*size < a.numCols()-1; ++c)
+				{
+					const Heightmap::HeightRange& x = a.minMaxBlock(L, r, c);
+					const Heightmap::HeightRange& y = b.minMaxBlock(L, r, c);
+					if( x.minH != y.minH || x.maxH != y.maxH )
+						return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	void check(const std::string& castleFile, int radius, Heightmap::FilterKernel kernel,
+		const std::vector<Stroke>& strokes)
+	{
+		char name[64];
+		sprintf(name, "%s filter, radius %d", kernel == Heightmap::FILTER_BOX ? "box" : "Gaussian", radius);
+		BenchHeading(name);
+
+		Heightmap brushed(257, 257, castleFile, 0.5f, 0.0f, radius, kernel);
+		Heightmap reference(257, 257, castleFile, 0.5f, 0.0f, 0);
+		for(size_t k = 0; k < strokes.size(); ++k)
+		{
+			brushed.modify(strokes[k].R, strokes[k].brush);
+			reference.modify(strokes[k].R, strokes[k].brush);
+		}
+		reference.filter(radius, kernel);
+
+		BENCH_CHECK(sameHeights(brushed, reference));
+		BENCH_CHECK(samePyramid(brushed, reference));
+
+		// Brushing again after the edits must still match.
+		brushed.modify(strokes[0].R, strokes[0].brush);
+		Heightmap again(257, 257, castleFile, 0.5f, 0.0f, 0);
+		for(size_t k = 0; k < strokes.size(); ++k)
+			again.modify(strokes[k].R, strokes[k].brush);
+		again.modify(strokes[0].R, strokes[0].brush);
+		again.filter(radius, kernel);
+		BENCH_CHECK(sameHeights(brushed, again));
+
+		int reps = 20;
+		BenchTimer timer;
+		for(int k = 0; k < reps; ++k)
+			for(size_t s = 0; s < strokes.size(); ++s)
+				brushed.modify(strokes[s].R, strokes[s].brush);
+		BenchReport("modify (per dab)", timer.elapsedMs(), reps*(int)strokes.size());
+
+		timer.start();
+		for(int k = 0; k < reps; ++k)
+			reference.filter(radius, kernel);
+		BenchReport("whole map filter()", timer.elapsedMs(), reps);
+	}
+}
+
+void BrushSuite(const BenchOptions& options)
+{
+	std::string castleFile = BenchArtFile(options, "castlehm257.raw");
+	if( castleFile.empty() )
+		return;
+
+	std::vector<Stroke> strokes;
+	makeStrokes(257, options.quick ? 20 : 100, strokes);
+
+	check(castleFile, 1, Heightmap::FILTER_BOX, strokes);
+	check(castleFile, 2, Heightmap::FILTER_BOX, strokes);
+	check(castleFile, 3, Heightmap::FILTER_GAUSSIAN, strokes);
+}
@@ -0,0 +1,128 @@
+//=============================================================================
+// FilterBench.cpp.
+//
+// Checks Heightmap::filter's radius 1 box filter, the SSE path every map
+// is loaded through, bit for bit against the plain 3x3 average it
+// replaced, on the castle map and on small maps whose widths leave every
+// count of columns over for the scalar tail.  Then times the two.
+//=============================================================================
+
+#include "Bench.h"
+#include "Heightmap.h"
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+	// The old Heightmap::filter3x3: each height averaged with the
+	// neighbours that are on the map, summed in the same order.
+	void referenceFilter(const Heightmap& src, std::vector<float>& out)
+	{
+		int m = src.numRows();
+		int n = src.numCols();
+		out.resize(m*n);
+		for(int i = 0; i < m; ++i)
+		{
+			for(int j = 0; j < n; ++j)
+			{
+				float avg = 0.0f;
+				float num = 0.0f;
+				for(int r = i-1; r <= i+1; ++r)
+				{
+					for(int c = j-1; c <= j+1; ++c)
+					{
+						if( r >= 0 && r < m && c >= 0 && c < n )
+						{
+							avg += src(r, c);
+							num += 1.0f;
+						}
+					}
+				}
+				out[i*n + j] = avg / num;
+			}
+		}
+	}
+
+	// Counts the heights that differ in any bit.
+	int countDifferent(const Heightmap& filtered, const std::vector<float>& expected)
+	{
+		int numDifferent = 0;
+		for(int i = 0; i < filtered.numRows(); ++i)
+			for(int j = 0; j < filtered.numCols(); ++j)
+				if( memcmp(&filtered(i, j), &expected[i*filtered.numCols() + j], sizeof(float)) != 0 )
+					++numDifferent;
+		return numDifferent;
+	}
+
+	void randomHeights(Heightmap& heightmap)
+	{
+		for(int i = 0; i < heightmap.numRows(); ++i)
+			for(int j = 0; j < heightmap.numCols(); ++j)
+				heightmap(i, j) = GetRandomFloat(-50.0f, 150.0f);
+	}
+
+	bool checkMap(Heightmap& heightmap)
+	{
+		std::vector<float> expected;
+		referenceFilter(heightmap, expected);
+		heightmap.filter(1, Heightmap::FILTER_BOX);
+		return countDifferent(heightmap, expected) == 0;
+	}
+}
+
+void FilterSuite(const BenchOptions& options)
+{
+	std::string castleFile = BenchArtFile(options, "castlehm257.raw");
+	if( castleFile.empty() )
+		return;
+
+	BenchHeading("against the 3x3 average");
+
+	// Unfiltered, so the bench filters it.
+	Heightmap castle(257, 257, castleFile, 0.5f, 0.0f, 0);
+	std::vector<float> expected;
+	referenceFilter(castle, expected);
+	castle.filter(1, Heightmap::FILTER_BOX);
+	int numDifferent = countDifferent(castle, expected);
+	BENCH_CHECK(numDifferent == 0);
+	printf("  castlehm257.raw: %d of %d heights differ\n", numDifferent, 257*257);
+
+	// Every width up to a few SSE blocks, so the interior loop ends with
+	// each possible tail, and maps too small to have an interior.
+	srand(3);
+	bool allSame = true;
+	for(int m = 1; m <= 4; ++m)
+	{
+		for(int n = 1; n <= 14; ++n)
+		{
+			Heightmap small(m, n);
+			randomHeights(small);
+			allSame = checkMap(small) && allSame;
+		}
+	}
+	Heightmap odd(37, 131);
+	randomHeights(odd);
+	allSame = checkMap(odd) && allSame;
+	BENCH_CHECK(allSame);
+
+	BenchHeading("timings");
+	int size = options.quick ? 513 : 2049;
+	int reps = options.quick ? 5 : 10;
+	Heightmap big(size, size);
+	randomHeights(big);
+	char label[64];
+
+	BenchTimer timer;
+	for(int k = 0; k < reps; ++k)
+		referenceFilter(big, expected);
+	sprintf(label, "%dx%d: 3x3 average (per map)", size, size);
+	BenchReport(label, timer.elapsedMs(), reps);
+
+	// filter() smooths the map it is given, so each rep filters the last
+	// one's result; the cost is the same.
+	timer.start();
+	for(int k = 0; k < reps; ++k)
+		big.filter(1, Heightmap::FILTER_BOX);
+	sprintf(label, "%dx%d: Heightmap::filter (per map)", size, size);
+	BenchReport(label, timer.elapsedMs(), reps);
+}
@@ -0,0 +1,259 @@
+//=============================================================================
+// GroundBench.cpp.
+//
+// Walks entities over the castle terrain through GroundQuery, one at a
+// time with sample() and a frame at a time with add() and resolve(), and
+// checks every height against Terrain::getHeight (they must be identical)
+// and every normal against getHeights'.  Checks that the cache both hits
+// and misses along the way, and that brushing the terrain drops it.  Then
+// times the three.
+//=============================================================================
+
+#include "Bench.h"
+#include "GroundQuery.h"
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+	// Both normalize with D3DXVec3Normalize; allow for rounding anyway.
+	const float NORMAL_TOLERANCE = 1e-6f;
+
+	// The demo's terrain, built without a device.
+	Terrain* buildTerrain(const std::string& castleFile)
+	{
+		Heightmap heightmap(257, 257, castleFile, 0.5f, 0.0f);
+		Table<float> heights(257, 257);
+		for(int i = 0; i < 257; ++i)
+			for(int j = 0; j < 257; ++j)
+				heights(i, j) = heightmap(i, j);
+		return new Terrain(heights, 2.0f, 2.0f, D3DXVECTOR3(0.0f, 0.0f, 0.0f));
+	}
+
+	// Entities wandering a little each frame, so most of their queries
+	// land in the cell they were in the frame before.  Some walk off the
+	// edge and are clamped.
+	struct Walkers
+	{
+		std::vector<D3DXVECTOR3> pos;
+		std::vector<D3DXVECTOR3> vel;
+
+		Walkers(Terrain& terrain, int n)
+		{
+			float halfW = 0.5f*terrain.getWidth();
+			pos.resize(n);
+			vel.resize(n);
+			for(int i = 0; i < n; ++i)
+			{
+				pos[i] = D3DXVECTOR3(GetRandomFloat(-halfW, halfW), 0.0f, GetRandomFloat(-halfW, halfW));
+				GetRandomVec(vel[i]);
+				vel[i].y = 0.0f;
+			}
+		}
+
+		void step(float dt)
+		{
+			for(size_t i = 0; i < pos.size(); ++i)
+				pos[i] += 5.0f*dt*vel[i];
+		}
+	};
+
+	struct Errors
+	{
+		int   numDifferent;
+		float maxNormalDiff;
+	};
+
+	void compare(Terrain& terrain, float x, float z, const GroundQuery::Sample& s, Errors& errors)
+	{
+		float h = terrain.getHeight(x, z);
+		if( memcmp(&h, &s.height, sizeof(float)) != 0 )
+			++errors.numDifferent;
+
+		// getHeights with one point takes the scalar path.
+		float h1;
+		D3DXVECTOR3 normal;
+		terrain.getHeights(&x, &z, &h1, 1, &normal);
+		D3DXVECTOR3 diff = normal - s.normal;
+		errors.maxNormalDiff = max(errors.maxNormalDiff, max(fabsf(diff.x), max(fabsf(diff.y), fabsf(diff.z))));
+	}
+
+	void checkSample(Terrain& terrain, int numWalkers, int numFrames)
+	{
+		BenchHeading("sample");
+		srand(20);
+		Walkers walkers(terrain, numWalkers);
+		GroundQuery ground(&terrain);
+		Errors errors = {0, 0.0f};
+		for(int f = 0; f < numFrames; ++f)
+		{
+			walkers.step(0.02f);
+			for(int i = 0; i < numWalkers; ++i)
+			{
+				const D3DXVECTOR3& p = walkers.pos[i];
+				compare(terrain, p.x, p.z, ground.sample(p.x, p.z), errors);
+			}
+		}
+
+		const GroundQuery::Stats& stats = ground.getStats();
+		printf("  %u queries, %u cell fetches: %d heights differ, largest normal difference %g\n",
+			stats.numQueries, stats.numCellFetches, errors.numDifferent, errors.maxNormalDiff);
+		BENCH_CHECK(errors.numDifferent == 0);
+		BENCH_CHECK(errors.maxNormalDiff <= NORMAL_TOLERANCE);
+		BENCH_CHECK(stats.numQueries == (DWORD)(numWalkers*numFrames));
+		BENCH_CHECK(stats.numCellFetches > 0 && stats.numCellFetches < stats.numQueries);
+	}
+
+	void checkResolve(Terrain& terrain, int numWalkers, int numFrames)
+	{
+		BenchHeading("add and resolve");
+		srand(21);
+		Walkers walkers(terrain, numWalkers);
+		GroundQuery batched(&terrain);
+		GroundQuery single(&terrain);
+		std::vector<UINT> queries(numWalkers);
+		Errors errors = {0, 0.0f};
+		bool sameAsSample = true;
+		for(int f = 0; f < numFrames; ++f)
+		{
+			walkers.step(0.02f);
+			batched.clear();
+			for(int i = 0; i < numWalkers; ++i)
+				queries[i] = batched.add(walkers.pos[i].x, walkers.pos[i].z);
+			batched.resolve();
+
+			for(int i = 0; i < numWalkers; ++i)
+			{
+				const D3DXVECTOR3& p = walkers.pos[i];
+				const GroundQuery::Sample& r = batched.result(queries[i]);
+				compare(terrain, p.x, p.z, r, errors);
+
+				GroundQuery::Sample s = single.sample(p.x, p.z);
+				sameAsSample = sameAsSample && s.height == r.height && s.normal == r.normal && s.slope == r.slope;
+			}
+		}
+		printf("  %d frames of %d: %d heights differ, largest normal difference %g\n",
+			numFrames, numWalkers, errors.numDifferent, errors.maxNormalDiff);
+		BENCH_CHECK(errors.numDifferent == 0);
+		BENCH_CHECK(errors.maxNormalDiff <= NORMAL_TOLERANCE);
+		BENCH_CHECK(sameAsSample);
+	}
+
+	void checkEdits(Terrain& terrain)
+	{
+		BenchHeading("edits");
+
+		// A point in the middle of the map, cached.
+		float x = 10.3f, z = -7.9f;
+		GroundQuery ground(&terrain);
+		GroundQuery::Sample before = ground.sample(x, z);
+		ground.sample(x, z);
+		BENCH_CHECK(ground.getStats().numCellFetches == 1);
+
+		// Raise the ground under it.
+		int row, col;
+		float s, t;
+		terrain.getCell(x, z, row, col, s, t);
+		RECT R = {col - 8, row - 8, col + 8, row + 8};
+		DWORD editCount = terrain.getEditCount();
+		terrain.modifyHeights(R, RaiseBrush((float)row, (float)col, 8.0f, 5.0f));
+		BENCH_CHECK(terrain.getEditCount() == editCount + 1);
+
+		// The next query fetches the cell again and sees the new height.
+		GroundQuery::Sample after = ground.sample(x, z);
+		BENCH_CHECK(ground.getStats().numCellFetches == 2);
+		BENCH_CHECK(after.height > before.height);
+		Errors errors = {0, 0.0f};
+		compare(terrain, x, z, after, errors);
+		BENCH_CHECK(errors.numDifferent == 0);
+		BENCH_CHECK(errors.maxNormalDiff <= NORMAL_TOLERANCE);
+
+		// So does a batch resolved after another edit.
+		terrain.modifyHeights(R, RaiseBrush((float)row, (float)col, 8.0f, -12.0f));
+		ground.clear();
+		UINT q = ground.add(x, z);
+		ground.resolve();
+		compare(terrain, x, z, ground.result(q), errors);
+		BENCH_CHECK(errors.numDifferent == 0);
+		BENCH_CHECK(ground.result(q).height < after.height);
+		printf("  %.3f, then %.3f, then %.3f after two edits\n", before.height, after.height, ground.result(q).height);
+	}
+
+	void timeQueries(Terrain& terrain, int numWalkers, int numFrames)
+	{
+		char name[64];
+		sprintf(name, "timings, %d walkers", numWalkers);
+		BenchHeading(name);
+		srand(22);
+		Walkers walkers(terrain, numWalkers);
+		std::vector<float> heights(numWalkers);
+		int numQueries = numWalkers*numFrames;
+
+		// The camera's old way: a height, and a second one ahead for the
+		// tangent, instead of the normal.
+		BenchTimer timer;
+		for(int f = 0; f < numFrames; ++f)
+		{
+			walkers.step(0.02f);
+			for(int i = 0; i < numWalkers; ++i)
+			{
+				const D3DXVECTOR3& p = walkers.pos[i];
+				heights[i] = terrain.getHeight(p.x, p.z) + terrain.getHeight(p.x + 0.1f, p.z);
+			}
+		}
+		BenchReport("getHeight twice (per query)", timer.elapsedMs(), numQueries);
+
+		srand(22);
+		Walkers again(terrain, numWalkers);
+		GroundQuery ground(&terrain);
+		timer.start();
+		for(int f = 0; f < numFrames; ++f)
+		{
+			again.step(0.02f);
+			for(int i = 0; i < numWalkers; ++i)
+				heights[i] = ground.sample(again.pos[i].x, again.pos[i].z).height;
+		}
+		BenchReport("sample (per query)", timer.elapsedMs(), numQueries);
+
+		srand(22);
+		Walkers batch(terrain, numWalkers);
+		GroundQuery batched(&terrain);
+		timer.start();
+		for(int f = 0; f < numFrames; ++f)
+		{
+			batch.step(0.02f);
+			batched.clear();
+			for(int i = 0; i < numWalkers; ++i)
+				batched.add(batch.pos[i].x, batch.pos[i].z);
+			batched.resolve();
+			for(int i = 0; i < numWalkers; ++i)
+				heights[i] = batched.result(i).height;
+		}
+		BenchReport("add and resolve (per query)", timer.elapsedMs(), numQueries);
+
+		const GroundQuery::Stats& stats = ground.getStats();
+		printf("  %.1f%% of queries hit the cache\n",
+			100.0f*(1.0f - (float)stats.numCellFetches / stats.numQueries));
+	}
+}
+
+void GroundSuite(const BenchOptions& options)
+{
+	std::string castleFile = BenchArtFile(options, "castlehm257.raw");
+	if( castleFile.empty() )
+		return;
+
+	Terrain* terrain = buildTerrain(castleFile);
+	checkSample(*terrain, 100, 200);
+	checkResolve(*terrain, 100, 50);
+	// The cache holds an 8x8 block of cells, so it is for a handful of
+	// things near each other, like the camera and what follows it.  A
+	// thousand walkers spread over the map mostly miss it.
+	int numFrames = options.quick ? 100 : 1000;
+	timeQueries(*terrain, 8, 100*numFrames);
+	timeQueries(*terrain, 1000, numFrames);
+
+	// Last, since it changes the heights.
+	checkEdits(*terrain);
+	delete terrain;
+}
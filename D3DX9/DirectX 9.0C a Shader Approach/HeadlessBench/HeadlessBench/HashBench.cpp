@@ -0,0 +1,747 @@
+//=============================================================================
+// HashBench.cpp.
+//
+// Checks SpatialHash against testing every object, for 1k, 10k and 100k
+// spheres: after inserting, moving, removing and reinserting them, the
+// handles must still give back what was stored, and queryBox,
+// querySphere, queryRay and findPairs must find exactly the objects a
+// scan does (queryRay nearest first, at the same distances).  Then times
+// each against its scan.
+//
+// Last, frustum culls a field of spinning asteroids the way the Asteroids
+// demo does, spheres first and then the boxes of those left, checks it
+// against testing every box, and times the two.  The demo draws from a
+// scan rather than the grid: with asteroids all around the camera, the
+// grid's cells near the view hold about as many as there are, and
+// walking them costs more than the sphere tests it saves.
+//=============================================================================
+
+#include "Bench.h"
+#include "Camera.h"
+#include "SpatialHash.h"
+#include "AABBXform.h"
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+	const float MIN_RADIUS = 1.0f;
+	const float MAX_RADIUS = 3.0f;
+
+	// What the grid should hold, by handle.
+	struct Objects
+	{
+		std::vector<D3DXVECTOR3> pos;
+		std::vector<float> radius;
+		std::vector<UINT>  data;
+		std::vector<bool>  alive;
+		float halfSize;
+
+		void set(UINT handle, const D3DXVECTOR3& p, float r, UINT d)
+		{
+			if( handle >= pos.size() )
+			{
+				pos.resize(handle + 1);
+				radius.resize(handle + 1);
+				data.resize(handle + 1);
+				alive.resize(handle + 1, false);
+			}
+			pos[handle]    = p;
+			radius[handle] = r;
+			data[handle]   = d;
+			alive[handle]  = true;
+		}
+	};
+
+	D3DXVECTOR3 randomPoint(float h)
+	{
+		return D3DXVECTOR3(GetRandomFloat(-h, h), GetRandomFloat(-h, h), GetRandomFloat(-h, h));
+	}
+
+	D3DXVECTOR3 randomDir()
+	{
+		D3DXVECTOR3 dir;
+		GetRandomVec(dir);
+		D3DXVec3Normalize(&dir, &dir);
+		return dir;
+	}
+
+	// Spread so each object overlaps about one other, so findPairs has
+	// work to do.
+	float spreadFor(UINT n)
+	{
+		return 0.5f*powf(1000.0f*n, 1.0f/3.0f);
+	}
+
+	// Cells twice the largest radius, and about a bucket per object.
+	UINT bucketsFor(UINT n)
+	{
+		UINT numBuckets = 1024;
+		while( numBuckets < n )
+			numBuckets <<= 1;
+		return numBuckets;
+	}
+
+	void fill(SpatialHash& grid, Objects& objects, UINT n)
+	{
+		objects.halfSize = spreadFor(n);
+		for(UINT i = 0; i < n; ++i)
+		{
+			D3DXVECTOR3 p = randomPoint(objects.halfSize);
+			float r = GetRandomFloat(MIN_RADIUS, MAX_RADIUS);
+			objects.set(grid.insert(p, r, 7*i), p, r, 7*i);
+		}
+	}
+
+	// Every live object takes a step of up to a cell, and one in a hundred
+	// jumps anywhere, a little way past the spread too.
+	void moveAll(SpatialHash& grid, Objects& objects)
+	{
+		for(UINT h = 0; h < (UINT)objects.pos.size(); ++h)
+		{
+			if( !objects.alive[h] )
+				continue;
+
+			D3DXVECTOR3 p;
+			if( rand() % 100 == 0 )
+				p = randomPoint(1.1f*objects.halfSize);
+			else
+				p = objects.pos[h] + GetRandomFloat(0.0f, 2.0f*MAX_RADIUS)*randomDir();
+			grid.move(h, p);
+			objects.pos[h] = p;
+		}
+	}
+
+	// The scans, testing every object the way the grid does.
+	void scanBox(const Objects& objects, const AABB& box, std::vector<UINT>& out)
+	{
+		for(UINT h = 0; h < (UINT)objects.pos.size(); ++h)
+		{
+			if( !objects.alive[h] )
+				continue;
+
+			D3DXVECTOR3 q;
+			D3DXVec3Maximize(&q, &box.minPt, &objects.pos[h]);
+			D3DXVec3Minimize(&q, &box.maxPt, &q);
+			D3DXVECTOR3 d = q - objects.pos[h];
+			if( D3DXVec3LengthSq(&d) <= objects.radius[h]*objects.radius[h] )
+				out.push_back(h);
+		}
+	}
+
+	void scanSphere(const Objects& objects, const D3DXVECTOR3& center, float radius, std::vector<UINT>& out)
+	{
+		for(UINT h = 0; h < (UINT)objects.pos.size(); ++h)
+		{
+			if( !objects.alive[h] )
+				continue;
+
+			D3DXVECTOR3 d = objects.pos[h] - center;
+			float r = objects.radius[h] + radius;
+			if( D3DXVec3LengthSq(&d) <= r*r )
+				out.push_back(h);
+		}
+	}
+
+	bool nearerHit(const SpatialHash::RayHit& a, const SpatialHash::RayHit& b)
+	{
+		return a.t < b.t || (a.t == b.t && a.handle < b.handle);
+	}
+
+	void scanRay(const Objects& objects, const D3DXVECTOR3& origin, const D3DXVECTOR3& dir, float maxT,
+		std::vector<SpatialHash::RayHit>& out)
+	{
+		for(UINT h = 0; h < (UINT)objects.pos.size(); ++h)
+		{
+			if( !objects.alive[h] )
+				continue;
+
+			D3DXVECTOR3 m = objects.pos[h] - origin;
+			float b = D3DXVec3Dot(&m, &dir);
+			float c = D3DXVec3LengthSq(&m) - objects.radius[h]*objects.radius[h];
+			float disc = b*b - c;
+			if( disc < 0.0f || (c > 0.0f && b < 0.0f) )
+				continue;
+
+			SpatialHash::RayHit hit;
+			hit.handle = h;
+			hit.t      = max(b - sqrtf(disc), 0.0f);
+			if( hit.t <= maxT )
+				out.push_back(hit);
+		}
+		std::sort(out.begin(), out.end(), nearerHit);
+	}
+
+	bool lowerPair(const SpatialHash::Pair& a, const SpatialHash::Pair& b)
+	{
+		return a.a < b.a || (a.a == b.a && a.b < b.b);
+	}
+
+	bool overlap(const Objects& objects, UINT i, UINT j)
+	{
+		D3DXVECTOR3 d = objects.pos[j] - objects.pos[i];
+		float r = objects.radius[i] + objects.radius[j];
+		return D3DXVec3LengthSq(&d) <= r*r;
+	}
+
+	// Every pair of live objects, lower handle first.
+	void scanPairs(const Objects& objects, std::vector<SpatialHash::Pair>& out)
+	{
+		UINT n = (UINT)objects.pos.size();
+		for(UINT i = 0; i < n; ++i)
+		{
+			if( !objects.alive[i] )
+				continue;
+			for(UINT j = i+1; j < n; ++j)
+			{
+				if( objects.alive[j] && overlap(objects, i, j) )
+				{
+					SpatialHash::Pair p = { i, j };
+					out.push_back(p);
+				}
+			}
+		}
+	}
+
+	// The same pairs, skipping those too far apart in x to overlap: every
+	// pair of 100k objects takes seconds.
+	void sweepPairs(const Objects& objects, std::vector<SpatialHash::Pair>& out,
+		std::vector<std::pair<float, UINT> >& order)
+	{
+		order.clear();
+		for(UINT h = 0; h < (UINT)objects.pos.size(); ++h)
+			if( objects.alive[h] )
+				order.push_back(std::make_pair(objects.pos[h].x, h));
+		std::sort(order.begin(), order.end());
+
+		for(size_t k = 0; k < order.size(); ++k)
+		{
+			for(size_t l = k+1; l < order.size() && order[l].first - order[k].first <= 2.0f*MAX_RADIUS; ++l)
+			{
+				UINT i = min(order[k].second, order[l].second);
+				UINT j = max(order[k].second, order[l].second);
+				if( overlap(objects, i, j) )
+				{
+					SpatialHash::Pair p = { i, j };
+					out.push_back(p);
+				}
+			}
+		}
+		std::sort(out.begin(), out.end(), lowerPair);
+	}
+
+	AABB randomBox(float h, float maxExtent)
+	{
+		D3DXVECTOR3 c = randomPoint(h);
+		D3DXVECTOR3 e(GetRandomFloat(0.0f, maxExtent), GetRandomFloat(0.0f, maxExtent), GetRandomFloat(0.0f, maxExtent));
+		AABB box;
+		box.minPt = c - e;
+		box.maxPt = c + e;
+		return box;
+	}
+
+	bool sameHits(std::vector<SpatialHash::RayHit>& found, const std::vector<SpatialHash::RayHit>& expected)
+	{
+		for(size_t k = 1; k < found.size(); ++k)
+			if( found[k].t < found[k-1].t )
+				return false;
+
+		// Hits at the same distance may come in any order.
+		std::sort(found.begin(), found.end(), nearerHit);
+		if( found.size() != expected.size() )
+			return false;
+		for(size_t k = 0; k < found.size(); ++k)
+			if( found[k].handle != expected[k].handle || found[k].t != expected[k].t )
+				return false;
+		return true;
+	}
+
+	bool samePairs(std::vector<SpatialHash::Pair>& found, const std::vector<SpatialHash::Pair>& expected)
+	{
+		std::sort(found.begin(), found.end(), lowerPair);
+		if( found.size() != expected.size() )
+			return false;
+		for(size_t k = 0; k < found.size(); ++k)
+			if( found[k].a != expected[k].a || found[k].b != expected[k].b )
+				return false;
+		return true;
+	}
+
+	// Runs every query on the grid and the scan and compares.
+	void checkQueries(SpatialHash& grid, const Objects& objects, int numQueries, const char* when)
+	{
+		float h = objects.halfSize;
+		std::vector<UINT> found;
+		std::vector<UINT> expected;
+		double numFound = 0.0;
+
+		// Boxes of every size, and ones around everything, off to one side
+		// and flat.
+		bool boxesSame = true;
+		for(int q = 0; q < numQueries + 3; ++q)
+		{
+			AABB box = randomBox(1.2f*h, q % 2 ? 10.0f : 0.5f*h);
+			if( q == numQueries )
+			{
+				box.minPt = D3DXVECTOR3(-2.0f*h, -2.0f*h, -2.0f*h);
+				box.maxPt = -box.minPt;
+			}
+			else if( q == numQueries + 1 )
+			{
+				box.minPt = D3DXVECTOR3(3.0f*h, -h, -h);
+				box.maxPt = D3DXVECTOR3(4.0f*h,  h,  h);
+			}
+			else if( q == numQueries + 2 )
+			{
+				box.maxPt.y = box.minPt.y;
+			}
+
+			found.clear();
+			expected.clear();
+			UINT count = grid.queryBox(box, found);
+			scanBox(objects, box, expected);
+			std::sort(found.begin(), found.end());
+			boxesSame = boxesSame && count == found.size() && found == expected;
+			numFound += found.size();
+		}
+		BENCH_CHECK(boxesSame);
+
+		// Spheres from points up to a sizeable part of the spread.
+		bool spheresSame = true;
+		for(int q = 0; q < numQueries; ++q)
+		{
+			D3DXVECTOR3 center = randomPoint(1.2f*h);
+			float radius = q % 3 == 0 ? 0.0f : GetRandomFloat(0.0f, q % 3 == 1 ? 10.0f : 0.5f*h);
+			found.clear();
+			expected.clear();
+			UINT count = grid.querySphere(center, radius, found);
+			scanSphere(objects, center, radius, expected);
+			std::sort(found.begin(), found.end());
+			spheresSame = spheresSame && count == found.size() && found == expected;
+			numFound += found.size();
+		}
+		BENCH_CHECK(spheresSame);
+
+		// Rays from inside and outside the spread, some along the axes,
+		// some endless and some short.
+		std::vector<SpatialHash::RayHit> hits;
+		std::vector<SpatialHash::RayHit> expectedHits;
+		bool raysSame = true;
+		for(int q = 0; q < numQueries; ++q)
+		{
+			D3DXVECTOR3 origin = randomPoint(1.5f*h);
+			D3DXVECTOR3 dir = randomDir();
+			if( q % 4 == 1 )
+			{
+				int a = rand() % 3;
+				dir = D3DXVECTOR3(0.0f, 0.0f, 0.0f);
+				(&dir.x)[a] = rand() % 2 ? 1.0f : -1.0f;
+			}
+			else if( q % 4 == 2 )
+			{
+				// Straight at an object, so even the sparse fields are hit.
+				D3DXVECTOR3 target = objects.pos[rand() % objects.pos.size()];
+				dir = target - origin;
+				D3DXVec3Normalize(&dir, &dir);
+			}
+			float maxT = q % 2 ? INFINITY : GetRandomFloat(0.0f, 2.0f*h);
+
+			hits.clear();
+			expectedHits.clear();
+			UINT count = grid.queryRay(origin, dir, maxT, hits);
+			scanRay(objects, origin, dir, maxT, expectedHits);
+			raysSame = raysSame && count == hits.size() && sameHits(hits, expectedHits);
+			numFound += hits.size();
+		}
+		BENCH_CHECK(raysSame);
+
+		std::vector<SpatialHash::Pair> pairs;
+		std::vector<SpatialHash::Pair> expectedPairs;
+		UINT numPairs = grid.findPairs(pairs);
+		if( objects.pos.size() <= 10000 )
+		{
+			scanPairs(objects, expectedPairs);
+		}
+		else
+		{
+			std::vector<std::pair<float, UINT> > order;
+			sweepPairs(objects, expectedPairs, order);
+		}
+		BENCH_CHECK(numPairs == pairs.size() && samePairs(pairs, expectedPairs));
+
+		printf("  %s: %.1f found per query, %u pairs\n", when, numFound / (3*numQueries + 3), numPairs);
+	}
+
+	void checkGrid(UINT n, int numQueries)
+	{
+		char name[64];
+		sprintf(name, "%u objects", n);
+		BenchHeading(name);
+		srand(23);
+
+		SpatialHash grid(2.0f*MAX_RADIUS, bucketsFor(n));
+		Objects objects;
+		fill(grid, objects, n);
+		BENCH_CHECK(grid.size() == n);
+		checkQueries(grid, objects, numQueries, "inserted");
+
+		// Twenty frames of moves.
+		for(int f = 0; f < 20; ++f)
+			moveAll(grid, objects);
+
+		// Take out a third and put as many back: they must reuse the
+		// freed handles.
+		std::vector<UINT> freed;
+		for(UINT h = 0; h < n; ++h)
+		{
+			if( rand() % 3 == 0 )
+			{
+				grid.remove(h);
+				objects.alive[h] = false;
+				freed.push_back(h);
+			}
+		}
+		BENCH_CHECK(grid.size() == n - freed.size());
+
+		bool reused = true;
+		for(size_t k = 0; k < freed.size(); ++k)
+		{
+			D3DXVECTOR3 p = randomPoint(objects.halfSize);
+			float r = GetRandomFloat(MIN_RADIUS, MAX_RADIUS);
+			UINT h = grid.insert(p, r, 3*(UINT)k + 1);
+			reused = reused && h < n && !objects.alive[h];
+			objects.set(h, p, r, 3*(UINT)k + 1);
+		}
+		BENCH_CHECK(reused);
+		BENCH_CHECK(grid.size() == n);
+
+		// Then take some out for good.
+		for(UINT h = 0; h < n; h += 5)
+		{
+			grid.remove(h);
+			objects.alive[h] = false;
+		}
+		BENCH_CHECK(grid.size() == n - (n + 4)/5);
+
+		bool stored = true;
+		for(UINT h = 0; h < n; ++h)
+		{
+			if( !objects.alive[h] )
+				continue;
+			stored = stored && grid.getPos(h) == objects.pos[h] && grid.getRadius(h) == objects.radius[h] &&
+				grid.getData(h) == objects.data[h];
+		}
+		BENCH_CHECK(stored);
+
+		// A few more moves, then everything again.
+		for(int f = 0; f < 5; ++f)
+			moveAll(grid, objects);
+		checkQueries(grid, objects, numQueries, "moved, removed, reinserted");
+
+		grid.clear();
+		std::vector<UINT> found;
+		BENCH_CHECK(grid.size() == 0);
+		BENCH_CHECK(grid.queryBox(randomBox(objects.halfSize, objects.halfSize), found) == 0);
+		BENCH_CHECK(grid.querySphere(D3DXVECTOR3(0.0f, 0.0f, 0.0f), objects.halfSize, found) == 0);
+	}
+
+	void timeGrid(UINT n, int numQueries)
+	{
+		char name[64];
+		char label[64];
+		sprintf(name, "timings, %u objects", n);
+		BenchHeading(name);
+		srand(231);
+
+		float h = spreadFor(n);
+		std::vector<D3DXVECTOR3> positions(n);
+		std::vector<float> radii(n);
+		for(UINT i = 0; i < n; ++i)
+		{
+			positions[i] = randomPoint(h);
+			radii[i] = GetRandomFloat(MIN_RADIUS, MAX_RADIUS);
+		}
+
+		SpatialHash grid(2.0f*MAX_RADIUS, bucketsFor(n));
+		BenchTimer timer;
+		for(UINT i = 0; i < n; ++i)
+			grid.insert(positions[i], radii[i], i);
+		BenchReport("insert (per object)", timer.elapsedMs(), n);
+
+		// A frame of the objects drifting, mostly within their cells.
+		for(UINT i = 0; i < n; ++i)
+			positions[i] += GetRandomFloat(0.0f, 0.5f)*randomDir();
+		timer.start();
+		for(UINT i = 0; i < n; ++i)
+			grid.move(i, positions[i]);
+		BenchReport("move (per object)", timer.elapsedMs(), n);
+
+		Objects objects;
+		objects.halfSize = h;
+		for(UINT i = 0; i < n; ++i)
+			objects.set(i, grid.getPos(i), grid.getRadius(i), i);
+
+		std::vector<AABB> boxes(numQueries);
+		std::vector<D3DXVECTOR3> points(numQueries);
+		std::vector<D3DXVECTOR3> dirs(numQueries);
+		for(int q = 0; q < numQueries; ++q)
+		{
+			boxes[q]  = randomBox(h, 10.0f);
+			points[q] = randomPoint(h);
+			dirs[q]   = randomDir();
+		}
+		std::vector<UINT> found;
+		std::vector<SpatialHash::RayHit> hits;
+
+		timer.start();
+		for(int q = 0; q < numQueries; ++q)
+		{
+			found.clear();
+			grid.queryBox(boxes[q], found);
+		}
+		BenchReport("queryBox (per query)", timer.elapsedMs(), numQueries);
+		timer.start();
+		for(int q = 0; q < numQueries; ++q)
+		{
+			found.clear();
+			scanBox(objects, boxes[q], found);
+		}
+		BenchReport("box scan (per query)", timer.elapsedMs(), numQueries);
+
+		timer.start();
+		for(int q = 0; q < numQueries; ++q)
+		{
+			found.clear();
+			grid.querySphere(points[q], 10.0f, found);
+		}
+		BenchReport("querySphere (per query)", timer.elapsedMs(), numQueries);
+		timer.start();
+		for(int q = 0; q < numQueries; ++q)
+		{
+			found.clear();
+			scanSphere(objects, points[q], 10.0f, found);
+		}
+		BenchReport("sphere scan (per query)", timer.elapsedMs(), numQueries);
+
+		// Endless, like a pick.
+		timer.start();
+		for(int q = 0; q < numQueries; ++q)
+		{
+			hits.clear();
+			grid.queryRay(points[q], dirs[q], INFINITY, hits);
+		}
+		BenchReport("queryRay (per query)", timer.elapsedMs(), numQueries);
+		timer.start();
+		for(int q = 0; q < numQueries; ++q)
+		{
+			hits.clear();
+			scanRay(objects, points[q], dirs[q], INFINITY, hits);
+		}
+		BenchReport("ray scan (per query)", timer.elapsedMs(), numQueries);
+
+		std::vector<SpatialHash::Pair> pairs;
+		timer.start();
+		grid.findPairs(pairs);
+		BenchReport("findPairs", timer.elapsedMs(), 1);
+		pairs.clear();
+		timer.start();
+		if( n <= 10000 )
+		{
+			scanPairs(objects, pairs);
+			BenchReport("pair scan", timer.elapsedMs(), 1);
+		}
+		else
+		{
+			std::vector<std::pair<float, UINT> > order;
+			sweepPairs(objects, pairs, order);
+			BenchReport("pair sweep along x", timer.elapsedMs(), 1);
+		}
+
+		timer.start();
+		for(UINT i = 0; i < n; ++i)
+			grid.remove(i);
+		BenchReport("remove (per object)", timer.elapsedMs(), n);
+	}
+
+	struct Asteroid
+	{
+		D3DXVECTOR3 axis;
+		float theta;
+		D3DXVECTOR3 pos;
+	};
+
+	struct Field
+	{
+		std::vector<Asteroid> asteroids;
+		AABB  localBox;
+		float radius;
+		float halfSize;
+
+		// Scratch for the batch transform.
+		std::vector<AffineMatrix> xforms;
+		std::vector<AABB> boxes;
+		std::vector<UINT> inView;
+	};
+
+	D3DXMATRIX asteroidWorld(const Asteroid& a)
+	{
+		D3DXMATRIX R, T;
+		D3DXMatrixRotationAxis(&R, &a.axis, a.theta);
+		D3DXMatrixTranslation(&T, a.pos.x, a.pos.y, a.pos.z);
+		return R*T;
+	}
+
+	// The demo scatters 300 asteroids over a 1000 unit cube; bigger fields
+	// keep that density.
+	void scatter(Field& field, UINT n)
+	{
+		srand(23);
+		field.localBox.minPt = D3DXVECTOR3(-2.5f, -2.0f, -3.0f);
+		field.localBox.maxPt = D3DXVECTOR3( 2.5f,  2.0f,  3.0f);
+		field.radius   = D3DXVec3Length(&field.localBox.maxPt);
+		field.halfSize = 500.0f * powf(n / 300.0f, 1.0f / 3.0f);
+
+		field.asteroids.resize(n);
+		for(UINT i = 0; i < n; ++i)
+		{
+			Asteroid& a = field.asteroids[i];
+			a.axis  = randomDir();
+			a.theta = GetRandomFloat(0.0f, 2.0f*D3DX_PI);
+			a.pos   = randomPoint(field.halfSize);
+		}
+	}
+
+	void randomView(Camera& camera, const Field& field)
+	{
+		D3DXVECTOR3 pos = randomPoint(0.8f*field.halfSize);
+		D3DXVECTOR3 target = pos + randomDir();
+		D3DXVECTOR3 up(0.0f, 1.0f, 0.0f);
+		camera.lookAt(pos, target, up);
+	}
+
+	// The demo's loop before: every asteroid's box to world space in one
+	// batch, and tested.
+	void cullBoxes(Field& field, const Camera& camera, std::vector<UINT>& visible)
+	{
+		visible.clear();
+		UINT n = (UINT)field.asteroids.size();
+		field.xforms.resize(n);
+		field.boxes.resize(n);
+		for(UINT i = 0; i < n; ++i)
+			field.xforms[i] = AffineMatrix(asteroidWorld(field.asteroids[i]));
+		XformAABBs(field.localBox, &field.xforms[0], &field.boxes[0], n);
+		for(UINT i = 0; i < n; ++i)
+			if( camera.isVisible(field.boxes[i]) )
+				visible.push_back(i);
+	}
+
+	// The demo's loop now: the spheres don't turn, so need no transform,
+	// and only the asteroids whose spheres are in view have their boxes
+	// transformed and tested.
+	void cullSpheresThenBoxes(Field& field, const Camera& camera, std::vector<UINT>& visible)
+	{
+		visible.clear();
+		field.inView.clear();
+		for(UINT i = 0; i < (UINT)field.asteroids.size(); ++i)
+		{
+			BoundingSphere sphere;
+			sphere.pos    = field.asteroids[i].pos;
+			sphere.radius = field.radius;
+			if( camera.isVisible(sphere) )
+				field.inView.push_back(i);
+		}
+
+		UINT numInView = (UINT)field.inView.size();
+		field.xforms.resize(numInView);
+		field.boxes.resize(numInView);
+		for(UINT k = 0; k < numInView; ++k)
+			field.xforms[k] = AffineMatrix(asteroidWorld(field.asteroids[field.inView[k]]));
+		if( numInView > 0 )
+			XformAABBs(field.localBox, &field.xforms[0], &field.boxes[0], numInView);
+		for(UINT k = 0; k < numInView; ++k)
+			if( camera.isVisible(field.boxes[k]) )
+				visible.push_back(field.inView[k]);
+	}
+
+	void runCull(UINT n, int numViews)
+	{
+		char name[64];
+		sprintf(name, "culling %u asteroids", n);
+		BenchHeading(name);
+
+		Field field;
+		scatter(field, n);
+
+		// The demo's lens.
+		Camera camera;
+		camera.setLens(D3DX_PI * 0.25f, 800.0f/600.0f, 0.01f, 5000.0f);
+
+		std::vector<UINT> boxVisible;
+		std::vector<UINT> expected;
+		std::vector<UINT> visible;
+		double numSpheres = 0.0;
+		double numVisible = 0.0;
+		double numBoxVisible = 0.0;
+		bool same = true;
+		srand(230);
+		for(int v = 0; v < numViews; ++v)
+		{
+			randomView(camera, field);
+			cullBoxes(field, camera, boxVisible);
+			cullSpheresThenBoxes(field, camera, visible);
+			numSpheres += field.inView.size();
+
+			// A box can poke out of its sphere, so the boxes alone may
+			// pass a few the spheres rule out.
+			expected.clear();
+			for(size_t k = 0; k < boxVisible.size(); ++k)
+			{
+				BoundingSphere sphere;
+				sphere.pos    = field.asteroids[boxVisible[k]].pos;
+				sphere.radius = field.radius;
+				if( camera.isVisible(sphere) )
+					expected.push_back(boxVisible[k]);
+			}
+			same = same && visible == expected;
+			numVisible    += visible.size();
+			numBoxVisible += boxVisible.size();
+		}
+		BENCH_CHECK(same);
+		printf("  per view: %.0f spheres in view, %.0f boxes (%.0f by box alone)\n",
+			numSpheres / numViews, numVisible / numViews, numBoxVisible / numViews);
+
+		// Each timing sees the same views.
+		srand(230);
+		BenchTimer timer;
+		for(int v = 0; v < numViews; ++v)
+		{
+			randomView(camera, field);
+			cullBoxes(field, camera, boxVisible);
+		}
+		BenchReport("boxes (per view)", timer.elapsedMs(), numViews);
+
+		srand(230);
+		timer.start();
+		for(int v = 0; v < numViews; ++v)
+		{
+			randomView(camera, field);
+			cullSpheresThenBoxes(field, camera, visible);
+		}
+		BenchReport("spheres, then boxes (per view)", timer.elapsedMs(), numViews);
+	}
+}
+
+void HashSuite(const BenchOptions& options)
+{
+	int numQueries = options.quick ? 50 : 200;
+	UINT sizes[] = {1000, 10000, 100000};
+	for(int s = 0; s < 3; ++s)
+		checkGrid(sizes[s], numQueries);
+	for(int s = 0; s < 3; ++s)
+		timeGrid(sizes[s], 10*numQueries);
+
+	int numViews = options.quick ? 10 : 100;
+	for(int s = 0; s < 3; ++s)
+		runCull(sizes[s], numViews);
+}
@@ -0,0 +1,174 @@
+//=============================================================================
+// HeightsBench.cpp.
+//
+// Checks Terrain::getHeights against getHeight over the castle map: the
+// heights must be identical, four at a time or in the scalar leftovers,
+// for random points, points on the cell edges and diagonals, on the
+// terrain's border and far off it (clamped).  The normals must match the
+// scalar path's to float rounding.  Then times the two.
+//=============================================================================
+
+#include "Bench.h"
+#include "Terrain.h"
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+	// The normals are normalized by D3DXVec3Normalize one way and by SSE
+	// the other, so they may differ in the last bits.
+	const float NORMAL_TOLERANCE = 1e-6f;
+
+	struct Points
+	{
+		std::vector<float> xs;
+		std::vector<float> zs;
+
+		void add(float x, float z)
+		{
+			xs.push_back(x);
+			zs.push_back(z);
+		}
+	};
+
+	// The demo's terrain, built without a device.
+	Terrain* buildTerrain(const std::string& castleFile)
+	{
+		Heightmap heightmap(257, 257, castleFile, 0.5f, 0.0f);
+		Table<float> heights(257, 257);
+		for(int i = 0; i < 257; ++i)
+			for(int j = 0; j < 257; ++j)
+				heights(i, j) = heightmap(i, j);
+		return new Terrain(heights, 2.0f, 2.0f, D3DXVECTOR3(0.0f, 0.0f, 0.0f));
+	}
+
+	void makePoints(Terrain& terrain, int numRandom, Points& points)
+	{
+		float halfW = 0.5f*terrain.getWidth();
+		float halfD = 0.5f*terrain.getDepth();
+		float dx = terrain.getDX();
+		float dz = terrain.getDZ();
+
+		for(int k = 0; k < numRandom; ++k)
+			points.add(GetRandomFloat(-halfW, halfW), GetRandomFloat(-halfD, halfD));
+
+		// Vertices, cell edges and cell diagonals along one row of cells.
+		for(int j = 0; j < 64; ++j)
+		{
+			float x = -halfW + j*dx;
+			float z = halfD - 100.0f*dz;
+			points.add(x, z);
+			points.add(x + 0.5f*dx, z);
+			points.add(x, z - 0.5f*dz);
+			points.add(x + 0.5f*dx, z - 0.5f*dz);
+			points.add(x + 0.25f*dx, z - 0.75f*dz);
+		}
+
+		// The border, the corners, and points off every side.
+		for(int k = 0; k < 32; ++k)
+		{
+			float u = GetRandomFloat(-halfW, halfW);
+			float v = GetRandomFloat(-halfD, halfD);
+			points.add(u, halfD);
+			points.add(u, -halfD);
+			points.add(halfW, v);
+			points.add(-halfW, v);
+			points.add(u, halfD + GetRandomFloat(0.0f, 1000.0f));
+			points.add(u, -halfD - GetRandomFloat(0.0f, 1000.0f));
+			points.add(halfW + GetRandomFloat(0.0f, 1000.0f), v);
+			points.add(-halfW - GetRandomFloat(0.0f, 1000.0f), v);
+		}
+		points.add( halfW,  halfD);
+		points.add(-halfW,  halfD);
+		points.add( halfW, -halfD);
+		points.add(-halfW, -halfD);
+		points.add( 1e6f,  1e6f);
+		points.add(-1e6f, -1e6f);
+
+		// An odd count, so the last points take the scalar leftovers.
+		if( points.xs.size() % 4 == 0 )
+			points.add(0.0f, 0.0f);
+	}
+
+	void check(Terrain& terrain)
+	{
+		BenchHeading("against getHeight");
+		srand(4);
+		Points points;
+		makePoints(terrain, 10000, points);
+		size_t n = points.xs.size();
+
+		std::vector<float> heights(n);
+		std::vector<D3DXVECTOR3> normals(n);
+		terrain.getHeights(&points.xs[0], &points.zs[0], &heights[0], n, &normals[0]);
+
+		// The same points one at a time: getHeight, and getHeights with a
+		// count too small for SSE, for the scalar normals.
+		int numDifferent = 0;
+		float maxNormalDiff = 0.0f;
+		for(size_t i = 0; i < n; ++i)
+		{
+			float h = terrain.getHeight(points.xs[i], points.zs[i]);
+			if( memcmp(&h, &heights[i], sizeof(float)) != 0 )
+				++numDifferent;
+
+			float h1;
+			D3DXVECTOR3 normal;
+			terrain.getHeights(&points.xs[i], &points.zs[i], &h1, 1, &normal);
+			if( memcmp(&h1, &heights[i], sizeof(float)) != 0 )
+				++numDifferent;
+			D3DXVECTOR3 diff = normal - normals[i];
+			maxNormalDiff = max(maxNormalDiff, max(fabsf(diff.x), max(fabsf(diff.y), fabsf(diff.z))));
+		}
+		printf("  %u points: %d heights differ, largest normal difference %g\n",
+			(UINT)n, numDifferent, maxNormalDiff);
+		BENCH_CHECK(numDifferent == 0);
+		BENCH_CHECK(maxNormalDiff <= NORMAL_TOLERANCE);
+
+		// Without normals the heights don't change.
+		std::vector<float> heightsOnly(n);
+		terrain.getHeights(&points.xs[0], &points.zs[0], &heightsOnly[0], n);
+		BENCH_CHECK(memcmp(&heightsOnly[0], &heights[0], n*sizeof(float)) == 0);
+	}
+
+	void timeHeights(Terrain& terrain, int n, int reps)
+	{
+		BenchHeading("timings");
+		srand(40);
+		Points points;
+		float halfW = 0.5f*terrain.getWidth();
+		float halfD = 0.5f*terrain.getDepth();
+		for(int k = 0; k < n; ++k)
+			points.add(GetRandomFloat(-halfW, halfW), GetRandomFloat(-halfD, halfD));
+		std::vector<float> heights(n);
+		std::vector<D3DXVECTOR3> normals(n);
+
+		BenchTimer timer;
+		for(int r = 0; r < reps; ++r)
+			for(int k = 0; k < n; ++k)
+				heights[k] = terrain.getHeight(points.xs[k], points.zs[k]);
+		BenchReport("getHeight (per point)", timer.elapsedMs(), reps*n);
+
+		timer.start();
+		for(int r = 0; r < reps; ++r)
+			terrain.getHeights(&points.xs[0], &points.zs[0], &heights[0], n);
+		BenchReport("getHeights (per point)", timer.elapsedMs(), reps*n);
+
+		timer.start();
+		for(int r = 0; r < reps; ++r)
+			terrain.getHeights(&points.xs[0], &points.zs[0], &heights[0], n, &normals[0]);
+		BenchReport("getHeights, normals (per point)", timer.elapsedMs(), reps*n);
+	}
+}
+
+void HeightsSuite(const BenchOptions& options)
+{
+	std::string castleFile = BenchArtFile(options, "castlehm257.raw");
+	if( castleFile.empty() )
+		return;
+
+	Terrain* terrain = buildTerrain(castleFile);
+	check(*terrain);
+	timeHeights(*terrain, 100000, options.quick ? 5 : 50);
+	delete terrain;
+}
@@ -0,0 +1,245 @@
+//=============================================================================
+// LayoutBench.cpp.
+//
+// Runs the heightmap passes that read 2D windows of a Table (a 3x3 filter,
+// vertex normals, and copying out terrain sub-grids) over the same heights
+// stored row-major, in 16x16 tiles and in Morton order.  Each pass visits
+// the table row by row and then tile by tile (numTiles/tile), and must give
+// the same results under every layout and order.
+//
+// These are plain element-by-element versions, since only row-major
+// tables can be walked with row pointers; they show what the blocked
+// layouts buy the windowed passes, not what the SSE passes in Heightmap
+// cost.
+//=============================================================================
+
+#include "Bench.h"
+#include "d3dUtil.h"
+#include "Table.h"
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+	const int SUBGRID_VERTS = 33;
+
+	template <typename Layout>
+	void synthesize(Table<float, Layout>& h, int n)
+	{
+		h.resize(n, n, 0.0f);
+		for(int i = 0; i < n; ++i)
+			for(int j = 0; j < n; ++j)
+				h(i, j) = 40.0f*sinf(0.011f*j)*cosf(0.017f*i) + 8.0f*sinf(0.07f*j + 0.05f*i);
+	}
+
+	// Averages each height with its neighbours on the map, over the
+	// rectangle R, in the same order as Heightmap::sampleHeight3x3.
+	template <typename Layout>
+	void filterTile(const Table<float, Layout>& src, Table<float, Layout>& dst, const TableTile& R)
+	{
+		int m = src.numRows();
+		int n = src.numCols();
+		for(int i = R.row0; i < R.row1; ++i)
+		{
+			for(int j = R.col0; j < R.col1; ++j)
+			{
+				float sum = 0.0f;
+				float num = 0.0f;
+				for(int a = i-1; a <= i+1; ++a)
+				{
+					for(int b = j-1; b <= j+1; ++b)
+					{
+						if( a >= 0 && a < m && b >= 0 && b < n )
+						{
+							sum += src(a, b);
+							num += 1.0f;
+						}
+					}
+				}
+				dst(i, j) = sum / num;
+			}
+		}
+	}
+
+	// Central difference normals, clamped at the edges.
+	template <typename Layout>
+	void normalsTile(const Table<float, Layout>& h, Table<D3DXVECTOR3, Layout>& out, const TableTile& R)
+	{
+		int m = h.numRows();
+		int n = h.numCols();
+		for(int i = R.row0; i < R.row1; ++i)
+		{
+			for(int j = R.col0; j < R.col1; ++j)
+			{
+				float l = h(i, max(j-1, 0));
+				float r = h(i, min(j+1, n-1));
+				float u = h(max(i-1, 0), j);
+				float d = h(min(i+1, m-1), j);
+				D3DXVECTOR3 v(l - r, 2.0f, d - u);
+				D3DXVec3Normalize(&out(i, j), &v);
+			}
+		}
+	}
+
+	TableTile wholeRow(int i, int n)
+	{
+		TableTile R = {i, 0, i+1, n};
+		return R;
+	}
+
+	template <typename Layout>
+	struct Passes
+	{
+		Table<float, Layout> heights;
+		Table<float, Layout> filtered;
+		Table<D3DXVECTOR3, Layout> normals;
+		std::vector<float> subgrids;
+
+		void filter(bool byTiles)
+		{
+			filtered.resize(heights.numRows(), heights.numCols());
+			if( byTiles )
+			{
+				for(int t = 0; t < heights.numTiles(); ++t)
+					filterTile(heights, filtered, heights.tile(t));
+			}
+			else
+			{
+				for(int i = 0; i < heights.numRows(); ++i)
+					filterTile(heights, filtered, wholeRow(i, heights.numCols()));
+			}
+		}
+
+		void computeNormals(bool byTiles)
+		{
+			normals.resize(heights.numRows(), heights.numCols());
+			if( byTiles )
+			{
+				for(int t = 0; t < heights.numTiles(); ++t)
+					normalsTile(heights, normals, heights.tile(t));
+			}
+			else
+			{
+				for(int i = 0; i < heights.numRows(); ++i)
+					normalsTile(heights, normals, wholeRow(i, heights.numCols()));
+			}
+		}
+
+		// Copies every 33x33 sub-grid out, the way Terrain builds its
+		// sub-grid meshes; neighbouring sub-grids share their borders.
+		void copySubGrids()
+		{
+			int perSide = (heights.numRows() - 1) / (SUBGRID_VERTS - 1);
+			subgrids.resize((size_t)perSide*perSide*SUBGRID_VERTS*SUBGRID_VERTS);
+			float* out = &subgrids[0];
+			for(int r = 0; r < perSide; ++r)
+				for(int c = 0; c < perSide; ++c)
+					for(int i = 0; i < SUBGRID_VERTS; ++i)
+						for(int j = 0; j < SUBGRID_VERTS; ++j)
+							*out++ = heights(r*(SUBGRID_VERTS-1) + i, c*(SUBGRID_VERTS-1) + j);
+		}
+	};
+
+	// Compares the passes' results under Layout with the row-major ones.
+	template <typename Layout>
+	void checkAgainst(Passes<Layout>& p, Passes<RowMajorLayout>& ref)
+	{
+		int m = ref.heights.numRows();
+		int n = ref.heights.numCols();
+		bool same = true;
+		for(int byTiles = 0; byTiles < 2; ++byTiles)
+		{
+			p.filter(byTiles != 0);
+			p.computeNormals(byTiles != 0);
+			for(int i = 0; i < m; ++i)
+			{
+				for(int j = 0; j < n; ++j)
+				{
+					same = same && p.filtered(i, j) == ref.filtered(i, j);
+					same = same && p.normals(i, j) == ref.normals(i, j);
+				}
+			}
+		}
+		p.copySubGrids();
+		BENCH_CHECK(same);
+		BENCH_CHECK(p.subgrids == ref.subgrids);
+	}
+
+	// The tiles cover the table exactly once.
+	template <typename Layout>
+	void checkTiles(const Table<float, Layout>& t)
+	{
+		std::vector<int> covered((size_t)t.numRows()*t.numCols(), 0);
+		for(int k = 0; k < t.numTiles(); ++k)
+		{
+			TableTile R = t.tile(k);
+			for(int i = R.row0; i < R.row1; ++i)
+				for(int j = R.col0; j < R.col1; ++j)
+					++covered[(size_t)i*t.numCols() + j];
+		}
+		bool once = true;
+		for(size_t k = 0; k < covered.size(); ++k)
+			once = once && covered[k] == 1;
+		BENCH_CHECK(once);
+	}
+
+	template <typename Layout>
+	void time(const char* name, Passes<Layout>& p, int reps)
+	{
+		int numVerts = p.heights.numRows()*p.heights.numCols();
+		char label[64];
+
+		for(int byTiles = 0; byTiles < 2; ++byTiles)
+		{
+			BenchTimer timer;
+			for(int k = 0; k < reps; ++k)
+				p.filter(byTiles != 0);
+			sprintf(label, "%s, 3x3 filter by %s", name, byTiles ? "tiles" : "rows");
+			BenchReport(label, timer.elapsedMs(), reps*numVerts);
+
+			timer.start();
+			for(int k = 0; k < reps; ++k)
+				p.computeNormals(byTiles != 0);
+			sprintf(label, "%s, normals by %s", name, byTiles ? "tiles" : "rows");
+			BenchReport(label, timer.elapsedMs(), reps*numVerts);
+		}
+
+		BenchTimer timer;
+		for(int k = 0; k < reps; ++k)
+			p.copySubGrids();
+		sprintf(label, "%s, sub-grid copy", name);
+		BenchReport(label, timer.elapsedMs(), reps*(int)p.subgrids.size());
+	}
+}
+
+void LayoutSuite(const BenchOptions& options)
+{
+	// A terrain-sized map, 2^k+1 on a side.
+	int n = options.quick ? 513 : 2049;
+	int reps = options.quick ? 1 : 5;
+
+	Passes<RowMajorLayout> rowMajor;
+	Passes< TiledLayout<4> > tiled;
+	Passes< MortonLayout<4> > morton;
+	synthesize(rowMajor.heights, n);
+	synthesize(tiled.heights, n);
+	synthesize(morton.heights, n);
+
+	BenchHeading("checks");
+	checkTiles(rowMajor.heights);
+	checkTiles(tiled.heights);
+	checkTiles(morton.heights);
+	rowMajor.filter(false);
+	rowMajor.computeNormals(false);
+	rowMajor.copySubGrids();
+	checkAgainst(rowMajor, rowMajor);
+	checkAgainst(tiled, rowMajor);
+	checkAgainst(morton, rowMajor);
+	printf("  %dx%d heights; %d row-major, %d tiled and %d Morton tiles\n", n, n,
+		rowMajor.heights.numTiles(), tiled.heights.numTiles(), morton.heights.numTiles());
+
+	BenchHeading("timings");
+	time("row-major", rowMajor, reps);
+	time("tiled", tiled, reps);
+	time("Morton", morton, reps);
+}
@@ -0,0 +1,204 @@
+//=============================================================================
+// OcclusionBench.cpp.
+//
+// Renders a fixed scene (the castle map's terrain occluder and two walls)
+// into OcclusionCuller's depth buffer and compares it with a known good
+// image in the golden folder.  Depths may differ a little from compiler to
+// compiler, and pixels on an edge may flip, so both are allowed within a
+// tolerance.  Then checks some boxes whose answers are known and times
+// render() and testBoxes.
+//
+// If the rasterizer changes on purpose, check the new image written to the
+// scratch folder and copy it over Golden/occlusion_depth.pgm.
+//=============================================================================
+
+#include "Bench.h"
+#include "OcclusionCuller.h"
+#include "Camera.h"
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+namespace
+{
+	const char* const GOLDEN_NAME = "occlusion_depth.pgm";
+
+	// Per pixel, in 16-bit PGM units, and how many pixels may be further off.
+	const int   DEPTH_TOLERANCE = 16;
+	const float MAX_BAD_PIXEL_FRACTION = 0.002f;
+
+	// Reads a 16-bit binary PGM like the ones saveDepthImage writes.
+	bool loadPGM(const std::string& filename, int& width, int& height, std::vector<WORD>& pixels)
+	{
+		std::ifstream inFile(filename.c_str(), std::ios_base::binary);
+		if( !inFile )
+			return false;
+
+		std::string magic;
+		int maxValue = 0;
+		inFile >> magic >> width >> height >> maxValue;
+		inFile.get(); // The newline before the samples.
+		if( !inFile || magic != "P5" || maxValue != 65535 || width <= 0 || height <= 0 )
+			return false;
+
+		pixels.resize(width*height);
+		for(size_t i = 0; i < pixels.size(); ++i)
+		{
+			int hi = inFile.get();
+			int lo = inFile.get();
+			pixels[i] = (WORD)((hi << 8) | lo);
+		}
+		return !inFile.fail();
+	}
+
+	// The scene's view: from the south, looking north over the castle
+	// map, with a wall straight ahead and another covering the left edge.
+	void setupCamera(Camera& camera, int width, int height)
+	{
+		D3DXVECTOR3 pos(0.0f, 60.0f, -120.0f);
+		D3DXVECTOR3 target(0.0f, 50.0f, 0.0f);
+		D3DXVECTOR3 up(0.0f, 1.0f, 0.0f);
+		camera.lookAt(pos, target, up);
+		camera.setLens(D3DX_PI * 0.25f, (float)width/height, 1.0f, 1000.0f);
+	}
+
+	void addWalls(OcclusionCuller& culler)
+	{
+		AABB ahead;
+		ahead.minPt = D3DXVECTOR3(-20.0f, 30.0f, -40.0f);
+		ahead.maxPt = D3DXVECTOR3( 20.0f, 90.0f, -38.0f);
+		culler.addBoxOccluder(ahead);
+
+		AABB left;
+		left.minPt = D3DXVECTOR3(-200.0f,  30.0f, -62.0f);
+		left.maxPt = D3DXVECTOR3( -10.0f, 110.0f, -60.0f);
+		culler.addBoxOccluder(left);
+	}
+
+	AABB makeBox(const D3DXVECTOR3& minPt, const D3DXVECTOR3& maxPt)
+	{
+		AABB box;
+		box.minPt = minPt;
+		box.maxPt = maxPt;
+		return box;
+	}
+
+	void compareGolden(const BenchOptions& options, const OcclusionCuller& culler)
+	{
+		BenchHeading("golden image");
+
+		// Quantize the same way saveDepthImage does.
+		std::string rendered = options.scratchDir + GOLDEN_NAME;
+		BENCH_CHECK(culler.saveDepthImage(rendered));
+
+		int width = 0, height = 0;
+		std::vector<WORD> golden;
+		std::vector<WORD> pixels;
+		int w = 0, h = 0;
+		if( !loadPGM(options.goldenDir + GOLDEN_NAME, width, height, golden) )
+		{
+			BenchFail(__FILE__, __LINE__, "golden image loads");
+			printf("  Can't read %s%s; use -golden to point at the Golden folder.\n"
+				"  This run's image is %s.\n", options.goldenDir.c_str(), GOLDEN_NAME, rendered.c_str());
+			return;
+		}
+		BENCH_CHECK(loadPGM(rendered, w, h, pixels));
+		BENCH_CHECK(w == width && h == height);
+		if( w != width || h != height )
+			return;
+
+		int maxDiff = 0;
+		int numBad = 0;
+		for(size_t i = 0; i < pixels.size(); ++i)
+		{
+			int diff = abs((int)pixels[i] - (int)golden[i]);
+			maxDiff = max(maxDiff, diff);
+			if( diff > DEPTH_TOLERANCE )
+				++numBad;
+		}
+
+		float badFraction = (float)numBad / (float)pixels.size();
+		printf("  %dx%d: %d pixels off by more than %d (%.3f%%), largest difference %d\n",
+			width, height, numBad, DEPTH_TOLERANCE, 100.0f*badFraction, maxDiff);
+		BENCH_CHECK(badFraction <= MAX_BAD_PIXEL_FRACTION);
+		if( badFraction > MAX_BAD_PIXEL_FRACTION )
+			printf("  This run's image is %s.\n", rendered.c_str());
+	}
+
+	void checkBoxes(OcclusionCuller& culler, const Camera& camera)
+	{
+		BenchHeading("boxes");
+
+		// Straight behind the wall ahead, and in front of it.
+		AABB hidden  = makeBox(D3DXVECTOR3(-1.0f, 49.0f, -21.0f), D3DXVECTOR3(1.0f, 51.0f, -19.0f));
+		AABB inFront = makeBox(D3DXVECTOR3(-1.0f, 49.0f, -61.0f), D3DXVECTOR3(1.0f, 51.0f, -59.0f));
+		BENCH_CHECK(!culler.isVisible(hidden));
+		BENCH_CHECK(culler.isVisible(inFront));
+
+		// Wholly off the screen counts as visible, whatever is in front.
+		AABB offScreen = makeBox(D3DXVECTOR3(-501.0f, 49.0f, -21.0f), D3DXVECTOR3(-499.0f, 51.0f, -19.0f));
+		BENCH_CHECK(culler.isVisible(offScreen));
+
+		// Partly off the left edge, and hidden by the left wall on screen:
+		// only the pixels on screen are tested.
+		AABB partlyOff = makeBox(D3DXVECTOR3(-70.0f, 55.0f, -32.0f), D3DXVECTOR3(-40.0f, 65.0f, -28.0f));
+		D3DXVECTOR4 p;
+		D3DXVec3Transform(&p, &partlyOff.minPt, &camera.viewProj());
+		BENCH_CHECK(p.x / p.w < -1.0f);
+		BENCH_CHECK(!culler.isVisible(partlyOff));
+
+		// Reaching behind the near plane counts as visible.
+		AABB aroundEye = makeBox(D3DXVECTOR3(-1.0f, 59.0f, -121.0f), D3DXVECTOR3(1.0f, 61.0f, -119.0f));
+		BENCH_CHECK(culler.isVisible(aroundEye));
+
+		// testBoxes gives the same answers.
+		AABB boxes[5] = {hidden, inFront, offScreen, partlyOff, aroundEye};
+		bool visible[5];
+		culler.testBoxes(boxes, 5, visible);
+		bool same = true;
+		for(int i = 0; i < 5; ++i)
+			same = same && visible[i] == culler.isVisible(boxes[i]);
+		BENCH_CHECK(same);
+	}
+}
+
+void OcclusionSuite(const BenchOptions& options)
+{
+	std::string castleFile = BenchArtFile(options, "castlehm257.raw");
+	if( castleFile.empty() )
+		return;
+
+	// The demo's terrain occluder.
+	Heightmap heightmap(257, 257, castleFile, 0.5f, 0.0f);
+	OcclusionCuller culler(256, 192);
+	culler.addHeightmapOccluder(heightmap, 2.0f, 2.0f, D3DXVECTOR3(0.0f, 0.0f, 0.0f), 4);
+	addWalls(culler);
+
+	Camera camera;
+	setupCamera(camera, culler.getWidth(), culler.getHeight());
+	culler.render(camera.viewProj());
+
+	compareGolden(options, culler);
+	checkBoxes(culler, camera);
+
+	BenchHeading("timings");
+	int reps = options.quick ? 20 : 200;
+	BenchTimer timer;
+	for(int k = 0; k < reps; ++k)
+		culler.render(camera.viewProj());
+	BenchReport("render", timer.elapsedMs(), reps);
+
+	srand(22);
+	std::vector<AABB> boxes(options.quick ? 1000 : 10000);
+	for(size_t i = 0; i < boxes.size(); ++i)
+	{
+		D3DXVECTOR3 c(GetRandomFloat(-250.0f, 250.0f), GetRandomFloat(0.0f, 60.0f), GetRandomFloat(-100.0f, 250.0f));
+		D3DXVECTOR3 e(GetRandomFloat(0.5f, 5.0f), GetRandomFloat(0.5f, 5.0f), GetRandomFloat(0.5f, 5.0f));
+		boxes[i] = makeBox(c - e, c + e);
+	}
+	std::vector<char> visible(boxes.size());
+	timer.start();
+	for(int k = 0; k < reps; ++k)
+		culler.testBoxes(&boxes[0], (UINT)boxes.size(), (bool*)&visible[0]);
+	BenchReport("testBoxes (per box)", timer.elapsedMs(), reps*(int)boxes.size());
+}
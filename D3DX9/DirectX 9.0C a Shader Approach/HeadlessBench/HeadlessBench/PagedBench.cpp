@@ -0,0 +1,162 @@
+//=============================================================================
+// PagedBench.cpp.
+//
+// Converts castlehm257.raw and a larger synthetic map to the tiled format
+// and checks the paged heights against Heightmap, Terrain's heights over a
+// paged region against the paged samples, and the cache's bookkeeping.
+// Then times sequential and scattered lookups and region copies.
+//=============================================================================
+
+#include "Bench.h"
+#include "PagedHeightmap.h"
+#include "Heightmap.h"
+#include "Terrain.h"
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+namespace
+{
+	const int TILE_SIZE = 64;
+
+	__int64 fileSize(const std::string& filename)
+	{
+		std::ifstream inFile(filename.c_str(), std::ios_base::binary | std::ios_base::ate);
+		return inFile ? (__int64)inFile.tellg() : -1;
+	}
+
+	void writeSyntheticRAW(const std::string& filename, int n)
+	{
+		std::ofstream outFile(filename.c_str(), std::ios_base::binary | std::ios_base::trunc);
+		std::vector<unsigned char> row(n);
+		for(int i = 0; i < n; ++i)
+		{
+			for(int j = 0; j < n; ++j)
+				row[j] = (unsigned char)(127.5f + 100.0f*sinf(0.013f*j)*cosf(0.009f*i) + 25.0f*sinf(0.1f*(i+j)));
+			outFile.write((const char*)&row[0], n);
+		}
+	}
+
+	void checkCastle(const BenchOptions& options, const std::string& rawFilename)
+	{
+		BenchHeading("castlehm257.raw");
+
+		std::string tiled = options.scratchDir + "castlehm257.til";
+		PagedHeightmap::convertRAW(257, 257, rawFilename, 0.5f, 0.0f, TILE_SIZE, tiled);
+
+		// Tiles are packed: a 64x64 tile is 16KB, not a 64KB slot.  The
+		// rest is the header.
+		int tilesPerSide = (257 + TILE_SIZE-1) / TILE_SIZE;
+		__int64 tileBytes = (__int64)tilesPerSide*tilesPerSide*TILE_SIZE*TILE_SIZE*sizeof(float);
+		__int64 size = fileSize(tiled);
+		printf("  %d tiles, %.0f bytes on disk\n", tilesPerSide*tilesPerSide, (double)size);
+		BENCH_CHECK(size >= tileBytes && size < tileBytes + 128);
+
+		Heightmap heightmap(257, 257, rawFilename, 0.5f, 0.0f);
+
+		// A cache of one tile forces a load on nearly every tile change,
+		// so every view offset gets exercised.
+		PagedHeightmap paged;
+		paged.open(tiled, 1);
+		float maxDiff = 0.0f;
+		for(int i = 0; i < 257; ++i)
+			for(int j = 0; j < 257; ++j)
+				maxDiff = max(maxDiff, fabsf(paged(i, j) - heightmap(i, j)));
+		printf("  Largest difference from Heightmap: %g\n", maxDiff);
+		BENCH_CHECK(maxDiff < 1e-4f);
+		BENCH_CHECK(paged.getStats().residentTiles == 1);
+
+		// A terrain built over a paged region, and sampled through the
+		// paged map, agree with each other.
+		RECT R = {64, 32, 64+128, 32+128}; // left, top, right, bottom
+		D3DXVECTOR3 center(10.0f, 0.0f, -20.0f);
+		Terrain terrain(paged, R, 2.0f, 2.0f, center);
+		BENCH_CHECK(terrain.getWidth() == 256.0f && terrain.getDepth() == 256.0f);
+		float maxHeightDiff = 0.0f;
+		for(int k = 0; k < 10000; ++k)
+		{
+			float x = center.x + GetRandomFloat(-128.0f, 128.0f);
+			float z = center.z + GetRandomFloat(-128.0f, 128.0f);
+			float row = R.top  + (0.5f*256.0f - (z - center.z)) / 2.0f;
+			float col = R.left + (x - center.x + 0.5f*256.0f) / 2.0f;
+			maxHeightDiff = max(maxHeightDiff, fabsf(terrain.getHeight(x, z) - paged.sampleHeight(row, col)));
+		}
+		BENCH_CHECK(maxHeightDiff < 1e-3f);
+
+		// update() keeps what it pages in inside the cache.
+		paged.open(tiled, 9);
+		BENCH_CHECK(paged.maxUpdateRadius() == 1);
+		paged.update(128, 128, 3);
+		BENCH_CHECK(paged.getStats().radiusClamps == 1);
+		BENCH_CHECK(paged.getStats().residentTiles == 9);
+		paged.resetStats();
+		paged.update(128, 128, 1);
+		BENCH_CHECK(paged.getStats().radiusClamps == 0);
+		BENCH_CHECK(paged.getStats().tileLoads == 0);
+	}
+
+	void timeLarge(const BenchOptions& options)
+	{
+		int n = options.quick ? 1025 : 4097;
+		char name[64];
+		sprintf(name, "synthetic %dx%d", n, n);
+		BenchHeading(name);
+
+		std::string raw   = options.scratchDir + "synthetic.raw";
+		std::string tiled = options.scratchDir + "synthetic.til";
+		writeSyntheticRAW(raw, n);
+
+		BenchTimer timer;
+		PagedHeightmap::convertRAW(n, n, raw, 0.5f, 0.0f, TILE_SIZE, tiled);
+		BenchReport("convertRAW (per row)", timer.elapsedMs(), n);
+
+		// A cache of 128 tiles holds 2MB of a 64MB map, and two rows of
+		// tiles across it.
+		PagedHeightmap paged;
+		paged.open(tiled, 128);
+
+		volatile float sink = 0.0f;
+		timer.start();
+		for(int i = 0; i < n; ++i)
+			for(int j = 0; j < n; ++j)
+				sink += paged(i, j);
+		BenchReport("sequential lookups", timer.elapsedMs(), n*n);
+		const PagedHeightmap::Stats& stats = paged.getStats();
+		printf("  %u tile loads, %.3f ms average, %.3f ms worst\n",
+			stats.tileLoads, stats.avgLoadMs, stats.maxLoadMs);
+
+		int numLookups = 200000;
+		paged.resetStats();
+		srand(1);
+		timer.start();
+		for(int k = 0; k < numLookups; ++k)
+			sink += paged(rand() % n, rand() % n);
+		BenchReport("scattered lookups", timer.elapsedMs(), numLookups);
+		printf("  %u tile loads, %.1f%% hits\n", stats.tileLoads,
+			100.0*stats.cacheHits / (stats.cacheHits + stats.cacheMisses));
+
+		// Terrain tile sized regions along a diagonal, as a streaming
+		// camera would ask for them.
+		Table<float> region;
+		int numRegions = (n-1) / 128;
+		timer.start();
+		for(int k = 0; k < numRegions; ++k)
+		{
+			RECT R = {k*128, k*128, k*128+128, k*128+128};
+			paged.copyRegion(R, region);
+		}
+		BenchReport("copyRegion 129x129", timer.elapsedMs(), numRegions);
+
+		paged.close();
+		DeleteFile(raw.c_str());
+		DeleteFile(tiled.c_str());
+	}
+}
+
+void PagedSuite(const BenchOptions& options)
+{
+	std::string filename = BenchArtFile(options, "castlehm257.raw");
+	if( !filename.empty() )
+		checkCastle(options, filename);
+	timeLarge(options);
+}
@@ -0,0 +1,259 @@
+//=============================================================================
+// QuadtreeBench.cpp.
+//
+// Replays a camera path through TerrainQuadtree::select, over the demo's
+// castle heightmap and over a larger synthetic one.  Every frame's
+// selection is checked against a brute force frustum test of each patch,
+// the projected error bound, the neighbour level rule and the stitch masks.
+//=============================================================================
+
+#include "Bench.h"
+#include "TerrainQuadtree.h"
+#include "Camera.h"
+#include "CameraPath.h"
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+	const int   PATCH_VERTS     = 33;
+	const float VIEWPORT_HEIGHT = 600.0f;
+	const float PIXEL_ERROR     = 2.0f;
+
+	struct TestTerrain
+	{
+		const char* name;
+		Heightmap   heights;
+		float       dx;
+		float       dz;
+	};
+
+	float groundHeight(const TestTerrain& t, float x, float z)
+	{
+		// Nearest vertex is close enough to keep the camera above ground.
+		float width = (t.heights.numCols()-1)*t.dx;
+		float depth = (t.heights.numRows()-1)*t.dz;
+		int c = (int)((x + 0.5f*width) / t.dx + 0.5f);
+		int r = (int)((0.5f*depth - z) / t.dz + 0.5f);
+		c = max(0, min(c, t.heights.numCols()-1));
+		r = max(0, min(r, t.heights.numRows()-1));
+		return t.heights(r, c);
+	}
+
+	// A loop around the middle of the map: the first half walks a few
+	// meters above the ground looking ahead, the second half flies high
+	// looking down, which puts most of the map in view.
+	void scriptPath(const TestTerrain& t, int numFrames, CameraPath& path)
+	{
+		float width  = (t.heights.numCols()-1)*t.dx;
+		float radius = 0.3f*width;
+
+		path.clear();
+		for(int i = 0; i < numFrames; ++i)
+		{
+			float a = 2.0f*D3DX_PI*i / numFrames;
+			D3DXVECTOR3 pos(radius*cosf(a), 0.0f, radius*sinf(a));
+			D3DXVECTOR3 look(-sinf(a), 0.0f, cosf(a));
+			if( i < numFrames/2 )
+				pos.y = groundHeight(t, pos.x, pos.z) + 3.0f;
+			else
+			{
+				pos.y  = groundHeight(t, pos.x, pos.z) + 80.0f;
+				look.y = -0.5f;
+			}
+			D3DXVec3Normalize(&look, &look);
+			path.addFrame(pos, look);
+		}
+	}
+
+	// Rolling hills with some finer detail, so the patches want a range
+	// of levels.
+	void synthesize(Heightmap& h, int n)
+	{
+		h.recreate(n, n);
+		for(int i = 0; i < n; ++i)
+		{
+			for(int j = 0; j < n; ++j)
+			{
+				float x = (float)j;
+				float z = (float)i;
+				h(i, j) = 40.0f*sinf(0.011f*x)*cosf(0.017f*z)
+				        + 8.0f*sinf(0.07f*x + 0.05f*z)
+				        + 1.5f*sinf(0.31f*x)*sinf(0.27f*z);
+			}
+		}
+		h.buildMinMax();
+	}
+
+	float distanceToBox(const AABB& box, const D3DXVECTOR3& p)
+	{
+		D3DXVECTOR3 q;
+		D3DXVec3Maximize(&q, &p, &box.minPt);
+		D3DXVec3Minimize(&q, &q, &box.maxPt);
+		D3DXVECTOR3 d = q - p;
+		return D3DXVec3Length(&d);
+	}
+
+	void checkSelection(const TerrainQuadtree& tree, const Camera& camera,
+		const std::vector<TerrainQuadtree::PatchLOD>& out)
+	{
+		int numPatches = tree.numPatches();
+		int cols       = tree.numPatchCols();
+
+		// -1 for patches that weren't selected.
+		std::vector<int> level(numPatches, -1);
+		std::vector<int> mask(numPatches, 0);
+		DWORD numTris = 0;
+		for(UINT i = 0; i < out.size(); ++i)
+		{
+			BENCH_CHECK(level[out[i].patch] < 0);
+			level[out[i].patch] = out[i].level;
+			mask[out[i].patch]  = out[i].stitchMask;
+			numTris += TerrainQuadtree::numTriangles(PATCH_VERTS, out[i].level, out[i].stitchMask);
+		}
+		BENCH_CHECK(numTris == tree.getStats().numTriangles);
+
+		float K = 0.5f*VIEWPORT_HEIGHT*camera.proj()(1,1);
+		for(int p = 0; p < numPatches; ++p)
+		{
+			// The tree culls exactly the patches a plain frustum test does.
+			bool visible = camera.isVisible(tree.getPatchBox(p));
+			BENCH_CHECK(visible == (level[p] >= 0));
+			if( level[p] < 0 )
+				continue;
+
+			int L = level[p];
+			BENCH_CHECK(L >= 0 && L < TerrainQuadtree::NUM_LODS);
+
+			// The level's error projects to no more than the tolerance.
+			float d = distanceToBox(tree.getPatchBox(p), camera.pos());
+			if( d <= EPSILON )
+				BENCH_CHECK(L == 0);
+			else
+				BENCH_CHECK(tree.getPatchError(p, L)*K/d <= PIXEL_ERROR*1.0001f);
+
+			// Selected neighbours differ by at most one level, and an edge
+			// is stitched exactly when the neighbour across it is coarser.
+			int pr = p / cols;
+			int pc = p % cols;
+			int neighbour[4] = { pr > 0 ? p-cols : -1,
+			                     pc < cols-1 ? p+1 : -1,
+			                     pr < tree.numPatchRows()-1 ? p+cols : -1,
+			                     pc > 0 ? p-1 : -1 };
+			int bits[4] = { TerrainQuadtree::STITCH_NORTH, TerrainQuadtree::STITCH_EAST,
+			                TerrainQuadtree::STITCH_SOUTH, TerrainQuadtree::STITCH_WEST };
+			for(int k = 0; k < 4; ++k)
+			{
+				int q = neighbour[k];
+				if( q < 0 )
+				{
+					BENCH_CHECK((mask[p] & bits[k]) == 0);
+					continue;
+				}
+				if( level[q] < 0 )
+					continue;
+				BENCH_CHECK(abs(level[q] - L) <= 1);
+				BENCH_CHECK(((mask[p] & bits[k]) != 0) == (level[q] > L));
+			}
+		}
+	}
+
+	void runPath(TestTerrain& t, const CameraPath& path)
+	{
+		BenchHeading(t.name);
+
+		TerrainQuadtree tree;
+		BenchTimer timer;
+		tree.build(t.heights, PATCH_VERTS, t.dx, t.dz);
+		BenchReport("build", timer.elapsedMs(), tree.numPatches());
+
+		Camera camera;
+		camera.setLens(D3DX_PI * 0.25f, 800.0f/600.0f, 1.0f, 1000.0f);
+
+		// Checked pass.
+		std::vector<TerrainQuadtree::PatchLOD> out;
+		double visiblePatches = 0.0;
+		double nodesVisited   = 0.0;
+		double numTris        = 0.0;
+		for(UINT i = 0; i < path.numFrames(); ++i)
+		{
+			path.apply(i, camera);
+			tree.select(camera, VIEWPORT_HEIGHT, PIXEL_ERROR, out, true);
+			checkSelection(tree, camera, out);
+
+			visiblePatches += tree.getStats().patchesVisible;
+			nodesVisited   += tree.getStats().nodesVisited;
+			numTris        += tree.getStats().numTriangles;
+		}
+
+		int n = path.numFrames();
+		double fullTris = 2.0*(PATCH_VERTS-1)*(PATCH_VERTS-1);
+		printf("  %d patches, %u frames: %.1f visible, %.1f nodes visited, %.0f triangles "
+			"(%.1f%% of full resolution) per frame\n",
+			tree.numPatches(), n, visiblePatches/n, nodesVisited/n, numTris/n,
+			100.0*numTris / (visiblePatches*fullTris));
+
+		// Timed passes, without the checks.
+		for(int stitch = 1; stitch >= 0; --stitch)
+		{
+			timer.start();
+			for(UINT i = 0; i < path.numFrames(); ++i)
+			{
+				path.apply(i, camera);
+				tree.select(camera, VIEWPORT_HEIGHT, PIXEL_ERROR, out, stitch != 0);
+			}
+			BenchReport(stitch ? "select, stitched (per frame)" : "select, unstitched (per frame)",
+				timer.elapsedMs(), n);
+		}
+	}
+}
+
+void QuadtreeSuite(const BenchOptions& options)
+{
+	int numFrames = options.quick ? 60 : 2000;
+
+	std::string filename = BenchArtFile(options, "castlehm257.raw");
+	if( filename.empty() )
+		return;
+
+	TestTerrain castle;
+	castle.name = "castlehm257.raw";
+	castle.heights.loadRAW(257, 257, filename, 0.5f, 0.0f);
+	castle.dx = 2.0f;
+	castle.dz = 2.0f;
+
+	CameraPath path;
+	if( !options.cameraPath.empty() )
+	{
+		BENCH_CHECK(path.load(options.cameraPath));
+		printf("  Replaying %s (%u frames).\n", options.cameraPath.c_str(), path.numFrames());
+	}
+	else
+	{
+		scriptPath(castle, numFrames, path);
+
+		// Saving and loading gives back the same frames.
+		std::string saved = options.scratchDir + "quadtree_path.txt";
+		CameraPath loaded;
+		BENCH_CHECK(path.save(saved));
+		BENCH_CHECK(loaded.load(saved));
+		BENCH_CHECK(loaded.numFrames() == path.numFrames());
+		for(UINT i = 0; i < loaded.numFrames() && i < path.numFrames(); ++i)
+		{
+			BENCH_CHECK(loaded.getFrame(i).pos  == path.getFrame(i).pos);
+			BENCH_CHECK(loaded.getFrame(i).look == path.getFrame(i).look);
+		}
+	}
+	runPath(castle, path);
+
+	TestTerrain hills;
+	hills.name = "synthetic hills";
+	synthesize(hills.heights, options.quick ? 513 : 1025);
+	hills.dx = 2.0f;
+	hills.dz = 2.0f;
+
+	// A recorded path was flown over the castle map; over the bigger
+	// map it only covers the middle, so the scripted loop is used.
+	scriptPath(hills, numFrames, path);
+	runPath(hills, path);
+}
@@ -0,0 +1,232 @@
+//=============================================================================
+// RayBench.cpp.
+//
+// Checks Heightmap::intersectRay against testing every triangle of the map,
+// for rays that start above, inside and outside the map and point every
+// which way, then times it against the brute force test.
+//=============================================================================
+
+#include "Bench.h"
+#include "Heightmap.h"
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+	struct Ray
+	{
+		D3DXVECTOR3 origin;
+		D3DXVECTOR3 dir;
+	};
+
+	// Nearest hit at t >= 0 with one triangle, the same test as
+	// Heightmap's, written out again so the check doesn't share its bugs.
+	bool rayTriangle(const Ray& ray, const D3DXVECTOR3& a, const D3DXVECTOR3& b,
+		const D3DXVECTOR3& c, float& t)
+	{
+		D3DXVECTOR3 e1 = b - a;
+		D3DXVECTOR3 e2 = c - a;
+		D3DXVECTOR3 p, q;
+		D3DXVec3Cross(&p, &ray.dir, &e2);
+		float det = D3DXVec3Dot(&e1, &p);
+		if( det == 0.0f )
+			return false;
+
+		D3DXVECTOR3 s = ray.origin - a;
+		float u = D3DXVec3Dot(&s, &p) / det;
+		D3DXVec3Cross(&q, &s, &e1);
+		float v = D3DXVec3Dot(&ray.dir, &q) / det;
+		t = D3DXVec3Dot(&e2, &q) / det;
+		return u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t >= 0.0f;
+	}
+
+	// Every cell, split the way GenTriGrid splits them.
+	bool bruteForce(const Heightmap& h, const Ray& ray, float maxT, float& tHit)
+	{
+		bool hit = false;
+		tHit = maxT;
+		for(int r = 0; r < h.numRows()-1; ++r)
+		{
+			for(int c = 0; c < h.numCols()-1; ++c)
+			{
+				D3DXVECTOR3 A((float)c,     h(r,   c),   (float)r);
+				D3DXVECTOR3 B((float)(c+1), h(r,   c+1), (float)r);
+				D3DXVECTOR3 C((float)c,     h(r+1, c),   (float)(r+1));
+				D3DXVECTOR3 D((float)(c+1), h(r+1, c+1), (float)(r+1));
+
+				float t;
+				if( rayTriangle(ray, A, B, C, t) && t <= tHit ) { tHit = t; hit = true; }
+				if( rayTriangle(ray, C, B, D, t) && t <= tHit ) { tHit = t; hit = true; }
+			}
+		}
+		return hit;
+	}
+
+	// Height of the surface under grid point (x, z), if it is on the map.
+	bool heightAt(const Heightmap& h, float x, float z, float& y)
+	{
+		int c = (int)floorf(x);
+		int r = (int)floorf(z);
+		if( r < 0 || c < 0 || r >= h.numRows()-1 || c >= h.numCols()-1 )
+			return false;
+		float s = x - c;
+		float t = z - r;
+		if( s + t <= 1.0f )
+			y = h(r, c) + s*(h(r, c+1) - h(r, c)) + t*(h(r+1, c) - h(r, c));
+		else
+			y = h(r+1, c+1) + (1.0f-s)*(h(r+1, c) - h(r+1, c+1)) + (1.0f-t)*(h(r, c+1) - h(r+1, c+1));
+		return true;
+	}
+
+	// A third of the rays look down from above the map, the way picking
+	// does, and a third start just above or below the surface and run
+	// nearly level.  Where a cell folds, those cross one of its triangles
+	// ahead of the origin and the other behind it, and the one behind must
+	// not count as the nearest hit.  The rest start anywhere, on or off
+	// the map.
+	void makeRays(const Heightmap& h, int numRays, std::vector<Ray>& rays)
+	{
+		srand(15);
+		float w = (float)(h.numCols()-1);
+		float d = (float)(h.numRows()-1);
+		float top = h.minMaxBlock(h.numMinMaxLevels()-1, 0, 0).maxH;
+
+		rays.resize(numRays);
+		for(int k = 0; k < numRays; ++k)
+		{
+			Ray& ray = rays[k];
+			float x = GetRandomFloat(0.0f, w);
+			float z = GetRandomFloat(0.0f, d);
+			GetRandomVec(ray.dir);
+			switch( k % 3 )
+			{
+			case 0:
+				ray.origin = D3DXVECTOR3(x, top + 20.0f, z);
+				ray.dir.y  = -fabsf(ray.dir.y) - 0.2f;
+				break;
+			case 1:
+				heightAt(h, x, z, ray.origin.y);
+				ray.origin.x = x;
+				ray.origin.y += (k % 2) ? 0.02f : -0.02f;
+				ray.origin.z = z;
+				ray.dir.y   *= 0.1f;
+				break;
+			default:
+				ray.origin = D3DXVECTOR3(GetRandomFloat(-w, 2.0f*w), GetRandomFloat(-20.0f, top + 20.0f),
+					GetRandomFloat(-d, 2.0f*d));
+				break;
+			}
+			D3DXVec3Normalize(&ray.dir, &ray.dir);
+		}
+	}
+
+	// The brute force test is slow, so only the first numRays are checked.
+	void check(const char* name, const Heightmap& h, const std::vector<Ray>& rays, int numRays, float maxT)
+	{
+		BenchHeading(name);
+
+		// A ray grazing a cell edge may hit on one side of it and miss on
+		// the other, depending on rounding; allow those few.
+		int numHits = 0;
+		int numDisagree = 0;
+		bool goodT = true;
+		for(int k = 0; k < numRays; ++k)
+		{
+			float t = -1.0f;
+			float tRef;
+			bool hit    = h.intersectRay(rays[k].origin, rays[k].dir, maxT, t);
+			bool hitRef = bruteForce(h, rays[k], maxT, tRef);
+			numHits += hitRef;
+			if( hit != hitRef )
+				++numDisagree;
+			else if( hit )
+				goodT = goodT && t >= 0.0f && t <= maxT && fabsf(t - tRef) <= 1e-3f*max(1.0f, tRef);
+		}
+		printf("  %d of %d rays hit, %d grazing rays disagree\n", numHits, numRays, numDisagree);
+		BENCH_CHECK(goodT);
+		BENCH_CHECK(numDisagree <= numRays / 100);
+	}
+
+	// One cell folded into a ridge along its diagonal, with a ray that
+	// starts inside the ridge and runs level.  The line through it crosses
+	// one triangle behind the origin and the other ahead; only the one
+	// ahead is a hit.
+	void checkRidge()
+	{
+		BenchHeading("ray inside a ridge");
+
+		Heightmap ridge(2, 2);
+		ridge(0, 0) = 0.0f; ridge(0, 1) = 1.0f;
+		ridge(1, 0) = 1.0f; ridge(1, 1) = 0.0f;
+		ridge.buildMinMax();
+
+		Ray ray;
+		ray.origin = D3DXVECTOR3(0.5f, 0.5f, 0.5f);
+		ray.dir    = D3DXVECTOR3(-1.0f, 0.0f, -1.0f);
+		D3DXVec3Normalize(&ray.dir, &ray.dir);
+
+		float t = -1.0f;
+		float tRef;
+		bool hit    = ridge.intersectRay(ray.origin, ray.dir, 10.0f, t);
+		bool hitRef = bruteForce(ridge, ray, 10.0f, tRef);
+		BENCH_CHECK(hitRef);
+		BENCH_CHECK(hit);
+		BENCH_CHECK(hit && fabsf(t - tRef) < 1e-5f);
+	}
+
+	void time(const Heightmap& h, const std::vector<Ray>& rays, float maxT, int numBrute)
+	{
+		int numHits = 0;
+		BenchTimer timer;
+		for(size_t k = 0; k < rays.size(); ++k)
+		{
+			float t;
+			numHits += h.intersectRay(rays[k].origin, rays[k].dir, maxT, t);
+		}
+		BenchReport("intersectRay (per ray)", timer.elapsedMs(), (int)rays.size());
+
+		timer.start();
+		for(int k = 0; k < numBrute; ++k)
+		{
+			float t;
+			numHits += bruteForce(h, rays[k], maxT, t);
+		}
+		BenchReport("every triangle (per ray)", timer.elapsedMs(), numBrute);
+
+		if( numHits == 0 )
+			printf("  (no hits)\n");
+	}
+
+	void synthesize(Heightmap& h, int n)
+	{
+		h.recreate(n, n);
+		for(int i = 0; i < n; ++i)
+			for(int j = 0; j < n; ++j)
+				h(i, j) = 40.0f*sinf(0.011f*j)*cosf(0.017f*i) + 8.0f*sinf(0.07f*j + 0.05f*i)
+				        + 1.5f*sinf(0.31f*j)*sinf(0.27f*i);
+		h.buildMinMax();
+	}
+}
+
+void RaySuite(const BenchOptions& options)
+{
+	checkRidge();
+
+	std::vector<Ray> rays;
+
+	std::string castleFile = BenchArtFile(options, "castlehm257.raw");
+	if( !castleFile.empty() )
+	{
+		Heightmap castle(257, 257, castleFile, 0.5f, 0.0f);
+		makeRays(castle, options.quick ? 10000 : 100000, rays);
+		check("castlehm257.raw", castle, rays, options.quick ? 150 : 600, 1000.0f);
+		time(castle, rays, 1000.0f, options.quick ? 10 : 50);
+	}
+
+	Heightmap hills;
+	int n = options.quick ? 257 : 1025;
+	synthesize(hills, n);
+	makeRays(hills, options.quick ? 10000 : 100000, rays);
+	check("synthetic hills", hills, rays, options.quick ? 150 : 45, 4.0f*n);
+	time(hills, rays, 4.0f*n, 5);
+}
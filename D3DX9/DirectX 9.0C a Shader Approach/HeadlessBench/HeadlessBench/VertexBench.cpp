@@ -0,0 +1,175 @@
+//=============================================================================
+// VertexBench.cpp.
+//
+// Round trips heights and normals through the VERTEX_COMPACT codecs in
+// Vertex.h and checks the errors stay inside their bounds: half a
+// quantization step for heights, about a degree for normals.  Then times
+// the codecs.
+//=============================================================================
+
+#include "Bench.h"
+#include "Vertex.h"
+#include "d3dUtil.h"
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+	// The normals most likely to go wrong: the axes, the octahedron's
+	// edges and faces in both hemispheres, and those just either side of
+	// the fold at y = 0.
+	void specialNormals(std::vector<D3DXVECTOR3>& normals)
+	{
+		for(int x = -1; x <= 1; ++x)
+		{
+			for(int y = -1; y <= 1; ++y)
+			{
+				for(int z = -1; z <= 1; ++z)
+				{
+					if( x == 0 && y == 0 && z == 0 )
+						continue;
+					D3DXVECTOR3 n((float)x, (float)y, (float)z);
+					D3DXVec3Normalize(&n, &n);
+					normals.push_back(n);
+
+					D3DXVECTOR3 m((float)x, (float)y * 1e-4f, (float)z);
+					if( D3DXVec3Length(&m) > 0.0f )
+					{
+						D3DXVec3Normalize(&m, &m);
+						normals.push_back(m);
+					}
+				}
+			}
+		}
+	}
+
+	void checkHeights(float minH, float maxH)
+	{
+		float step = (maxH - minH) / 65534.0f;
+		float maxErr = 0.0f;
+		for(int k = 0; k <= 100000; ++k)
+		{
+			float h = minH + (maxH - minH) * (float)k / 100000.0f;
+			float err = fabsf(DequantizeHeight(QuantizeHeight(h, minH, maxH), minH, maxH) - h);
+			maxErr = max(maxErr, err);
+		}
+
+		// Half a step, plus the rounding of the float arithmetic.
+		float bound = 0.5f*step + 1e-6f*max(fabsf(minH), fabsf(maxH));
+		printf("  heights in [%g, %g]: max error %g, half a step %g\n", minH, maxH, maxErr, 0.5f*step);
+		BENCH_CHECK(maxErr <= bound);
+
+		// The ends map to the ends of the range, and past them clamp.
+		BENCH_CHECK(QuantizeHeight(minH, minH, maxH) == -32767);
+		BENCH_CHECK(QuantizeHeight(maxH, minH, maxH) ==  32767);
+		BENCH_CHECK(QuantizeHeight(minH - 100.0f, minH, maxH) == -32767);
+		BENCH_CHECK(QuantizeHeight(maxH + 100.0f, minH, maxH) ==  32767);
+	}
+
+	void checkNormals(const std::vector<D3DXVECTOR3>& normals)
+	{
+		float maxAngle = 0.0f;
+		float maxLengthErr = 0.0f;
+		for(size_t k = 0; k < normals.size(); ++k)
+		{
+			short e = EncodeOctNormal(normals[k]);
+			D3DXVECTOR3 n = DecodeOctNormal(e);
+			float c = D3DXVec3Dot(&n, &normals[k]);
+			float angle = acosf(min(max(c, -1.0f), 1.0f));
+			maxAngle = max(maxAngle, angle);
+			maxLengthErr = max(maxLengthErr, fabsf(D3DXVec3Length(&n) - 1.0f));
+		}
+
+		float degrees = maxAngle * 180.0f / D3DX_PI;
+		printf("  %d normals: max error %.3f degrees\n", (int)normals.size(), degrees);
+		BENCH_CHECK(degrees <= 1.0f);
+		BENCH_CHECK(maxLengthErr <= 1e-5f);
+	}
+
+	// Every code decodes to a normal that encodes back to it, or, on the
+	// folded edges of the octahedron where two codes meet, to the code on
+	// the other side, which decodes to the same normal.
+	void checkCodes()
+	{
+		int numAliased = 0;
+		bool stable = true;
+		for(int qx = -127; qx <= 127; ++qx)
+		{
+			for(int qz = -127; qz <= 127; ++qz)
+			{
+				short e = (short)(qx*256 + qz);
+				D3DXVECTOR3 n = DecodeOctNormal(e);
+				short f = EncodeOctNormal(n);
+				if( f == e )
+					continue;
+
+				++numAliased;
+				D3DXVECTOR3 m = DecodeOctNormal(f);
+				stable = stable && D3DXVec3Dot(&n, &m) >= 1.0f - 1e-6f;
+			}
+		}
+		printf("  %d codes: %d on the folded edges re-encode to their twin\n", 255*255, numAliased);
+		BENCH_CHECK(stable);
+	}
+
+	void timeCodecs(const std::vector<D3DXVECTOR3>& normals)
+	{
+		int n = (int)normals.size();
+		std::vector<short> codes(n);
+		std::vector<D3DXVECTOR3> decoded(n);
+		std::vector<short> heights(n);
+
+		BenchTimer timer;
+		for(int k = 0; k < n; ++k)
+			codes[k] = EncodeOctNormal(normals[k]);
+		BenchReport("EncodeOctNormal", timer.elapsedMs(), n);
+
+		timer.start();
+		for(int k = 0; k < n; ++k)
+			decoded[k] = DecodeOctNormal(codes[k]);
+		BenchReport("DecodeOctNormal", timer.elapsedMs(), n);
+
+		timer.start();
+		for(int k = 0; k < n; ++k)
+			heights[k] = QuantizeHeight(normals[k].y * 100.0f, -100.0f, 100.0f);
+		BenchReport("QuantizeHeight", timer.elapsedMs(), n);
+
+		float sum = 0.0f;
+		timer.start();
+		for(int k = 0; k < n; ++k)
+			sum += DequantizeHeight(heights[k], -100.0f, 100.0f);
+		BenchReport("DequantizeHeight", timer.elapsedMs(), n);
+
+		if( sum == 12345.0f )
+			printf("  (sum %g)\n", sum);
+	}
+}
+
+void VertexSuite(const BenchOptions& options)
+{
+	BenchHeading("heights");
+	checkHeights(0.0f, 127.5f);      // castlehm257.raw at a scale of 0.5.
+	checkHeights(-500.0f, 2500.0f);
+	checkHeights(-0.25f, 0.25f);
+
+	BenchHeading("normals");
+	std::vector<D3DXVECTOR3> normals;
+	specialNormals(normals);
+	srand(18);
+	int numRandom = options.quick ? 100000 : 1000000;
+	for(int k = 0; k < numRandom; ++k)
+	{
+		D3DXVECTOR3 n;
+		GetRandomVec(n);
+		if( D3DXVec3Length(&n) > 0.0f )
+		{
+			D3DXVec3Normalize(&n, &n);
+			normals.push_back(n);
+		}
+	}
+	checkNormals(normals);
+	checkCodes();
+
+	BenchHeading("timings");
+	timeCodecs(normals);
+}
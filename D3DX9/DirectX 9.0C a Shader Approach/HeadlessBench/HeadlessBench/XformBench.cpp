@@ -0,0 +1,156 @@
+//=============================================================================
+// XformBench.cpp.
+//
+// Checks that both XformAABBs overloads give the boxes AABB::xform does,
+// within float rounding, for random boxes under random rotations, scales
+// and translations, and when writing over their input.  Then times the
+// three for batches from a handful of boxes up to more than fit in cache.
+//=============================================================================
+
+#include "Bench.h"
+#include "AABBXform.h"
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+	// The two differ only in the order of their sums, which costs a few
+	// ulps of the largest coordinate; this leaves plenty of room.
+	const float RELATIVE_TOLERANCE = 1e-5f;
+
+	void randomWorld(D3DXMATRIX& W)
+	{
+		D3DXVECTOR3 axis;
+		GetRandomVec(axis);
+		D3DXVECTOR3 scale(GetRandomFloat(0.25f, 4.0f), GetRandomFloat(0.25f, 4.0f), GetRandomFloat(0.25f, 4.0f));
+		D3DXVECTOR3 pos(GetRandomFloat(-500.0f, 500.0f), GetRandomFloat(-500.0f, 500.0f), GetRandomFloat(-500.0f, 500.0f));
+
+		D3DXMATRIX S, R, T;
+		D3DXMatrixScaling(&S, scale.x, scale.y, scale.z);
+		D3DXMatrixRotationAxis(&R, &axis, GetRandomFloat(0.0f, 2.0f*D3DX_PI));
+		D3DXMatrixTranslation(&T, pos.x, pos.y, pos.z);
+		W = S*R*T;
+	}
+
+	AABB randomBox()
+	{
+		D3DXVECTOR3 c(GetRandomFloat(-10.0f, 10.0f), GetRandomFloat(-10.0f, 10.0f), GetRandomFloat(-10.0f, 10.0f));
+		D3DXVECTOR3 e(GetRandomFloat(0.0f, 5.0f), GetRandomFloat(0.0f, 5.0f), GetRandomFloat(0.0f, 5.0f));
+		AABB box;
+		box.minPt = c - e;
+		box.maxPt = c + e;
+		return box;
+	}
+
+	// How far apart two boxes are, relative to the larger coordinate.
+	float boxError(const AABB& a, const AABB& b)
+	{
+		float maxErr = 0.0f;
+		for(int i = 0; i < 3; ++i)
+		{
+			float scale = 1.0f + max(max(fabsf(a.minPt[i]), fabsf(a.maxPt[i])),
+			                         max(fabsf(b.minPt[i]), fabsf(b.maxPt[i])));
+			maxErr = max(maxErr, fabsf(a.minPt[i] - b.minPt[i]) / scale);
+			maxErr = max(maxErr, fabsf(a.maxPt[i] - b.maxPt[i]) / scale);
+		}
+		return maxErr;
+	}
+
+	void makeBatch(UINT n, std::vector<AABB>& boxes, std::vector<D3DXMATRIX>& worlds,
+		std::vector<AffineMatrix>& xforms)
+	{
+		boxes.resize(n);
+		worlds.resize(n);
+		xforms.resize(n);
+		for(UINT i = 0; i < n; ++i)
+		{
+			boxes[i] = randomBox();
+			randomWorld(worlds[i]);
+			xforms[i] = AffineMatrix(worlds[i]);
+		}
+	}
+
+	void checkBatch(UINT n)
+	{
+		std::vector<AABB> boxes;
+		std::vector<D3DXMATRIX> worlds;
+		std::vector<AffineMatrix> xforms;
+		makeBatch(n, boxes, worlds, xforms);
+
+		// One box per matrix.
+		std::vector<AABB> expected(n);
+		std::vector<AABB> out(n);
+		for(UINT i = 0; i < n; ++i)
+			boxes[i].xform(worlds[i], expected[i]);
+		XformAABBs(&boxes[0], &xforms[0], &out[0], n);
+		float maxErr = 0.0f;
+		for(UINT i = 0; i < n; ++i)
+			maxErr = max(maxErr, boxError(out[i], expected[i]));
+		BENCH_CHECK(maxErr <= RELATIVE_TOLERANCE);
+
+		// In place.
+		std::vector<AABB> inPlace(boxes);
+		XformAABBs(&inPlace[0], &xforms[0], &inPlace[0], n);
+		bool same = true;
+		for(UINT i = 0; i < n; ++i)
+			same = same && memcmp(&inPlace[i], &out[i], sizeof(AABB)) == 0;
+		BENCH_CHECK(same);
+
+		// One box under every matrix.
+		AABB shared = boxes[0];
+		for(UINT i = 0; i < n; ++i)
+			shared.xform(worlds[i], expected[i]);
+		XformAABBs(shared, &xforms[0], &out[0], n);
+		float maxSharedErr = 0.0f;
+		for(UINT i = 0; i < n; ++i)
+			maxSharedErr = max(maxSharedErr, boxError(out[i], expected[i]));
+		BENCH_CHECK(maxSharedErr <= RELATIVE_TOLERANCE);
+
+		printf("  %u: largest relative difference %g, %g with a shared box\n", n, maxErr, maxSharedErr);
+	}
+
+	// Every box goes through once per rep, so small batches stay in cache.
+	void timeBatch(UINT n, int reps)
+	{
+		std::vector<AABB> boxes;
+		std::vector<D3DXMATRIX> worlds;
+		std::vector<AffineMatrix> xforms;
+		makeBatch(n, boxes, worlds, xforms);
+		std::vector<AABB> out(n);
+
+		char label[64];
+		BenchTimer timer;
+		for(int k = 0; k < reps; ++k)
+			for(UINT i = 0; i < n; ++i)
+				boxes[i].xform(worlds[i], out[i]);
+		sprintf(label, "%u: AABB::xform (per box)", n);
+		BenchReport(label, timer.elapsedMs(), reps*(int)n);
+
+		timer.start();
+		for(int k = 0; k < reps; ++k)
+			XformAABBs(&boxes[0], &xforms[0], &out[0], n);
+		sprintf(label, "%u: XformAABBs (per box)", n);
+		BenchReport(label, timer.elapsedMs(), reps*(int)n);
+
+		timer.start();
+		for(int k = 0; k < reps; ++k)
+			XformAABBs(boxes[0], &xforms[0], &out[0], n);
+		sprintf(label, "%u: XformAABBs, shared box (per box)", n);
+		BenchReport(label, timer.elapsedMs(), reps*(int)n);
+	}
+}
+
+void XformSuite(const BenchOptions& options)
+{
+	BenchHeading("against AABB::xform");
+	srand(24);
+	checkBatch(1);
+	checkBatch(7);
+	checkBatch(10000);
+
+	BenchHeading("throughput");
+	int boxesPerSize = options.quick ? 1000000 : 10000000;
+	UINT sizes[] = {16, 1000, 100000, 1000000};
+	for(int s = 0; s < 4; ++s)
+		timeBatch(sizes[s], max(1, boxesPerSize / (int)sizes[s]));
+}
@@ -0,0 +1,117 @@
+//=============================================================================
+// main.cpp.
+//
+// Parses the command line and runs the suites; see Bench.h.
+//=============================================================================
+
+#include "Bench.h"
+#include "JobSystem.h"
+#include "d3dUtil.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+	struct Suite
+	{
+		const char* name;
+		void (*run)(const BenchOptions& options);
+	};
+
+	const Suite SUITES[] =
+	{
+		{ "quadtree",  QuadtreeSuite },
+		{ "paged",     PagedSuite },
+		{ "bvh",       BVHSuite },
+		{ "soa",       SoASuite },
+		{ "layout",    LayoutSuite },
+		{ "ray",       RaySuite },
+		{ "brush",     BrushSuite },
+		{ "filter",    FilterSuite },
+		{ "heights",   HeightsSuite },
+		{ "ground",    GroundSuite },
+		{ "vertex",    VertexSuite },
+		{ "ao",        AOSuite },
+		{ "occlusion", OcclusionSuite },
+		{ "hash",      HashSuite },
+		{ "xform",     XformSuite },
+	};
+	const int NUM_SUITES = sizeof(SUITES) / sizeof(SUITES[0]);
+
+	// The debugger starts the program in the project directory.
+	const char* const DEFAULT_ART_DIR =
+		"../../Chapter 18 - Terrain Rendering - Part II/Exercise 5 - FrustumCulling/FrustumCulling/Art/";
+	const char* const DEFAULT_GOLDEN_DIR = "Golden/";
+
+	// Adds a trailing slash to a directory given on the command line.
+	std::string directoryArg(const char* arg)
+	{
+		std::string dir = arg;
+		char last = dir[dir.size()-1];
+		if( last != '/' && last != '\\' )
+			dir += "/";
+		return dir;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	BenchOptions options;
+	options.artDir     = DEFAULT_ART_DIR;
+	options.goldenDir  = DEFAULT_GOLDEN_DIR;
+	options.scratchDir = GetScratchDirectory("HeadlessBench");
+	options.quick      = false;
+
+	std::vector<const Suite*> suites;
+	for(int i = 1; i < argc; ++i)
+	{
+		if( strcmp(argv[i], "-quick") == 0 )
+			options.quick = true;
+		else if( strcmp(argv[i], "-art") == 0 && i+1 < argc )
+			options.artDir = directoryArg(argv[++i]);
+		else if( strcmp(argv[i], "-golden") == 0 && i+1 < argc )
+			options.goldenDir = directoryArg(argv[++i]);
+		else if( strcmp(argv[i], "-path") == 0 && i+1 < argc )
+			options.cameraPath = argv[++i];
+		else
+		{
+			int s = 0;
+			while( s < NUM_SUITES && strcmp(argv[i], SUITES[s].name) != 0 )
+				++s;
+			if( s == NUM_SUITES )
+			{
+				printf("Unknown suite or option '%s'.  Suites:", argv[i]);
+				for(s = 0; s < NUM_SUITES; ++s)
+					printf(" %s", SUITES[s].name);
+				printf("\n");
+				return 1;
+			}
+			suites.push_back(&SUITES[s]);
+		}
+	}
+	if( suites.empty() )
+	{
+		for(int s = 0; s < NUM_SUITES; ++s)
+			suites.push_back(&SUITES[s]);
+	}
+
+	// The terrain code hands its loops to the job system, as in the demos.
+	JobSystem jobs;
+	gJobSystem = &jobs;
+
+	for(UINT i = 0; i < suites.size(); ++i)
+	{
+		BenchHeading(suites[i]->name);
+		suites[i]->run(options);
+	}
+
+	gJobSystem = 0;
+
+	int failures = BenchNumFailures();
+	if( failures == 0 )
+		printf("\nAll checks passed.\n");
+	else
+		printf("\n%d check(s) failed.\n", failures);
+	return failures;
+}